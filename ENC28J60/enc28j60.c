@@ -1,17 +1,38 @@
+#include <string.h>
+#if !defined(ENC28J60_EMU)
 #include "tm_stm32_spi.h"
+#endif
 #include "tm_stm32_gpio.h"
 #include "tm_stm32_delay.h"
 #include "enc28j60.h"
 #include "enc28j60_ll.h"
 
+#if defined(ENC28J60_INT_PORT) && defined(ENC28J60_INT_PIN)
+#define ENC28J60_USE_INT
+#include "tm_stm32_exti.h"
+#endif
+
 #define ENC28J60_BUFSIZE	0x2000
-#define ENC28J60_RXSIZE		0x1A00
 #define ENC28J60_BUFEND		(ENC28J60_BUFSIZE - 1)
 
+// Tx slot: control byte, frame and 7 bytes of transmit status vector
+#define ENC28J60_TSV_SIZE	7
+#define ENC28J60_TXSLOT		((1 + ENC28J60_MAXFRAME + ENC28J60_TSV_SIZE + 1) & ~1)
+
+// Tx slots at end of buffer, rest is Rx ring (see enc28j60_set_partition)
+#define ENC28J60_RXSIZE		(ENC28J60_BUFSIZE - enc28j60_tx_slots * ENC28J60_TXSLOT)
 #define ENC28J60_RXSTART	0
 #define ENC28J60_RXEND		(ENC28J60_RXSIZE - 1)
 #define ENC28J60_TXSTART	ENC28J60_RXSIZE
 
+// Rx ring must hold at least one frame with its header
+#define ENC28J60_RXMIN		((6 + ENC28J60_MAXFRAME + 4 + 1) & ~1)
+
+// Slot lengths are kept in array of ENC28J60_TX_SLOTS_MAX entries
+#if (ENC28J60_TX_SLOTS < 1) || (ENC28J60_TX_SLOTS > ENC28J60_TX_SLOTS_MAX)
+#error "ENC28J60_TX_SLOTS must be from 1 to ENC28J60_TX_SLOTS_MAX"
+#endif
+
 #define ENC28J60_SPI_RCR	0x00
 #define ENC28J60_SPI_RBM	0x3A
 #define ENC28J60_SPI_WCR	0x40
@@ -116,6 +137,7 @@
 #define EPMCSH 				(0x11 | 0x20)
 #define EPMOL 				(0x14 | 0x20)
 #define EPMOH 				(0x15 | 0x20)
+#define EPMO				EPMOL
 
 // Wake-on-LAN interrupt registers
 #define EWOLIE 				(0x16 | 0x20)
@@ -124,15 +146,6 @@
 // Receive filters mask
 #define ERXFCON 			(0x18 | 0x20)
 
-#define ERXFCON_UCEN		0x80
-#define ERXFCON_ANDOR		0x40
-#define ERXFCON_CRCEN		0x20
-#define ERXFCON_PMEN		0x10
-#define ERXFCON_MPEN		0x08
-#define ERXFCON_HTEN		0x04
-#define ERXFCON_MCEN		0x02
-#define ERXFCON_BCEN		0x01
-
 // Packet counter
 #define EPKTCNT 			(0x19 | 0x20)
 
@@ -260,16 +273,6 @@
 #define EWOLIR_MCWOLIF		0x02
 #define EWOLIR_BCWOLIF		0x01
 
-// ERXFCON
-#define ERXFCON_UCEN		0x80
-#define ERXFCON_ANDOR		0x40
-#define ERXFCON_CRCEN		0x20
-#define ERXFCON_PMEN		0x10
-#define ERXFCON_MPEN		0x08
-#define ERXFCON_HTEN		0x04
-#define ERXFCON_MCEN		0x02
-#define ERXFCON_BCEN		0x01
-
 // MACON1
 #define MACON1_LOOPBK		0x10
 #define MACON1_TXPAUS		0x08
@@ -344,35 +347,82 @@
 volatile static uint8_t enc28j60_current_bank = 0;
 volatile static uint16_t enc28j60_rxrdpt = 0;
 
-#define enc28j60_rx()				ENC28J60_LL_SPIRxTx(0xff)
-#define enc28j60_tx(data)			ENC28J60_LL_SPIRxTx(data)
+// Frames known to be in Rx buffer, EPKTCNT is read only when it drops to zero
+static uint8_t enc28j60_rx_pending = 0;
+
+// Tx queue, slot at enc28j60_tx_head is on wire while enc28j60_tx_count != 0
+static uint8_t enc28j60_tx_slots = ENC28J60_TX_SLOTS;
+static uint8_t enc28j60_tx_retry = 0;
+static uint8_t enc28j60_tx_head = 0;
+static uint8_t enc28j60_tx_count = 0;
+static uint16_t enc28j60_tx_len[ENC28J60_TX_SLOTS_MAX];
+static uint16_t enc28j60_etxst;
+
+// Frame opened by enc28j60_rx_begin
+static uint8_t enc28j60_rx_active = 0;
+static uint16_t enc28j60_rx_start;		// address of first data byte in Rx buffer
+static uint16_t enc28j60_rx_len;		// frame length without CRC
+static uint16_t enc28j60_rx_pos;		// current read offset in frame
+#if ENC28J60_USE_STATS
+static uint32_t enc28j60_rx_transactions, enc28j60_rx_bytes;
+
+// Rx buffer usage peaks
+static uint16_t enc28j60_rx_used_max;
+static uint8_t enc28j60_pktcnt_max;
+#endif
+
+#ifdef ENC28J60_USE_INT
+// Set from EXTI interrupt, SPI is never touched in interrupt context
+volatile static uint8_t enc28j60_irq_flag = 0;
+// PKTIF is not reliable (errata), EPKTCNT is checked periodically too
+static uint32_t enc28j60_rx_checked;
+#endif
+
+// Link state from PHSTAT2, updated on PHY interrupt
+static uint8_t enc28j60_link = 0;
+
+#if ENC28J60_USE_STATS
+static enc28j60_stats_t enc28j60_stats;
+
+#define enc28j60_select()			do { ENC28J60_CS_LOW; enc28j60_stats.spi_transactions++; } while(0)
+#define enc28j60_xfer(data)			(enc28j60_stats.spi_bytes++, ENC28J60_LL_SPIRxTx(data))
+#define enc28j60_stat(field)		(enc28j60_stats.field++)
+#else
+#define enc28j60_select()			ENC28J60_CS_LOW
+#define enc28j60_xfer(data)			ENC28J60_LL_SPIRxTx(data)
+#define enc28j60_stat(field)
+#endif
+#define enc28j60_release()			ENC28J60_CS_HIGH
+
+#define enc28j60_rx()				enc28j60_xfer(0xff)
+#define enc28j60_tx(data)			enc28j60_xfer(data)
 
 // Generic SPI read command
 static uint8_t enc28j60_read_op(uint8_t cmd, uint8_t adr){
 	uint8_t data;
 
-	ENC28J60_CS_LOW;
+	enc28j60_select();
 	enc28j60_tx(cmd | (adr & ENC28J60_ADDR_MASK));
 	if(adr & 0x80) // throw out dummy byte 
 		enc28j60_rx(); // when reading MII/MAC register
 	data = enc28j60_rx();
-	ENC28J60_CS_HIGH;
+	enc28j60_release();
 	return data;
 }
 
 // Generic SPI write command
 static void enc28j60_write_op(uint8_t cmd, uint8_t adr, uint8_t data){
-	ENC28J60_CS_LOW;
+	enc28j60_select();
 	enc28j60_tx(cmd | (adr & ENC28J60_ADDR_MASK));
 	enc28j60_tx(data);
-	ENC28J60_CS_HIGH;
+	enc28j60_release();
 }
 
 // Initiate software reset
 static void enc28j60_soft_reset(void){
-	ENC28J60_CS_LOW;
+	enc28j60_select();
 	enc28j60_tx(ENC28J60_SPI_SC);
-	ENC28J60_CS_HIGH;
+	enc28j60_release();
 	
 	enc28j60_current_bank = 0;
 	Delayms(1);
@@ -389,9 +439,13 @@ void enc28j60_set_bank(uint8_t adr){
 	if( (adr & ENC28J60_ADDR_MASK) < ENC28J60_COMMON_CR ){
 		bank = (adr >> 5) & 0x03; //BSEL1|BSEL0=0x03
 		if(bank != enc28j60_current_bank){
-			enc28j60_write_op(ENC28J60_SPI_BFC, ECON1, 0x03);
-			enc28j60_write_op(ENC28J60_SPI_BFS, ECON1, bank);
+			// Touch only BSEL bits which differ, bank 0 <-> any costs single command
+			if(enc28j60_current_bank & ~bank)
+				enc28j60_write_op(ENC28J60_SPI_BFC, ECON1, enc28j60_current_bank & ~bank);
+			if(bank & ~enc28j60_current_bank)
+				enc28j60_write_op(ENC28J60_SPI_BFS, ECON1, bank & ~enc28j60_current_bank);
 			enc28j60_current_bank = bank;
+			enc28j60_stat(bank_switches);
 		}
 	}
 }
@@ -434,22 +488,46 @@ void enc28j60_bfs(uint8_t adr, uint8_t mask){
 	enc28j60_write_op(ENC28J60_SPI_BFS, adr, mask);
 }
 
+// Receive block of bytes in current transaction
+static void enc28j60_rx_block(uint8_t *buf, uint16_t len){
+#ifdef ENC28J60_LL_BURST
+	ENC28J60_LL_SPIRead(buf, len);
+#if ENC28J60_USE_STATS
+	enc28j60_stats.spi_bytes += len;
+#endif
+#else
+	while(len--)
+		*(buf++) = enc28j60_rx();
+#endif
+}
+
+// Send block of bytes in current transaction
+static void enc28j60_tx_block(const uint8_t *buf, uint16_t len){
+#ifdef ENC28J60_LL_BURST
+	ENC28J60_LL_SPIWrite(buf, len);
+#if ENC28J60_USE_STATS
+	enc28j60_stats.spi_bytes += len;
+#endif
+#else
+	while(len--)
+		enc28j60_tx(*(buf++));
+#endif
+}
+
 // Read Rx/Tx buffer (at ERDPT)
 void enc28j60_read_buffer(uint8_t *buf, uint16_t len){
-	ENC28J60_CS_LOW;
+	enc28j60_select();
 	enc28j60_tx(ENC28J60_SPI_RBM);
-	while(len--)
-		*(buf++) = enc28j60_rx();
-	ENC28J60_CS_HIGH;
+	enc28j60_rx_block(buf, len);
+	enc28j60_release();
 }
 
 // Write Rx/Tx buffer (at EWRPT)
 void enc28j60_write_buffer(const uint8_t *buf, uint16_t len){
-	ENC28J60_CS_LOW;
+	enc28j60_select();
 	enc28j60_tx(ENC28J60_SPI_WBM);
-	while(len--)
-		enc28j60_tx(*(buf++));
-	ENC28J60_CS_HIGH;
+	enc28j60_tx_block(buf, len);
+	enc28j60_release();
 }
 
 // Read PHY register
@@ -473,6 +551,38 @@ void enc28j60_write_phy(uint8_t adr, uint16_t data){
 /*
  * Init & packet Rx/Tx
  */
+
+// Setup Rx ring, Rx must be disabled
+static void enc28j60_rx_setup(void){
+	enc28j60_wcr16(ERXST, ENC28J60_RXSTART);
+	enc28j60_wcr16(ERXND, ENC28J60_RXEND);
+	enc28j60_wcr16(ERXRDPT, ENC28J60_RXEND); // must be odd (errata)
+	enc28j60_rxrdpt = ENC28J60_RXSTART;
+	enc28j60_rx_pending = 0;
+	enc28j60_rx_active = 0;
+}
+
+// Reset receive logic and drop all frames
+static void enc28j60_rx_reset(void){
+	enc28j60_bfc(ECON1, ECON1_RXEN);
+	enc28j60_bfs(ECON1, ECON1_RXRST);
+	enc28j60_bfc(ECON1, ECON1_RXRST);
+	enc28j60_rx_setup();
+	while(enc28j60_rcr(EPKTCNT))
+		enc28j60_bfs(ECON2, ECON2_PKTDEC);
+	enc28j60_bfc(EIR, EIR_RXERIF | EIR_PKTIF);
+	enc28j60_bfs(ECON1, ECON1_RXEN);
+}
+
+// Used space in Rx ring, from hardware write pointer to first unread frame
+static uint16_t enc28j60_rx_used(void){
+	uint16_t wrpt = enc28j60_rcr16(ERXWRPT);
+
+	if(wrpt >= enc28j60_rxrdpt)
+		return wrpt - enc28j60_rxrdpt;
+	return ENC28J60_RXSIZE - (enc28j60_rxrdpt - wrpt);
+}
+
 void enc28j60_init(uint8_t *macadr){
 
 	ENC28J60_LL_SPIInit();
@@ -483,20 +593,28 @@ void enc28j60_init(uint8_t *macadr){
 	enc28j60_soft_reset();
 
 	// Setup Rx/Tx buffer
-	enc28j60_wcr16(ERXST, ENC28J60_RXSTART);
-	enc28j60_rcr16(ERXST);
-	enc28j60_wcr16(ERXRDPT, ENC28J60_RXSTART);
-	enc28j60_wcr16(ERXND, ENC28J60_RXEND);
-	enc28j60_rxrdpt = ENC28J60_RXSTART;
+	enc28j60_rx_setup();
+	enc28j60_wcr16(ETXST, ENC28J60_TXSTART);
+	enc28j60_etxst = ENC28J60_TXSTART;
+	enc28j60_tx_head = 0;
+	enc28j60_tx_count = 0;
+	enc28j60_tx_retry = 0;
 
 	// Setup MAC
 	enc28j60_wcr(MACON1, MACON1_TXPAUS| // Enable flow control
 				 MACON1_RXPAUS|MACON1_MARXEN); // Enable MAC Rx
 	enc28j60_wcr(MACON2, 0); // Clear reset
+#if ENC28J60_FULL_DUPLEX
 	enc28j60_wcr(MACON3, MACON3_PADCFG0| // Enable padding,
 				 MACON3_TXCRCEN|MACON3_FRMLNEN|MACON3_FULDPX); // Enable crc & frame len chk
-	enc28j60_wcr16(MAMXFL, ENC28J60_MAXFRAME);
 	enc28j60_wcr(MABBIPG, 0x15); // Set inter-frame gap
+#else
+	enc28j60_wcr(MACON3, MACON3_PADCFG0| // Enable padding,
+				 MACON3_TXCRCEN|MACON3_FRMLNEN); // Enable crc & frame len chk
+	enc28j60_wcr(MACON4, MACON4_DEFER); // Wait for medium, do not abort
+	enc28j60_wcr(MABBIPG, 0x12); // Set inter-frame gap
+#endif
+	enc28j60_wcr16(MAMXFL, ENC28J60_MAXFRAME);
 	enc28j60_wcr(MAIPGL, 0x12);
 	enc28j60_wcr(MAIPGH, 0x0c);
 	enc28j60_wcr(MAADR5, macadr[0]); // Set MAC address
@@ -506,62 +624,583 @@ void enc28j60_init(uint8_t *macadr){
 	enc28j60_wcr(MAADR1, macadr[4]);
 	enc28j60_wcr(MAADR0, macadr[5]);
 
-	enc28j60_wcr(ERXFCON, ERXFCON_UCEN | ERXFCON_CRCEN | ERXFCON_BCEN); // Filter policy: only unicast frames and
+	enc28j60_set_filter(ENC28J60_FILTER_DEFAULT); // Filter policy: only unicast frames and broadcasts
 
 	// Setup PHY
+#if ENC28J60_FULL_DUPLEX
 	enc28j60_write_phy(PHCON1, PHCON1_PDPXMD); // Force full-duplex mode
+#else
+	enc28j60_write_phy(PHCON1, 0); // Half-duplex mode
+#endif
 	enc28j60_write_phy(PHCON2, PHCON2_HDLDIS); // Disable loopback
 	enc28j60_write_phy(PHLCON, PHLCON_LACFG2| // Configure LED ctrl
 						PHLCON_LBCFG2|PHLCON_LBCFG1|PHLCON_LBCFG0|
 						PHLCON_LFRQ0|PHLCON_STRCH);
 
+	// Link change sets EIR_LINKIF
+	enc28j60_write_phy(PHIE, PHIE_PGEIE | PHIE_PLNKIE);
+	enc28j60_read_phy(PHIR);
+	enc28j60_link = (enc28j60_read_phy(PHSTAT2) & PHSTAT2_LSTAT) ? 1 : 0;
+
+#ifdef ENC28J60_USE_INT
+	// Interrupt on received packet, finished transmit, errors and link change, INT pin goes low
+	enc28j60_irq_flag = 0;
+	enc28j60_rx_checked = HAL_GetTick();
+	TM_EXTI_Attach(ENC28J60_INT_PORT, ENC28J60_INT_PIN, TM_EXTI_Trigger_Falling);
+	enc28j60_wcr(EIE, EIE_INTIE | EIE_PKTIE | EIE_TXIE | EIE_TXERIE |
+				 EIE_RXERIE | EIE_LINKIE);
+#endif
+
 	// Enable Rx packets
 	enc28j60_bfs(ECON1, ECON1_RXEN);
 }
 
-void enc28j60_send_packet(const uint8_t *data, uint16_t len){
-	while(enc28j60_rcr(ECON1) & ECON1_TXRTS){
+void enc28j60_irq_handler(void){
+#ifdef ENC28J60_USE_INT
+	enc28j60_irq_flag = 1;
+#endif
+}
+
+// Check if chip may have received packet
+static uint8_t enc28j60_rx_signalled(void){
+#ifdef ENC28J60_USE_INT
+	// INT line stays low while PKTIF is set, edge alone could be missed
+	if(!enc28j60_irq_flag && TM_GPIO_GetInputPinValue(ENC28J60_INT_PORT, ENC28J60_INT_PIN) &&
+		(HAL_GetTick() - enc28j60_rx_checked < ENC28J60_RX_CHECK_INTERVAL))
+		return 0;
+	enc28j60_irq_flag = 0;
+	enc28j60_rx_checked = HAL_GetTick();
+#endif
+	return 1;
+}
+
+// Start transmit of frame in slot
+static void enc28j60_tx_start(uint8_t slot){
+	uint16_t start = ENC28J60_TXSTART + slot * ENC28J60_TXSLOT;
+
+	if(enc28j60_etxst != start){
+		enc28j60_wcr16(ETXST, start);
+		enc28j60_etxst = start;
+	}
+	// TXIF/TXERIF were cleared when previous frame finished
+	enc28j60_wcr16(ETXND, start + enc28j60_tx_len[slot]);
+#if !ENC28J60_FULL_DUPLEX
+	// Transmit logic may stall after collision, reset it before each frame (errata)
+	enc28j60_bfs(ECON1, ECON1_TXRST);
+	enc28j60_bfc(ECON1, ECON1_TXRST);
+#endif
+	enc28j60_bfs(ECON1, ECON1_TXRTS); // Request packet send
+}
+
+// Read transmit status vector written after frame in slot
+static void enc28j60_tx_read_tsv(uint8_t slot, enc28j60_tsv_t *tsv){
+	uint8_t v[ENC28J60_TSV_SIZE];
+
+	enc28j60_wcr16(ERDPT, ENC28J60_TXSTART + slot * ENC28J60_TXSLOT + 1 + enc28j60_tx_len[slot]);
+	enc28j60_read_buffer(v, sizeof(v));
+
+	// Restore read pointer of opened Rx frame
+	if(enc28j60_rx_active)
+		enc28j60_rx_seek(enc28j60_rx_pos);
+
+	tsv->byte_count = v[0] | (v[1] << 8);
+	tsv->collisions = v[2] & 0x0f;
+	tsv->done = (v[2] & 0x80) ? 1 : 0;
+	tsv->late_collision = (v[3] & 0x20) ? 1 : 0;
+	tsv->aborted = (v[3] & 0x90) ? 1 : 0; // excessive collisions or underrun
+	tsv->wire_count = v[4] | (v[5] << 8);
+}
+
+__weak void enc28j60_tx_callback(const enc28j60_tsv_t *tsv){
+	/* NOTE: This function should not be modified, when the callback is needed,
+	         the enc28j60_tx_callback could be implemented in the user file
+	*/
+}
+
+void enc28j60_tx_poll(void){
+	enc28j60_tsv_t tsv;
+	uint8_t eir, error = 0;
+
+	if(!enc28j60_tx_count)
+		return;
+
+#ifdef ENC28J60_USE_INT
+	// TXIF/TXERIF hold INT low until cleared
+	if(TM_GPIO_GetInputPinValue(ENC28J60_INT_PORT, ENC28J60_INT_PIN))
+		return;
+#endif
+
+	// TXIF is set when frame left the wire, TXERIF when it was aborted
+	eir = enc28j60_rcr(EIR);
+	if(!(eir & (EIR_TXIF | EIR_TXERIF)))
+		return;
+
+	if(eir & EIR_TXERIF){
 		// TXRTS may not clear - ENC28J60 bug. We must reset
 		// transmit logic in cause of Tx error
-		if(enc28j60_rcr(EIR) & EIR_TXERIF) {
-			enc28j60_bfs(ECON1, ECON1_TXRST);
-			enc28j60_bfc(ECON1, ECON1_TXRST);
-		}
+		enc28j60_bfs(ECON1, ECON1_TXRST);
+		enc28j60_bfc(ECON1, ECON1_TXRST | ECON1_TXRTS);
+		error = 1;
+	}
+	enc28j60_bfc(EIR, EIR_TXIF | EIR_TXERIF);
+
+	enc28j60_tx_read_tsv(enc28j60_tx_head, &tsv);
+#if ENC28J60_USE_STATS
+	enc28j60_stats.tx_collisions += tsv.collisions;
+	enc28j60_stats.tx_late_collisions += tsv.late_collision;
+	enc28j60_stats.tx_errors += error;
+#endif
+
+	// Frame aborted by late collision must be sent again (errata)
+	if((error || tsv.late_collision) && (enc28j60_tx_retry < ENC28J60_TX_RETRIES)){
+		enc28j60_tx_retry++;
+		enc28j60_stat(tx_retries);
+		enc28j60_tx_start(enc28j60_tx_head);
+		return;
 	}
+	enc28j60_tx_retry = 0;
+#if ENC28J60_USE_STATS
+	enc28j60_stats.tx_aborts += (tsv.aborted || !tsv.done);
+#endif
+
+	// Next staged frame goes to wire
+	if(++enc28j60_tx_head == enc28j60_tx_slots)
+		enc28j60_tx_head = 0;
+	if(--enc28j60_tx_count)
+		enc28j60_tx_start(enc28j60_tx_head);
+
+	enc28j60_tx_callback(&tsv);
+}
 
-	enc28j60_wcr16(EWRPT, ENC28J60_TXSTART);
-	enc28j60_write_buffer((uint8_t*)"\x00", 1);
-	enc28j60_write_buffer(data, len);
+// Copy frame to free Tx slot, checksum is stored at field (0 - frame is sent as is)
+static uint8_t enc28j60_tx_write(const uint8_t *data, uint16_t len, uint16_t field, uint16_t cksum){
+	uint8_t slot, temp[2];
 
-	enc28j60_wcr16(ETXST, ENC28J60_TXSTART);
-	enc28j60_wcr16(ETXND, ENC28J60_TXSTART + len);
+	// Wait only when all slots are staged
+	enc28j60_tx_poll();
+	while(enc28j60_tx_count == enc28j60_tx_slots)
+		enc28j60_tx_poll();
 
-	enc28j60_bfs(ECON1, ECON1_TXRTS); // Request packet send
+	slot = enc28j60_tx_head + enc28j60_tx_count;
+	if(slot >= enc28j60_tx_slots)
+		slot -= enc28j60_tx_slots;
+
+	enc28j60_wcr16(EWRPT, ENC28J60_TXSTART + slot * ENC28J60_TXSLOT);
+
+	// Control byte and packet in single transaction
+	enc28j60_select();
+	enc28j60_tx(ENC28J60_SPI_WBM);
+	enc28j60_tx(0x00);
+	if(field && (field + 2 <= len)){
+		temp[0] = cksum >> 8;
+		temp[1] = cksum;
+		enc28j60_tx_block(data, field);
+		enc28j60_tx_block(temp, 2);
+		enc28j60_tx_block(data + field + 2, len - field - 2);
+	} else {
+		enc28j60_tx_block(data, len);
+	}
+	enc28j60_release();
+
+	enc28j60_tx_len[slot] = len;
+	return slot;
 }
 
-uint16_t enc28j60_recv_packet(uint8_t *buf, uint16_t buflen){
-	uint16_t len = 0, rxlen, status, temp;
+// Queue staged frame, start it now if wire is idle
+static void enc28j60_tx_queue(uint8_t slot){
+	if(!enc28j60_tx_count++)
+		enc28j60_tx_start(slot);
+}
+
+void enc28j60_send_packet(const uint8_t *data, uint16_t len){
+#if ENC28J60_USE_STATS
+	uint32_t transactions = enc28j60_stats.spi_transactions;
+	uint32_t bytes = enc28j60_stats.spi_bytes;
+#endif
+
+	if(len > ENC28J60_MAXFRAME)
+		len = ENC28J60_MAXFRAME;
+
+	enc28j60_tx_queue(enc28j60_tx_write(data, len, 0, 0));
+
+#if ENC28J60_USE_STATS
+	enc28j60_stats.tx_frames++;
+	enc28j60_stats.tx_frame_transactions = enc28j60_stats.spi_transactions - transactions;
+	enc28j60_stats.tx_frame_bytes = enc28j60_stats.spi_bytes - bytes;
+#endif
+}
+
+#if ENC28J60_USE_DMA_CSUM
+// Checksum of buffer memory by DMA, returns complemented sum
+static uint16_t enc28j60_dma_cksum(uint16_t start, uint16_t end){
+	enc28j60_wcr16(EDMAST, start);
+	enc28j60_wcr16(EDMAND, end);
+	enc28j60_bfs(ECON1, ECON1_CSUMEN | ECON1_DMAST);
+	while(enc28j60_rcr(ECON1) & ECON1_DMAST)
+		;
+	enc28j60_bfc(ECON1, ECON1_CSUMEN);
+
+	// EDMACSH is first byte of checksum
+	return (enc28j60_rcr(EDMACSH) << 8) | enc28j60_rcr(EDMACSL);
+}
+#else
+// One's complement sum of big endian words
+static uint32_t enc28j60_sum(uint32_t sum, const uint8_t *buf, uint16_t len){
+	while(len >= 2){
+		sum += (buf[0] << 8) | buf[1];
+		buf += 2;
+		len -= 2;
+	}
+	if(len)
+		sum += buf[0] << 8;
+	return sum;
+}
+#endif
+
+void enc28j60_send_packet_cksum(const uint8_t *data, uint16_t len, uint16_t start, uint16_t field, uint16_t sum){
+	uint32_t temp;
+#if ENC28J60_USE_DMA_CSUM
+	uint16_t adr;
+	uint8_t cksum[2];
+#endif
+	uint8_t slot;
+#if ENC28J60_USE_STATS
+	uint32_t transactions = enc28j60_stats.spi_transactions;
+	uint32_t bytes = enc28j60_stats.spi_bytes;
+#endif
+
+	if(len > ENC28J60_MAXFRAME)
+		len = ENC28J60_MAXFRAME;
+
+#if ENC28J60_USE_DMA_CSUM
+	// Frame data is summed where it already is, after control byte of slot
+	slot = enc28j60_tx_write(data, len, 0, 0);
+	adr = ENC28J60_TXSTART + slot * ENC28J60_TXSLOT + 1;
+	temp = (uint16_t)~enc28j60_dma_cksum(adr + start, adr + len - 1);
+	temp += sum;
+	while(temp >> 16)
+		temp = (temp & 0xffff) + (temp >> 16);
+	temp = ~temp;
+
+	cksum[0] = temp >> 8;
+	cksum[1] = temp;
+	enc28j60_wcr16(EWRPT, adr + field);
+	enc28j60_write_buffer(cksum, 2);
+#else
+	// Software fallback, checksum is inserted while frame is copied
+	temp = enc28j60_sum(sum, data + start, len - start);
+	while(temp >> 16)
+		temp = (temp & 0xffff) + (temp >> 16);
+	slot = enc28j60_tx_write(data, len, field, ~temp);
+#endif
+
+	enc28j60_tx_queue(slot);
+
+#if ENC28J60_USE_STATS
+	enc28j60_stats.tx_frames++;
+	enc28j60_stats.tx_frame_transactions = enc28j60_stats.spi_transactions - transactions;
+	enc28j60_stats.tx_frame_bytes = enc28j60_stats.spi_bytes - bytes;
+#endif
+}
+
+uint16_t enc28j60_rx_begin(void){
+	uint16_t rxlen, status;
+#if ENC28J60_USE_STATS
+	uint16_t used;
+#endif
+	uint8_t header[6];
+
+	if(enc28j60_rx_active)
+		enc28j60_rx_end();
+
+	for(;;){
+		// Read packet counter only when there is no known frame left
+		if(!enc28j60_rx_pending){
+			if(!enc28j60_rx_signalled())
+				return 0;
+			enc28j60_rx_pending = enc28j60_rcr(EPKTCNT);
+			if(!enc28j60_rx_pending)
+				return 0;
+
+#if ENC28J60_USE_STATS
+			// Buffer is fullest when new burst is noticed
+			if(enc28j60_rx_pending > enc28j60_pktcnt_max)
+				enc28j60_pktcnt_max = enc28j60_rx_pending;
+			used = enc28j60_rx_used();
+			if(used > enc28j60_rx_used_max)
+				enc28j60_rx_used_max = used;
+#endif
+		}
+
+#if ENC28J60_USE_STATS
+		enc28j60_rx_transactions = enc28j60_stats.spi_transactions;
+		enc28j60_rx_bytes = enc28j60_stats.spi_bytes;
+#endif
 
-	if(enc28j60_rcr(EPKTCNT)){
 		enc28j60_wcr16(ERDPT, enc28j60_rxrdpt);
 
-		enc28j60_read_buffer((void*)&enc28j60_rxrdpt, sizeof(enc28j60_rxrdpt));
-		enc28j60_read_buffer((void*)&rxlen, sizeof(rxlen));
-		enc28j60_read_buffer((void*)&status, sizeof(status));
+		// Next packet pointer, length and status
+		enc28j60_read_buffer(header, sizeof(header));
+
+		enc28j60_rx_start = enc28j60_rxrdpt + sizeof(header);
+		if(enc28j60_rx_start > ENC28J60_RXEND)
+			enc28j60_rx_start -= ENC28J60_RXSIZE;
+		enc28j60_rxrdpt = header[0] | (header[1] << 8);
+		rxlen = header[2] | (header[3] << 8);
+		status = header[4] | (header[5] << 8);
+
+		// Broken header, receive logic lost track of Rx buffer
+		if((enc28j60_rxrdpt & 1) || (enc28j60_rxrdpt > ENC28J60_RXEND) ||
+			(rxlen > ENC28J60_MAXFRAME + 4)){
+			enc28j60_rx_reset();
+			enc28j60_stat(rx_resets);
+			return 0;
+		}
+
+		enc28j60_rx_active = 1;
+		enc28j60_rx_pos = 0;
+		enc28j60_rx_len = 0;
 
 		if(status & 0x80){
 			//success
-			len = rxlen - 4; //throw out crc
-			if(len > buflen) len = buflen;
-			enc28j60_read_buffer(buf, len);	
+			enc28j60_rx_len = rxlen - 4; //throw out crc
+			return enc28j60_rx_len;
 		}
 
-		// Set Rx read pointer to next packet
-		temp = (enc28j60_rxrdpt - 1) & ENC28J60_BUFEND;
-		enc28j60_wcr16(ERXRDPT, temp);
+		// Broken frame, drop it and try next one
+		enc28j60_rx_end();
+	}
+}
 
-		// Decrement packet counter
-		enc28j60_bfs(ECON2, ECON2_PKTDEC);
+uint16_t enc28j60_rx_read(uint8_t *buf, uint16_t len){
+	if(!enc28j60_rx_active)
+		return 0;
+	if(len > enc28j60_rx_len - enc28j60_rx_pos)
+		len = enc28j60_rx_len - enc28j60_rx_pos;
+	if(!len)
+		return 0;
+
+	// ERDPT wraps from ERXND to ERXST automatically
+	enc28j60_read_buffer(buf, len);
+
+	enc28j60_rx_pos += len;
+	return len;
+}
+
+void enc28j60_rx_seek(uint16_t offset){
+	uint16_t adr;
+
+	if(!enc28j60_rx_active)
+		return;
+	if(offset > enc28j60_rx_len)
+		offset = enc28j60_rx_len;
+
+	adr = enc28j60_rx_start + offset;
+	if(adr > ENC28J60_RXEND)
+		adr -= ENC28J60_RXSIZE;
+	enc28j60_wcr16(ERDPT, adr);
+	enc28j60_rx_pos = offset;
+}
+
+void enc28j60_rx_end(void){
+	uint16_t temp;
+
+	if(!enc28j60_rx_active)
+		return;
+
+	// Set Rx read pointer to next packet, ERXRDPT must be odd (errata)
+	if(enc28j60_rxrdpt == ENC28J60_RXSTART)
+		temp = ENC28J60_RXEND;
+	else
+		temp = enc28j60_rxrdpt - 1;
+	enc28j60_wcr16(ERXRDPT, temp);
+
+	// Decrement packet counter
+	enc28j60_bfs(ECON2, ECON2_PKTDEC);
+	enc28j60_rx_pending--;
+	enc28j60_rx_active = 0;
+
+#if ENC28J60_USE_STATS
+	enc28j60_stats.rx_frames++;
+	enc28j60_stats.rx_frame_transactions = enc28j60_stats.spi_transactions - enc28j60_rx_transactions;
+	enc28j60_stats.rx_frame_bytes = enc28j60_stats.spi_bytes - enc28j60_rx_bytes;
+#endif
+}
+
+uint16_t enc28j60_recv_packet(uint8_t *buf, uint16_t buflen){
+	uint16_t len;
+
+	if((len = enc28j60_rx_begin())){
+		len = enc28j60_rx_read(buf, buflen);
+		enc28j60_rx_end();
 	}
 	return len;
 }
+
+__weak void enc28j60_link_callback(uint8_t up){
+	/* NOTE: This function should not be modified, when the callback is needed,
+	         the enc28j60_link_callback could be implemented in the user file
+	*/
+}
+
+uint8_t enc28j60_link_up(void){
+	return enc28j60_link;
+}
+
+void enc28j60_poll(void){
+	uint8_t eir;
+
+#ifdef ENC28J60_USE_INT
+	// All enabled events hold INT low until handled
+	if(!TM_GPIO_GetInputPinValue(ENC28J60_INT_PORT, ENC28J60_INT_PIN))
+#endif
+	{
+		eir = enc28j60_rcr(EIR);
+
+		// Link changed, reading PHIR clears interrupt
+		if(eir & EIR_LINKIF){
+			enc28j60_read_phy(PHIR);
+			enc28j60_link = (enc28j60_read_phy(PHSTAT2) & PHSTAT2_LSTAT) ? 1 : 0;
+			enc28j60_stat(link_changes);
+			enc28j60_link_callback(enc28j60_link);
+		}
+
+		// Rx buffer full or EPKTCNT overflow, frames were dropped
+		if(eir & EIR_RXERIF){
+			enc28j60_bfc(EIR, EIR_RXERIF);
+			enc28j60_stat(rx_overflows);
+		}
+	}
+
+	enc28j60_tx_poll();
+}
+
+void enc28j60_set_filter(uint8_t filter){
+	enc28j60_wcr(ERXFCON, filter);
+}
+
+uint8_t enc28j60_get_filter(void){
+	return enc28j60_rcr(ERXFCON);
+}
+
+void enc28j60_set_pattern(uint16_t offset, const uint8_t *mask, const uint8_t *pattern){
+	uint32_t sum = 0;
+	uint8_t i, odd = 0;
+
+	// Checksum of selected bytes as if they were contiguous
+	for(i = 0; i < 64; i++){
+		if(mask[i >> 3] & (1 << (i & 7))){
+			sum += odd ? pattern[i] : (pattern[i] << 8);
+			odd ^= 1;
+		}
+		if(!(i & 7))
+			enc28j60_wcr(EPMM0 + (i >> 3), mask[i >> 3]);
+	}
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	sum = ~sum;
+
+	enc28j60_wcr(EPMCSL, sum);
+	enc28j60_wcr(EPMCSH, sum >> 8);
+	enc28j60_wcr16(EPMO, offset);
+}
+
+void enc28j60_filter_arp(const uint8_t *ip){
+	uint8_t mask[8], pattern[64];
+
+	// Ethernet type, ARP operation and target IP address
+	memset(mask, 0, sizeof(mask));
+	memset(pattern, 0, sizeof(pattern));
+	mask[1] = 0x30;			// bytes 12, 13
+	mask[2] = 0x30;			// bytes 20, 21
+	mask[4] = 0xC0;			// bytes 38, 39
+	mask[5] = 0x03;			// bytes 40, 41
+	pattern[12] = 0x08;
+	pattern[13] = 0x06;
+	pattern[20] = 0x00;
+	pattern[21] = 0x01;
+	memcpy(&pattern[38], ip, 4);
+
+	enc28j60_set_pattern(0, mask, pattern);
+}
+
+void enc28j60_hash_add(const uint8_t *mac){
+	uint32_t crc = 0xffffffff;
+	uint8_t i, j, octet, bit;
+
+	// Ethernet CRC of destination address, bits 28:23 select hash table bit
+	for(i = 0; i < 6; i++){
+		octet = mac[i];
+		for(j = 0; j < 8; j++, octet >>= 1){
+			bit = (crc >> 31) ^ (octet & 1);
+			crc <<= 1;
+			if(bit)
+				crc ^= 0x04C11DB7;
+		}
+	}
+	bit = (crc >> 23) & 0x3f;
+	enc28j60_bfs(EHT0 + (bit >> 3), 1 << (bit & 7));
+}
+
+void enc28j60_hash_clear(void){
+	uint8_t i;
+
+	for(i = 0; i < 8; i++)
+		enc28j60_wcr(EHT0 + i, 0);
+}
+
+void enc28j60_get_stats(enc28j60_stats_t *stats){
+#if ENC28J60_USE_STATS
+	*stats = enc28j60_stats;
+#else
+	memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+void enc28j60_reset_stats(void){
+#if ENC28J60_USE_STATS
+	memset(&enc28j60_stats, 0, sizeof(enc28j60_stats));
+	enc28j60_rx_used_max = 0;
+	enc28j60_pktcnt_max = 0;
+#endif
+}
+
+uint8_t enc28j60_set_partition(uint8_t tx_slots){
+	if(!tx_slots || (tx_slots > ENC28J60_TX_SLOTS_MAX) ||
+		(ENC28J60_BUFSIZE - tx_slots * ENC28J60_TXSLOT < ENC28J60_RXMIN))
+		return 1;
+
+	// Staged frames live in old slots
+	while(enc28j60_tx_count)
+		enc28j60_tx_poll();
+
+	// Frames in Rx ring are dropped
+	enc28j60_tx_slots = tx_slots;
+	enc28j60_wcr16(ETXST, ENC28J60_TXSTART);
+	enc28j60_etxst = ENC28J60_TXSTART;
+	enc28j60_tx_head = 0;
+	enc28j60_rx_reset();
+
+#if ENC28J60_USE_STATS
+	enc28j60_rx_used_max = 0;
+	enc28j60_pktcnt_max = 0;
+#endif
+	return 0;
+}
+
+void enc28j60_get_buffer_info(enc28j60_buffer_info_t *info){
+	info->rx_size = ENC28J60_RXSIZE;
+	info->tx_slots = enc28j60_tx_slots;
+	info->tx_queued = enc28j60_tx_count;
+	info->rx_free = ENC28J60_RXSIZE - enc28j60_rx_used();
+	info->pkt_count = enc28j60_rcr(EPKTCNT);
+#if ENC28J60_USE_STATS
+	info->rx_used_max = enc28j60_rx_used_max;
+	info->pkt_count_max = enc28j60_pktcnt_max;
+	info->rx_overflows = enc28j60_stats.rx_overflows;
+#else
+	info->rx_used_max = 0;
+	info->pkt_count_max = 0;
+	info->rx_overflows = 0;
+#endif
+}
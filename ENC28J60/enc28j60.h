@@ -19,6 +19,62 @@ extern "C" {
 
 #define ENC28J60_MAXFRAME	1500
 
+/**
+ * @brief  Number of frames which can be staged in ENC28J60 buffer memory
+ * @note   Each slot takes ENC28J60_MAXFRAME + 8 bytes from 8 kB buffer, rest is used for Rx.
+ *         Can be changed at runtime with \ref enc28j60_set_partition
+ */
+#ifndef ENC28J60_TX_SLOTS
+#define ENC28J60_TX_SLOTS	2
+#endif
+
+/**
+ * @brief  Maximal number of Tx slots for \ref enc28j60_set_partition
+ */
+#ifndef ENC28J60_TX_SLOTS_MAX
+#define ENC28J60_TX_SLOTS_MAX	4
+#endif
+
+/**
+ * @brief  Full (1) or half (0) duplex mode
+ * @note   ENC28J60 has no auto-negotiation, mode must match link partner
+ */
+#ifndef ENC28J60_FULL_DUPLEX
+#define ENC28J60_FULL_DUPLEX	1
+#endif
+
+/**
+ * @brief  Number of retransmits of frame aborted by late collision or transmit error
+ */
+#ifndef ENC28J60_TX_RETRIES
+#define ENC28J60_TX_RETRIES		3
+#endif
+
+/**
+ * @brief  Interval in milliseconds to check packet counter when INT pin is used
+ * @note   PKTIF does not reliably report pending packets (errata), so INT pin alone is not trusted
+ */
+#ifndef ENC28J60_RX_CHECK_INTERVAL
+#define ENC28J60_RX_CHECK_INTERVAL	100
+#endif
+
+/**
+ * @brief  Use DMA checksum engine of ENC28J60 in \ref enc28j60_send_packet_cksum
+ * @note   Disabled by default: ENC28J60 errata describe DMA operations disturbing frame reception
+ *         on some silicon revisions, checksum is then computed in software while frame is copied
+ */
+#ifndef ENC28J60_USE_DMA_CSUM
+#define ENC28J60_USE_DMA_CSUM	0
+#endif
+
+/**
+ * @brief  Enable (1) SPI traffic statistics and buffer usage peaks, see \ref enc28j60_get_stats
+ * @note   Disabled by default, counters are updated on every SPI byte and transaction
+ */
+#ifndef ENC28J60_USE_STATS
+#define ENC28J60_USE_STATS	0
+#endif
+
 // PHY registers
 #define PHCON1 				0x00
 #define PHSTAT1 			0x01
@@ -77,6 +133,77 @@ extern "C" {
 #define PHLCON_LFRQ0		0x0004
 #define PHLCON_STRCH		0x0002
 
+// ERXFCON, receive filters for enc28j60_set_filter
+#define ERXFCON_UCEN		0x80	/*!< Accept unicast frames for our MAC address */
+#define ERXFCON_ANDOR		0x40	/*!< Frame must match all enabled filters, otherwise any of them */
+#define ERXFCON_CRCEN		0x20	/*!< Discard frames with bad CRC */
+#define ERXFCON_PMEN		0x10	/*!< Accept frames matching pattern, see enc28j60_set_pattern */
+#define ERXFCON_MPEN		0x08	/*!< Accept magic packets for our MAC address */
+#define ERXFCON_HTEN		0x04	/*!< Accept frames with destination in hash table, see enc28j60_hash_add */
+#define ERXFCON_MCEN		0x02	/*!< Accept all multicast frames */
+#define ERXFCON_BCEN		0x01	/*!< Accept all broadcast frames */
+
+#define ENC28J60_FILTER_DEFAULT	(ERXFCON_UCEN | ERXFCON_CRCEN | ERXFCON_BCEN)
+
+/**
+ * @defgroup ENC28J60_Typedefs
+ * @brief    Library Typedefs
+ * @{
+ */
+
+/**
+ * @brief  SPI traffic statistics
+ */
+typedef struct {
+	uint32_t spi_transactions;        /*!< Number of SPI transactions (CS low periods) */
+	uint32_t spi_bytes;               /*!< Number of bytes transferred over SPI including opcodes */
+	uint32_t bank_switches;           /*!< Number of register bank changes */
+	uint32_t rx_frames;               /*!< Number of frames read from chip */
+	uint32_t tx_frames;               /*!< Number of frames sent to chip */
+	uint16_t rx_frame_transactions;   /*!< SPI transactions used by last received frame */
+	uint16_t rx_frame_bytes;          /*!< SPI bytes used by last received frame */
+	uint16_t tx_frame_transactions;   /*!< SPI transactions used by last sent frame */
+	uint16_t tx_frame_bytes;          /*!< SPI bytes used by last sent frame */
+	uint32_t tx_collisions;           /*!< Number of collisions reported by transmit status vectors */
+	uint32_t tx_late_collisions;      /*!< Number of frames with late collision */
+	uint32_t tx_aborts;               /*!< Number of frames not transmitted */
+	uint32_t tx_errors;               /*!< Number of transmit errors (TXERIF) */
+	uint32_t tx_retries;              /*!< Number of frames sent again after error or late collision */
+	uint32_t rx_overflows;            /*!< Number of Rx buffer or packet counter overflows (RXERIF) */
+	uint32_t rx_resets;               /*!< Number of receive logic resets after corrupted Rx buffer */
+	uint32_t link_changes;            /*!< Number of link up/down events */
+} enc28j60_stats_t;
+
+/**
+ * @brief  Buffer memory partition and usage
+ */
+typedef struct {
+	uint16_t rx_size;                 /*!< Size of Rx ring in bytes */
+	uint16_t rx_free;                 /*!< Free space in Rx ring now */
+	uint16_t rx_used_max;             /*!< Peak used space in Rx ring */
+	uint8_t pkt_count;                /*!< Frames waiting in Rx ring now (EPKTCNT) */
+	uint8_t pkt_count_max;            /*!< Peak of EPKTCNT */
+	uint8_t tx_slots;                 /*!< Number of Tx slots */
+	uint8_t tx_queued;                /*!< Frames staged in Tx slots now */
+	uint32_t rx_overflows;            /*!< Number of Rx buffer overflows */
+} enc28j60_buffer_info_t;
+
+/**
+ * @brief  Transmit status vector of sent frame
+ */
+typedef struct {
+	uint16_t byte_count;              /*!< Number of bytes in frame */
+	uint16_t wire_count;              /*!< Number of bytes on wire including collided attempts */
+	uint8_t collisions;               /*!< Number of collisions during transmit */
+	uint8_t done;                     /*!< Frame transmitted successfully */
+	uint8_t late_collision;           /*!< Late collision occurred */
+	uint8_t aborted;                  /*!< Transmit aborted after excessive collisions or underrun */
+} enc28j60_tsv_t;
+
+/**
+ * @}
+ */
+
 /**
  * @defgroup ENC28J60_Functions
  * @brief    ENC28J60 Functions
@@ -93,22 +220,115 @@ void enc28j60_init(uint8_t *macadr);
 
 /**
  * @brief  Sends packet to ethernet using ENC28J60
- * @note
+ * @note   Frame is copied to free Tx slot and sent when previous frames leave the wire,
+ *         function waits only when all ENC28J60_TX_SLOTS slots are staged
  * @param  *data: pointer to packet data
  * @param  len: size of data
  * @retval None
  */
 void enc28j60_send_packet(const uint8_t *data, uint16_t len);
 
+/**
+ * @brief  Sends packet with checksum field filled by ENC28J60
+ * @note   Internet checksum of frame from start offset to end of frame plus sum is stored at field offset.
+ *         With ENC28J60_USE_DMA_CSUM checksum is computed by DMA engine from data already copied to chip,
+ *         otherwise it is computed in software. Checksum field in data must be zero.
+ * @param  *data: pointer to packet data
+ * @param  len: size of data
+ * @param  start: offset of first checksummed byte in frame
+ * @param  field: offset of 16 bit checksum field in frame
+ * @param  sum: initial sum (e.g. pseudo header protocol and length), big endian words as integers
+ * @retval None
+ */
+void enc28j60_send_packet_cksum(const uint8_t *data, uint16_t len, uint16_t start, uint16_t field, uint16_t sum);
+
+/**
+ * @brief  Handles chip events: link change, Rx overflow and finished transmits
+ * @note   Call periodically, e.g. from main loop. With INT pin configured SPI is used only when INT is asserted
+ * @retval None
+ */
+void enc28j60_poll(void);
+
+/**
+ * @brief  Gets link state
+ * @note   State is updated from PHY interrupt in \ref enc28j60_poll, no SPI transfer is done
+ * @retval 1 when link is up, 0 otherwise
+ */
+uint8_t enc28j60_link_up(void);
+
+/**
+ * @brief  Called from \ref enc28j60_poll when link goes up or down
+ * @param  up: 1 when link is up, 0 otherwise
+ * @retval None
+ * @note   With __weak parameter to prevent link errors if not defined by user
+ */
+void enc28j60_link_callback(uint8_t up);
+
+/**
+ * @brief  Processes finished transmits
+ * @note   Reads transmit status vector, calls \ref enc28j60_tx_callback and starts next staged frame.
+ *         Called from \ref enc28j60_poll and \ref enc28j60_send_packet
+ * @retval None
+ */
+void enc28j60_tx_poll(void);
+
+/**
+ * @brief  Called from \ref enc28j60_tx_poll when frame transmit is finished
+ * @param  *tsv: pointer to transmit status vector of frame
+ * @retval None
+ * @note   With __weak parameter to prevent link errors if not defined by user
+ */
+void enc28j60_tx_callback(const enc28j60_tsv_t *tsv);
+
 /**
  * @brief  Receive packet from ethernet using ENC28J60
- * @note
+ * @note   Copies whole frame, use \ref enc28j60_rx_begin to read only needed parts of frame
  * @param  *data: pointer to buffer
  * @param  len: size of buffer
  * @retval uint16_t : length of packet
  */
 uint16_t enc28j60_recv_packet(uint8_t *buf, uint16_t buflen);
 
+/**
+ * @brief  Opens next received frame for streaming read
+ * @note   Frame stays in ENC28J60 buffer memory, read parts of it with \ref enc28j60_rx_read and
+ *         \ref enc28j60_rx_seek and release it with \ref enc28j60_rx_end. Frames with bad CRC
+ *         or length are dropped automatically. Previously opened frame is released.
+ * @retval uint16_t : length of frame without CRC, 0 when no frame is available
+ */
+uint16_t enc28j60_rx_begin(void);
+
+/**
+ * @brief  Reads data from opened frame at current position
+ * @note   Position advances by number of bytes read
+ * @param  *buf: pointer to destination buffer
+ * @param  len: number of bytes to read
+ * @retval uint16_t : number of bytes read, less than len at end of frame
+ */
+uint16_t enc28j60_rx_read(uint8_t *buf, uint16_t len);
+
+/**
+ * @brief  Moves read position in opened frame
+ * @note   Skipped data never crosses SPI bus
+ * @param  offset: offset from start of frame
+ * @retval None
+ */
+void enc28j60_rx_seek(uint16_t offset);
+
+/**
+ * @brief  Releases opened frame and frees its space in Rx buffer
+ * @retval None
+ */
+void enc28j60_rx_end(void);
+
+/**
+ * @brief  Handles interrupt from INT pin of ENC28J60
+ * @note   Call from EXTI handler when ENC28J60_INT_PORT and ENC28J60_INT_PIN are defined in enc28j60_ll.h,
+ *         function only sets flag, packets are read in next \ref enc28j60_recv_packet call
+ * @retval None
+ */
+void enc28j60_irq_handler(void);
+
 /**
  * @brief  Read PHY register
  * @note
@@ -126,6 +346,84 @@ uint16_t enc28j60_read_phy(uint8_t adr);
  */
 void enc28j60_write_phy(uint8_t adr, uint16_t data);
 
+/**
+ * @brief  Sets receive filters
+ * @note   Frames rejected by filters never get to Rx buffer. Default is ENC28J60_FILTER_DEFAULT
+ * @param  filter: ERXFCON_xxx flags
+ * @retval None
+ */
+void enc28j60_set_filter(uint8_t filter);
+
+/**
+ * @brief  Gets receive filters
+ * @retval uint8_t: ERXFCON_xxx flags
+ */
+uint8_t enc28j60_get_filter(void);
+
+/**
+ * @brief  Sets pattern match filter used with ERXFCON_PMEN
+ * @note   Filter compares checksum of selected bytes, bytes which are not selected are ignored
+ * @param  offset: offset of 64 byte window from start of frame
+ * @param  *mask: 8 bytes, bit n selects byte n in window
+ * @param  *pattern: 64 bytes of window content, only selected bytes are used
+ * @retval None
+ */
+void enc28j60_set_pattern(uint16_t offset, const uint8_t *mask, const uint8_t *pattern);
+
+/**
+ * @brief  Sets pattern match filter to ARP requests for IP address
+ * @note   Use with ERXFCON_PMEN and without ERXFCON_BCEN to drop broadcasts for other hosts
+ * @param  *ip: IP address, 4 bytes in network order
+ * @retval None
+ */
+void enc28j60_filter_arp(const uint8_t *ip);
+
+/**
+ * @brief  Adds destination MAC address to hash table filter used with ERXFCON_HTEN
+ * @note   Other addresses with same hash are accepted too
+ * @param  *mac: multicast MAC address (6 bytes)
+ * @retval None
+ */
+void enc28j60_hash_add(const uint8_t *mac);
+
+/**
+ * @brief  Clears hash table filter
+ * @retval None
+ */
+void enc28j60_hash_clear(void);
+
+/**
+ * @brief  Gets SPI traffic statistics
+ * @note   Counters are updated only when ENC28J60_USE_STATS is enabled
+ * @param  *stats: pointer to @ref enc28j60_stats_t structure to fill
+ * @retval None
+ */
+void enc28j60_get_stats(enc28j60_stats_t *stats);
+
+/**
+ * @brief  Resets SPI traffic statistics
+ * @retval None
+ */
+void enc28j60_reset_stats(void);
+
+/**
+ * @brief  Changes split of 8 kB buffer between Rx ring and Tx slots
+ * @note   Waits for staged frames, frames waiting in Rx ring are dropped.
+ *         More Tx slots suit Tx heavy traffic, fewer slots give longer Rx ring for bursts
+ * @param  tx_slots: number of Tx slots, 1 to ENC28J60_TX_SLOTS_MAX
+ * @retval 0 on success, 1 when Rx ring would be shorter than one frame
+ */
+uint8_t enc28j60_set_partition(uint8_t tx_slots);
+
+/**
+ * @brief  Gets buffer partition and usage
+ * @note   Peaks are sampled when new frames are noticed and need ENC28J60_USE_STATS,
+ *         they are cleared by \ref enc28j60_reset_stats
+ * @param  *info: pointer to @ref enc28j60_buffer_info_t structure to fill
+ * @retval None
+ */
+void enc28j60_get_buffer_info(enc28j60_buffer_info_t *info);
+
 /* C++ detection */
 #ifdef __cplusplus
 }
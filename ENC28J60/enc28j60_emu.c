@@ -0,0 +1,1035 @@
+#include <string.h>
+#include "enc28j60_ll.h"
+
+#if defined(ENC28J60_EMU)
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+#define EMU_BUFSIZE			0x2000
+#define EMU_BUFMASK			(EMU_BUFSIZE - 1)
+#define EMU_MAXFRAME		1518
+#define EMU_MINFRAME		60
+
+// SPI opcodes, upper 3 bits of first byte
+#define EMU_SPI_RCR			0x00
+#define EMU_SPI_RBM			0x20
+#define EMU_SPI_WCR			0x40
+#define EMU_SPI_WBM			0x60
+#define EMU_SPI_BFS			0x80
+#define EMU_SPI_BFC			0xA0
+#define EMU_SPI_SC			0xE0
+
+// Registers, address in bank
+#define EMU_COMMON			0x1B
+#define EMU_ERDPT			0x00	// bank 0
+#define EMU_EWRPT			0x02
+#define EMU_ETXST			0x04
+#define EMU_ETXND			0x06
+#define EMU_ERXST			0x08
+#define EMU_ERXND			0x0A
+#define EMU_ERXRDPT			0x0C
+#define EMU_ERXWRPT			0x0E
+#define EMU_EDMAST			0x10
+#define EMU_EDMAND			0x12
+#define EMU_EDMADST			0x14
+#define EMU_EDMACS			0x16
+#define EMU_EHT0			0x00	// bank 1
+#define EMU_EPMM0			0x08
+#define EMU_EPMCS			0x10
+#define EMU_EPMO			0x14
+#define EMU_ERXFCON			0x18
+#define EMU_EPKTCNT			0x19
+#define EMU_MACON3			0x02	// bank 2
+#define EMU_MAMXFL			0x0A
+#define EMU_MICMD			0x12
+#define EMU_MIREGADR		0x14
+#define EMU_MIWR			0x16
+#define EMU_MIRD			0x18
+#define EMU_MAADR1			0x00	// bank 3
+#define EMU_MISTAT			0x0A
+#define EMU_EREVID			0x12
+#define EMU_EIE				0x1B	// common
+#define EMU_EIR				0x1C
+#define EMU_ESTAT			0x1D
+#define EMU_ECON2			0x1E
+#define EMU_ECON1			0x1F
+
+// Register bits, same as in enc28j60.c
+#define EMU_EIE_INTIE		0x80
+#define EMU_EIR_PKTIF		0x40
+#define EMU_EIR_DMAIF		0x20
+#define EMU_EIR_LINKIF		0x10
+#define EMU_EIR_TXIF		0x08
+#define EMU_EIR_TXERIF		0x02
+#define EMU_EIR_RXERIF		0x01
+#define EMU_ESTAT_LATECOL	0x10
+#define EMU_ESTAT_TXABRT	0x02
+#define EMU_ESTAT_CLKRDY	0x01
+#define EMU_ECON2_AUTOINC	0x80
+#define EMU_ECON2_PKTDEC	0x40
+#define EMU_ECON1_TXRST		0x80
+#define EMU_ECON1_RXRST		0x40
+#define EMU_ECON1_DMAST		0x20
+#define EMU_ECON1_CSUMEN	0x10
+#define EMU_ECON1_TXRTS		0x08
+#define EMU_ECON1_RXEN		0x04
+#define EMU_ECON1_BSEL		0x03
+#define EMU_MACON3_PADCFG0	0x20
+#define EMU_MACON3_TXCRCEN	0x10
+#define EMU_MACON3_HFRMEN	0x04
+#define EMU_MICMD_MIIRD		0x01
+
+// Per packet control byte
+#define EMU_TXCTRL_POVERRIDE	0x01
+#define EMU_TXCTRL_PCRCEN		0x02
+#define EMU_TXCTRL_PPADEN		0x04
+
+// PHY registers
+#define EMU_PHCON1			0x00
+#define EMU_PHSTAT1			0x01
+#define EMU_PHID1			0x02
+#define EMU_PHID2			0x03
+#define EMU_PHSTAT2			0x11
+#define EMU_PHIE			0x12
+#define EMU_PHIR			0x13
+#define EMU_PHCON1_PRST		0x8000
+#define EMU_PHCON1_PDPXMD	0x0100
+#define EMU_PHSTAT1_PFDPX	0x1000
+#define EMU_PHSTAT1_PHDPX	0x0800
+#define EMU_PHSTAT1_LLSTAT	0x0004
+#define EMU_PHSTAT2_LSTAT	0x0400
+#define EMU_PHSTAT2_DPXSTAT	0x0200
+#define EMU_PHIE_PLNKIE		0x0010
+#define EMU_PHIE_PGEIE		0x0002
+#define EMU_PHIR_PLNKIF		0x0010
+#define EMU_PHIR_PGIF		0x0004
+
+// 10 Mbit/s wire: 800 ns per byte, preamble with SFD and inter-frame gap around frame
+#define EMU_WIRE_NS_PER_BYTE	800
+#define EMU_WIRE_OVERHEAD		(8 + 12)
+
+#define EMU_NS_PER_US		1000ULL
+#define EMU_NS_PER_MS		1000000ULL
+
+// pcap format
+#define EMU_PCAP_MAGIC		0xa1b2c3d4
+#define EMU_PCAP_MAGIC_NS	0xa1b23c4d
+#define EMU_PCAP_LINKTYPE	1
+
+/*
+ * Chip state
+ */
+static uint8_t emu_started = 0;
+static uint8_t emu_mem[EMU_BUFSIZE];
+static uint8_t emu_regs[4][32];			// common registers are kept in bank 0
+static uint16_t emu_phy[32];
+static uint8_t emu_link = 1;
+static uint8_t emu_llstat = 1;			// PHSTAT1_LLSTAT, latches low
+
+// SPI transaction
+static uint8_t emu_cs = 1;
+static uint8_t emu_opcode, emu_arg;
+static uint16_t emu_count;
+
+// Transmit in progress, frame is on wire until emu_tx_done
+static uint8_t emu_tx_busy = 0;
+static uint64_t emu_tx_done;
+static uint16_t emu_tx_len;
+static uint8_t emu_tx_failed;
+static uint8_t emu_tx_frame[EMU_MAXFRAME];
+
+static enc28j60_emu_stats_t emu_stats;
+static uint32_t emu_spi_clock = ENC28J60_EMU_SPI_CLOCK;
+static enc28j60_emu_faults_t emu_faults;
+static uint16_t emu_tx_seq, emu_rx_seq;
+
+/*
+ * Wire backends
+ */
+static int emu_tap = -1;
+static FILE *emu_pcap_rx = NULL;
+static FILE *emu_pcap_tx = NULL;
+static uint8_t emu_pcap_swap, emu_pcap_ns;
+static uint64_t emu_pcap_base;			// simulated time of first frame, in microseconds
+static int64_t emu_pcap_first = -1;	// timestamp of first frame in file, in microseconds
+static uint64_t emu_pcap_next;			// timestamp of frame in emu_pcap_frame
+static uint16_t emu_pcap_len = 0;
+static uint8_t emu_pcap_frame[EMU_MAXFRAME];
+
+/*
+ * Time
+ */
+
+static uint64_t emu_now(void){
+	return TM_HOST_GetTimeNs();
+}
+
+static void emu_advance(uint64_t ns){
+	TM_HOST_Advance(ns);
+}
+
+static uint64_t emu_real_time(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Registers
+ */
+
+static uint8_t *emu_reg(uint8_t bank, uint8_t adr){
+	return &emu_regs[adr >= EMU_COMMON ? 0 : bank][adr];
+}
+
+static uint16_t emu_get16(uint8_t bank, uint8_t adr){
+	return emu_regs[bank][adr] | (emu_regs[bank][adr + 1] << 8);
+}
+
+static void emu_set16(uint8_t bank, uint8_t adr, uint16_t value){
+	emu_regs[bank][adr] = value;
+	emu_regs[bank][adr + 1] = value >> 8;
+}
+
+// MAC and MII registers send dummy byte before data
+static uint8_t emu_is_mac(uint8_t bank, uint8_t adr){
+	if(adr >= EMU_COMMON)
+		return 0;
+	return bank == 2 || (bank == 3 && (adr <= 0x05 || adr == EMU_MISTAT));
+}
+
+// Next address in Rx ring or in whole buffer
+static uint16_t emu_next(uint16_t adr, uint8_t ring){
+	if(ring && adr == emu_get16(0, EMU_ERXND))
+		return emu_get16(0, EMU_ERXST);
+	return (adr + 1) & EMU_BUFMASK;
+}
+
+static uint8_t emu_in_ring(uint16_t adr){
+	return adr >= emu_get16(0, EMU_ERXST) && adr <= emu_get16(0, EMU_ERXND);
+}
+
+// Reset by SPI system reset command, PHY and buffer memory keep content
+static void emu_reset(void){
+	memset(emu_regs, 0, sizeof(emu_regs));
+	emu_set16(0, EMU_ERDPT, 0x05FA);
+	emu_set16(0, EMU_ERXST, 0x05FA);
+	emu_set16(0, EMU_ERXND, 0x1FFF);
+	emu_set16(0, EMU_ERXRDPT, 0x05FA);
+	emu_set16(0, EMU_ERXWRPT, 0x05FA);
+	emu_regs[1][EMU_ERXFCON] = 0xA1;
+	emu_set16(2, EMU_MAMXFL, 0x0600);
+	emu_regs[3][EMU_EREVID] = 0x06;
+	emu_regs[0][EMU_ESTAT] = EMU_ESTAT_CLKRDY;
+	emu_regs[0][EMU_ECON2] = EMU_ECON2_AUTOINC;
+	emu_tx_busy = 0;
+}
+
+static void emu_phy_reset(void){
+	memset(emu_phy, 0, sizeof(emu_phy));
+	emu_phy[EMU_PHID1] = 0x0083;
+	emu_phy[EMU_PHID2] = 0x1400;
+	emu_llstat = emu_link;
+}
+
+static void emu_start(void){
+	if(emu_started)
+		return;
+	emu_started = 1;
+	memset(emu_mem, 0, sizeof(emu_mem));
+	emu_reset();
+	emu_phy_reset();
+}
+
+/*
+ * PHY
+ */
+
+static uint16_t emu_phy_read(uint8_t adr){
+	uint16_t value;
+
+	adr &= 0x1F;
+	switch(adr){
+	case EMU_PHSTAT1:
+		value = EMU_PHSTAT1_PFDPX | EMU_PHSTAT1_PHDPX | (emu_llstat ? EMU_PHSTAT1_LLSTAT : 0);
+		emu_llstat = emu_link;
+		return value;
+	case EMU_PHSTAT2:
+		return (emu_link ? EMU_PHSTAT2_LSTAT : 0) |
+			((emu_phy[EMU_PHCON1] & EMU_PHCON1_PDPXMD) ? EMU_PHSTAT2_DPXSTAT : 0);
+	case EMU_PHIR:
+		// Reading clears PHY interrupt and LINKIF
+		value = emu_phy[EMU_PHIR];
+		emu_phy[EMU_PHIR] = 0;
+		emu_regs[0][EMU_EIR] &= ~EMU_EIR_LINKIF;
+		return value;
+	default:
+		return emu_phy[adr];
+	}
+}
+
+static void emu_phy_write(uint8_t adr, uint16_t value){
+	adr &= 0x1F;
+	switch(adr){
+	case EMU_PHCON1:
+		if(value & EMU_PHCON1_PRST){
+			emu_phy_reset();
+			return;
+		}
+		break;
+	case EMU_PHSTAT1:
+	case EMU_PHID1:
+	case EMU_PHID2:
+	case EMU_PHSTAT2:
+	case EMU_PHIR:
+		return;
+	}
+	emu_phy[adr] = value;
+}
+
+/*
+ * DMA
+ */
+
+static void emu_dma(void){
+	uint16_t adr = emu_get16(0, EMU_EDMAST), end = emu_get16(0, EMU_EDMAND);
+	uint16_t dst = emu_get16(0, EMU_EDMADST), i;
+	uint8_t ring = emu_in_ring(adr), odd = 0;
+	uint32_t sum = 0;
+
+	for(i = 0; i < EMU_BUFSIZE; i++){
+		if(emu_regs[0][EMU_ECON1] & EMU_ECON1_CSUMEN){
+			sum += odd ? emu_mem[adr] : (emu_mem[adr] << 8);
+			odd ^= 1;
+		} else {
+			emu_mem[dst] = emu_mem[adr];
+			dst = (dst + 1) & EMU_BUFMASK;
+		}
+		if(adr == end)
+			break;
+		adr = emu_next(adr, ring);
+	}
+
+	if(emu_regs[0][EMU_ECON1] & EMU_ECON1_CSUMEN){
+		while(sum >> 16)
+			sum = (sum & 0xffff) + (sum >> 16);
+		emu_set16(0, EMU_EDMACS, ~sum);
+	}
+	emu_regs[0][EMU_ECON1] &= ~EMU_ECON1_DMAST;
+	emu_regs[0][EMU_EIR] |= EMU_EIR_DMAIF;
+	emu_stats.dma_runs++;
+}
+
+/*
+ * Tx
+ */
+
+static void emu_wire_tx(const uint8_t *frame, uint16_t len);
+
+static void emu_tx_start(void){
+	uint16_t adr = emu_get16(0, EMU_ETXST), end = emu_get16(0, EMU_ETXND);
+	uint8_t ctrl, pad, crc;
+
+	// Control byte at ETXST, frame up to ETXND
+	ctrl = emu_mem[adr];
+	if(ctrl & EMU_TXCTRL_POVERRIDE){
+		pad = ctrl & EMU_TXCTRL_PPADEN;
+		crc = ctrl & EMU_TXCTRL_PCRCEN;
+	} else {
+		pad = emu_regs[2][EMU_MACON3] & EMU_MACON3_PADCFG0;
+		crc = emu_regs[2][EMU_MACON3] & EMU_MACON3_TXCRCEN;
+	}
+
+	emu_tx_len = 0;
+	while(adr != end && emu_tx_len < EMU_MAXFRAME){
+		adr = (adr + 1) & EMU_BUFMASK;
+		emu_tx_frame[emu_tx_len++] = emu_mem[adr];
+	}
+	if(pad && emu_tx_len < EMU_MINFRAME){
+		memset(&emu_tx_frame[emu_tx_len], 0, EMU_MINFRAME - emu_tx_len);
+		emu_tx_len = EMU_MINFRAME;
+	}
+
+	emu_tx_failed = emu_faults.tx_late_collision && !(++emu_tx_seq % emu_faults.tx_late_collision);
+	emu_tx_busy = 1;
+	emu_tx_done = emu_now() + (emu_tx_len + (crc ? 4 : 0) + EMU_WIRE_OVERHEAD) * EMU_WIRE_NS_PER_BYTE;
+}
+
+static void emu_tx_finish(void){
+	uint16_t adr = emu_get16(0, EMU_ETXND), count = emu_tx_len + 4;
+	uint8_t tsv[7], i;
+
+	emu_tx_busy = 0;
+
+	// Transmit status vector after frame
+	memset(tsv, 0, sizeof(tsv));
+	tsv[0] = count;
+	tsv[1] = count >> 8;
+	tsv[4] = count;
+	tsv[5] = count >> 8;
+	if(emu_tx_frame[0] & 0x01)
+		tsv[3] |= memcmp(emu_tx_frame, "\xff\xff\xff\xff\xff\xff", 6) ? 0x01 : 0x02;
+	if(emu_tx_failed)
+		tsv[3] |= 0x20;
+	else
+		tsv[2] |= 0x80;
+	for(i = 0; i < sizeof(tsv); i++){
+		adr = (adr + 1) & EMU_BUFMASK;
+		emu_mem[adr] = tsv[i];
+	}
+
+	emu_regs[0][EMU_ECON1] &= ~EMU_ECON1_TXRTS;
+	if(emu_tx_failed){
+		emu_regs[0][EMU_ESTAT] |= EMU_ESTAT_LATECOL | EMU_ESTAT_TXABRT;
+		emu_regs[0][EMU_EIR] |= EMU_EIR_TXERIF;
+		emu_stats.tx_failed++;
+		return;
+	}
+	emu_regs[0][EMU_EIR] |= EMU_EIR_TXIF;
+	emu_stats.tx_frames++;
+	emu_stats.tx_bytes += emu_tx_len;
+	emu_wire_tx(emu_tx_frame, emu_tx_len);
+}
+
+// Completes transmit which left the wire
+static void emu_update(void){
+	if(emu_tx_busy && emu_now() >= emu_tx_done)
+		emu_tx_finish();
+}
+
+/*
+ * Register writes with side effects
+ */
+
+static void emu_write(uint8_t adr, uint8_t value){
+	uint8_t bank = emu_regs[0][EMU_ECON1] & EMU_ECON1_BSEL, old;
+
+	if(adr >= EMU_COMMON){
+		old = emu_regs[0][adr];
+		switch(adr){
+		case EMU_EIR:
+			emu_regs[0][adr] = value & ~EMU_EIR_PKTIF;
+			break;
+		case EMU_ESTAT:
+			emu_regs[0][adr] = (value & (EMU_ESTAT_LATECOL | EMU_ESTAT_TXABRT)) | EMU_ESTAT_CLKRDY;
+			break;
+		case EMU_ECON2:
+			if((value & EMU_ECON2_PKTDEC) && emu_regs[1][EMU_EPKTCNT])
+				emu_regs[1][EMU_EPKTCNT]--;
+			emu_regs[0][adr] = value & ~EMU_ECON2_PKTDEC;
+			break;
+		case EMU_ECON1:
+			emu_regs[0][adr] = value;
+			if(value & EMU_ECON1_TXRST){
+				// Transmit logic held in reset, frame on wire is lost
+				emu_tx_busy = 0;
+				emu_regs[0][adr] &= ~EMU_ECON1_TXRTS;
+			} else if((value & EMU_ECON1_TXRTS) && !(old & EMU_ECON1_TXRTS)){
+				emu_tx_start();
+			} else if(!(value & EMU_ECON1_TXRTS)){
+				emu_tx_busy = 0;
+			}
+			if((value & EMU_ECON1_RXRST) && !(old & EMU_ECON1_RXRST))
+				emu_set16(0, EMU_ERXWRPT, emu_get16(0, EMU_ERXST));
+			if(value & EMU_ECON1_DMAST)
+				emu_dma();
+			break;
+		default:
+			emu_regs[0][adr] = value;
+		}
+		return;
+	}
+
+	switch(bank){
+	case 0:
+		if(adr == EMU_ERXWRPT || adr == EMU_ERXWRPT + 1 || adr == EMU_EDMACS || adr == EMU_EDMACS + 1)
+			return;
+		emu_regs[0][adr] = value;
+		// Write pointer follows start of Rx ring
+		if(adr == EMU_ERXST || adr == EMU_ERXST + 1)
+			emu_set16(0, EMU_ERXWRPT, emu_get16(0, EMU_ERXST));
+		return;
+	case 1:
+		if(adr != EMU_EPKTCNT)
+			emu_regs[1][adr] = value;
+		return;
+	case 2:
+		emu_regs[2][adr] = value;
+		if(adr == EMU_MICMD && (value & EMU_MICMD_MIIRD))
+			emu_set16(2, EMU_MIRD, emu_phy_read(emu_regs[2][EMU_MIREGADR]));
+		if(adr == EMU_MIWR + 1)
+			emu_phy_write(emu_regs[2][EMU_MIREGADR], emu_get16(2, EMU_MIWR));
+		return;
+	default:
+		if(adr != EMU_EREVID && adr != EMU_MISTAT)
+			emu_regs[3][adr] = value;
+	}
+}
+
+static uint8_t emu_read(uint8_t adr){
+	uint8_t bank = emu_regs[0][EMU_ECON1] & EMU_ECON1_BSEL;
+
+	if(adr == EMU_EIR)
+		return emu_regs[0][EMU_EIR] | (emu_regs[1][EMU_EPKTCNT] ? EMU_EIR_PKTIF : 0);
+	return *emu_reg(bank, adr);
+}
+
+/*
+ * SPI
+ */
+
+void enc28j60_emu_cs(uint8_t level){
+	emu_start();
+	if(!level && emu_cs){
+		emu_count = 0;
+		emu_stats.spi_transactions++;
+		emu_update();
+	}
+	emu_cs = level;
+}
+
+uint8_t ENC28J60_LL_SPIInit(void){
+	emu_start();
+	return 0;
+}
+
+// Time spent in LL function besides bit times, once per call
+static void emu_spi_call(void){
+	emu_stats.spi_time += ENC28J60_EMU_SPI_CALL;
+	emu_advance(ENC28J60_EMU_SPI_CALL);
+}
+
+static uint8_t emu_spi_byte(uint8_t txbyte){
+	uint8_t bank, value = 0;
+	uint16_t adr;
+
+	emu_stats.spi_bytes++;
+	emu_stats.spi_time += 8000000000ULL / emu_spi_clock;
+	emu_advance(8000000000ULL / emu_spi_clock);
+	if(emu_cs)
+		return 0xff;
+
+	// First byte is opcode with argument
+	if(!emu_count++){
+		emu_opcode = txbyte & 0xE0;
+		emu_arg = txbyte & 0x1F;
+		if(emu_opcode == EMU_SPI_SC)
+			emu_reset();
+		return 0;
+	}
+
+	bank = emu_regs[0][EMU_ECON1] & EMU_ECON1_BSEL;
+	switch(emu_opcode){
+	case EMU_SPI_RCR:
+		if(emu_count == 2 && emu_is_mac(bank, emu_arg))
+			return 0;
+		value = emu_read(emu_arg);
+		break;
+	case EMU_SPI_RBM:
+		adr = emu_get16(0, EMU_ERDPT);
+		value = emu_mem[adr];
+		if(emu_regs[0][EMU_ECON2] & EMU_ECON2_AUTOINC)
+			emu_set16(0, EMU_ERDPT, emu_next(adr, 1));
+		break;
+	case EMU_SPI_WCR:
+		if(emu_count == 2)
+			emu_write(emu_arg, txbyte);
+		break;
+	case EMU_SPI_WBM:
+		adr = emu_get16(0, EMU_EWRPT);
+		emu_mem[adr] = txbyte;
+		if(emu_regs[0][EMU_ECON2] & EMU_ECON2_AUTOINC)
+			emu_set16(0, EMU_EWRPT, emu_next(adr, 0));
+		break;
+	case EMU_SPI_BFS:
+		if(emu_count == 2)
+			emu_write(emu_arg, *emu_reg(bank, emu_arg) | txbyte);
+		break;
+	case EMU_SPI_BFC:
+		if(emu_count == 2)
+			emu_write(emu_arg, *emu_reg(bank, emu_arg) & ~txbyte);
+		break;
+	}
+	return value;
+}
+
+uint8_t ENC28J60_LL_SPIRxTx(uint8_t txbyte){
+	emu_start();
+	emu_spi_call();
+	return emu_spi_byte(txbyte);
+}
+
+void ENC28J60_LL_SPIRead(uint8_t *data, uint16_t len){
+	emu_start();
+	emu_spi_call();
+	while(len--)
+		*(data++) = emu_spi_byte(0xff);
+}
+
+void ENC28J60_LL_SPIWrite(const uint8_t *data, uint16_t len){
+	emu_start();
+	emu_spi_call();
+	while(len--)
+		emu_spi_byte(*(data++));
+}
+
+/*
+ * Rx
+ */
+
+static uint32_t emu_crc(const uint8_t *data, uint16_t len){
+	uint32_t crc = 0xffffffff;
+	uint8_t j;
+
+	while(len--){
+		crc ^= *(data++);
+		for(j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+	}
+	return ~crc;
+}
+
+// Hash table bit, bits 28:23 of CRC in the order used by enc28j60_hash_add
+static uint8_t emu_hash(const uint8_t *mac){
+	uint32_t crc = 0xffffffff;
+	uint8_t i, j, octet, bit;
+
+	for(i = 0; i < 6; i++){
+		octet = mac[i];
+		for(j = 0; j < 8; j++, octet >>= 1){
+			bit = (crc >> 31) ^ (octet & 1);
+			crc <<= 1;
+			if(bit)
+				crc ^= 0x04C11DB7;
+		}
+	}
+	return (crc >> 23) & 0x3f;
+}
+
+static void emu_mac(uint8_t *mac){
+	mac[0] = emu_regs[3][EMU_MAADR1 + 4];
+	mac[1] = emu_regs[3][EMU_MAADR1 + 5];
+	mac[2] = emu_regs[3][EMU_MAADR1 + 2];
+	mac[3] = emu_regs[3][EMU_MAADR1 + 3];
+	mac[4] = emu_regs[3][EMU_MAADR1 + 0];
+	mac[5] = emu_regs[3][EMU_MAADR1 + 1];
+}
+
+static uint8_t emu_pattern_match(const uint8_t *frame, uint16_t len){
+	uint16_t offset = emu_get16(1, EMU_EPMO), i;
+	uint32_t sum = 0;
+	uint8_t odd = 0;
+
+	for(i = 0; i < 64; i++){
+		if(!(emu_regs[1][EMU_EPMM0 + (i >> 3)] & (1 << (i & 7))))
+			continue;
+		if(offset + i >= len)
+			return 0;
+		sum += odd ? frame[offset + i] : (frame[offset + i] << 8);
+		odd ^= 1;
+	}
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum == emu_get16(1, EMU_EPMCS);
+}
+
+// FF x 6 followed by 16 copies of our address anywhere after source address
+static uint8_t emu_magic_packet(const uint8_t *frame, uint16_t len, const uint8_t *mac){
+	uint16_t i, k;
+
+	for(i = 12; i + 102 <= len; i++){
+		if(memcmp(&frame[i], "\xff\xff\xff\xff\xff\xff", 6))
+			continue;
+		for(k = 1; k <= 16; k++)
+			if(memcmp(&frame[i + k * 6], mac, 6))
+				break;
+		if(k > 16)
+			return 1;
+	}
+	return 0;
+}
+
+static uint8_t emu_filter(const uint8_t *frame, uint16_t len, uint8_t crc_ok){
+	uint8_t filter = emu_regs[1][EMU_ERXFCON], mac[6], bit;
+	uint8_t enabled = 0, matched = 0, broadcast;
+
+	if((filter & 0x20) && !crc_ok)
+		return 0;
+	filter &= ~0x60; // ANDOR and CRCEN are not filters
+	if(!filter)
+		return 1;
+
+	emu_mac(mac);
+	broadcast = !memcmp(frame, "\xff\xff\xff\xff\xff\xff", 6);
+	if(filter & 0x80){ // UCEN
+		enabled++;
+		matched += !memcmp(frame, mac, 6);
+	}
+	if(filter & 0x10){ // PMEN
+		enabled++;
+		matched += emu_pattern_match(frame, len);
+	}
+	if(filter & 0x08){ // MPEN
+		enabled++;
+		matched += (broadcast || !memcmp(frame, mac, 6)) && emu_magic_packet(frame, len, mac);
+	}
+	if(filter & 0x04){ // HTEN
+		enabled++;
+		bit = emu_hash(frame);
+		matched += (emu_regs[1][EMU_EHT0 + (bit >> 3)] >> (bit & 7)) & 1;
+	}
+	if(filter & 0x02){ // MCEN
+		enabled++;
+		matched += (frame[0] & 0x01) && !broadcast;
+	}
+	if(filter & 0x01){ // BCEN
+		enabled++;
+		matched += broadcast;
+	}
+	if(emu_regs[1][EMU_ERXFCON] & 0x40) // ANDOR
+		return matched == enabled;
+	return matched != 0;
+}
+
+// Frame received from wire, result as enc28j60_emu_inject
+static uint8_t emu_receive(const uint8_t *data, uint16_t len){
+	uint8_t frame[EMU_MAXFRAME + 4], header[6], crc_ok = 1;
+	uint16_t start = emu_get16(0, EMU_ERXST), end = emu_get16(0, EMU_ERXND);
+	uint16_t wrpt = emu_get16(0, EMU_ERXWRPT), rdpt = emu_get16(0, EMU_ERXRDPT);
+	uint16_t size = end - start + 1, count, need, space, i;
+	uint32_t crc;
+
+	emu_start();
+	emu_update();
+	if(!(emu_regs[0][EMU_ECON1] & EMU_ECON1_RXEN) || (emu_regs[0][EMU_ECON1] & EMU_ECON1_RXRST) ||
+		!emu_link || len > EMU_MAXFRAME){
+		emu_stats.rx_disabled++;
+		return 2;
+	}
+
+	// Short frames arrive padded, CRC is added on wire
+	memcpy(frame, data, len);
+	if(len < EMU_MINFRAME){
+		memset(&frame[len], 0, EMU_MINFRAME - len);
+		len = EMU_MINFRAME;
+	}
+	crc = emu_crc(frame, len);
+	if(emu_faults.rx_bad_crc && !(++emu_rx_seq % emu_faults.rx_bad_crc)){
+		crc = ~crc;
+		crc_ok = 0;
+	}
+	frame[len] = crc;
+	frame[len + 1] = crc >> 8;
+	frame[len + 2] = crc >> 16;
+	frame[len + 3] = crc >> 24;
+	count = len + 4;
+
+	// MAC discards frames longer than MAMXFL
+	if((count > emu_get16(2, EMU_MAMXFL) && !(emu_regs[2][EMU_MACON3] & EMU_MACON3_HFRMEN)) ||
+		!emu_filter(frame, len, crc_ok)){
+		emu_stats.rx_filtered++;
+		return 1;
+	}
+
+	// Receive status vector and frame must fit before ERXRDPT, next frame starts at even address
+	need = (sizeof(header) + count + 1) & ~1;
+	if(wrpt > rdpt)
+		space = size - 1 - (wrpt - rdpt);
+	else if(wrpt == rdpt)
+		space = size - 1;
+	else
+		space = rdpt - wrpt - 1;
+	if(emu_regs[1][EMU_EPKTCNT] == 0xff || need > space || wrpt < start || wrpt > end){
+		emu_regs[0][EMU_EIR] |= EMU_EIR_RXERIF;
+		emu_stats.rx_overflows++;
+		return 2;
+	}
+
+	i = wrpt - start + need;
+	i = start + (i % size);
+	header[0] = i;
+	header[1] = i >> 8;
+	header[2] = count;
+	header[3] = count >> 8;
+	header[4] = crc_ok ? 0x80 : 0x10;
+	header[5] = (frame[0] & 0x01) ? (memcmp(frame, "\xff\xff\xff\xff\xff\xff", 6) ? 0x01 : 0x02) : 0;
+	for(i = 0; i < sizeof(header); i++, wrpt = emu_next(wrpt, 1))
+		emu_mem[wrpt] = header[i];
+	for(i = 0; i < count; i++, wrpt = emu_next(wrpt, 1))
+		emu_mem[wrpt] = frame[i];
+	if(count & 1)
+		wrpt = emu_next(wrpt, 1);
+
+	emu_set16(0, EMU_ERXWRPT, wrpt);
+	emu_regs[1][EMU_EPKTCNT]++;
+	emu_stats.rx_frames++;
+	return 0;
+}
+
+/*
+ * Wire backends
+ */
+
+static uint32_t emu_swap32(uint32_t value){
+	if(!emu_pcap_swap)
+		return value;
+	return (value >> 24) | ((value >> 8) & 0xff00) | ((value << 8) & 0xff0000) | (value << 24);
+}
+
+static void emu_pcap_write(FILE *file, const void *data, size_t len){
+	if(fwrite(data, 1, len, file) != len)
+		emu_pcap_tx = NULL; // stop writing to broken file, it is closed in enc28j60_emu_close
+}
+
+static void emu_wire_tx(const uint8_t *frame, uint16_t len){
+	uint64_t now;
+	uint32_t record[4];
+
+	// Kernel drops frame when its queue is full, like congested wire
+	if(emu_tap >= 0 && write(emu_tap, frame, len) != len)
+		emu_stats.tx_dropped++;
+	if(emu_pcap_tx){
+		now = emu_now() / EMU_NS_PER_US;
+		record[0] = now / 1000000;
+		record[1] = now % 1000000;
+		record[2] = len;
+		record[3] = len;
+		emu_pcap_write(emu_pcap_tx, record, sizeof(record));
+		if(emu_pcap_tx)
+			emu_pcap_write(emu_pcap_tx, frame, len);
+	}
+	enc28j60_emu_tx_callback(frame, len);
+}
+
+// Reads next frame from pcap file to emu_pcap_frame
+static void emu_pcap_read(void){
+	uint32_t record[4], len;
+	uint64_t ts;
+
+	emu_pcap_len = 0;
+	while(fread(record, sizeof(record), 1, emu_pcap_rx) == 1){
+		len = emu_swap32(record[2]);
+		if(len > sizeof(emu_pcap_frame)){
+			if(fseek(emu_pcap_rx, len, SEEK_CUR))
+				return;
+			continue;
+		}
+		if(fread(emu_pcap_frame, 1, len, emu_pcap_rx) != len || !len)
+			return;
+		ts = emu_swap32(record[0]) * 1000000ULL + emu_swap32(record[1]) / (emu_pcap_ns ? 1000 : 1);
+		if(emu_pcap_first < 0)
+			emu_pcap_first = ts;
+		emu_pcap_next = ts - emu_pcap_first;
+		emu_pcap_len = len;
+		return;
+	}
+}
+
+// Replays pcap frames with timestamps up to now
+static uint16_t emu_pcap_replay(void){
+	uint16_t frames = 0;
+
+	while(emu_pcap_rx && emu_pcap_len &&
+		emu_pcap_base + emu_pcap_next <= emu_now() / EMU_NS_PER_US){
+		emu_receive(emu_pcap_frame, emu_pcap_len);
+		frames++;
+		emu_pcap_read();
+	}
+	return frames;
+}
+
+static uint16_t emu_tap_read(void){
+	uint8_t frame[EMU_MAXFRAME];
+	uint16_t frames = 0;
+	ssize_t len;
+
+	while(emu_tap >= 0 && (len = read(emu_tap, frame, sizeof(frame))) > 0){
+		emu_receive(frame, len);
+		frames++;
+	}
+	return frames;
+}
+
+/*
+ * Public functions
+ */
+
+uint8_t enc28j60_emu_open_tap(const char *name){
+	struct ifreq ifr;
+	int fd;
+
+	emu_start();
+	if((fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK)) < 0)
+		return 1;
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+	if(ioctl(fd, TUNSETIFF, &ifr) < 0){
+		close(fd);
+		return 1;
+	}
+	if(emu_tap >= 0)
+		close(emu_tap);
+	emu_tap = fd;
+	return 0;
+}
+
+uint8_t enc28j60_emu_open_pcap(const char *rx_file, const char *tx_file){
+	uint32_t header[6];
+
+	emu_start();
+	if(rx_file){
+		if(emu_pcap_rx)
+			fclose(emu_pcap_rx);
+		if(!(emu_pcap_rx = fopen(rx_file, "rb")))
+			return 1;
+		emu_pcap_swap = 0;
+		if(fread(header, sizeof(header), 1, emu_pcap_rx) != 1)
+			goto bad_file;
+		if(header[0] != EMU_PCAP_MAGIC && header[0] != EMU_PCAP_MAGIC_NS)
+			emu_pcap_swap = 1;
+		header[0] = emu_swap32(header[0]);
+		if((header[0] != EMU_PCAP_MAGIC && header[0] != EMU_PCAP_MAGIC_NS) ||
+			emu_swap32(header[5]) != EMU_PCAP_LINKTYPE)
+			goto bad_file;
+		emu_pcap_ns = header[0] == EMU_PCAP_MAGIC_NS;
+		emu_pcap_first = -1;
+		emu_pcap_base = emu_now() / EMU_NS_PER_US;
+		emu_pcap_read();
+	}
+	if(tx_file){
+		if(emu_pcap_tx)
+			fclose(emu_pcap_tx);
+		if(!(emu_pcap_tx = fopen(tx_file, "wb")))
+			return 1;
+		header[0] = EMU_PCAP_MAGIC;
+		header[1] = 2 | (4 << 16); // version 2.4
+		header[2] = 0;
+		header[3] = 0;
+		header[4] = 65535;
+		header[5] = EMU_PCAP_LINKTYPE;
+		emu_pcap_write(emu_pcap_tx, header, sizeof(header));
+	}
+	return 0;
+
+bad_file:
+	fclose(emu_pcap_rx);
+	emu_pcap_rx = NULL;
+	return 1;
+}
+
+void enc28j60_emu_close(void){
+	if(emu_tap >= 0)
+		close(emu_tap);
+	emu_tap = -1;
+	if(emu_pcap_rx)
+		fclose(emu_pcap_rx);
+	emu_pcap_rx = NULL;
+	emu_pcap_len = 0;
+	if(emu_pcap_tx)
+		fclose(emu_pcap_tx);
+	emu_pcap_tx = NULL;
+}
+
+uint8_t enc28j60_emu_inject(const uint8_t *frame, uint16_t len){
+	return emu_receive(frame, len);
+}
+
+uint16_t enc28j60_emu_poll(uint32_t timeout){
+	struct timeval tv;
+	fd_set fds;
+	uint64_t wait, start, due;
+	uint16_t frames;
+
+	emu_start();
+	emu_update();
+	frames = emu_pcap_replay() + emu_tap_read();
+	if(!frames && timeout){
+		// Wake up when frame leaves wire or next pcap frame is due
+		wait = timeout * EMU_NS_PER_MS;
+		if(emu_tx_busy && emu_tx_done - emu_now() < wait)
+			wait = emu_tx_done - emu_now();
+		if(emu_pcap_rx && emu_pcap_len){
+			due = (emu_pcap_base + emu_pcap_next) * EMU_NS_PER_US;
+			if(due - emu_now() < wait)
+				wait = due - emu_now();
+		}
+		if(emu_tap >= 0){
+			// Wait in real time, simulated clock follows
+			FD_ZERO(&fds);
+			FD_SET(emu_tap, &fds);
+			tv.tv_sec = wait / 1000000000ULL;
+			tv.tv_usec = (wait % 1000000000ULL + EMU_NS_PER_US - 1) / EMU_NS_PER_US;
+			start = emu_real_time();
+			select(emu_tap + 1, &fds, NULL, NULL, &tv);
+			if(emu_real_time() - start < wait)
+				wait = emu_real_time() - start;
+		}
+		emu_advance(wait);
+		frames = emu_pcap_replay() + emu_tap_read();
+	}
+	emu_update();
+	return frames;
+}
+
+void enc28j60_emu_set_spi_clock(uint32_t clock){
+	emu_spi_clock = clock;
+}
+
+uint32_t enc28j60_emu_get_spi_clock(void){
+	return emu_spi_clock;
+}
+
+void enc28j60_emu_set_link(uint8_t up){
+	emu_start();
+	up = up ? 1 : 0;
+	if(up == emu_link)
+		return;
+	emu_link = up;
+	if(!up)
+		emu_llstat = 0;
+	emu_phy[EMU_PHIR] |= EMU_PHIR_PLNKIF;
+	if((emu_phy[EMU_PHIE] & (EMU_PHIE_PGEIE | EMU_PHIE_PLNKIE)) == (EMU_PHIE_PGEIE | EMU_PHIE_PLNKIE)){
+		emu_phy[EMU_PHIR] |= EMU_PHIR_PGIF;
+		emu_regs[0][EMU_EIR] |= EMU_EIR_LINKIF;
+	}
+}
+
+uint8_t enc28j60_emu_int_pin(void){
+	uint8_t eie = emu_regs[0][EMU_EIE];
+
+	return !((eie & EMU_EIE_INTIE) && (emu_read(EMU_EIR) & eie & 0x7B));
+}
+
+void enc28j60_emu_set_faults(const enc28j60_emu_faults_t *faults){
+	if(faults)
+		emu_faults = *faults;
+	else
+		memset(&emu_faults, 0, sizeof(emu_faults));
+	emu_tx_seq = 0;
+	emu_rx_seq = 0;
+}
+
+void enc28j60_emu_get_stats(enc28j60_emu_stats_t *stats){
+	*stats = emu_stats;
+}
+
+void enc28j60_emu_reset_stats(void){
+	memset(&emu_stats, 0, sizeof(emu_stats));
+}
+
+__weak void enc28j60_emu_tx_callback(const uint8_t *frame, uint16_t len){
+	/* NOTE: This function should not be modified, when the callback is needed,
+	         the enc28j60_emu_tx_callback could be implemented in the user file
+	*/
+}
+
+#endif /* ENC28J60_EMU */
@@ -0,0 +1,253 @@
+#ifndef ENC28J60_EMU_H
+#define ENC28J60_EMU_H 100
+
+/* C++ detection */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup ENC28J60_EMU
+ * @brief    ENC28J60 emulator for host builds, frames are bridged to Linux TAP interface or pcap files
+ * @{
+ *
+ * Emulator implements \ref ENC28J60_LL_SPIInit and \ref ENC28J60_LL_SPIRxTx on Linux host and decodes
+ * SPI commands like ENC28J60 does, so unmodified enc28j60.c and lan.c run on workstation.
+ *
+ * \par Host build
+ *
+ * Define ENC28J60_EMU and TM_HOST globally (compiler flags -DENC28J60_EMU -DTM_HOST) and compile
+ * enc28j60_emu.c and tm_stm32_host.c instead of enc28j60_ll.c. TM_HOST provides host definitions
+ * and simulated time used by Delay(), Delayms() and HAL_GetTick(). enc28j60_ll.h then maps CS pin to emulator.
+ * INT pin is not used in host build, its level is available with \ref enc28j60_emu_int_pin.
+ * host/Makefile builds enc28j60_emu_test.c with the driver and stack, run it with "make -C host test".
+ *
+ * \par What is modelled
+ *
+ *  - Register banks, common registers, MAC/MII registers with dummy byte on read and PHY registers
+ *  - 8 kB buffer memory with ERDPT/EWRPT auto increment and Rx ring wrap at ERXND
+ *  - Rx: MAC address, broadcast, multicast, hash table, pattern match and magic packet filters (ERXFCON),
+ *    free space check against ERXRDPT, receive status vectors, EPKTCNT, PKTDEC and RXERIF on overflow
+ *  - Tx: per packet control byte, padding and CRC, transmit status vector at ETXND + 1, TXIF
+ *    set after frame time on 10 Mbit/s wire, TXRST and RXRST
+ *  - DMA copy and checksum engine, link state with PHIR/LINKIF
+ *
+ * \par Time
+ *
+ * Every SPI byte advances simulated time according to emulated SPI clock and every LL call
+ * by \ref ENC28J60_EMU_SPI_CALL, so bus time of driver can be compared between versions. \ref enc28j60_emu_poll waits for frames from TAP interface in real time
+ * and advances simulated time by time waited. Frames from pcap file are replayed at their timestamps
+ * relative to simulated time when file was opened.
+ *
+@verbatim
+//Bridge stack to tap0, run "ip addr add 10.1.20.1/24 dev tap0; ip link set tap0 up" on host
+enc28j60_emu_open_tap("tap0");
+LAN_init();
+while (1) {
+    enc28j60_emu_poll(1);
+    LAN_poll();
+}
+
+//Fuzz receive path, input from fuzzer is one frame
+enc28j60_emu_inject(data, size);
+LAN_poll();
+@endverbatim
+ */
+#include <stdint.h>
+#include "attributes.h"
+
+#if !defined(TM_HOST)
+#error "ENC28J60 emulator needs host build with TM_HOST defined"
+#endif
+
+/**
+ * @defgroup ENC28J60_EMU_Macros
+ * @brief    Library defines
+ * @{
+ */
+
+/**
+ * @brief  Emulated SPI clock in Hz after start, ENC28J60 supports up to 20 MHz
+ * @note   Can be changed at run time with \ref enc28j60_emu_set_spi_clock
+ */
+#ifndef ENC28J60_EMU_SPI_CLOCK
+#define ENC28J60_EMU_SPI_CLOCK	10000000
+#endif
+
+/**
+ * @brief  Time in nanoseconds spent in each call of LL SPI function besides bit times
+ * @note   Models function call, wait loops and gaps between bytes on MCU. Block transfers with
+ *         \ref ENC28J60_LL_SPIRead and \ref ENC28J60_LL_SPIWrite pay it once per block
+ */
+#ifndef ENC28J60_EMU_SPI_CALL
+#define ENC28J60_EMU_SPI_CALL	250
+#endif
+
+/**
+ * @brief  Chip select used by enc28j60_ll.h in host build
+ */
+#define ENC28J60_EMU_CS_INIT	enc28j60_emu_cs(1)
+#define ENC28J60_EMU_CS_LOW		enc28j60_emu_cs(0)
+#define ENC28J60_EMU_CS_HIGH	enc28j60_emu_cs(1)
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup ENC28J60_EMU_Typedefs
+ * @brief    Library Typedefs
+ * @{
+ */
+
+/**
+ * @brief  Emulator counters
+ */
+typedef struct {
+	uint32_t spi_transactions;        /*!< Number of SPI transactions (CS low periods) */
+	uint32_t spi_bytes;               /*!< Number of bytes transferred over SPI */
+	uint64_t spi_time;                /*!< Time spent in LL SPI functions, in nanoseconds */
+	uint32_t rx_frames;               /*!< Number of frames stored to Rx ring */
+	uint32_t rx_filtered;             /*!< Number of frames rejected by receive filters or longer than MAMXFL */
+	uint32_t rx_overflows;            /*!< Number of frames dropped because Rx ring or EPKTCNT was full */
+	uint32_t rx_disabled;             /*!< Number of frames dropped while Rx was disabled or link was down */
+	uint32_t tx_frames;               /*!< Number of frames sent to wire */
+	uint32_t tx_bytes;                /*!< Number of bytes sent to wire without CRC */
+	uint32_t tx_failed;               /*!< Number of transmits failed by injected late collision */
+	uint32_t tx_dropped;              /*!< Number of frames not accepted by TAP interface */
+	uint32_t dma_runs;                /*!< Number of DMA copy and checksum operations */
+} enc28j60_emu_stats_t;
+
+/**
+ * @brief  Injected errors, each value is period in frames, 0 disables error
+ */
+typedef struct {
+	uint16_t tx_late_collision;       /*!< Every n-th transmit fails with late collision and TXERIF */
+	uint16_t rx_bad_crc;              /*!< Every n-th received frame has bad CRC */
+} enc28j60_emu_faults_t;
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup ENC28J60_EMU_Functions
+ * @brief    ENC28J60 emulator Functions
+ * @{
+ */
+
+/**
+ * @brief  Sets chip select level, used by CS macros
+ * @param  level: 0 to select chip, 1 to end transaction
+ * @retval None
+ */
+void enc28j60_emu_cs(uint8_t level);
+
+/**
+ * @brief  Bridges emulated wire to Linux TAP interface
+ * @note   Needs access to /dev/net/tun, interface is created when it does not exist
+ * @param  *name: interface name, e.g. "tap0"
+ * @retval 0 on success, 1 when interface can not be opened
+ */
+uint8_t enc28j60_emu_open_tap(const char *name);
+
+/**
+ * @brief  Bridges emulated wire to pcap files
+ * @param  *rx_file: pcap file with frames to receive, NULL for none
+ * @param  *tx_file: pcap file to write transmitted frames to, NULL for none
+ * @retval 0 on success, 1 when file can not be opened or has wrong format
+ */
+uint8_t enc28j60_emu_open_pcap(const char *rx_file, const char *tx_file);
+
+/**
+ * @brief  Closes TAP interface and pcap files
+ * @retval None
+ */
+void enc28j60_emu_close(void);
+
+/**
+ * @brief  Puts frame on emulated wire, chip receives it immediately
+ * @note   Frame is without CRC, frames shorter than 60 bytes are padded like on real wire
+ * @param  *frame: pointer to frame
+ * @param  len: frame length, up to 1518 bytes
+ * @retval 0 when frame was stored to Rx ring, 1 when rejected by filter, 2 when dropped
+ */
+uint8_t enc28j60_emu_inject(const uint8_t *frame, uint16_t len);
+
+/**
+ * @brief  Moves frames from TAP interface or pcap file to chip and completes finished transmits
+ * @param  timeout: time to wait for first frame in milliseconds, 0 returns immediately
+ * @retval Number of frames put on emulated wire
+ */
+uint16_t enc28j60_emu_poll(uint32_t timeout);
+
+/**
+ * @brief  Sets emulated SPI clock, so one build can be measured at several clocks
+ * @param  clock: SPI clock in Hz
+ * @retval None
+ */
+void enc28j60_emu_set_spi_clock(uint32_t clock);
+
+/**
+ * @brief  Gets emulated SPI clock
+ * @retval SPI clock in Hz
+ */
+uint32_t enc28j60_emu_get_spi_clock(void);
+
+/**
+ * @brief  Sets link state, link change is reported by PHIR and EIR_LINKIF
+ * @note   Link is up after start
+ * @param  up: 1 for link up, 0 for link down
+ * @retval None
+ */
+void enc28j60_emu_set_link(uint8_t up);
+
+/**
+ * @brief  Gets level of INT pin
+ * @retval 0 when interrupt is asserted, 1 otherwise
+ */
+uint8_t enc28j60_emu_int_pin(void);
+
+/**
+ * @brief  Sets injected errors
+ * @param  *faults: pointer to @ref enc28j60_emu_faults_t structure, NULL disables errors
+ * @retval None
+ */
+void enc28j60_emu_set_faults(const enc28j60_emu_faults_t *faults);
+
+/**
+ * @brief  Gets emulator counters
+ * @param  *stats: pointer to @ref enc28j60_emu_stats_t structure to fill
+ * @retval None
+ */
+void enc28j60_emu_get_stats(enc28j60_emu_stats_t *stats);
+
+/**
+ * @brief  Resets emulator counters
+ * @retval None
+ */
+void enc28j60_emu_reset_stats(void);
+
+/**
+ * @brief  Called for each frame chip puts on wire, after it is bridged to TAP or pcap
+ * @param  *frame: pointer to frame without CRC
+ * @param  len: frame length
+ * @retval None
+ * @note   With __weak parameter to prevent link errors if not defined by user
+ */
+void enc28j60_emu_tx_callback(const uint8_t *frame, uint16_t len);
+
+/**
+ * @}
+ */
+
+/**
+ * @}
+ */
+
+/* C++ detection */
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,689 @@
+/*
+ * Benchmarks of ENC28J60 driver and LAN stack on ENC28J60 emulator.
+ * Build and run with "make -C host bench", or run host/build/enc28j60_emu_bench <mode> [args].
+ *
+ * Times are simulated: SPI bytes and calls cost time per ENC28J60_EMU_SPI_CLOCK and ENC28J60_EMU_SPI_CALL,
+ * frames take their time on 10 Mbit/s wire. Code of driver and stack runs on host and takes no simulated time,
+ * so results are upper bounds set by SPI bus and wire.
+ *
+ *   ping [payload] [count]   echo requests from peer, echo/s and latency of one echo
+ *   spi                      SPI time per echo at 4, 10 and 20 MHz, build with HOST_LL_BYTE defined
+ *                            (enc28j60_emu_bench_byte) measures per byte transfers of buffer memory
+ *   tcp-send [rtt] [loss] [bytes]
+ *                            bulk transfer from stack to peer, kB/s with round trip time in ms
+ *                            and loss of 1 in loss data segments, build with HOST_TCP_BUF_SIZE
+ *                            defined (enc28j60_emu_bench_4k) for bigger buffers
+ *   tcp-recv [rtt] [loss] [bytes]
+ *                            bulk transfer from peer to stack, same arguments
+ *   tap <interface>          stack bridged to TAP interface, e.g. "ping -f" or "ping -i 0" from host
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "enc28j60.h"
+#include "enc28j60_ll.h"
+#include "enc28j60_emu.h"
+#include "lan.h"
+
+// Peer on emulated wire, stack has MAC_ADDR and IP_ADDR from lan_conf.h
+#define BENCH_PEER_IP		inet_addr(10,1,20,7)
+
+static uint8_t bench_mac[6] = MAC_ADDR;
+static uint8_t bench_peer[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x07};
+
+// Frames put on wire by chip and time when last one left
+static uint32_t bench_tx_count;
+static uint64_t bench_tx_time;
+
+static void bench_tcp_from_stack(const eth_frame_t *frame, uint16_t len);
+
+void enc28j60_emu_tx_callback(const uint8_t *frame, uint16_t len){
+	bench_tx_count++;
+	bench_tx_time = TM_HOST_GetTimeNs();
+	bench_tcp_from_stack((const eth_frame_t*)frame, len);
+}
+
+// Internet checksum, bytes paired from start of buffer
+static uint16_t bench_cksum(uint32_t sum, const uint8_t *buf, uint16_t len){
+	uint16_t i;
+
+	for(i = 0; i < len; i++)
+		sum += (i & 1) ? buf[i] : (buf[i] << 8);
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+// Ethernet and IP header of packet from peer to stack, payload follows IP header
+static void bench_ip_header(uint8_t *buf, uint8_t protocol, uint16_t len){
+	eth_frame_t *frame = (void*)buf;
+	ip_packet_t *ip = (void*)frame->data;
+
+	memcpy(frame->to_addr, bench_mac, 6);
+	memcpy(frame->from_addr, bench_peer, 6);
+	frame->type = ETH_TYPE_IP;
+	memset(ip, 0, sizeof(ip_packet_t));
+	ip->ver_head_len = 0x45;
+	ip->total_len = htons(sizeof(ip_packet_t) + len);
+	ip->ttl = 64;
+	ip->protocol = protocol;
+	ip->from_addr = BENCH_PEER_IP;
+	ip->to_addr = IP_ADDR;
+	ip->cksum = htons(bench_cksum(0, (void*)ip, sizeof(ip_packet_t)));
+}
+
+// Echo request with payload bytes, returns frame length
+static uint16_t bench_echo_request(uint8_t *buf, uint16_t payload){
+	ip_packet_t *ip = (void*)((eth_frame_t*)buf)->data;
+	icmp_echo_packet_t *icmp = (void*)ip->data;
+	uint16_t len = sizeof(icmp_echo_packet_t) + payload;
+	uint16_t i;
+
+	bench_ip_header(buf, IP_PROTOCOL_ICMP, len);
+	memset(icmp, 0, sizeof(icmp_echo_packet_t));
+	icmp->type = ICMP_TYPE_ECHO_RQ;
+	icmp->id = htons(39);
+	for(i = 0; i < payload; i++)
+		icmp->data[i] = (uint8_t)i;
+	icmp->cksum = htons(bench_cksum(0, (void*)icmp, len));
+
+	len += sizeof(eth_frame_t) + sizeof(ip_packet_t);
+	return len < 60 ? 60 : len;
+}
+
+// Run stack until n more frames left wire, 0 on timeout
+static int bench_wait_tx(uint32_t n){
+	uint32_t count = bench_tx_count + n;
+	uint32_t start = HAL_GetTick();
+
+	while(bench_tx_count < count){
+		if(HAL_GetTick() - start > 1000)
+			return 0;
+		LAN_poll();
+		enc28j60_emu_poll(1);
+	}
+	return 1;
+}
+
+// Results of echo measurement
+typedef struct {
+	double rate;			// echo/s
+	double latency;			// us of single echo on idle stack
+	double spi_time;		// us of SPI per echo
+	uint32_t spi_bytes;		// SPI bytes per echo
+} bench_echo_t;
+
+// Echo rate with requests arriving as fast as stack reads them, latency of single echo on idle stack
+static int bench_echo(uint16_t payload, uint32_t count, bench_echo_t *result){
+	enc28j60_emu_stats_t emu;
+	static uint8_t frame[ENC28J60_MAXFRAME];
+	uint16_t len;
+	uint64_t start;
+	uint32_t i, sent;
+
+	if(payload > ENC28J60_MAXFRAME - 4 - sizeof(eth_frame_t) - sizeof(ip_packet_t) - sizeof(icmp_echo_packet_t)){
+		printf("payload too long\n");
+		return 1;
+	}
+	len = bench_echo_request(frame, payload);
+
+	// Latency from request stored in Rx ring to end of reply on wire
+	HAL_Delay(10);
+	start = TM_HOST_GetTimeNs();
+	enc28j60_emu_inject(frame, len);
+	if(!bench_wait_tx(1)){
+		printf("no echo reply\n");
+		return 1;
+	}
+	result->latency = (bench_tx_time - start) / 1000.0;
+
+	// Rate, next request arrives when previous one was read from chip
+	HAL_Delay(10);
+	enc28j60_emu_reset_stats();
+	start = TM_HOST_GetTimeNs();
+	sent = bench_tx_count;
+	for(i = 0; i < count; i++){
+		enc28j60_emu_inject(frame, len);
+		LAN_poll();
+	}
+	bench_wait_tx(count - (bench_tx_count - sent));
+	enc28j60_emu_get_stats(&emu);
+	if(emu.tx_frames != count){
+		printf("%u replies to %u requests\n", (unsigned)emu.tx_frames, (unsigned)count);
+		return 1;
+	}
+
+	result->rate = count * 1e9 / (bench_tx_time - start);
+	result->spi_time = emu.spi_time / 1000.0 / count;
+	result->spi_bytes = emu.spi_bytes / count;
+	return 0;
+}
+
+static int bench_ping(int argc, char **argv){
+	bench_echo_t echo;
+	uint16_t payload = argc > 0 ? atoi(argv[0]) : 56;
+
+	if(bench_echo(payload, argc > 1 ? atoi(argv[1]) : 1000, &echo))
+		return 1;
+	printf("ping payload %4u, SPI %4.1f MHz: %7.0f echo/s, latency %6.1f us, SPI %6.1f us and %5u bytes per echo\n",
+		payload, enc28j60_emu_get_spi_clock() / 1e6, echo.rate, echo.latency, echo.spi_time, (unsigned)echo.spi_bytes);
+	return 0;
+}
+
+// SPI time of echo at several clocks, for comparison of block and per byte transfers of buffer memory.
+//	Cost of each LL call on MCU is modelled by ENC28J60_EMU_SPI_CALL, results scale with it
+static int bench_spi(int argc, char **argv){
+	static const uint32_t clocks[] = {4000000, 10000000, 20000000};
+	static const uint16_t payloads[] = {56, 1000};
+	bench_echo_t echo;
+	uint8_t c, p;
+
+#ifdef ENC28J60_LL_BURST
+	printf("block transfers, modelled with %u ns per LL call\n", ENC28J60_EMU_SPI_CALL);
+#else
+	printf("per byte transfers, modelled with %u ns per LL call\n", ENC28J60_EMU_SPI_CALL);
+#endif
+	for(c = 0; c < sizeof(clocks) / sizeof(clocks[0]); c++){
+		for(p = 0; p < sizeof(payloads) / sizeof(payloads[0]); p++){
+			enc28j60_emu_set_spi_clock(clocks[c]);
+			if(bench_echo(payloads[p], 200, &echo))
+				return 1;
+			printf("  payload %4u, SPI %2u MHz: SPI %6.1f us per echo, %6.0f echo/s\n",
+				payloads[p], (unsigned)(clocks[c] / 1000000), echo.spi_time, echo.rate);
+		}
+	}
+	return 0;
+}
+
+// TCP peer on emulated wire. Segments in both directions take half of round trip time,
+//	peer sends on its own 10 Mbit/s link and loses data segments with probability 1/loss
+#define BENCH_PORT			80
+#define BENCH_PEER_PORT		4000
+#define BENCH_PEER_ISN		7000
+#define BENCH_PEER_MSS		1460
+#define BENCH_SEGMENTS		1024
+#define BENCH_RTO			200			// ms of peer retransmission timer
+
+// Segment on its way between peer and stack
+typedef struct {
+	uint64_t due;			// ns when segment arrives
+	uint8_t to_stack;		// 1 - from peer to stack, 0 - from stack to peer
+	uint8_t flags;			// TCP_FLAG_*
+	uint32_t seq, ack;
+	uint16_t len;			// bytes of data
+	uint16_t window;
+} bench_segment_t;
+
+static bench_segment_t bench_segments[BENCH_SEGMENTS];
+static uint16_t bench_segment_count;
+static uint32_t bench_rtt, bench_loss, bench_lost;
+static uint64_t bench_wire;			// ns when peer link is free
+static uint8_t bench_arp;			// ARP request from stack waits for reply
+
+// Connection seen by peer, data offsets are relative to first byte after SYN
+static uint32_t bench_stack_isn;
+static uint16_t bench_stack_mss;
+static uint8_t bench_established, bench_closed;
+static uint32_t bench_received;		// bytes passed to app by stack
+static uint32_t bench_peer_rcv;		// bytes received by peer in order
+static uint32_t bench_stack_max;	// end of data sent by stack
+static uint32_t bench_stack_segments, bench_stack_retransmits;
+static uint16_t bench_stack_frame;	// longest frame sent by stack, without CRC
+static uint32_t bench_corrupt;		// data bytes not in stream order
+
+// Peer handler of data and ACK segments from stack
+static void (*bench_tcp_peer)(const bench_segment_t *seg);
+
+// Puts segment on its way, data segments may be lost
+static void bench_tcp_queue(bench_segment_t *seg){
+	uint64_t now = TM_HOST_GetTimeNs();
+
+	if(seg->len && bench_loss && (rand() % bench_loss == 0)){
+		bench_lost++;
+		return;
+	}
+	if(bench_segment_count == BENCH_SEGMENTS)
+		return;
+
+	seg->due = now + bench_rtt * 500000ULL;
+	if(seg->to_stack){
+		// Frame with preamble, CRC and gap on 10 Mbit/s link, 0.8 us per byte
+		if(bench_wire < now)
+			bench_wire = now;
+		bench_wire += (sizeof(eth_frame_t) + sizeof(ip_packet_t) + sizeof(tcp_packet_t) + seg->len + 24) * 800;
+		if(seg->due < bench_wire)
+			seg->due = bench_wire;
+	}
+	bench_segments[bench_segment_count++] = *seg;
+}
+
+// Segment from peer to stack, SYN carries MSS option, byte at each offset of data is its lower 8 bits
+static void bench_tcp_inject(const bench_segment_t *seg){
+	static uint8_t buf[ENC28J60_MAXFRAME];
+	ip_packet_t *ip = (void*)((eth_frame_t*)buf)->data;
+	tcp_packet_t *tcp = (void*)ip->data;
+	uint16_t head = sizeof(tcp_packet_t) + ((seg->flags & TCP_FLAG_SYN) ? 4 : 0);
+	uint16_t len = head + seg->len;
+	uint16_t i;
+
+	bench_ip_header(buf, IP_PROTOCOL_TCP, len);
+	memset(tcp, 0, head);
+	tcp->from_port = htons(BENCH_PEER_PORT);
+	tcp->to_port = htons(BENCH_PORT);
+	tcp->seq_num = htonl(seg->seq);
+	tcp->ack_num = htonl(seg->ack);
+	tcp->data_offset = (head / 4) << 4;
+	tcp->flags = seg->flags;
+	tcp->window = htons(seg->window);
+	if(seg->flags & TCP_FLAG_SYN){
+		tcp->data[0] = 2;
+		tcp->data[1] = 4;
+		tcp->data[2] = BENCH_PEER_MSS >> 8;
+		tcp->data[3] = BENCH_PEER_MSS & 0xff;
+	}
+	for(i = 0; i < seg->len; i++)
+		((uint8_t*)tcp)[head + i] = (uint8_t)(seg->seq - BENCH_PEER_ISN - 1 + i);
+	tcp->cksum = htons(bench_cksum((uint16_t)~bench_cksum(0, (void*)&ip->from_addr, 8) + IP_PROTOCOL_TCP + len,
+		(void*)tcp, len));
+
+	len += sizeof(eth_frame_t) + sizeof(ip_packet_t);
+	enc28j60_emu_inject(buf, len < 60 ? 60 : len);
+}
+
+// Segment with ACK from peer, window is always open
+static void bench_tcp_send(uint32_t offset, uint16_t len){
+	bench_segment_t seg = {0};
+
+	seg.to_stack = 1;
+	seg.flags = TCP_FLAG_ACK;
+	seg.seq = BENCH_PEER_ISN + 1 + offset;
+	seg.ack = bench_stack_isn + 1 + bench_peer_rcv;
+	seg.len = len;
+	seg.window = 0xffff;
+	bench_tcp_queue(&seg);
+}
+
+// Frames from stack: ARP requests are answered, TCP segments go to peer.
+//	Data sent by stack are checked, byte at each offset is its lower 8 bits
+static void bench_tcp_from_stack(const eth_frame_t *frame, uint16_t len){
+	const arp_message_t *arp = (const void*)frame->data;
+	const ip_packet_t *ip = (const void*)frame->data;
+	const tcp_packet_t *tcp = (const void*)ip->data;
+	bench_segment_t seg = {0};
+	uint32_t offset;
+	uint16_t i;
+
+	if( (frame->type == ETH_TYPE_ARP) && (arp->type == ARP_TYPE_REQUEST) )
+		bench_arp = 1;
+	if( (frame->type != ETH_TYPE_IP) || (ip->protocol != IP_PROTOCOL_TCP) )
+		return;
+
+	seg.flags = tcp->flags;
+	seg.seq = ntohl(tcp->seq_num);
+	seg.ack = ntohl(tcp->ack_num);
+	seg.len = ntohs(ip->total_len) - sizeof(ip_packet_t) - tcp_head_size(tcp);
+	seg.window = ntohs(tcp->window);
+	if( (tcp->flags & TCP_FLAG_SYN) && (tcp_head_size(tcp) >= sizeof(tcp_packet_t) + 4) && (tcp->data[0] == 2) )
+		bench_stack_mss = (tcp->data[2] << 8) | tcp->data[3];
+
+	if(seg.len){
+		offset = seg.seq - bench_stack_isn - 1;
+		for(i = 0; i < seg.len; i++)
+			if(tcp_get_data(tcp)[i] != (uint8_t)(offset + i))
+				bench_corrupt++;
+		bench_stack_segments++;
+		if(offset < bench_stack_max)
+			bench_stack_retransmits++;
+		else
+			bench_stack_max = offset + seg.len;
+		if(len > bench_stack_frame)
+			bench_stack_frame = len;
+	}
+	bench_tcp_queue(&seg);
+}
+
+// ARP reply from peer
+static void bench_arp_reply(void){
+	static uint8_t buf[60];
+	eth_frame_t *frame = (void*)buf;
+	arp_message_t *arp = (void*)frame->data;
+
+	memcpy(frame->to_addr, bench_mac, 6);
+	memcpy(frame->from_addr, bench_peer, 6);
+	frame->type = ETH_TYPE_ARP;
+	arp->hw_type = ARP_HW_TYPE_ETH;
+	arp->proto_type = ARP_PROTO_TYPE_IP;
+	arp->hw_addr_len = 6;
+	arp->proto_addr_len = 4;
+	arp->type = ARP_TYPE_RESPONSE;
+	memcpy(arp->mac_addr_from, bench_peer, 6);
+	arp->ip_addr_from = BENCH_PEER_IP;
+	memcpy(arp->mac_addr_to, bench_mac, 6);
+	arp->ip_addr_to = IP_ADDR;
+	enc28j60_emu_inject(buf, sizeof(buf));
+}
+
+// Runs stack for 50 us and delivers segments which arrived, in order of sending.
+//	Segments queued by handlers are appended and kept by same loop
+static void bench_tcp_step(void){
+	uint64_t now;
+	uint16_t i, n;
+
+	LAN_poll();
+	enc28j60_emu_poll(0);
+	if(bench_arp){
+		bench_arp = 0;
+		bench_arp_reply();
+	}
+
+	now = TM_HOST_GetTimeNs();
+	for(i = 0, n = 0; i < bench_segment_count; i++){
+		bench_segment_t seg = bench_segments[i];
+
+		if(seg.due > now){
+			bench_segments[n++] = seg;
+			continue;
+		}
+		if(seg.to_stack){
+			bench_tcp_inject(&seg);
+		}else if( (seg.flags & TCP_FLAG_SYN) && (seg.flags & TCP_FLAG_ACK) ){
+			bench_stack_isn = seg.seq;
+			bench_established = 1;
+			bench_tcp_send(0, 0);
+		}else if(bench_established){
+			bench_tcp_peer(&seg);
+		}
+	}
+	bench_segment_count = n;
+
+	TM_HOST_Delay(50);
+}
+
+// App on stack: sends bench_app_total bytes in stream order, checks data it receives
+static uint32_t bench_app_sent, bench_app_total;
+
+static uint8_t bench_tcp_listen(uint8_t id, eth_frame_t *frame){
+	return 1;
+}
+
+static void bench_tcp_read(uint8_t id, eth_frame_t *frame, uint8_t re){
+	uint8_t data[256];
+	uint16_t len, i;
+
+	while(bench_app_sent < bench_app_total){
+		len = bench_app_total - bench_app_sent < sizeof(data) ? bench_app_total - bench_app_sent : sizeof(data);
+		for(i = 0; i < len; i++)
+			data[i] = (uint8_t)(bench_app_sent + i);
+		len = LAN_TCPWrite(id, data, len);
+		if(!len)
+			break;
+		bench_app_sent += len;
+	}
+}
+
+static void bench_tcp_write(uint8_t id, eth_frame_t *frame, uint16_t len){
+	const uint8_t *data = tcp_get_data((tcp_packet_t*)((ip_packet_t*)frame->data)->data);
+	uint16_t i;
+
+	for(i = 0; i < len; i++)
+		if(data[i] != (uint8_t)(bench_received + i))
+			bench_corrupt++;
+	bench_received += len;
+}
+
+static void bench_tcp_closed(uint8_t id, uint8_t hard){
+	bench_closed = 1;
+}
+
+static const tcp_callbacks_t bench_tcp_callbacks = {bench_tcp_listen, bench_tcp_read, bench_tcp_write, bench_tcp_closed};
+
+// Opens connection from peer to stack, 0 on timeout. Datagram from stack puts peer
+//	to ARP cache first, so data segments do not wait for ARP reply
+static int bench_tcp_connect(void){
+	bench_segment_t syn = {0};
+	eth_frame_t *frame = LAN_BufAlloc();
+	ip_packet_t *ip = (void*)frame->data;
+	udp_packet_t *udp = (void*)ip->data;
+	uint32_t start = HAL_GetTick();
+
+	ip->to_addr = BENCH_PEER_IP;
+	udp->from_port = htons(BENCH_PORT);
+	udp->to_port = htons(BENCH_PEER_PORT);
+	LAN_UDPSend(frame, 0);
+	LAN_BufFree(frame);
+	while(HAL_GetTick() - start < 10)
+		bench_tcp_step();
+
+	LAN_TCPListen(htons(BENCH_PORT), 0, &bench_tcp_callbacks);
+	syn.to_stack = 1;
+	syn.flags = TCP_FLAG_SYN;
+	syn.seq = BENCH_PEER_ISN;
+	syn.window = 0xffff;
+	bench_tcp_queue(&syn);
+
+	while(!bench_established){
+		if(HAL_GetTick() - start > 1000)
+			return 0;
+		bench_tcp_step();
+	}
+	return 1;
+}
+
+// Peer receiving data: every segment is acknowledged at once, segments
+//	out of order are kept and acknowledged when gap before them is filled
+#define BENCH_RCV_BLOCKS	64
+
+static struct {
+	uint32_t start, end;
+} bench_rcv_blocks[BENCH_RCV_BLOCKS];
+static uint8_t bench_rcv_count;
+
+static void bench_rcv_peer(const bench_segment_t *seg){
+	uint32_t start = seg->seq - bench_stack_isn - 1, end = start + seg->len;
+	uint8_t i, n;
+
+	if(!seg->len)
+		return;
+
+	if( (start > bench_peer_rcv) && (bench_rcv_count < BENCH_RCV_BLOCKS) ){
+		bench_rcv_blocks[bench_rcv_count].start = start;
+		bench_rcv_blocks[bench_rcv_count].end = end;
+		bench_rcv_count++;
+	}else if( (start <= bench_peer_rcv) && (end > bench_peer_rcv) ){
+		bench_peer_rcv = end;
+	}
+
+	// Blocks joined to data in order, others are kept
+	do {
+		for(i = 0, n = 0; i < bench_rcv_count; i++){
+			if(bench_rcv_blocks[i].start <= bench_peer_rcv){
+				if(bench_rcv_blocks[i].end > bench_peer_rcv)
+					bench_peer_rcv = bench_rcv_blocks[i].end;
+			}else{
+				bench_rcv_blocks[n++] = bench_rcv_blocks[i];
+			}
+		}
+		i = bench_rcv_count != n;
+		bench_rcv_count = n;
+	} while(i);
+
+	bench_tcp_send(0, 0);
+}
+
+// Bulk transfer from stack to peer, throughput is limited by wire, SPI bus,
+//	by send buffer (at most TCP_TX_BUF_SIZE bytes per round trip) and by congestion window
+static int bench_tcp_send_data(int argc, char **argv){
+	enc28j60_emu_stats_t emu;
+	uint32_t start, time;
+
+	bench_rtt = argc > 0 ? atoi(argv[0]) : 20;
+	bench_loss = argc > 1 ? atoi(argv[1]) : 0;
+	bench_app_total = argc > 2 ? atoi(argv[2]) : 500000;
+	if(!bench_rtt){
+		printf("round trip time must be 1 ms at least\n");
+		return 1;
+	}
+
+	// App sends when connection is established
+	bench_tcp_peer = bench_rcv_peer;
+	if(!bench_tcp_connect()){
+		printf("no connection\n");
+		return 1;
+	}
+
+	enc28j60_emu_reset_stats();
+	start = HAL_GetTick();
+	while( (bench_peer_rcv < bench_app_total) && !bench_closed && (HAL_GetTick() - start < 600000) )
+		bench_tcp_step();
+	time = HAL_GetTick() - start;
+	enc28j60_emu_get_stats(&emu);
+
+	printf("tcp-send buffer %5u, RTT %3u ms, loss 1/%-4u: %7.1f kB/s, window limit %7.1f kB/s, "
+		"%u segments, longest frame %u bytes, %u lost, %u retransmits\n",
+		TCP_TX_BUF_SIZE, (unsigned)bench_rtt, (unsigned)bench_loss, bench_peer_rcv / (double)time,
+		TCP_TX_BUF_SIZE / (double)bench_rtt, (unsigned)bench_stack_segments, bench_stack_frame,
+		(unsigned)bench_lost, (unsigned)bench_stack_retransmits);
+	if( (bench_peer_rcv != bench_app_total) || bench_corrupt || (bench_stack_frame > ENC28J60_MAXFRAME - 4) ){
+		printf("%u of %u bytes received, %u corrupt\n", (unsigned)bench_peer_rcv,
+			(unsigned)bench_app_total, (unsigned)bench_corrupt);
+		return 1;
+	}
+	return 0;
+}
+
+// Peer sending data: window of stack limits data in flight, lost segment is sent again
+//	after three duplicate ACKs, or all data from it after BENCH_RTO
+static uint32_t bench_snd_una, bench_snd_nxt, bench_snd_max, bench_snd_wnd, bench_snd_total;
+static uint32_t bench_snd_segments, bench_snd_retransmits;
+static uint32_t bench_snd_timer;
+static uint8_t bench_snd_dup;
+
+static uint16_t bench_snd_len(uint32_t offset){
+	uint32_t len = bench_snd_total - offset;
+
+	if(len > bench_stack_mss)
+		len = bench_stack_mss;
+	if(offset + len > bench_snd_una + bench_snd_wnd)
+		len = bench_snd_una + bench_snd_wnd - offset;
+	return len;
+}
+
+static void bench_snd_segment(uint32_t offset, uint16_t len){
+	bench_snd_segments++;
+	bench_tcp_send(offset, len);
+}
+
+static void bench_snd_peer(const bench_segment_t *seg){
+	uint32_t ack = seg->ack - BENCH_PEER_ISN - 1;
+
+	if( (ack == bench_snd_una) && (bench_snd_una < bench_snd_max) && (seg->window == bench_snd_wnd) && !seg->len ){
+		if(++bench_snd_dup == 3){
+			bench_snd_retransmits++;
+			bench_snd_segment(bench_snd_una, bench_snd_len(bench_snd_una));
+		}
+	}
+	bench_snd_wnd = seg->window;
+	if( (ack > bench_snd_una) && (ack <= bench_snd_max) ){
+		bench_snd_una = ack;
+		bench_snd_dup = 0;
+		bench_snd_timer = HAL_GetTick();
+		if(bench_snd_nxt < bench_snd_una)
+			bench_snd_nxt = bench_snd_una;
+	}
+}
+
+static void bench_snd_pump(void){
+	uint16_t len;
+
+	if( (bench_snd_una < bench_snd_max) && (HAL_GetTick() - bench_snd_timer > BENCH_RTO) ){
+		bench_snd_retransmits++;
+		bench_snd_nxt = bench_snd_una;
+		bench_snd_dup = 0;
+		bench_snd_timer = HAL_GetTick();
+	}
+	while( (bench_snd_nxt < bench_snd_total) && ((len = bench_snd_len(bench_snd_nxt)) > 0) ){
+		if(bench_snd_nxt == bench_snd_una)
+			bench_snd_timer = HAL_GetTick();
+		bench_snd_segment(bench_snd_nxt, len);
+		bench_snd_nxt += len;
+		if(bench_snd_nxt > bench_snd_max)
+			bench_snd_max = bench_snd_nxt;
+	}
+}
+
+// Bulk transfer from peer to stack, throughput is limited by wire, SPI bus
+//	and by receive window, at most TCP_RX_BUF_SIZE bytes per round trip
+static int bench_tcp_recv(int argc, char **argv){
+	enc28j60_emu_stats_t emu;
+	uint32_t start, time;
+
+	bench_rtt = argc > 0 ? atoi(argv[0]) : 20;
+	bench_loss = argc > 1 ? atoi(argv[1]) : 0;
+	bench_snd_total = argc > 2 ? atoi(argv[2]) : 500000;
+	if(!bench_rtt){
+		printf("round trip time must be 1 ms at least\n");
+		return 1;
+	}
+
+	bench_tcp_peer = bench_snd_peer;
+	if(!bench_tcp_connect()){
+		printf("no connection\n");
+		return 1;
+	}
+
+	enc28j60_emu_reset_stats();
+	start = HAL_GetTick();
+	bench_snd_wnd = TCP_RX_BUF_SIZE;
+	bench_snd_timer = start;
+	while( (bench_received < bench_snd_total) && !bench_closed && (HAL_GetTick() - start < 600000) ){
+		bench_snd_pump();
+		bench_tcp_step();
+	}
+	time = HAL_GetTick() - start;
+	enc28j60_emu_get_stats(&emu);
+
+	printf("tcp-recv buffer %5u, RTT %3u ms, loss 1/%-4u: %7.1f kB/s, window limit %7.1f kB/s, "
+		"%u segments of up to %u bytes, %u lost, %u retransmits, %u rx overflows\n",
+		TCP_RX_BUF_SIZE, (unsigned)bench_rtt, (unsigned)bench_loss, bench_received / (double)time,
+		TCP_RX_BUF_SIZE / (double)bench_rtt, (unsigned)bench_snd_segments, bench_stack_mss,
+		(unsigned)bench_lost, (unsigned)bench_snd_retransmits, (unsigned)emu.rx_overflows);
+	if( (bench_received != bench_snd_total) || bench_corrupt ){
+		printf("%u of %u bytes received, %u corrupt\n", (unsigned)bench_received,
+			(unsigned)bench_snd_total, (unsigned)bench_corrupt);
+		return 1;
+	}
+	return 0;
+}
+
+// Stack bridged to host network, runs until killed
+static int bench_tap(int argc, char **argv){
+	if(argc < 1 || enc28j60_emu_open_tap(argv[0])){
+		printf("can not open TAP interface\n");
+		return 1;
+	}
+	printf("stack is %u.%u.%u.%u on %s\n", IP_ADDR & 0xff, (IP_ADDR >> 8) & 0xff,
+		(IP_ADDR >> 16) & 0xff, IP_ADDR >> 24, argv[0]);
+	while(1){
+		enc28j60_emu_poll(1);
+		LAN_poll();
+	}
+	return 0;
+}
+
+int main(int argc, char **argv){
+	LAN_init();
+
+	if(argc > 1 && !strcmp(argv[1], "ping"))
+		return bench_ping(argc - 2, argv + 2);
+	if(argc > 1 && !strcmp(argv[1], "spi"))
+		return bench_spi(argc - 2, argv + 2);
+	if(argc > 1 && !strcmp(argv[1], "tcp-recv"))
+		return bench_tcp_recv(argc - 2, argv + 2);
+	if(argc > 1 && !strcmp(argv[1], "tcp-send"))
+		return bench_tcp_send_data(argc - 2, argv + 2);
+	if(argc > 1 && !strcmp(argv[1], "tap"))
+		return bench_tap(argc - 2, argv + 2);
+
+	printf("usage: %s ping [payload] [count] | spi | tcp-send [rtt] [loss] [bytes] | tcp-recv [rtt] [loss] [bytes] | tap <interface>\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,344 @@
+/*
+ * Fuzzing of ENC28J60 driver and LAN stack receive path on ENC28J60 emulator.
+ *
+ * LLVMFuzzerTestOneInput takes one frame per input, so file can be linked with libFuzzer
+ * (clang -fsanitize=fuzzer,address -DENC28J60_EMU_LIBFUZZER ...). Without libFuzzer main generates
+ * ARP, ICMP, UDP and TCP frames from peer, follows TCP sequence numbers of stack so segments reach
+ * established connections, and corrupts some of them. "make -C host test" runs it with fixed seed
+ * under AddressSanitizer, run host/build/enc28j60_emu_fuzz [iterations] [seed] for longer sessions.
+ *
+ * Every frame sent by stack is checked: length, IP header and ICMP, UDP and TCP checksums.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "enc28j60.h"
+#include "enc28j60_emu.h"
+#include "lan.h"
+
+// Peer on emulated wire, stack has MAC_ADDR and IP_ADDR from lan_conf.h
+#define FUZZ_PEER_IP		inet_addr(10,1,20,7)
+#define FUZZ_PORT			htons(80)
+
+static uint8_t fuzz_mac[6] = MAC_ADDR;
+static uint8_t fuzz_peer[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x07};
+static const uint8_t fuzz_broadcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+// Frames from stack, number of wrong ones
+static uint32_t fuzz_tx_count;
+static uint32_t fuzz_errors;
+
+// Echo request being answered had valid checksum, reply checksum is updated incrementally
+//	and stays wrong for wrong request
+static uint8_t fuzz_icmp_valid;
+
+// Sequence and acknowledgment numbers of next segment from peer, taken from last segment of stack
+static uint32_t fuzz_seq, fuzz_ack;
+static uint16_t fuzz_port;
+
+// Internet checksum, bytes paired from start of buffer
+static uint16_t fuzz_cksum(uint32_t sum, const uint8_t *buf, uint16_t len){
+	uint16_t i;
+
+	for(i = 0; i < len; i++)
+		sum += (i & 1) ? buf[i] : (buf[i] << 8);
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+// Sum of pseudo header of TCP and UDP
+static uint32_t fuzz_pseudo(const ip_packet_t *ip, uint16_t len){
+	return (uint16_t)~fuzz_cksum(0, (void*)&ip->from_addr, 8) + ip->protocol + len;
+}
+
+static void fuzz_error(const char *what){
+	printf("bad frame from stack: %s\n", what);
+	fuzz_errors++;
+}
+
+void enc28j60_emu_tx_callback(const uint8_t *buf, uint16_t len){
+	const eth_frame_t *frame = (void*)buf;
+	const ip_packet_t *ip = (void*)frame->data;
+	const tcp_packet_t *tcp = (void*)ip->data;
+	const udp_packet_t *udp = (void*)ip->data;
+	uint16_t ip_len;
+
+	fuzz_tx_count++;
+	if(len < 60 || len > ENC28J60_MAXFRAME - 4){
+		fuzz_error("length");
+		return;
+	}
+	if(frame->type != ETH_TYPE_IP)
+		return;
+
+	ip_len = ntohs(ip->total_len);
+	if(ip->ver_head_len != 0x45 || ip_len < sizeof(ip_packet_t) || sizeof(eth_frame_t) + ip_len > len){
+		fuzz_error("IP length");
+		return;
+	}
+	if(fuzz_cksum(0, (void*)ip, sizeof(ip_packet_t))){
+		fuzz_error("IP checksum");
+		return;
+	}
+
+	ip_len -= sizeof(ip_packet_t);
+	switch(ip->protocol){
+	case IP_PROTOCOL_ICMP:
+		if(fuzz_icmp_valid && fuzz_cksum(0, ip->data, ip_len))
+			fuzz_error("ICMP checksum");
+		break;
+	case IP_PROTOCOL_UDP:
+		if(udp->cksum && fuzz_cksum(fuzz_pseudo(ip, ip_len), ip->data, ip_len))
+			fuzz_error("UDP checksum");
+		break;
+	case IP_PROTOCOL_TCP:
+		if(fuzz_cksum(fuzz_pseudo(ip, ip_len), ip->data, ip_len)){
+			fuzz_error("TCP checksum");
+			break;
+		}
+		if(ip->to_addr == FUZZ_PEER_IP){
+			fuzz_seq = ntohl(tcp->ack_num);
+			fuzz_ack = ntohl(tcp->seq_num) + ip_len - tcp_head_size(tcp)
+				+ ((tcp->flags & (TCP_FLAG_SYN | TCP_FLAG_FIN)) ? 1 : 0);
+			fuzz_port = tcp->to_port;
+		}
+		break;
+	}
+}
+
+static uint32_t fuzz_rand_state;
+
+static uint32_t fuzz_rand(void){
+	fuzz_rand_state = fuzz_rand_state * 1103515245 + 12345;
+	return fuzz_rand_state >> 8;
+}
+
+// Read all data passed to application, so sanitizer sees lengths past buffer
+static volatile uint8_t fuzz_sink;
+
+static void fuzz_read(const uint8_t *data, uint16_t len){
+	uint16_t i;
+
+	for(i = 0; i < len; i++)
+		fuzz_sink += data[i];
+}
+
+// Stack side of connections: accepts them, sends back some data, closes some of them
+
+uint8_t LAN_Callback_TCPListen(uint8_t id, eth_frame_t *frame){
+	return 1;
+}
+
+void LAN_Callback_TCPRead(uint8_t id, eth_frame_t *frame, uint8_t re){
+}
+
+void LAN_Callback_TCPWrite(uint8_t id, eth_frame_t *frame, uint16_t len){
+	static const uint8_t data[700];
+
+	fuzz_read(tcp_get_data((tcp_packet_t*)((ip_packet_t*)frame->data)->data), len);
+	switch(fuzz_rand() % 8){
+	case 0:
+		LAN_TCPClose(id);
+		break;
+	case 1:
+	case 2:
+		LAN_TCPWrite(id, data, fuzz_rand() % sizeof(data));
+		break;
+	}
+}
+
+void LAN_Callback_UDPPacket(eth_frame_t *frame, uint16_t len){
+	fuzz_read(((udp_packet_t*)((ip_packet_t*)frame->data)->data)->data, len);
+	if(len && (fuzz_rand() & 1))
+		LAN_UDPReply(frame, len);
+}
+
+// Fix IP header and ICMP, UDP or TCP checksum of frame, so it gets past checks of stack
+static void fuzz_fix(uint8_t *buf, uint16_t len){
+	eth_frame_t *frame = (void*)buf;
+	ip_packet_t *ip = (void*)frame->data;
+	uint16_t *cksum;
+	uint16_t ip_len;
+
+	if(len < sizeof(eth_frame_t) + sizeof(ip_packet_t) || frame->type != ETH_TYPE_IP)
+		return;
+	ip->cksum = 0;
+	ip->cksum = htons(fuzz_cksum(0, (void*)ip, sizeof(ip_packet_t)));
+
+	ip_len = ntohs(ip->total_len);
+	if(ip_len < sizeof(ip_packet_t) || sizeof(eth_frame_t) + ip_len > len)
+		return;
+	ip_len -= sizeof(ip_packet_t);
+	switch(ip->protocol){
+	case IP_PROTOCOL_ICMP:
+		if(ip_len < sizeof(icmp_echo_packet_t))
+			return;
+		cksum = &((icmp_echo_packet_t*)ip->data)->cksum;
+		*cksum = 0;
+		*cksum = htons(fuzz_cksum(0, ip->data, ip_len));
+		break;
+	case IP_PROTOCOL_UDP:
+		if(ip_len < sizeof(udp_packet_t))
+			return;
+		cksum = &((udp_packet_t*)ip->data)->cksum;
+		*cksum = 0;
+		*cksum = htons(fuzz_cksum(fuzz_pseudo(ip, ip_len), ip->data, ip_len));
+		break;
+	case IP_PROTOCOL_TCP:
+		if(ip_len < sizeof(tcp_packet_t))
+			return;
+		cksum = &((tcp_packet_t*)ip->data)->cksum;
+		*cksum = 0;
+		*cksum = htons(fuzz_cksum(fuzz_pseudo(ip, ip_len), ip->data, ip_len));
+		break;
+	}
+}
+
+// Fill frame from peer with header of random kind, returns frame length
+static uint16_t fuzz_generate(uint8_t *buf, uint16_t size){
+	eth_frame_t *frame = (void*)buf;
+	arp_message_t *arp = (void*)frame->data;
+	ip_packet_t *ip = (void*)frame->data;
+	tcp_packet_t *tcp = (void*)ip->data;
+	udp_packet_t *udp = (void*)ip->data;
+	icmp_echo_packet_t *icmp = (void*)ip->data;
+	uint16_t len, i, data;
+
+	len = 60 + fuzz_rand() % (size - 60 + 1);
+	if(fuzz_rand() % 4)
+		len = 60 + fuzz_rand() % 200;
+	for(i = 0; i < len; i++)
+		buf[i] = fuzz_rand();
+
+	memcpy(frame->to_addr, (fuzz_rand() % 8) ? fuzz_mac : fuzz_broadcast, 6);
+	memcpy(frame->from_addr, fuzz_peer, 6);
+	frame->from_addr[5] += fuzz_rand() % 4;
+	data = len - sizeof(eth_frame_t) - sizeof(ip_packet_t);
+
+	switch(fuzz_rand() % 8){
+	case 0:
+		// ARP request or reply for stack, peers change their MAC addresses
+		frame->type = ETH_TYPE_ARP;
+		arp->hw_type = ARP_HW_TYPE_ETH;
+		arp->proto_type = ARP_PROTO_TYPE_IP;
+		arp->hw_addr_len = 6;
+		arp->proto_addr_len = 4;
+		arp->type = (fuzz_rand() & 1) ? ARP_TYPE_REQUEST : ARP_TYPE_RESPONSE;
+		memcpy(arp->mac_addr_from, frame->from_addr, 6);
+		arp->ip_addr_from = FUZZ_PEER_IP + ((fuzz_rand() % 16) << 24);
+		arp->ip_addr_to = IP_ADDR;
+		return len;
+	case 1:
+		// Fully random frame
+		return len;
+	}
+
+	frame->type = ETH_TYPE_IP;
+	ip->ver_head_len = 0x45;
+	ip->total_len = htons(sizeof(ip_packet_t) + data - fuzz_rand() % 4);
+	ip->flags_framgent_offset = (fuzz_rand() % 8) ? 0 : ip->flags_framgent_offset;
+	ip->from_addr = FUZZ_PEER_IP;
+	ip->to_addr = (fuzz_rand() % 8) ? IP_ADDR : (IP_ADDR | ~IP_SUBNET_MASK);
+
+	switch(fuzz_rand() % 3){
+	case 0:
+		ip->protocol = IP_PROTOCOL_ICMP;
+		icmp->type = (fuzz_rand() % 4) ? ICMP_TYPE_ECHO_RQ : icmp->type;
+		icmp->code = 0;
+		break;
+	case 1:
+		ip->protocol = IP_PROTOCOL_UDP;
+		udp->len = htons(data);
+		break;
+	default:
+		// Segment near sequence numbers of last connection, or new connection
+		ip->protocol = IP_PROTOCOL_TCP;
+		tcp->to_port = FUZZ_PORT;
+		if(fuzz_port && (fuzz_rand() % 4)){
+			tcp->from_port = fuzz_port;
+			tcp->seq_num = htonl(fuzz_seq + ((fuzz_rand() % 4) ? 0 : fuzz_rand() % 3000));
+			tcp->ack_num = htonl(fuzz_ack - ((fuzz_rand() % 4) ? 0 : fuzz_rand() % 1000));
+			tcp->flags = (fuzz_rand() % 4) ? TCP_FLAG_ACK : fuzz_rand();
+		} else {
+			tcp->from_port = htons(1024 + fuzz_rand() % 8);
+			tcp->flags = TCP_FLAG_SYN;
+		}
+		tcp->data_offset = (fuzz_rand() % 8) ? (sizeof(tcp_packet_t) << 2) : tcp->data_offset;
+		tcp->window = htons((fuzz_rand() % 4) ? 8192 : fuzz_rand());
+		if(data < sizeof(tcp_packet_t) || data - sizeof(tcp_packet_t) > fuzz_rand() % 1400)
+			ip->total_len = htons(sizeof(ip_packet_t) + sizeof(tcp_packet_t) + (fuzz_rand() % 8 ? 0 : 4));
+		break;
+	}
+	return len;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+	const ip_packet_t *ip = (void*)((eth_frame_t*)data)->data;
+	static uint8_t init;
+
+	if(!init){
+		LAN_init();
+		LAN_TCPListen(FUZZ_PORT, 0, 0);
+		init = 1;
+	}
+
+	if(size > ENC28J60_MAXFRAME - 4)
+		size = ENC28J60_MAXFRAME - 4;
+	fuzz_icmp_valid = (size >= sizeof(eth_frame_t) + sizeof(ip_packet_t)) &&
+		(sizeof(eth_frame_t) + ntohs(ip->total_len) <= size) && (ntohs(ip->total_len) >= sizeof(ip_packet_t)) &&
+		!fuzz_cksum(0, ip->data, ntohs(ip->total_len) - sizeof(ip_packet_t));
+
+	// Replies leave wire before next frame, longest one takes 1.2 ms
+	enc28j60_emu_inject(data, size);
+	LAN_poll();
+	HAL_Delay(2);
+	LAN_poll();
+	return 0;
+}
+
+#ifndef ENC28J60_EMU_LIBFUZZER
+int main(int argc, char **argv){
+	static uint8_t frame[ENC28J60_MAXFRAME - 4];
+	uint32_t count = argc > 1 ? strtoul(argv[1], 0, 0) : 20000;
+	uint32_t i, n;
+	uint16_t len;
+
+	fuzz_rand_state = argc > 2 ? strtoul(argv[2], 0, 0) : 39;
+	for(i = 0; i < count; i++){
+		len = fuzz_generate(frame, sizeof(frame));
+		if(fuzz_rand() % 8)
+			fuzz_fix(frame, len);
+
+		// Corrupt some bytes after checksums were fixed
+		if(!(fuzz_rand() % 8))
+			for(n = fuzz_rand() % 4; n; n--)
+				frame[fuzz_rand() % len] = fuzz_rand();
+
+		LLVMFuzzerTestOneInput(frame, len);
+
+		// Stack sends to unresolved addresses sometimes, timers run out
+		if(!(fuzz_rand() % 64)){
+			eth_frame_t *tx = LAN_BufAlloc();
+			ip_packet_t *ip;
+			udp_packet_t *udp;
+
+			if(tx){
+				ip = (void*)tx->data;
+				udp = (void*)ip->data;
+				ip->to_addr = FUZZ_PEER_IP + ((fuzz_rand() % 16) << 24);
+				udp->from_port = htons(1000);
+				udp->to_port = htons(2000);
+				LAN_UDPSend(tx, fuzz_rand() % 100);
+				LAN_BufFree(tx);
+			}
+		}
+		if(!(fuzz_rand() % 32))
+			HAL_Delay(fuzz_rand() % 2000);
+	}
+
+	printf("enc28j60 emu fuzz: %u frames, %u frames from stack, %u bad\n",
+		(unsigned)count, (unsigned)fuzz_tx_count, (unsigned)fuzz_errors);
+	return fuzz_errors ? 1 : 0;
+}
+#endif
@@ -0,0 +1,1175 @@
+/*
+ * Host tests of ENC28J60 driver and LAN stack on ENC28J60 emulator.
+ * Build and run with "make -C host test".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "enc28j60.h"
+#include "enc28j60_emu.h"
+#include "lan.h"
+#include "lan_socket.h"
+
+// Check condition, report line and stop test on failure
+#define CHECK(c) do { if(!(c)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #c); return 1; } } while(0)
+
+// Peer on emulated wire, stack has MAC_ADDR and IP_ADDR from lan_conf.h
+#define TEST_PEER_IP		inet_addr(10,1,20,7)
+
+static uint8_t test_mac[6] = MAC_ADDR;
+static uint8_t test_peer[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x07};
+static const uint8_t test_broadcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+// Last frame put on wire by chip
+static uint8_t test_tx[1518];
+static uint16_t test_tx_len;
+static uint32_t test_tx_count;
+
+static void test_from_stack(const uint8_t *frame, uint16_t len);
+
+void enc28j60_emu_tx_callback(const uint8_t *frame, uint16_t len){
+	memcpy(test_tx, frame, len);
+	test_tx_len = len;
+	test_tx_count++;
+	test_from_stack(frame, len);
+}
+
+// Transmit status vectors reported by driver
+static enc28j60_tsv_t test_tsv;
+static uint32_t test_tsv_count;
+
+void enc28j60_tx_callback(const enc28j60_tsv_t *tsv){
+	test_tsv = *tsv;
+	test_tsv_count++;
+}
+
+// Ethernet frame from peer to us, payload bytes are counting from 0
+static uint16_t test_frame(uint8_t *frame, uint16_t len){
+	uint16_t i;
+
+	memcpy(frame, test_mac, 6);
+	memcpy(frame + 6, test_peer, 6);
+	frame[12] = 0x88;
+	frame[13] = 0xB5;
+	for(i = 14; i < len; i++)
+		frame[i] = (uint8_t)i;
+	return len;
+}
+
+// Reference internet checksum, bytes paired from start of buffer
+static uint16_t test_cksum(uint32_t sum, const uint8_t *buf, uint16_t len){
+	uint16_t i;
+
+	for(i = 0; i < len; i++)
+		sum += (i & 1) ? buf[i] : (buf[i] << 8);
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+// Ethernet and IP header of packet from peer, payload follows IP header
+static void test_ip_header(uint8_t *buf, const uint8_t *to_mac, uint32_t to_addr, uint8_t protocol, uint16_t len){
+	eth_frame_t *frame = (void*)buf;
+	ip_packet_t *ip = (void*)frame->data;
+
+	memcpy(frame->to_addr, to_mac, 6);
+	memcpy(frame->from_addr, test_peer, 6);
+	frame->type = ETH_TYPE_IP;
+	memset(ip, 0, sizeof(ip_packet_t));
+	ip->ver_head_len = 0x45;
+	ip->total_len = htons(sizeof(ip_packet_t) + len);
+	ip->ttl = 64;
+	ip->protocol = protocol;
+	ip->from_addr = TEST_PEER_IP;
+	ip->to_addr = to_addr;
+	ip->cksum = htons(test_cksum(0, (void*)ip, sizeof(ip_packet_t)));
+}
+
+// SPI cost of one minimal frame in each direction
+static int test_spi_cost(void){
+	enc28j60_stats_t stats;
+	enc28j60_emu_stats_t emu;
+	uint8_t frame[60], buf[1518];
+
+	// Receive: header and data in one RBM transaction, first frame selects bank of receive path
+	test_frame(frame, sizeof(frame));
+	CHECK(enc28j60_emu_inject(frame, sizeof(frame)) == 0);
+	CHECK(enc28j60_emu_inject(frame, sizeof(frame)) == 0);
+	CHECK(enc28j60_recv_packet(buf, sizeof(buf)) == sizeof(frame));
+	enc28j60_reset_stats();
+	enc28j60_emu_reset_stats();
+	CHECK(enc28j60_recv_packet(buf, sizeof(buf)) == sizeof(frame));
+	CHECK(memcmp(buf, frame, sizeof(frame)) == 0);
+	enc28j60_get_stats(&stats);
+	enc28j60_emu_get_stats(&emu);
+	CHECK(stats.rx_frames == 1);
+	CHECK(stats.rx_frame_transactions == 7 && stats.rx_frame_bytes == 78);
+	CHECK(stats.bank_switches == 0);
+
+	// Driver counters match traffic seen by chip
+	CHECK(stats.spi_transactions == emu.spi_transactions && stats.spi_bytes == emu.spi_bytes);
+
+	// Transmit: control byte and frame in one WBM transaction, all registers are in bank 0
+	enc28j60_reset_stats();
+	enc28j60_emu_reset_stats();
+	enc28j60_send_packet(frame, sizeof(frame));
+	enc28j60_get_stats(&stats);
+	enc28j60_emu_get_stats(&emu);
+	CHECK(stats.tx_frames == 1);
+	CHECK(stats.tx_frame_transactions == 6 && stats.tx_frame_bytes == 72);
+	CHECK(stats.bank_switches == 0);
+	CHECK(stats.spi_transactions == emu.spi_transactions && stats.spi_bytes == emu.spi_bytes);
+
+	// Frame leaves wire after its time
+	HAL_Delay(1);
+	enc28j60_emu_poll(0);
+	CHECK(test_tx_count == 1 && test_tx_len == sizeof(frame) && memcmp(test_tx, frame, sizeof(frame)) == 0);
+
+	return 0;
+}
+
+// Retire all staged frames
+static void test_tx_drain(void){
+	uint8_t i;
+
+	for(i = 0; i < 2 * ENC28J60_TX_SLOTS_MAX * (ENC28J60_TX_RETRIES + 1); i++){
+		HAL_Delay(2);
+		enc28j60_tx_poll();
+	}
+}
+
+// Frames are staged while wire is busy, sender waits only when all slots are used
+static int test_tx_queue(void){
+	enc28j60_emu_faults_t faults = {0};
+	enc28j60_buffer_info_t info;
+	enc28j60_stats_t stats;
+	uint8_t frame[ENC28J60_MAXFRAME - 4];
+	uint8_t i;
+
+	test_frame(frame, sizeof(frame));
+	test_tx_drain();
+	test_tx_count = test_tsv_count = 0;
+	enc28j60_reset_stats();
+
+	// All slots are staged without waiting for transmit status
+	for(i = 0; i < ENC28J60_TX_SLOTS; i++)
+		enc28j60_send_packet(frame, sizeof(frame));
+	CHECK(test_tsv_count == 0);
+	enc28j60_get_buffer_info(&info);
+	CHECK(info.tx_slots == ENC28J60_TX_SLOTS && info.tx_queued == ENC28J60_TX_SLOTS);
+
+	// Next frame waits for first slot only, byte count includes CRC
+	enc28j60_send_packet(frame, sizeof(frame));
+	CHECK(test_tsv_count == 1 && test_tsv.done && test_tsv.byte_count == sizeof(frame) + 4);
+
+	// Staged frames go to wire one after another
+	test_tx_drain();
+	enc28j60_get_buffer_info(&info);
+	CHECK(info.tx_queued == 0);
+	CHECK(test_tsv_count == ENC28J60_TX_SLOTS + 1 && test_tx_count == ENC28J60_TX_SLOTS + 1);
+	CHECK(memcmp(test_tx, frame, sizeof(frame)) == 0);
+
+	// Frames aborted by late collision are sent again from their slots
+	faults.tx_late_collision = 2;
+	enc28j60_emu_set_faults(&faults);
+	test_tx_count = test_tsv_count = 0;
+	enc28j60_reset_stats();
+	for(i = 0; i < 4; i++)
+		enc28j60_send_packet(frame, sizeof(frame));
+	test_tx_drain();
+	enc28j60_emu_set_faults(NULL);
+	enc28j60_get_stats(&stats);
+	CHECK(test_tsv_count == 4 && test_tsv.done);
+	CHECK(stats.tx_late_collisions == stats.tx_retries && stats.tx_retries > 0 && stats.tx_aborts == 0);
+
+	return 0;
+}
+
+// Rx ring shrinks with more Tx slots, peaks of its usage are sampled when burst is noticed
+static int test_partition(void){
+	enc28j60_buffer_info_t info, before;
+	uint8_t frame[300], buf[1518];
+	uint8_t i;
+
+	enc28j60_get_buffer_info(&before);
+	CHECK(enc28j60_set_partition(0) == 1);
+	CHECK(enc28j60_set_partition(ENC28J60_TX_SLOTS_MAX + 1) == 1);
+
+	CHECK(enc28j60_set_partition(3) == 0);
+	enc28j60_get_buffer_info(&info);
+	CHECK(info.tx_slots == 3 && info.rx_size == before.rx_size - (3 - before.tx_slots) * (ENC28J60_MAXFRAME + 8));
+	CHECK(info.rx_free == info.rx_size && info.pkt_count == 0);
+	CHECK(info.rx_used_max == 0 && info.pkt_count_max == 0);
+
+	// Five frames wait in ring, each takes 6 byte header, data and CRC
+	test_frame(frame, sizeof(frame));
+	for(i = 0; i < 5; i++)
+		CHECK(enc28j60_emu_inject(frame, sizeof(frame)) == 0);
+	enc28j60_get_buffer_info(&info);
+	CHECK(info.pkt_count == 5 && info.rx_free == info.rx_size - 5 * (6 + sizeof(frame) + 4));
+
+	for(i = 0; i < 5; i++){
+		CHECK(enc28j60_recv_packet(buf, sizeof(buf)) == sizeof(frame));
+		CHECK(memcmp(buf, frame, sizeof(frame)) == 0);
+	}
+	CHECK(enc28j60_recv_packet(buf, sizeof(buf)) == 0);
+	enc28j60_get_buffer_info(&info);
+	CHECK(info.pkt_count == 0 && info.rx_free == info.rx_size);
+	CHECK(info.rx_used_max == 5 * (6 + sizeof(frame) + 4) && info.pkt_count_max == 5);
+
+	// Peaks are cleared with statistics, default partition is restored
+	enc28j60_reset_stats();
+	enc28j60_get_buffer_info(&info);
+	CHECK(info.rx_used_max == 0 && info.pkt_count_max == 0);
+	CHECK(enc28j60_set_partition(before.tx_slots) == 0);
+	enc28j60_get_buffer_info(&info);
+	CHECK(info.tx_slots == before.tx_slots && info.rx_size == before.rx_size);
+
+	return 0;
+}
+
+// Checksum filled by driver, DMA engine or software depending on ENC28J60_USE_DMA_CSUM
+static int test_cksum_offload(void){
+	enc28j60_emu_stats_t emu;
+	uint8_t frame[ENC28J60_MAXFRAME - 4];
+	uint16_t len, start, field, sum, i, cksum;
+	uint16_t n;
+
+	srand(35);
+	test_tx_drain();
+	enc28j60_emu_reset_stats();
+	for(n = 0; n < 2000; n++){
+		// Random frame, checksummed part starts at even offset like IP payload
+		len = 16 + rand() % (sizeof(frame) - 16 + 1);
+		start = 14 + 2 * (rand() % ((len - 14) / 2));
+		field = start + 2 * (rand() % ((len - start) / 2));
+		sum = rand();
+		for(i = 0; i < len; i++)
+			frame[i] = rand();
+		memcpy(frame, test_peer, 6);
+		frame[field] = frame[field + 1] = 0;
+
+		enc28j60_send_packet_cksum(frame, len, start, field, sum);
+		test_tx_drain();
+
+		// Wire frame has checksum at field, other bytes unchanged
+		cksum = test_cksum(sum, frame + start, len - start);
+		frame[field] = cksum >> 8;
+		frame[field + 1] = cksum;
+		CHECK(test_tx_len == (len < 60 ? 60 : len) && memcmp(test_tx, frame, len) == 0);
+	}
+
+	enc28j60_emu_get_stats(&emu);
+	CHECK(emu.tx_frames == 2000);
+	CHECK(emu.dma_runs == (ENC28J60_USE_DMA_CSUM ? 2000 : 0));
+
+	return 0;
+}
+
+// UDP packets passed to application
+static uint32_t test_udp_count;
+static uint16_t test_udp_len;
+
+void LAN_Callback_UDPPacket(eth_frame_t *frame, uint16_t len){
+	test_udp_count++;
+	test_udp_len = len;
+}
+
+// UDP broadcasts reach application with default receive filter
+static int test_udp_broadcast(void){
+	uint8_t buf[60] = {0};
+	eth_frame_t *frame = (void*)buf;
+	udp_packet_t *udp = (void*)((ip_packet_t*)frame->data)->data;
+
+	test_ip_header(buf, test_broadcast, IP_ADDR | ~IP_SUBNET_MASK, IP_PROTOCOL_UDP, sizeof(udp_packet_t) + 4);
+	udp->from_port = htons(68);
+	udp->to_port = htons(5000);
+	udp->len = htons(sizeof(udp_packet_t) + 4);
+
+	test_udp_count = 0;
+	CHECK(enc28j60_emu_inject(buf, sizeof(buf)) == 0);
+	LAN_poll();
+	CHECK(test_udp_count == 1 && test_udp_len == 4);
+
+	return 0;
+}
+
+// Checksum request of datagram to unresolved host does not leak to next frame
+static int test_cksum_after_arp_miss(void){
+	uint8_t buf[sizeof(eth_frame_t) + sizeof(ip_packet_t) + sizeof(icmp_echo_packet_t) + 32];
+	eth_frame_t *frame = LAN_BufAlloc();
+	ip_packet_t *ip = (void*)frame->data;
+	udp_packet_t *udp = (void*)ip->data;
+	icmp_echo_packet_t *icmp = (void*)((ip_packet_t*)((eth_frame_t*)buf)->data)->data;
+	uint16_t len = sizeof(icmp_echo_packet_t) + 32;
+
+	// Datagram waits in ARP queue or is dropped, depending on WITH_ARP_QUEUE
+	CHECK(frame);
+	ip->to_addr = inet_addr(10,1,20,99);
+	udp->from_port = htons(1000);
+	udp->to_port = htons(2000);
+	LAN_UDPSend(frame, 8);
+	LAN_BufFree(frame);
+	test_tx_drain();
+
+	// Echo reply is sent right after it
+	test_ip_header(buf, test_mac, IP_ADDR, IP_PROTOCOL_ICMP, len);
+	memset(icmp, 0x5a, len);
+	icmp->type = ICMP_TYPE_ECHO_RQ;
+	icmp->code = 0;
+	icmp->cksum = 0;
+	icmp->cksum = htons(test_cksum(0, (void*)icmp, len));
+	test_tx_count = 0;
+	CHECK(enc28j60_emu_inject(buf, sizeof(buf)) == 0);
+	LAN_poll();
+	test_tx_drain();
+
+	icmp = (void*)((ip_packet_t*)((eth_frame_t*)test_tx)->data)->data;
+	CHECK(test_tx_count == 1 && icmp->type == ICMP_TYPE_ECHO_RPLY);
+	CHECK(test_cksum(0, (void*)icmp, len) == 0);
+
+	return 0;
+}
+
+// TCP peer on emulated wire, segments from stack are kept for test in order of sending
+#define TEST_PORT			80
+#define TEST_PEER_PORT		4000
+#define TEST_PEER_ISN		7000
+#define TEST_SEGMENTS		64
+
+// Segment from stack to peer, ports in host byte order
+typedef struct {
+	uint16_t port, peer_port;
+	uint8_t flags;			// TCP_FLAG_*
+	uint32_t seq, ack;
+	uint16_t window;
+	uint16_t len;			// bytes of data
+	uint8_t data[ENC28J60_MAXFRAME];
+} test_segment_t;
+
+static test_segment_t test_segments[TEST_SEGMENTS];
+static test_segment_t test_segment;
+static uint8_t test_segment_count;
+static uint8_t test_arp;			// ARP request for peer waits for reply
+
+// Connection seen by peer, ports in host byte order
+typedef struct {
+	uint16_t port, peer_port;
+	uint32_t seq;			// next sequence number of peer
+	uint32_t ack;			// next sequence number of stack
+	uint16_t window;		// window advertised by peer
+	uint8_t id;				// connection in stack
+} test_conn_t;
+
+// Frames from stack: ARP requests for peer are answered, TCP segments are kept
+static void test_from_stack(const uint8_t *buf, uint16_t len){
+	const eth_frame_t *frame = (const void*)buf;
+	const arp_message_t *arp = (const void*)frame->data;
+	const ip_packet_t *ip = (const void*)frame->data;
+	const tcp_packet_t *tcp = (const void*)ip->data;
+	test_segment_t *seg;
+
+	if( (frame->type == ETH_TYPE_ARP) && (arp->type == ARP_TYPE_REQUEST) && (arp->ip_addr_to == TEST_PEER_IP) )
+		test_arp = 1;
+	if( (frame->type != ETH_TYPE_IP) || (ip->protocol != IP_PROTOCOL_TCP) || (test_segment_count == TEST_SEGMENTS) )
+		return;
+
+	seg = test_segments + test_segment_count++;
+	seg->port = ntohs(tcp->from_port);
+	seg->peer_port = ntohs(tcp->to_port);
+	seg->flags = tcp->flags;
+	seg->seq = ntohl(tcp->seq_num);
+	seg->ack = ntohl(tcp->ack_num);
+	seg->window = ntohs(tcp->window);
+	seg->len = ntohs(ip->total_len) - sizeof(ip_packet_t) - tcp_head_size(tcp);
+	memcpy(seg->data, tcp_get_data(tcp), seg->len);
+}
+
+// ARP reply from peer
+static void test_arp_reply(void){
+	uint8_t buf[60] = {0};
+	eth_frame_t *frame = (void*)buf;
+	arp_message_t *arp = (void*)frame->data;
+
+	memcpy(frame->to_addr, test_mac, 6);
+	memcpy(frame->from_addr, test_peer, 6);
+	frame->type = ETH_TYPE_ARP;
+	arp->hw_type = ARP_HW_TYPE_ETH;
+	arp->proto_type = ARP_PROTO_TYPE_IP;
+	arp->hw_addr_len = 6;
+	arp->proto_addr_len = 4;
+	arp->type = ARP_TYPE_RESPONSE;
+	memcpy(arp->mac_addr_from, test_peer, 6);
+	arp->ip_addr_from = TEST_PEER_IP;
+	memcpy(arp->mac_addr_to, test_mac, 6);
+	arp->ip_addr_to = IP_ADDR;
+	enc28j60_emu_inject(buf, sizeof(buf));
+}
+
+// Runs stack for ms milliseconds, frames leave wire and ARP requests for peer are answered
+static void test_run(uint32_t ms){
+	uint32_t start = HAL_GetTick();
+
+	while(HAL_GetTick() - start < ms){
+		LAN_poll();
+		enc28j60_emu_poll(0);
+		if(test_arp){
+			test_arp = 0;
+			test_arp_reply();
+		}
+		HAL_Delay(1);
+	}
+	enc28j60_emu_poll(0);
+}
+
+// Segment from peer, SYN carries MSS option. Sequence number of peer moves past data, SYN and FIN
+static void test_tcp_in(test_conn_t *c, uint8_t flags, const void *data, uint16_t len){
+	static uint8_t buf[ENC28J60_MAXFRAME];
+	ip_packet_t *ip = (void*)((eth_frame_t*)buf)->data;
+	tcp_packet_t *tcp = (void*)ip->data;
+	uint16_t head = sizeof(tcp_packet_t) + ((flags & TCP_FLAG_SYN) ? 4 : 0);
+	uint16_t tlen = head + len;
+
+	test_ip_header(buf, test_mac, IP_ADDR, IP_PROTOCOL_TCP, tlen);
+	memset(tcp, 0, head);
+	tcp->from_port = htons(c->peer_port);
+	tcp->to_port = htons(c->port);
+	tcp->seq_num = htonl(c->seq);
+	tcp->ack_num = (flags & TCP_FLAG_ACK) ? htonl(c->ack) : 0;
+	tcp->data_offset = (head / 4) << 4;
+	tcp->flags = flags;
+	tcp->window = htons(c->window);
+	if(flags & TCP_FLAG_SYN){
+		tcp->data[0] = 2;
+		tcp->data[1] = 4;
+		tcp->data[2] = 1460 >> 8;
+		tcp->data[3] = 1460 & 0xff;
+	}
+	memcpy((uint8_t*)tcp + head, data, len);
+	tcp->cksum = htons(test_cksum((uint16_t)~test_cksum(0, (void*)&ip->from_addr, 8) + IP_PROTOCOL_TCP + tlen,
+		(void*)tcp, tlen));
+
+	c->seq += len + ((flags & (TCP_FLAG_SYN|TCP_FLAG_FIN)) ? 1 : 0);
+
+	tlen += sizeof(eth_frame_t) + sizeof(ip_packet_t);
+	enc28j60_emu_inject(buf, tlen < 60 ? 60 : tlen);
+	test_run(2);
+}
+
+// Oldest segment from stack to connection, 0 when none was sent
+static const test_segment_t *test_tcp_out(const test_conn_t *c){
+	uint8_t i;
+
+	for(i = 0; i < test_segment_count; i++){
+		if( (test_segments[i].port != c->port) || (test_segments[i].peer_port != c->peer_port) )
+			continue;
+		test_segment = test_segments[i];
+		memmove(test_segments + i, test_segments + i + 1, (test_segment_count - i - 1) * sizeof(test_segment_t));
+		test_segment_count--;
+		return &test_segment;
+	}
+	return 0;
+}
+
+// App on stack, it accepts connections unless test refuses them
+static uint8_t test_app_accept;
+static uint8_t test_app_id;				// connection of last SYN
+static uint8_t test_app_rx_id;			// connection of last data
+static uint8_t test_app_rx[ENC28J60_MAXFRAME];
+static uint16_t test_app_rx_len;
+static uint8_t test_app_closed_id, test_app_hard;
+static uint32_t test_app_closed;
+
+static uint8_t test_app_listen(uint8_t id, eth_frame_t *frame){
+	test_app_id = id;
+	return test_app_accept;
+}
+
+static void test_app_read(uint8_t id, eth_frame_t *frame, uint8_t re){
+
+}
+
+static void test_app_write(uint8_t id, eth_frame_t *frame, uint16_t len){
+	tcp_packet_t *tcp = (void*)((ip_packet_t*)frame->data)->data;
+
+	test_app_rx_id = id;
+	test_app_rx_len = len;
+	memcpy(test_app_rx, tcp_get_data(tcp), len);
+}
+
+static void test_app_closed_cb(uint8_t id, uint8_t hard){
+	test_app_closed_id = id;
+	test_app_hard = hard;
+	test_app_closed++;
+}
+
+static const tcp_callbacks_t test_app_cb = {
+	test_app_listen,
+	test_app_read,
+	test_app_write,
+	test_app_closed_cb
+};
+
+// Clean state of peer and app, peer address is resolved by stack
+static void test_tcp_begin(void){
+	eth_frame_t *frame = LAN_BufAlloc();
+	ip_packet_t *ip = (void*)frame->data;
+	udp_packet_t *udp = (void*)ip->data;
+
+	ip->to_addr = TEST_PEER_IP;
+	udp->from_port = htons(1000);
+	udp->to_port = htons(2000);
+	LAN_UDPSend(frame, 8);
+	LAN_BufFree(frame);
+	test_run(10);
+
+	test_segment_count = 0;
+	test_app_accept = 1;
+	test_app_id = test_app_rx_id = test_app_closed_id = TCP_ID_NONE;
+	test_app_rx_len = 0;
+	test_app_closed = 0;
+}
+
+static void test_conn_init(test_conn_t *c, uint16_t port, uint16_t peer_port){
+	memset(c, 0, sizeof(*c));
+	c->port = port;
+	c->peer_port = peer_port;
+	c->seq = TEST_PEER_ISN;
+	c->window = 8192;
+	c->id = TCP_ID_NONE;
+}
+
+// Handshake of peer with listening stack, 0 when connection is established.
+//	Connection id is known when SYN came to callbacks of test, not to socket
+static int test_tcp_open(test_conn_t *c, uint16_t port, uint16_t peer_port){
+	const test_segment_t *seg;
+
+	test_conn_init(c, port, peer_port);
+	test_app_id = TCP_ID_NONE;
+	test_tcp_in(c, TCP_FLAG_SYN, 0, 0);
+	seg = test_tcp_out(c);
+	CHECK(seg && seg->flags == (TCP_FLAG_SYN|TCP_FLAG_ACK) && seg->ack == c->seq);
+	c->ack = seg->seq + 1;
+	c->id = test_app_id;
+	test_tcp_in(c, TCP_FLAG_ACK, 0, 0);
+	CHECK( (c->id == TCP_ID_NONE) || (LAN_TCPGetStatus(c->id) == TCP_ESTABLISHED) );
+	return 0;
+}
+
+// SYN to port nobody listens on and SYN refused by app get RST, no slot is taken
+static int test_tcp_refuse(void){
+	const test_segment_t *seg;
+	test_conn_t c;
+
+	test_tcp_begin();
+	CHECK(LAN_TCPListen(htons(TEST_PORT), 0, &test_app_cb) == 0);
+	CHECK(LAN_TCPListen(htons(TEST_PORT), 0, &test_app_cb) == 1);
+	CHECK(LAN_TCPListen(0, 0, &test_app_cb) == 1);
+
+	test_conn_init(&c, TEST_PORT + 1, TEST_PEER_PORT);
+	test_tcp_in(&c, TCP_FLAG_SYN, 0, 0);
+	seg = test_tcp_out(&c);
+	CHECK(seg && seg->flags == (TCP_FLAG_RST|TCP_FLAG_ACK) && seg->seq == 0 && seg->ack == TEST_PEER_ISN + 1);
+	CHECK(test_app_id == TCP_ID_NONE);
+
+	test_app_accept = 0;
+	test_conn_init(&c, TEST_PORT, TEST_PEER_PORT);
+	test_tcp_in(&c, TCP_FLAG_SYN, 0, 0);
+	seg = test_tcp_out(&c);
+	CHECK(seg && seg->flags == (TCP_FLAG_RST|TCP_FLAG_ACK) && seg->ack == TEST_PEER_ISN + 1);
+	CHECK(test_app_id != TCP_ID_NONE && LAN_TCPGetStatus(test_app_id) == TCP_CLOSED);
+	CHECK(!test_tcp_out(&c));
+
+	// ACK of unknown connection gets RST with its sequence number
+	c.ack = 12345;
+	test_tcp_in(&c, TCP_FLAG_ACK, 0, 0);
+	seg = test_tcp_out(&c);
+	CHECK(seg && seg->flags == TCP_FLAG_RST && seg->seq == 12345);
+
+	LAN_TCPUnlisten(htons(TEST_PORT));
+	return 0;
+}
+
+// Connections of handshake are limited by backlog, SYN over limit is dropped and peer sends it again
+static int test_tcp_backlog(void){
+	static test_conn_t c[3];
+	const test_segment_t *seg;
+	uint8_t i;
+
+	test_tcp_begin();
+	CHECK(LAN_TCPListen(htons(TEST_PORT), 2, &test_app_cb) == 0);
+
+	for(i = 0; i < 3; i++){
+		test_conn_init(&c[i], TEST_PORT, TEST_PEER_PORT + i);
+		test_tcp_in(&c[i], TCP_FLAG_SYN, 0, 0);
+	}
+	seg = test_tcp_out(&c[0]);
+	CHECK(seg && seg->flags == (TCP_FLAG_SYN|TCP_FLAG_ACK));
+	c[0].ack = seg->seq + 1;
+	seg = test_tcp_out(&c[1]);
+	CHECK(seg && seg->flags == (TCP_FLAG_SYN|TCP_FLAG_ACK));
+	CHECK(!test_tcp_out(&c[2]));
+
+	// Established connection leaves backlog
+	test_tcp_in(&c[0], TCP_FLAG_ACK, 0, 0);
+	c[2].seq = TEST_PEER_ISN;
+	test_tcp_in(&c[2], TCP_FLAG_SYN, 0, 0);
+	seg = test_tcp_out(&c[2]);
+	CHECK(seg && seg->flags == (TCP_FLAG_SYN|TCP_FLAG_ACK));
+
+	for(i = 0; i < 3; i++)
+		test_tcp_in(&c[i], TCP_FLAG_RST, 0, 0);
+	LAN_TCPUnlisten(htons(TEST_PORT));
+	return 0;
+}
+
+// Connections are found in hash chains, slot of closed connection moves to chain of new one
+static int test_tcp_lookup(void){
+	static test_conn_t c[TCP_MAX_CONNECTIONS + 1];
+	const test_segment_t *seg;
+	uint8_t i, j, k = TCP_MAX_CONNECTIONS / 2;
+
+	test_tcp_begin();
+	CHECK(LAN_TCPListen(htons(TEST_PORT), 0, &test_app_cb) == 0);
+
+	for(i = 0; i < TCP_MAX_CONNECTIONS; i++){
+		CHECK(test_tcp_open(&c[i], TEST_PORT, TEST_PEER_PORT + i) == 0);
+		for(j = 0; j < i; j++)
+			CHECK(c[j].id != c[i].id);
+	}
+
+	// All slots used, SYN is dropped
+	test_conn_init(&c[TCP_MAX_CONNECTIONS], TEST_PORT, TEST_PEER_PORT + TCP_MAX_CONNECTIONS);
+	test_tcp_in(&c[TCP_MAX_CONNECTIONS], TCP_FLAG_SYN, 0, 0);
+	CHECK(!test_tcp_out(&c[TCP_MAX_CONNECTIONS]));
+
+	// Data reach connection of their ports
+	for(i = 0; i < TCP_MAX_CONNECTIONS; i++){
+		test_tcp_in(&c[i], TCP_FLAG_ACK, &i, 1);
+		CHECK(test_app_rx_id == c[i].id && test_app_rx_len == 1 && test_app_rx[0] == i);
+	}
+
+	// Slot of reset connection is taken by new one
+	test_tcp_in(&c[k], TCP_FLAG_RST, 0, 0);
+	CHECK(LAN_TCPGetStatus(c[k].id) == TCP_CLOSED);
+	CHECK(test_tcp_open(&c[TCP_MAX_CONNECTIONS], TEST_PORT, TEST_PEER_PORT + TCP_MAX_CONNECTIONS) == 0);
+	CHECK(c[TCP_MAX_CONNECTIONS].id == c[k].id);
+
+	// Rest of old chain is found, old ports of slot are not
+	for(i = 0; i <= TCP_MAX_CONNECTIONS; i++){
+		if(i == k)
+			continue;
+		test_tcp_in(&c[i], TCP_FLAG_ACK, &i, 1);
+		CHECK(test_app_rx_id == c[i].id && test_app_rx[0] == i);
+	}
+	test_segment_count = 0;
+	test_tcp_in(&c[k], TCP_FLAG_ACK, &k, 1);
+	seg = test_tcp_out(&c[k]);
+	CHECK(seg && seg->flags == TCP_FLAG_RST && seg->seq == c[k].ack);
+
+	for(i = 0; i <= TCP_MAX_CONNECTIONS; i++)
+		test_tcp_in(&c[i], TCP_FLAG_RST, 0, 0);
+	LAN_TCPUnlisten(htons(TEST_PORT));
+	return 0;
+}
+
+// Entry of unlistened port is not given to new port while its connections use callbacks from it
+static int test_tcp_listen_entry(void){
+	test_conn_t c;
+	uint8_t i, data = 0x5a;
+
+	test_tcp_begin();
+	for(i = 0; i < TCP_MAX_LISTENERS; i++)
+		CHECK(LAN_TCPListen(htons(TEST_PORT + i), 0, &test_app_cb) == 0);
+	CHECK(LAN_TCPListen(htons(TEST_PORT + TCP_MAX_LISTENERS), 0, &test_app_cb) == 1);
+
+	CHECK(test_tcp_open(&c, TEST_PORT + 1, TEST_PEER_PORT) == 0 && c.id != TCP_ID_NONE);
+	LAN_TCPUnlisten(htons(TEST_PORT + 1));
+	CHECK(LAN_TCPListen(htons(TEST_PORT + TCP_MAX_LISTENERS), 0, &test_app_cb) == 1);
+
+	test_tcp_in(&c, TCP_FLAG_ACK, &data, 1);
+	CHECK(test_app_rx_id == c.id && test_app_rx[0] == data);
+
+	test_tcp_in(&c, TCP_FLAG_RST, 0, 0);
+	CHECK(LAN_TCPListen(htons(TEST_PORT + TCP_MAX_LISTENERS), 0, &test_app_cb) == 0);
+
+	for(i = 0; i <= TCP_MAX_LISTENERS; i++)
+		LAN_TCPUnlisten(htons(TEST_PORT + i));
+	return 0;
+}
+
+// Active close from app, peer acknowledges FIN and sends its own. 0 when connection is in TIME_WAIT
+static int test_tcp_close_active(test_conn_t *c){
+	const test_segment_t *seg;
+
+	LAN_TCPClose(c->id);
+	test_run(2);
+	seg = test_tcp_out(c);
+	CHECK(seg && seg->flags == (TCP_FLAG_FIN|TCP_FLAG_ACK) && seg->seq == c->ack);
+	c->ack++;
+	test_tcp_in(c, TCP_FLAG_FIN|TCP_FLAG_ACK, 0, 0);
+	seg = test_tcp_out(c);
+	CHECK(seg && seg->flags == TCP_FLAG_ACK && seg->ack == c->seq);
+	CHECK(LAN_TCPGetStatus(c->id) == TCP_TIME_WAIT);
+	return 0;
+}
+
+// Silent peer is probed after TCP_KEEPALIVE_IDLE, connection is reset after TCP_KEEPALIVE_COUNT unanswered probes
+static int test_tcp_keepalive(void){
+#ifdef WITH_TCP_KEEPALIVE
+	const test_segment_t *seg;
+	test_conn_t c;
+	uint8_t probes = 0;
+
+	test_tcp_begin();
+	CHECK(LAN_TCPListen(htons(TEST_PORT), 0, &test_app_cb) == 0);
+	CHECK(test_tcp_open(&c, TEST_PORT, TEST_PEER_PORT) == 0);
+
+	// Probe has sequence number acknowledged already, answer keeps connection
+	test_run(TCP_KEEPALIVE_IDLE + 10);
+	seg = test_tcp_out(&c);
+	CHECK(seg && seg->flags == TCP_FLAG_ACK && seg->len == 0 && seg->seq == c.ack - 1);
+	CHECK(!test_tcp_out(&c));
+	test_tcp_in(&c, TCP_FLAG_ACK, 0, 0);
+
+	test_run(TCP_KEEPALIVE_IDLE + TCP_KEEPALIVE_COUNT * TCP_KEEPALIVE_INTERVAL + 10);
+	while( (seg = test_tcp_out(&c)) && (!(seg->flags & TCP_FLAG_RST)) ){
+		CHECK(seg->flags == TCP_FLAG_ACK && seg->seq == c.ack - 1);
+		probes++;
+	}
+	CHECK(probes == TCP_KEEPALIVE_COUNT);
+	CHECK(seg && seg->flags == (TCP_FLAG_RST|TCP_FLAG_ACK) && seg->seq == c.ack);
+	CHECK(LAN_TCPGetStatus(c.id) == TCP_CLOSED);
+	CHECK(test_app_closed == 1 && test_app_closed_id == c.id && test_app_hard == 1);
+
+	LAN_TCPUnlisten(htons(TEST_PORT));
+#endif
+	return 0;
+}
+
+// FIN sent again by peer in TIME_WAIT is acknowledged again and restarts timer
+static int test_tcp_time_wait(void){
+	const test_segment_t *seg;
+	test_conn_t c;
+
+	test_tcp_begin();
+	CHECK(LAN_TCPListen(htons(TEST_PORT), 0, &test_app_cb) == 0);
+	CHECK(test_tcp_open(&c, TEST_PORT, TEST_PEER_PORT) == 0);
+	CHECK(test_tcp_close_active(&c) == 0);
+	CHECK(test_app_closed == 1 && test_app_hard == 0);
+
+	test_run(TCP_TIME_WAIT_TIMEOUT / 2);
+	c.seq--;
+	test_tcp_in(&c, TCP_FLAG_FIN|TCP_FLAG_ACK, 0, 0);
+	seg = test_tcp_out(&c);
+	CHECK(seg && seg->flags == TCP_FLAG_ACK && seg->seq == c.ack && seg->ack == c.seq);
+
+	// RST does not end TIME_WAIT early
+	test_tcp_in(&c, TCP_FLAG_RST, 0, 0);
+	test_run(TCP_TIME_WAIT_TIMEOUT - 100);
+	CHECK(LAN_TCPGetStatus(c.id) == TCP_TIME_WAIT);
+	test_run(200);
+	CHECK(LAN_TCPGetStatus(c.id) == TCP_CLOSED);
+	CHECK(test_app_closed == 1);
+
+	LAN_TCPUnlisten(htons(TEST_PORT));
+	return 0;
+}
+
+// SYN ahead of old stream opens connection again from TIME_WAIT, old duplicate SYN is dropped
+static int test_tcp_time_wait_syn(void){
+	const test_segment_t *seg;
+	test_conn_t c;
+
+	test_tcp_begin();
+	CHECK(LAN_TCPListen(htons(TEST_PORT), 0, &test_app_cb) == 0);
+	CHECK(test_tcp_open(&c, TEST_PORT, TEST_PEER_PORT) == 0);
+	CHECK(test_tcp_close_active(&c) == 0);
+
+	c.seq = TEST_PEER_ISN;
+	test_app_id = TCP_ID_NONE;
+	test_tcp_in(&c, TCP_FLAG_SYN, 0, 0);
+	CHECK(!test_tcp_out(&c) && test_app_id == TCP_ID_NONE);
+	CHECK(LAN_TCPGetStatus(c.id) == TCP_TIME_WAIT);
+
+	c.seq = TEST_PEER_ISN + 100000;
+	test_tcp_in(&c, TCP_FLAG_SYN, 0, 0);
+	seg = test_tcp_out(&c);
+	CHECK(seg && seg->flags == (TCP_FLAG_SYN|TCP_FLAG_ACK) && seg->ack == c.seq);
+	CHECK(test_app_id != TCP_ID_NONE && LAN_TCPGetStatus(test_app_id) == TCP_SYN_RECEIVED);
+	c.ack = seg->seq + 1;
+	c.id = test_app_id;
+	test_tcp_in(&c, TCP_FLAG_ACK, 0, 0);
+	CHECK(LAN_TCPGetStatus(c.id) == TCP_ESTABLISHED);
+
+	test_tcp_in(&c, TCP_FLAG_RST, 0, 0);
+	LAN_TCPUnlisten(htons(TEST_PORT));
+	return 0;
+}
+
+// New connection finds all slots used, connection longest in TIME_WAIT gives its slot up
+static int test_tcp_time_wait_evict(void){
+	static test_conn_t c[TCP_MAX_CONNECTIONS + 1];
+	uint8_t i;
+
+	test_tcp_begin();
+	CHECK(LAN_TCPListen(htons(TEST_PORT), 0, &test_app_cb) == 0);
+	for(i = 0; i < TCP_MAX_CONNECTIONS; i++)
+		CHECK(test_tcp_open(&c[i], TEST_PORT, TEST_PEER_PORT + i) == 0);
+	CHECK(test_tcp_close_active(&c[1]) == 0);
+	test_run(100);
+	CHECK(test_tcp_close_active(&c[0]) == 0);
+
+	CHECK(test_tcp_open(&c[TCP_MAX_CONNECTIONS], TEST_PORT, TEST_PEER_PORT + TCP_MAX_CONNECTIONS) == 0);
+	CHECK(c[TCP_MAX_CONNECTIONS].id == c[1].id);
+	CHECK(LAN_TCPGetStatus(c[0].id) == TCP_TIME_WAIT);
+
+	for(i = 2; i <= TCP_MAX_CONNECTIONS; i++)
+		test_tcp_in(&c[i], TCP_FLAG_RST, 0, 0);
+	test_run(TCP_TIME_WAIT_TIMEOUT + 10);
+	CHECK(LAN_TCPGetStatus(c[0].id) == TCP_CLOSED);
+
+	LAN_TCPUnlisten(htons(TEST_PORT));
+	return 0;
+}
+
+// FIN from peer while data wait for window: rest of data goes before FIN (CLOSE_WAIT, then LAST_ACK)
+static int test_tcp_close_wait(void){
+	const test_segment_t *seg;
+	test_conn_t c;
+	uint8_t data[300];
+	uint16_t i;
+
+	for(i = 0; i < sizeof(data); i++)
+		data[i] = (uint8_t)i;
+
+	test_tcp_begin();
+	CHECK(LAN_TCPListen(htons(TEST_PORT), 0, &test_app_cb) == 0);
+	CHECK(test_tcp_open(&c, TEST_PORT, TEST_PEER_PORT) == 0);
+	c.window = 100;
+	test_tcp_in(&c, TCP_FLAG_ACK, 0, 0);
+
+	CHECK(LAN_TCPWrite(c.id, data, sizeof(data)) == sizeof(data));
+	test_run(2);
+	seg = test_tcp_out(&c);
+	CHECK(seg && seg->len == 100 && seg->seq == c.ack && !(seg->flags & TCP_FLAG_FIN));
+	CHECK(!test_tcp_out(&c));
+
+	// FIN is acknowledged alone, app is told at once
+	test_tcp_in(&c, TCP_FLAG_FIN|TCP_FLAG_ACK, 0, 0);
+	seg = test_tcp_out(&c);
+	CHECK(seg && seg->flags == TCP_FLAG_ACK && seg->len == 0 && seg->ack == c.seq);
+	CHECK(LAN_TCPGetStatus(c.id) == TCP_CLOSE_WAIT);
+	CHECK(test_app_closed == 1 && test_app_hard == 0);
+	CHECK(LAN_TCPWrite(c.id, data, 1) == 0);
+
+	c.ack += 100;
+	test_tcp_in(&c, TCP_FLAG_ACK, 0, 0);
+	seg = test_tcp_out(&c);
+	CHECK(seg && seg->len == 100 && seg->seq == c.ack && !(seg->flags & TCP_FLAG_FIN));
+	CHECK(memcmp(seg->data, data + 100, 100) == 0);
+	CHECK(LAN_TCPGetStatus(c.id) == TCP_CLOSE_WAIT);
+
+	// Last data carry FIN
+	c.ack += 100;
+	c.window = 1000;
+	test_tcp_in(&c, TCP_FLAG_ACK, 0, 0);
+	seg = test_tcp_out(&c);
+	CHECK(seg && seg->len == 100 && seg->seq == c.ack && (seg->flags & TCP_FLAG_FIN));
+	CHECK(memcmp(seg->data, data + 200, 100) == 0);
+	CHECK(LAN_TCPGetStatus(c.id) == TCP_LAST_ACK);
+
+	c.ack += 101;
+	test_tcp_in(&c, TCP_FLAG_ACK, 0, 0);
+	CHECK(LAN_TCPGetStatus(c.id) == TCP_CLOSED && test_app_closed == 1);
+	CHECK(!test_tcp_out(&c));
+
+	LAN_TCPUnlisten(htons(TEST_PORT));
+	return 0;
+}
+
+// Socket bound to port sends SYN to peer, 0 when it was sent
+static int test_sock_syn(int8_t *s, test_conn_t *c, uint16_t port){
+	const test_segment_t *seg;
+
+	*s = lan_socket();
+	CHECK(*s >= 0);
+	CHECK(lan_bind(*s, htons(port)) == 0);
+	CHECK(lan_connect(*s, TEST_PEER_IP, htons(TEST_PEER_PORT)) == LAN_EINPROGRESS);
+	test_run(2);
+	test_conn_init(c, port, TEST_PEER_PORT);
+	seg = test_tcp_out(c);
+	CHECK(seg && seg->flags == TCP_FLAG_SYN);
+	c->ack = seg->seq + 1;
+	return 0;
+}
+
+// Socket connects to peer, 0 when connection is established
+static int test_sock_open(int8_t *s, test_conn_t *c, uint16_t port){
+	const test_segment_t *seg;
+
+	CHECK(test_sock_syn(s, c, port) == 0);
+	test_tcp_in(c, TCP_FLAG_SYN|TCP_FLAG_ACK, 0, 0);
+	seg = test_tcp_out(c);
+	CHECK(seg && seg->flags == TCP_FLAG_ACK && seg->ack == c->seq && seg->window == TCP_RX_BUF_SIZE);
+	return 0;
+}
+
+// Established connections wait for lan_accept up to backlog, SYN over it gets RST
+static int test_sock_accept(void){
+	static test_conn_t c[3];
+	const test_segment_t *seg;
+	lan_pollfd_t fd;
+	uint32_t addr;
+	uint16_t port;
+	int8_t s, a[3];
+	uint8_t i;
+
+	test_tcp_begin();
+	s = lan_socket();
+	CHECK(s >= 0);
+	CHECK(lan_bind(s, htons(TEST_PORT)) == 0);
+	CHECK(lan_listen(s, 2) == 0);
+	a[0] = lan_socket();
+	CHECK(lan_bind(a[0], htons(TEST_PORT)) == LAN_EADDRINUSE);
+	lan_close(a[0]);
+
+	fd.fd = s;
+	fd.events = LAN_POLLIN;
+	CHECK(lan_sockpoll(&fd, 1) == 0 && fd.revents == 0);
+	CHECK(lan_accept(s, 0, 0) == LAN_EAGAIN);
+
+	for(i = 0; i < 2; i++)
+		CHECK(test_tcp_open(&c[i], TEST_PORT, TEST_PEER_PORT + i) == 0);
+	CHECK(lan_sockpoll(&fd, 1) == 1 && fd.revents == LAN_POLLIN);
+
+	test_conn_init(&c[2], TEST_PORT, TEST_PEER_PORT + 2);
+	test_tcp_in(&c[2], TCP_FLAG_SYN, 0, 0);
+	seg = test_tcp_out(&c[2]);
+	CHECK(seg && seg->flags == (TCP_FLAG_RST|TCP_FLAG_ACK));
+
+	for(i = 0; i < 2; i++){
+		a[i] = lan_accept(s, &addr, &port);
+		CHECK(a[i] >= 0 && addr == TEST_PEER_IP && port == htons(TEST_PEER_PORT + i));
+	}
+	CHECK(lan_accept(s, 0, 0) == LAN_EAGAIN);
+	CHECK(lan_sockpoll(&fd, 1) == 0);
+
+	// Accepted connections leave backlog
+	CHECK(test_tcp_open(&c[2], TEST_PORT, TEST_PEER_PORT + 2) == 0);
+	a[2] = lan_accept(s, 0, &port);
+	CHECK(a[2] >= 0 && port == htons(TEST_PEER_PORT + 2));
+
+	for(i = 0; i < 3; i++){
+		CHECK(lan_close(a[i]) == 0);
+		test_tcp_in(&c[i], TCP_FLAG_RST, 0, 0);
+	}
+	CHECK(lan_close(s) == 0);
+	CHECK(lan_close(s) == LAN_EINVAL);
+	return 0;
+}
+
+// RST for SYN of socket is reported as refused connection
+static int test_sock_refused(void){
+	test_conn_t c;
+	lan_pollfd_t fd[3];
+	uint8_t buf[4];
+	int8_t s;
+
+	test_tcp_begin();
+	CHECK(test_sock_syn(&s, &c, 5000) == 0);
+
+	fd[0].fd = s;
+	fd[0].events = LAN_POLLIN|LAN_POLLOUT;
+	fd[1].fd = -1;
+	fd[2].fd = LAN_SOCKETS;
+	fd[2].events = LAN_POLLIN;
+	CHECK(lan_sockpoll(fd, 3) == 1 && fd[0].revents == 0 && fd[1].revents == 0 && fd[2].revents == LAN_POLLERR);
+	CHECK(lan_send(s, buf, sizeof(buf)) == LAN_EAGAIN);
+	CHECK(lan_recv(s, buf, sizeof(buf)) == LAN_EAGAIN);
+
+	test_tcp_in(&c, TCP_FLAG_RST|TCP_FLAG_ACK, 0, 0);
+	CHECK(lan_sockpoll(fd, 1) == 1 && fd[0].revents == (LAN_POLLIN|LAN_POLLERR|LAN_POLLHUP));
+	CHECK(lan_sockerror(s) == LAN_ECONNREFUSED);
+	CHECK(lan_send(s, buf, sizeof(buf)) == LAN_ECONNREFUSED);
+	CHECK(lan_recv(s, buf, sizeof(buf)) == LAN_ECONNREFUSED);
+
+	CHECK(lan_close(s) == 0);
+	return 0;
+}
+
+// Data stay in receive buffer until app reads them, window opens by half of buffer at least
+static int test_sock_stream(void){
+	static uint8_t data[2 * TCP_RX_BUF_SIZE], buf[2 * TCP_RX_BUF_SIZE];
+	const test_segment_t *seg;
+	test_conn_t c;
+	lan_pollfd_t fd;
+	uint32_t end;
+	uint16_t i;
+	int8_t s;
+
+	for(i = 0; i < sizeof(data); i++)
+		data[i] = (uint8_t)(i * 7);
+
+	test_tcp_begin();
+	CHECK(test_sock_open(&s, &c, 5001) == 0);
+	fd.fd = s;
+	fd.events = LAN_POLLIN|LAN_POLLOUT;
+	CHECK(lan_sockpoll(&fd, 1) == 1 && fd.revents == LAN_POLLOUT);
+	CHECK(lan_recv(s, buf, sizeof(buf)) == LAN_EAGAIN);
+
+	// Peer fills window
+	test_tcp_in(&c, TCP_FLAG_ACK, data, TCP_RX_BUF_SIZE / 2);
+	test_tcp_in(&c, TCP_FLAG_ACK, data + TCP_RX_BUF_SIZE / 2, TCP_RX_BUF_SIZE / 2);
+	test_run(TCP_ACK_DELAY + 10);
+	while( (seg = test_tcp_out(&c)) && (seg->ack != c.seq) )
+		;
+	CHECK(seg && seg->window == 0);
+	CHECK(lan_sockpoll(&fd, 1) == 1 && fd.revents == (LAN_POLLIN|LAN_POLLOUT));
+
+	// Small read keeps window closed, larger one sends window update
+	CHECK(lan_recv(s, buf, 100) == 100);
+	test_run(2);
+	CHECK(!test_tcp_out(&c));
+	CHECK(lan_recv(s, buf + 100, 500) == 500);
+	test_run(2);
+	seg = test_tcp_out(&c);
+	CHECK(seg && seg->flags == TCP_FLAG_ACK && seg->ack == c.seq && seg->window == 600);
+
+	test_tcp_in(&c, TCP_FLAG_ACK, data + TCP_RX_BUF_SIZE, 600);
+	CHECK(lan_recv(s, buf + 600, sizeof(buf)) == TCP_RX_BUF_SIZE);
+	CHECK(memcmp(buf, data, TCP_RX_BUF_SIZE + 600) == 0);
+	CHECK(lan_recv(s, buf, sizeof(buf)) == LAN_EAGAIN);
+	CHECK(lan_sockpoll(&fd, 1) == 1 && fd.revents == LAN_POLLOUT);
+
+	// Full send buffer clears POLLOUT until peer acknowledges data
+	test_run(TCP_ACK_DELAY + 10);
+	while(test_tcp_out(&c))
+		;
+	CHECK(lan_send(s, data, sizeof(data)) == TCP_TX_BUF_SIZE);
+	CHECK(lan_send(s, data, 1) == LAN_EAGAIN);
+	CHECK(lan_sockpoll(&fd, 1) == 0);
+	test_run(2);
+	end = c.ack;
+	while( (seg = test_tcp_out(&c)) ){
+		CHECK(memcmp(seg->data, data + (seg->seq - c.ack), seg->len) == 0);
+		if(seg->seq + seg->len > end)
+			end = seg->seq + seg->len;
+	}
+	CHECK(end > c.ack);
+	c.ack = end;
+	test_tcp_in(&c, TCP_FLAG_ACK, 0, 0);
+	CHECK(lan_sockpoll(&fd, 1) == 1 && fd.revents == LAN_POLLOUT);
+	CHECK(lan_send(s, data, 10) == 10);
+
+	CHECK(lan_close(s) == 0);
+	test_tcp_in(&c, TCP_FLAG_RST, 0, 0);
+	return 0;
+}
+
+// Peer FIN is end of stream after data in buffer, RST is reported as reset connection
+static int test_sock_close(void){
+	static uint8_t data[100];
+	const test_segment_t *seg;
+	test_conn_t c;
+	lan_pollfd_t fd;
+	uint8_t buf[100];
+	uint16_t i;
+	int8_t s;
+
+	for(i = 0; i < sizeof(data); i++)
+		data[i] = (uint8_t)(i + 1);
+
+	test_tcp_begin();
+	CHECK(test_sock_open(&s, &c, 5002) == 0);
+	fd.fd = s;
+	fd.events = LAN_POLLIN;
+	test_tcp_in(&c, TCP_FLAG_FIN|TCP_FLAG_ACK, data, sizeof(data));
+	CHECK(lan_sockpoll(&fd, 1) == 1 && fd.revents == (LAN_POLLIN|LAN_POLLHUP));
+	CHECK(lan_sockerror(s) == 0);
+	CHECK(lan_recv(s, buf, 60) == 60);
+	CHECK(lan_recv(s, buf + 60, sizeof(buf)) == 40);
+	CHECK(memcmp(buf, data, sizeof(data)) == 0);
+	CHECK(lan_recv(s, buf, sizeof(buf)) == 0);
+
+	// Stack closes its side
+	while( (seg = test_tcp_out(&c)) && (!(seg->flags & TCP_FLAG_FIN)) )
+		;
+	CHECK(seg && seg->seq == c.ack && seg->ack == c.seq);
+	c.ack++;
+	test_tcp_in(&c, TCP_FLAG_ACK, 0, 0);
+	CHECK(lan_recv(s, buf, sizeof(buf)) == 0);
+	CHECK(lan_close(s) == 0);
+
+	// Reset after data, error comes before them
+	CHECK(test_sock_open(&s, &c, 5003) == 0);
+	test_tcp_in(&c, TCP_FLAG_ACK, data, 10);
+	test_tcp_in(&c, TCP_FLAG_RST, 0, 0);
+	fd.fd = s;
+	fd.events = LAN_POLLIN|LAN_POLLOUT;
+	CHECK(lan_sockpoll(&fd, 1) == 1 && fd.revents == (LAN_POLLIN|LAN_POLLERR|LAN_POLLHUP));
+	CHECK(lan_recv(s, buf, sizeof(buf)) == LAN_ECONNRESET);
+	CHECK(lan_send(s, buf, 1) == LAN_ECONNRESET);
+	CHECK(lan_sockerror(s) == LAN_ECONNRESET);
+	CHECK(lan_close(s) == 0);
+
+	return 0;
+}
+
+// Closing listening socket closes connections not accepted yet and frees their sockets
+static int test_sock_close_listen(void){
+	static test_conn_t c[3];
+	const test_segment_t *seg;
+	int8_t s, fds[LAN_SOCKETS];
+	uint8_t i;
+
+	test_tcp_begin();
+	s = lan_socket();
+	CHECK(lan_bind(s, htons(TEST_PORT)) == 0);
+	CHECK(lan_listen(s, 0) == 0);
+
+	// Established connection and one in handshake
+	CHECK(test_tcp_open(&c[0], TEST_PORT, TEST_PEER_PORT) == 0);
+	test_conn_init(&c[1], TEST_PORT, TEST_PEER_PORT + 1);
+	test_tcp_in(&c[1], TCP_FLAG_SYN, 0, 0);
+	seg = test_tcp_out(&c[1]);
+	CHECK(seg && seg->flags == (TCP_FLAG_SYN|TCP_FLAG_ACK));
+	c[1].ack = seg->seq + 1;
+
+	CHECK(lan_close(s) == 0);
+	test_run(2);
+	seg = test_tcp_out(&c[0]);
+	CHECK(seg && seg->flags == (TCP_FLAG_FIN|TCP_FLAG_ACK) && seg->seq == c[0].ack);
+	test_tcp_in(&c[1], TCP_FLAG_ACK, 0, 0);
+	seg = test_tcp_out(&c[1]);
+	CHECK(seg && seg->flags == TCP_FLAG_RST);
+
+	// Port is not listened anymore
+	test_conn_init(&c[2], TEST_PORT, TEST_PEER_PORT + 2);
+	test_tcp_in(&c[2], TCP_FLAG_SYN, 0, 0);
+	seg = test_tcp_out(&c[2]);
+	CHECK(seg && seg->flags == (TCP_FLAG_RST|TCP_FLAG_ACK));
+
+	for(i = 0; i < LAN_SOCKETS; i++)
+		CHECK((fds[i] = lan_socket()) >= 0);
+	CHECK(lan_socket() == LAN_ENOMEM);
+	for(i = 0; i < LAN_SOCKETS; i++)
+		CHECK(lan_close(fds[i]) == 0);
+
+	test_tcp_in(&c[0], TCP_FLAG_RST, 0, 0);
+	return 0;
+}
+
+int main(void){
+	LAN_init();
+
+	if(test_spi_cost() || test_tx_queue() || test_partition() || test_cksum_offload() || test_udp_broadcast() ||
+		test_cksum_after_arp_miss() || test_tcp_refuse() || test_tcp_backlog() || test_tcp_lookup() ||
+		test_tcp_listen_entry() || test_tcp_keepalive() || test_tcp_time_wait() || test_tcp_time_wait_syn() ||
+		test_tcp_time_wait_evict() || test_tcp_close_wait() || test_sock_accept() || test_sock_refused() ||
+		test_sock_stream() || test_sock_close() || test_sock_close_listen())
+		return 1;
+
+	printf("enc28j60 emu tests ok, simulated time %u ms\n", (unsigned)(TM_HOST_GetTime() / 1000));
+	return 0;
+}
@@ -48,3 +48,13 @@ uint8_t ENC28J60_LL_SPIRxTx(uint8_t txbyte) {
 	/* Return 0 = Successful */
 	return 0;
 }
+
+void ENC28J60_LL_SPIRead(uint8_t *data, uint16_t len) {
+	/* receive len bytes via SPI, send 0xFF for each */
+	
+}
+
+void ENC28J60_LL_SPIWrite(const uint8_t *data, uint16_t len) {
+	/* send len bytes via SPI */
+	
+}
@@ -31,6 +31,8 @@ extern "C" {
  *
  * - \ref ENC28J60_LL_SPIInit: Function, which is called when SPI should be initialized
  * - \ref ENC8J60_LL_SPIRxTx: Function, which is called when data should be sent to ENC28J60 device
+ * - \ref ENC28J60_LL_SPIRead and \ref ENC28J60_LL_SPIWrite: Functions for block transfers of buffer memory,
+ *   used when \ref ENC28J60_LL_BURST is defined. Frames are then moved with one call instead of call per byte
  *
  *
 \code
@@ -59,6 +61,15 @@ uint8_t ENC28J60_LL_SPIRxTx(uint8_t txbyte){
     return TM_SPI_Send( ENC28J60_SPI, 0xff );
 }
 
+//Block transfers, CS is already low, can use DMA but must return when last byte is transferred
+void ENC28J60_LL_SPIRead(uint8_t *data, uint16_t len){
+    TM_SPI_ReadMulti( ENC28J60_SPI, data, 0xff, len );
+}
+
+void ENC28J60_LL_SPIWrite(const uint8_t *data, uint16_t len){
+    TM_SPI_WriteMulti( ENC28J60_SPI, (uint8_t *)data, len );
+}
+
 \endcode
  * 
  * \par Chip Select configuration
@@ -79,11 +90,41 @@ uint8_t ENC28J60_LL_SPIRxTx(uint8_t txbyte){
 #define ENC28J60_CS_HIGH        TM_GPIO_SetPinHigh(GPIOA, GPIO_PIN_4)
 //Set CS pin low
 #define ENC28J60_CS_LOW         TM_GPIO_SetPinLow(GPIOA, GPIO_PIN_4)
+\endcode
+ *
+ * \par Host emulator
+ *
+ * With ENC28J60_EMU defined, CS macros and SPI functions are provided by enc28j60_emu.c,
+ * which emulates ENC28J60 on Linux host. Check \ref ENC28J60_EMU for details.
+ *
+ * \par Interrupt configuration
+ *
+ * When INT pin of ENC28J60 is connected to MCU, define \ref ENC28J60_INT_PORT and \ref ENC28J60_INT_PIN.
+ * Driver then attaches falling edge interrupt on this pin and reads packet counter from chip only when
+ * INT line signals received packet. Without these defines packet counter is polled over SPI on each call.
+ *
+ * Call \ref enc28j60_irq_handler from your EXTI handler:
+ *
+\code
+void TM_EXTI_Handler(uint16_t GPIO_Pin) {
+    if (GPIO_Pin == ENC28J60_INT_PIN) {
+        enc28j60_irq_handler();
+    }
+}
 \endcode
  */
 #include "stm32fxxx_hal.h"
 #include "tm_stm32_gpio.h"
 
+#if defined(ENC28J60_EMU)
+/* Host build, SPI and CS are implemented by emulator, see ENC28J60_EMU */
+#include "enc28j60_emu.h"
+
+#define ENC28J60_CS_INIT    ENC28J60_EMU_CS_INIT
+#define ENC28J60_CS_LOW     ENC28J60_EMU_CS_LOW
+#define ENC28J60_CS_HIGH    ENC28J60_EMU_CS_HIGH
+#else
+
 /**
  * @brief  Initializes CS pin on platform
  * @note   Function is called from ENC stack module when needed
@@ -105,6 +146,14 @@ uint8_t ENC28J60_LL_SPIRxTx(uint8_t txbyte){
  */
 #define ENC28J60_CS_HIGH    TM_GPIO_SetPinHigh(GPIOA, GPIO_PIN_4)
 
+/**
+ * @brief  GPIO port and pin connected to INT pin of ENC28J60
+ * @note   Uncomment to use interrupt driven receive, INT pin is active low
+ */
+//#define ENC28J60_INT_PORT   GPIOA
+//#define ENC28J60_INT_PIN    GPIO_PIN_3
+#endif /* ENC28J60_EMU */
+
 
 /**
  * @brief  Initializes SPI peripheral for ENC28J60 communication
@@ -122,6 +171,30 @@ uint8_t ENC28J60_LL_SPIInit(void);
  */
 uint8_t ENC28J60_LL_SPIRxTx(uint8_t txbyte);
 
+/**
+ * @brief  Buffer memory is transferred with \ref ENC28J60_LL_SPIRead and \ref ENC28J60_LL_SPIWrite
+ * @note   Comment out when only \ref ENC28J60_LL_SPIRxTx is implemented for platform
+ */
+#define ENC28J60_LL_BURST
+
+/**
+ * @brief  Receives block of data from ENC28J60 module, 0xFF is sent for each byte
+ * @note   Called inside SPI transaction, CS pin is already low
+ * @param  *data: pointer to buffer for received data
+ * @param  len: number of bytes
+ * @retval None
+ */
+void ENC28J60_LL_SPIRead(uint8_t *data, uint16_t len);
+
+/**
+ * @brief  Sends block of data to ENC28J60 module, received bytes are ignored
+ * @note   Called inside SPI transaction, CS pin is already low
+ * @param  *data: pointer to data
+ * @param  len: number of bytes
+ * @retval None
+ */
+void ENC28J60_LL_SPIWrite(const uint8_t *data, uint16_t len);
+
 
 /**
  * @}
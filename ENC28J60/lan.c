@@ -1,4 +1,5 @@
 #include <string.h>
+#include <stddef.h>
 #include "time.h"
 #include "tm_stm32_delay.h"
 #include "lan.h"
@@ -12,28 +13,56 @@ uint32_t ip_mask = IP_SUBNET_MASK;
 uint32_t ip_gateway = IP_DEFAULT_GATEWAY;
 #define ip_broadcast (ip_addr | ~ip_mask)
 
-// Packet buffer
-uint8_t net_buf[ENC28J60_MAXFRAME];
+// Buffer pool
+static lan_buf_t lan_buf_pool[LAN_BUF_COUNT];
+
+// Frame headers read before deciding to read whole frame (ARP message is longest)
+#define LAN_RX_HEADER_SIZE	(sizeof(eth_frame_t) + sizeof(arp_message_t))
 
 // ARP cache
-static uint8_t arp_cache_wr;
+//	(entries are chained by hash of IP address)
 static arp_cache_entry_t arp_cache[ARP_CACHE_SIZE];
+static uint8_t arp_hash_head[ARP_CACHE_HASH_SIZE];
+
+// ARP request frame, built outside of buffer pool
+static uint8_t arp_buf[sizeof(eth_frame_t) + sizeof(arp_message_t)];
+
+#ifdef WITH_ARP_QUEUE
+// frames waiting for ARP reply
+//	(copies in pool buffers, oldest first)
+static uint8_t arp_queue_head;
+static uint8_t arp_queue_count;
+
+// frame queued by ip_send and its next hop, 0 - frame was sent
+//	(ip_resend queues next frames from same buffer too)
+static eth_frame_t *arp_queue_frame;
+static uint32_t arp_queue_route;
+#endif
 
 // TCP connection pool
 static tcp_state_t tcp_pool[TCP_MAX_CONNECTIONS];
 
 // Function prototypes
-static void eth_send(eth_frame_t *frame, uint16_t len);
-static void eth_reply(eth_frame_t *frame, uint16_t len);
-static void eth_resend(eth_frame_t *frame, uint16_t len);
+static void lan_rx_filter(void);
+static void eth_send(eth_frame_t *frame, uint16_t len, uint16_t cksum_field);
+static void eth_reply(eth_frame_t *frame, uint16_t len, uint16_t cksum_field);
+static void eth_resend(eth_frame_t *frame, uint16_t len, uint16_t cksum_field);
+static void eth_xmit(eth_frame_t *frame, uint16_t len, uint16_t cksum_field);
 
 static uint8_t *arp_resolve(uint32_t node_ip_addr);
+static void arp_poll(void);
+#ifdef WITH_ARP_QUEUE
+static uint8_t arp_queue_add(uint32_t node_ip_addr, eth_frame_t *frame, uint16_t len);
+static void arp_queue_flush(uint32_t node_ip_addr, uint8_t *node_mac);
+#endif
 
 static uint8_t ip_send(eth_frame_t *frame, uint16_t len);
 static void ip_reply(eth_frame_t *frame, uint16_t len);
 static void ip_resend(eth_frame_t *frame, uint16_t len);
 
 static uint16_t ip_cksum(uint32_t sum, uint8_t *buf, uint16_t len);
+static uint16_t ip_cksum_update(uint16_t cksum, uint16_t old, uint16_t new);
+static uint16_t ip_cksum_field(eth_frame_t *frame);
 
 #ifdef WITH_NTP
 /*----------------------------------------------------------------------
@@ -102,21 +131,19 @@ void ntp_filter(eth_frame_t *frame, uint16_t len)
 	}
 }
 
-void ntp_poll(void)
+void ntp_poll(eth_frame_t *frame)
 {
-	eth_frame_t *frame = (void*)net_buf;
 	ip_packet_t *ip = (void*)(frame->data);
 	udp_packet_t *udp = (void*)(ip->data);
 	ntp_message_t *ntp = (void*)(udp->data);
 
-	// Too slow (
-	/*// Link is down
-	if(!(enc28j60_read_phy(PHSTAT1) & PHSTAT1_LLSTAT))
+	// Link is down
+	if(!enc28j60_link_up())
 	{
-		ntp_status = DHCP_INIT;
+		ntp_status = NTP_INIT;
 		ntp_retry_time = HAL_GetTick() + 2 * 1000;
 		return;
-	}*/
+	}
 
 	// time to initiate NTP
 	//  (startup/lease end)
@@ -355,6 +382,7 @@ void dhcp_filter(eth_frame_t *frame, uint16_t len)
 				ip_addr = dhcp->offered_addr;
 				ip_mask = offered_net_mask;
 				ip_gateway = offered_gateway;
+				lan_rx_filter();
 				LAN_Callback_DHCPGetLANConfig( ip_addr, ip_mask, ip_gateway );
 			}
 			break;
@@ -362,28 +390,30 @@ void dhcp_filter(eth_frame_t *frame, uint16_t len)
 	}
 }
 
-void dhcp_poll(void)
+void dhcp_poll(eth_frame_t *frame)
 {
-	eth_frame_t *frame = (void*)net_buf;
 	ip_packet_t *ip = (void*)(frame->data);
 	udp_packet_t *udp = (void*)(ip->data);
 	dhcp_message_t *dhcp = (void*)(udp->data);
 	uint8_t *op;
 
-	// Too slow (
-	/*// Link is down
-	if(!(enc28j60_read_phy(PHSTAT1) & PHSTAT1_LLSTAT))
+	// Link is down
+	if(!enc28j60_link_up())
 	{
-		dhcp_status = DHCP_INIT;
 		dhcp_retry_time = HAL_GetTick() + 2 * 1000;
 
 		// network down
-		ip_addr = 0;
-		ip_mask = 0;
-		ip_gateway = 0;
+		if(dhcp_status != DHCP_INIT)
+		{
+			dhcp_status = DHCP_INIT;
+			ip_addr = 0;
+			ip_mask = 0;
+			ip_gateway = 0;
+			lan_rx_filter();
+		}
 
 		return;
-	}*/
+	}
 
 	// time to initiate DHCP
 	//  (startup/lease end)
@@ -397,6 +427,7 @@ void dhcp_poll(void)
 		ip_addr = 0;
 		ip_mask = 0;
 		ip_gateway = 0;
+		lan_rx_filter();
 
 		// send DHCP discover
 		ip->to_addr = inet_addr(255,255,255,255);
@@ -467,7 +498,7 @@ void dhcp_poll(void)
 
 
 /*
- * TCP (ver. 3.0)
+ * TCP (ver. 4.0)
  * lots of indian bydlocode here
  *
  * History:
@@ -475,23 +506,104 @@ void dhcp_poll(void)
  *	2.0 second attempt, first suitable working variant
  *	2.1 added normal seq/ack management
  *	3.0 added rexmit feature
+ *	4.0 send buffer, several segments in flight, rexmit from buffer
+ *	4.1 congestion window, RTT based rexmit timeout, fast rexmit, MSS option
+ *	4.2 receive buffer for out-of-order segments, real window, delayed ACK
+ *	4.3 listening ports with own callbacks and backlog, hashed connection lookup
+ *	4.4 received data kept in buffer for app, window follows free space
+ *	4.5 CLOSE_WAIT/LAST_ACK/CLOSING/TIME_WAIT states, keep-alive, idle timeout
  */
 
 #ifdef WITH_TCP
 
+__weak uint8_t LAN_Callback_TCPListen(uint8_t id, eth_frame_t *frame){
+	return 0;
+}
+
+__weak void LAN_Callback_TCPRead(uint8_t id, eth_frame_t *frame, uint8_t re){
+
+}
+
+__weak void LAN_Callback_TCPWrite(uint8_t id, eth_frame_t *frame, uint16_t len){
+
+}
+
+__weak void LAN_Callback_TCPClosed(uint8_t id, uint8_t hard){
+
+}
+
 // packet sending mode
 static tcp_sending_mode_t tcp_send_mode;
 
 // "ack sent" flag
 static uint8_t tcp_ack_sent;
 
+// send buffers
+//	(byte with sequence number n is stored at n % TCP_TX_BUF_SIZE,
+//	buffer holds bytes from una_num to una_num + tx_len)
+static uint8_t tcp_tx_buf[TCP_MAX_CONNECTIONS][TCP_TX_BUF_SIZE];
+
+// receive buffers
+//	(byte with sequence number n is stored at n % TCP_RX_BUF_SIZE,
+//	buffer holds bytes from rd_num to end of window - in-order data
+//	not read by app yet, then blocks received out of order,
+//	in-order data go to app at once unless rx_keep is set)
+static uint8_t tcp_rx_buf[TCP_MAX_CONNECTIONS][TCP_RX_BUF_SIZE];
+static uint32_t tcp_rx_seq[TCP_MAX_CONNECTIONS][TCP_RX_QUEUE_LEN];
+static uint16_t tcp_rx_len[TCP_MAX_CONNECTIONS][TCP_RX_QUEUE_LEN];
+
+// listening ports
+//	(until app listens first port, SYN to any port goes to global callback)
+static tcp_listener_t tcp_listeners[TCP_MAX_LISTENERS];
+static uint8_t tcp_listening;
+
+// connections are chained by hash of remote address/port and local port
+//	(closed connection stays in chain until its slot is used again)
+static uint8_t tcp_hash_head[TCP_HASH_SIZE];
+
+// callbacks of connections opened by app and of ports listened without own callbacks
+static const tcp_callbacks_t tcp_default_cb = {
+	LAN_Callback_TCPListen,
+	LAN_Callback_TCPRead,
+	LAN_Callback_TCPWrite,
+	LAN_Callback_TCPClosed
+};
+
+// sequence numbers comparison
+#define tcp_seq_lt(a, b)	((int32_t)((a) - (b)) < 0)
+
+// largest segment fitting to frame buffer, ENC28J60_MAXFRAME includes 4 bytes of CRC
+#define TCP_MSS_MAX			(LAN_BUF_SIZE - 4 - sizeof(eth_frame_t) - \
+	sizeof(ip_packet_t) - sizeof(tcp_packet_t))
+
+// larger segments from peer do not pass MAMXFL and are dropped by chip
+#if TCP_SYN_MSS > ENC28J60_MAXFRAME - 58
+#error "TCP_SYN_MSS must be ENC28J60_MAXFRAME - 58 at most"
+#endif
+
+// segment size when peer sends no MSS option
+#define TCP_MSS_DEFAULT		536
+
+// free space in receive buffer from ack_num on
+#define tcp_rx_space(st)	((uint16_t)((st)->rd_num + TCP_RX_BUF_SIZE - (st)->ack_num))
+
+// window grows by one segment or half of buffer at least
+//	(receiver side silly window avoidance)
+#define TCP_RX_WND_STEP		( (TCP_SYN_MSS < TCP_RX_BUF_SIZE / 2) ? \
+	TCP_SYN_MSS : TCP_RX_BUF_SIZE / 2 )
+
+// free space in send buffer when app is asked for data
+//	(one segment, half of buffer at most)
+#define tcp_tx_room(st)		( ((st)->mss < TCP_TX_BUF_SIZE / 2) ? \
+	(st)->mss : TCP_TX_BUF_SIZE / 2 )
+
 // send TCP packet
 // must be set manually:
 //	- tcp.flags
 uint8_t tcp_xmit(tcp_state_t *st, eth_frame_t *frame, uint16_t len)
 {
 	uint8_t status = 1;
-	uint16_t temp, plen = len;
+	uint16_t temp, wnd, plen = len;
 
 	ip_packet_t *ip = (void*)(frame->data);
 	tcp_packet_t *tcp = (void*)(ip->data);
@@ -517,10 +629,19 @@ uint8_t tcp_xmit(tcp_state_t *st, eth_frame_t *frame, uint16_t len)
 	if(tcp_send_mode != TCP_SENDING_RESEND)
 	{
 		// fill packet header ("static" fields)
-		tcp->window = htons(TCP_WINDOW_SIZE);
 		tcp->urgent_ptr = 0;
 	}
 
+	// receive window, right edge does not move by small steps
+	wnd = tcp_rx_space(st);
+	if( (tcp_seq_lt(st->ack_num + wnd, st->adv_num + TCP_RX_WND_STEP)) &&
+		(!tcp_seq_lt(st->adv_num, st->ack_num)) )
+	{
+		wnd = st->adv_num - st->ack_num;
+	}
+	st->adv_num = st->ack_num + wnd;
+	tcp->window = htons(wnd);
+
 	if(tcp->flags & TCP_FLAG_SYN)
 	{
 		// add MSS option (max. segment size)
@@ -540,11 +661,8 @@ uint8_t tcp_xmit(tcp_state_t *st, eth_frame_t *frame, uint16_t len)
 	tcp->seq_num = htonl(st->seq_num);
 	tcp->ack_num = htonl(st->ack_num);
 
-	// set checksum
+	// checksum is computed when frame is sent
 	plen += sizeof(tcp_packet_t);
-	tcp->cksum = 0;
-	tcp->cksum = ip_cksum(plen + IP_PROTOCOL_TCP,
-		(uint8_t*)tcp - 8, plen + 8);
 
 	// send packet
 	switch(tcp_send_mode)
@@ -566,337 +684,1299 @@ uint8_t tcp_xmit(tcp_state_t *st, eth_frame_t *frame, uint16_t len)
 	st->seq_num += len;
 	if( (tcp->flags & TCP_FLAG_SYN) || (tcp->flags & TCP_FLAG_FIN) )
 		st->seq_num++;
+	if(tcp_seq_lt(st->max_num, st->seq_num))
+		st->max_num = st->seq_num;
 
-	// set "ACK sent" flag
+	// set "ACK sent" flag, no delayed ACK needed
 	if( (tcp->flags & TCP_FLAG_ACK) && (status) )
+	{
 		tcp_ack_sent = 1;
+		st->ack_delayed = 0;
+	}
 
 	return status;
 }
 
-// sending SYN to peer
-// return: 0xff - error, other value - connection id (not established)
-uint8_t LAN_TCPOpen(uint32_t addr, uint16_t port, uint16_t local_port)
+// put data to send buffer
+// return: number of bytes stored
+static uint16_t tcp_write(uint8_t id, const uint8_t *data, uint16_t len)
 {
-	eth_frame_t *frame = (void*)net_buf;
-	ip_packet_t *ip = (void*)(frame->data);
-	tcp_packet_t *tcp = (void*)(ip->data);
-	tcp_state_t *st = 0, *pst;
-	uint8_t id;
-	uint32_t seq_num;
+	tcp_state_t *st = tcp_pool + id;
+	uint16_t pos, part;
 
-	// search for free conection slot
-	for(id = 0; id < TCP_MAX_CONNECTIONS; ++id)
-	{
-		pst = tcp_pool + id;
+	// no data after FIN
+	if(st->fin_state != TCP_FIN_NONE)
+		return 0;
 
-		if(pst->status == TCP_CLOSED)
-		{
-			st = pst;
-			break;
-		}
-	}
+	if(len > TCP_TX_BUF_SIZE - st->tx_len)
+		len = TCP_TX_BUF_SIZE - st->tx_len;
 
-	// free connection slot found
-	if(st)
-	{
-		// add new connection
-		seq_num = HAL_GetTick() + (HAL_GetTick() << 16);
+	// copy with wrap at end of buffer
+	pos = (st->una_num + st->tx_len) & (TCP_TX_BUF_SIZE - 1);
+	part = TCP_TX_BUF_SIZE - pos;
+	if(part > len) part = len;
 
-		st->status = TCP_SYN_SENT;
-		st->event_time = HAL_GetTick();
-		st->seq_num = seq_num;
-		st->ack_num = 0;
-		st->remote_addr = addr;
-		st->remote_port = port;
-		st->local_port = local_port;
-
-#ifdef WITH_TCP_REXMIT
-		st->is_closing = 0;
-		st->rexmit_count = 0;
-		st->seq_num_saved = seq_num;
-#endif
+	memcpy(tcp_tx_buf[id] + pos, data, part);
+	memcpy(tcp_tx_buf[id], data + part, len - part);
 
-		// send packet
-		tcp_send_mode = TCP_SENDING_SEND;
-		tcp->flags = TCP_FLAG_SYN;
-		if(tcp_xmit(st, frame, 0))
-			return id;
+	st->tx_len += len;
+	if(len)
+		st->data_time = HAL_GetTick();
+	return len;
+}
 
-		st->status = TCP_CLOSED;
-	}
+// send segment from send buffer at seq_num
+//	(stays in REPLY/RESEND mode for received frame)
+static uint8_t tcp_send_segment(uint8_t id, uint16_t len, uint8_t fin)
+{
+	tcp_state_t *st = tcp_pool + id;
+	tcp_sending_mode_t mode = tcp_send_mode;
+	eth_frame_t *frame;
+	ip_packet_t *ip;
+	tcp_packet_t *tcp;
+	uint16_t pos, part;
+	uint8_t status;
+
+	if(!(frame = LAN_BufAlloc()))
+		return 0;
+
+	ip = (void*)(frame->data);
+	tcp = (void*)(ip->data);
+
+	// copy data with wrap at end of buffer
+	pos = st->seq_num & (TCP_TX_BUF_SIZE - 1);
+	part = TCP_TX_BUF_SIZE - pos;
+	if(part > len) part = len;
+
+	memcpy(tcp->data, tcp_tx_buf[id] + pos, part);
+	memcpy(tcp->data + part, tcp_tx_buf[id], len - part);
+
+	tcp->flags = TCP_FLAG_ACK;
+	if( (len) && (st->seq_num + len == st->una_num + st->tx_len) )
+		tcp->flags |= TCP_FLAG_PSH;
+	if(fin)
+		tcp->flags |= TCP_FLAG_FIN;
+
+	// rexmit timer runs from oldest segment in flight
+	if( ( (len) || (fin) ) && (st->una_num == st->max_num) )
+		st->event_time = HAL_GetTick();
 
-	return 0xff;
+	tcp_send_mode = TCP_SENDING_SEND;
+	status = tcp_xmit(st, frame, len);
+	tcp_send_mode = mode;
+
+	LAN_BufFree(frame);
+	return status;
 }
 
-// send TCP data
-// dont use somewhere except tcp_write callback!
-void LAN_TCPSend(uint8_t id, eth_frame_t *frame, uint16_t len, uint8_t options)
+// send data from send buffer not sent yet, then FIN
+//	(data in flight are limited by peer window and congestion window,
+//	only one small segment is in flight unless pushed - Nagle algorithm
+//	with Minshall modification, so bulk data tail does not wait for all ACKs)
+static void tcp_output(uint8_t id)
 {
-	ip_packet_t *ip = (void*)(frame->data);
-	tcp_packet_t *tcp = (void*)(ip->data);
 	tcp_state_t *st = tcp_pool + id;
-	uint8_t flags = TCP_FLAG_ACK;
+	uint32_t end, wnd, seq_num;
+	uint16_t len;
+	uint8_t fin;
 
-	// check if connection established
-	if(st->status != TCP_ESTABLISHED)
+	if( (st->status < TCP_ESTABLISHED) || (st->status == TCP_TIME_WAIT) ||
+		(st->fin_state == TCP_FIN_SENT) )
+	{
 		return;
-	
-	// send PSH/ACK
-	if(options & TCP_OPTION_PUSH)
-		flags |= TCP_FLAG_PSH;
+	}
 
-	// send FIN/ACK
-	if(options & TCP_OPTION_CLOSE)
+	end = st->una_num + st->tx_len;
+
+	while(1)
 	{
-		flags |= TCP_FLAG_FIN;
-		st->status = TCP_FIN_WAIT;
-	}
+		// unsent data limited by segment size and windows
+		len = end - st->seq_num;
+		if(len > st->mss)
+			len = st->mss;
 
-	// send packet
-	tcp->flags = flags;
-	tcp_xmit(st, frame, len);
-}
+		wnd = (st->window < st->cwnd) ? st->window : st->cwnd;
+		wnd += st->una_num;
+		wnd = tcp_seq_lt(wnd, st->seq_num) ? 0 : wnd - st->seq_num;
+		if(len > wnd)
+			len = wnd;
 
-// processing tcp packets
-void tcp_filter(eth_frame_t *frame, uint16_t len)
-{
-	ip_packet_t *ip = (void*)(frame->data);
-	tcp_packet_t *tcp = (void*)(ip->data);
-	tcp_state_t *st = 0, *pst;
-	uint8_t id, tcpflags;
+		// FIN follows last byte of data
+		fin = (st->fin_state == TCP_FIN_QUEUED) && (st->seq_num + len == end);
 
-	if(ip->to_addr != ip_addr)
-		return;
+		if( (!len) && (!fin) )
+			break;
 
-	// tcp data length
-	len -= tcp_head_size(tcp);
+		// small segment waits for ACK of previous small segment
+		if( (len < st->mss) && (!fin) && (!st->tx_push) &&
+			(tcp_seq_lt(st->una_num, st->small_num)) )
+		{
+			break;
+		}
 
-	// me needs only SYN/FIN/ACK/RST
-	tcpflags = tcp->flags & (TCP_FLAG_SYN|TCP_FLAG_ACK|
-		TCP_FLAG_RST|TCP_FLAG_FIN);
+		// new data, time one segment at once (Karn algorithm)
+		seq_num = st->seq_num;
+		if(!tcp_send_segment(id, len, fin))
+			break;
 
-	// sending packets back
-	tcp_send_mode = TCP_SENDING_REPLY;
-	tcp_ack_sent = 0;
+		if( (!st->rtt_timing) && (len) && (seq_num + len == st->max_num) &&
+			(st->seq_num == st->max_num) )
+		{
+			st->rtt_timing = 1;
+			st->rtt_num = st->max_num;
+			st->rtt_time = HAL_GetTick();
+		}
 
-	// search connection pool for connection
-	//	to specific port from specific host/port
-	for(id = 0; id < TCP_MAX_CONNECTIONS; ++id)
-	{
-		pst = tcp_pool + id;
+		if(len < st->mss)
+			st->small_num = st->seq_num;
 
-		if( (pst->status != TCP_CLOSED) &&
-			(ip->from_addr == pst->remote_addr) &&
-			(tcp->from_port == pst->remote_port) &&
-			(tcp->to_port == pst->local_port) )
+		if(fin)
 		{
-			st = pst;
+			st->fin_state = TCP_FIN_SENT;
+			if(st->status == TCP_CLOSE_WAIT)
+				st->status = TCP_LAST_ACK;
 			break;
 		}
 	}
 
-	// connection not found/new connection
-	if(!st)
-	{
-		// received SYN - initiating new connection
-		if( tcpflags == TCP_FLAG_SYN )
-		{
-			// search for free slot for connection
-			for(id = 0; id < TCP_MAX_CONNECTIONS; ++id)
-			{
-				pst = tcp_pool + id;
+	if(st->seq_num == end)
+		st->tx_push = 0;
+}
 
-				if(pst->status == TCP_CLOSED)
-				{
-					st = pst;
-					break;
-				}
-			}
+// segment lost, less data in flight from now
+static void tcp_congestion(tcp_state_t *st)
+{
+	uint32_t flight = st->max_num - st->una_num;
 
-			// slot found and app accepts connection?
-			if(st && LAN_Callback_TCPListen(id, frame))
-			{
-				// add embrionic connection to pool
-				st->status = TCP_SYN_RECEIVED;
-				st->event_time = HAL_GetTick();
-				st->seq_num = HAL_GetTick() + (HAL_GetTick() << 16);
-				st->ack_num = ntohl(tcp->seq_num) + 1;
-				st->remote_addr = ip->from_addr;
-				st->remote_port = tcp->from_port;
-				st->local_port = tcp->to_port;
-
-#ifdef WITH_TCP_REXMIT
-				st->is_closing = 0;
-				st->rexmit_count = 0;
-				st->seq_num_saved = st->seq_num;
-#endif
+	flight /= 2;
+	if(flight < 2 * st->mss)
+		flight = 2 * st->mss;
+	st->ssthresh = (flight > 0xffff) ? 0xffff : flight;
 
-				// send SYN/ACK
-				tcp->flags = TCP_FLAG_SYN|TCP_FLAG_ACK;
-				tcp_xmit(st, frame, 0);
-			}
-		}
-	}
+	// no RTT sample from retransmitted data
+	st->rtt_timing = 0;
+}
 
-	else
+// new data acknowledged, update RTT and congestion window
+static void tcp_acked(tcp_state_t *st, uint32_t ack_num, uint32_t acked)
+{
+	uint32_t cwnd = st->cwnd;
+	int32_t rtt, delta;
+
+	// RTT estimation (Jacobson/Karels),
+	//	srtt is scaled by 8, rttvar by 4
+	if( (st->rtt_timing) && (!tcp_seq_lt(ack_num, st->rtt_num)) )
 	{
-		// connection reset by peer?
-		if(tcpflags & TCP_FLAG_RST)
+		st->rtt_timing = 0;
+		rtt = HAL_GetTick() - st->rtt_time;
+
+		if(!st->srtt)
 		{
-			if( (st->status == TCP_ESTABLISHED) ||
-				(st->status == TCP_FIN_WAIT) )
-			{
-				LAN_Callback_TCPClosed(id, 1);
-			}
-			st->status = TCP_CLOSED;
-			return;
+			st->srtt = rtt << 3;
+			st->rttvar = rtt << 1;
 		}
-
-		// me needs only ack packet
-		if( (ntohl(tcp->seq_num) != st->ack_num) ||
-			(ntohl(tcp->ack_num) != st->seq_num) ||
-			(!(tcpflags & TCP_FLAG_ACK)) )
+		else
 		{
-			return;
+			delta = rtt - (st->srtt >> 3);
+			st->srtt += delta;
+			if(delta < 0) delta = -delta;
+			st->rttvar += delta - (st->rttvar >> 2);
 		}
 
-#ifdef WITH_TCP_REXMIT
-		// save sequence number
-		st->seq_num_saved = st->seq_num;
-
-		// reset rexmit counter
-		st->rexmit_count = 0;
-#endif
+		rtt = (st->srtt >> 3) + st->rttvar;
+		if(rtt < TCP_REXMIT_TIMEOUT_MIN) rtt = TCP_REXMIT_TIMEOUT_MIN;
+		if(rtt > TCP_REXMIT_TIMEOUT_MAX) rtt = TCP_REXMIT_TIMEOUT_MAX;
+		st->rto = rtt;
+	}
 
-		// update ack pointer
-		st->ack_num += len;
-		if( (tcpflags & TCP_FLAG_FIN) || (tcpflags & TCP_FLAG_SYN) )
-			st->ack_num++;
+	// fast recovery ends
+	if(st->dup_acks >= 3)
+		cwnd = st->ssthresh;
 
-		// reset timeout counter
-		st->event_time = HAL_GetTick();
+	// slow start
+	else if(cwnd < st->ssthresh)
+		cwnd += (acked < st->mss) ? acked : st->mss;
 
-		switch(st->status)
-		{
+	// congestion avoidance, one segment per RTT
+	else
+		cwnd += (uint32_t)st->mss * st->mss / cwnd + 1;
 
-		// SYN sent by me (active open, step 1)
-		// awaiting SYN/ACK (active open, step 2)
-		case TCP_SYN_SENT:
+	st->cwnd = (cwnd > 0xffff) ? 0xffff : cwnd;
+	st->dup_acks = 0;
+}
 
-			// received packet must be SYN/ACK
-			if(tcpflags != (TCP_FLAG_SYN|TCP_FLAG_ACK))
-			{
-				st->status = TCP_CLOSED;
-				break;
-			}
+// third duplicate ACK, send oldest segment again without waiting for timeout
+static void tcp_fast_rexmit(uint8_t id)
+{
+	tcp_state_t *st = tcp_pool + id;
+	uint32_t seq_num = st->seq_num, cwnd;
+	uint16_t len = (st->tx_len < st->mss) ? st->tx_len : st->mss;
 
-			// send ACK (active open, step 3)
-			tcp->flags = TCP_FLAG_ACK;
-			tcp_xmit(st, frame, 0);
+	tcp_congestion(st);
 
-			// connection is now established
-			st->status = TCP_ESTABLISHED;
+	st->seq_num = st->una_num;
+	if(len) tcp_send_segment(id, len, 0);
+	if(tcp_seq_lt(st->seq_num, seq_num))
+		st->seq_num = seq_num;
 
-			// app can send some data
-			LAN_Callback_TCPRead(id, frame, 0);
+	// segments which left network make room for new ones
+	cwnd = st->ssthresh + 3 * st->mss;
+	st->cwnd = (cwnd > 0xffff) ? 0xffff : cwnd;
+	st->event_time = HAL_GetTick();
+}
 
-			break;
+// initial state of sender on connection open
+static void tcp_init(tcp_state_t *st, uint32_t seq_num)
+{
+	st->seq_num = seq_num;
+	st->una_num = seq_num;
+	st->max_num = seq_num;
+	st->small_num = seq_num;
+	st->window = 0;
+	st->tx_len = 0;
+	st->tx_push = 0;
+	st->fin_state = TCP_FIN_NONE;
+	st->rexmit_count = 0;
+	st->mss = TCP_MSS_DEFAULT;
+	st->cwnd = TCP_MSS_DEFAULT;
+	st->ssthresh = 0xffff;
+	st->rto = TCP_REXMIT_TIMEOUT;
+	st->srtt = 0;
+	st->rttvar = 0;
+	st->rtt_timing = 0;
+	st->dup_acks = 0;
+	st->ack_delayed = 0;
+	st->rx_fin = 0;
+	st->rd_num = st->ack_num;
+	st->adv_num = st->ack_num;
+	st->rx_time = HAL_GetTick();
+	st->data_time = st->rx_time;
+	st->ka_probes = 0;
+	memset(tcp_rx_len[st - tcp_pool], 0, sizeof(tcp_rx_len[0]));
+}
 
-		// SYN received my me (passive open, step 1)
-		// SYN/ACK sent by me (passive open, step 2)
-		// awaiting ACK (passive open, step 3)
-		case TCP_SYN_RECEIVED:
+// keep segment received out of order in receive buffer
+//	(joined with overlapping and adjacent blocks, when all blocks
+//	are used, block furthest ahead is dropped)
+static void tcp_rx_queue(uint8_t id, uint32_t seq_num, const uint8_t *data, uint16_t len)
+{
+	tcp_state_t *st = tcp_pool + id;
+	uint32_t *seq = tcp_rx_seq[id];
+	uint16_t *blen = tcp_rx_len[id];
+	uint32_t start, end;
+	uint16_t pos, part;
+	uint8_t i, slot;
+
+	// only data ahead of expected ones and within window
+	end = st->rd_num + TCP_RX_BUF_SIZE;
+	if( (!tcp_seq_lt(st->ack_num, seq_num)) || (!tcp_seq_lt(seq_num, end)) )
+		return;
+	if(tcp_seq_lt(end, seq_num + len))
+		len = end - seq_num;
 
-			// received packet must be ACK
-			if(tcpflags != TCP_FLAG_ACK)
-			{
-				st->status = TCP_CLOSED;
-				break;
-			}
+	// copy with wrap at end of buffer
+	pos = seq_num & (TCP_RX_BUF_SIZE - 1);
+	part = TCP_RX_BUF_SIZE - pos;
+	if(part > len) part = len;
 
-			// connection is now established
-			st->status = TCP_ESTABLISHED;
+	memcpy(tcp_rx_buf[id] + pos, data, part);
+	memcpy(tcp_rx_buf[id], data + part, len - part);
 
-			// app can send some data
-			LAN_Callback_TCPRead(id, frame, 0);
+	// join blocks, joined block can reach blocks checked before
+	start = seq_num;
+	end = seq_num + len;
+	for(i = 0; i < TCP_RX_QUEUE_LEN; )
+	{
+		if( (blen[i]) && (!tcp_seq_lt(end, seq[i])) &&
+			(!tcp_seq_lt(seq[i] + blen[i], start)) )
+		{
+			if(tcp_seq_lt(seq[i], start))
+				start = seq[i];
+			if(tcp_seq_lt(end, seq[i] + blen[i]))
+				end = seq[i] + blen[i];
+			blen[i] = 0;
+			i = 0;
+			continue;
+		}
+		i++;
+	}
 
+	// free slot, or slot of block furthest ahead of new one
+	slot = TCP_RX_QUEUE_LEN;
+	for(i = 0; i < TCP_RX_QUEUE_LEN; ++i)
+	{
+		if(!blen[i])
+		{
+			slot = i;
 			break;
+		}
 
-		// connection established
-		// awaiting ACK or FIN/ACK
-		case TCP_ESTABLISHED:
-
-			// received FIN/ACK?
-			// (passive close, step 1)
-			if(tcpflags == (TCP_FLAG_FIN|TCP_FLAG_ACK))
-			{
-				// feed data to app
-				if(len) LAN_Callback_TCPWrite(id, frame, len);
+		if( (tcp_seq_lt(start, seq[i])) && ( (slot == TCP_RX_QUEUE_LEN) ||
+			(tcp_seq_lt(seq[slot], seq[i])) ) )
+		{
+			slot = i;
+		}
+	}
 
-				// send FIN/ACK (passive close, step 2)
-				tcp->flags = TCP_FLAG_FIN|TCP_FLAG_ACK;
-				tcp_xmit(st, frame, 0);
+	if(slot < TCP_RX_QUEUE_LEN)
+	{
+		seq[slot] = start;
+		blen[slot] = end - start;
+	}
+}
 
-				// connection is now closed
-				st->status = TCP_CLOSED;
-				LAN_Callback_TCPClosed(id, 0);
-			}
+// feed app with data from receive buffer which follow stream now
+//	(data are copied to frame after TCP header)
+// return: 1 - some data passed, gap was filled
+static uint8_t tcp_rx_deliver(uint8_t id, eth_frame_t *frame)
+{
+	tcp_state_t *st = tcp_pool + id;
+	ip_packet_t *ip = (void*)(frame->data);
+	tcp_packet_t *tcp = (void*)(ip->data);
+	uint8_t *data = tcp_get_data(tcp);
+	uint16_t room = LAN_BUF_SIZE - (data - (uint8_t*)frame);
+	uint32_t *seq = tcp_rx_seq[id];
+	uint16_t *blen = tcp_rx_len[id];
+	uint32_t end;
+	uint16_t pos, part, len;
+	uint8_t i, filled = 0;
+
+	for(i = 0; i < TCP_RX_QUEUE_LEN; ++i)
+	{
+		if( (!blen[i]) || (tcp_seq_lt(st->ack_num, seq[i])) )
+			continue;
 
-			// received ACK
-			else if(tcpflags == TCP_FLAG_ACK)
-			{
-				// feed data to app
-				if(len) LAN_Callback_TCPWrite(id, frame, len);
+		// block reached by stream, part of it can be passed already
+		end = seq[i] + blen[i];
+		blen[i] = 0;
 
-				// app can send some data
-				LAN_Callback_TCPRead(id, frame, 0);
+		// data stay in buffer for app
+		if( (st->rx_keep) && (tcp_seq_lt(st->ack_num, end)) )
+		{
+			st->ack_num = end;
+			filled = 1;
+		}
 
-				// send ACK
-				if( (len) && (!tcp_ack_sent) )
-				{
-					tcp->flags = TCP_FLAG_ACK;
-					tcp_xmit(st, frame, 0);
-				}
-			}
+		while(tcp_seq_lt(st->ack_num, end))
+		{
+			len = end - st->ack_num;
+			if(len > room) len = room;
 
-			break;
+			pos = st->ack_num & (TCP_RX_BUF_SIZE - 1);
+			part = TCP_RX_BUF_SIZE - pos;
+			if(part > len) part = len;
 
-		// FIN/ACK sent by me (active close, step 1)
-		// awaiting ACK or FIN/ACK
-		case TCP_FIN_WAIT:
+			memcpy(data, tcp_rx_buf[id] + pos, part);
+			memcpy(data + part, tcp_rx_buf[id], len - part);
 
-			// received FIN/ACK?
-			// (active close, step 2)
-			if(tcpflags == (TCP_FLAG_FIN|TCP_FLAG_ACK))
-			{
-				// feed data to app
-				if(len) LAN_Callback_TCPWrite(id, frame, len);
+			st->ack_num += len;
+			st->rd_num = st->ack_num;
+			st->cb->write(id, frame, len);
+			filled = 1;
+		}
+	}
 
-				// send ACK (active close, step 3)
-				tcp->flags = TCP_FLAG_ACK;
-				tcp_xmit(st, frame, 0);
+	return filled;
+}
 
-				// connection is now closed
+// in-order data received, app gets them at once or they stay in buffer,
+//	then data received out of order before which follow them
+// return: 1 - gap was filled
+static uint8_t tcp_rx_data(uint8_t id, eth_frame_t *frame, uint32_t seq_num, uint16_t len)
+{
+	tcp_state_t *st = tcp_pool + id;
+	ip_packet_t *ip = (void*)(frame->data);
+	tcp_packet_t *tcp = (void*)(ip->data);
+	uint8_t *data = tcp_get_data(tcp);
+	uint16_t pos, part;
+
+	if(st->rx_keep)
+	{
+		// copy with wrap at end of buffer
+		pos = seq_num & (TCP_RX_BUF_SIZE - 1);
+		part = TCP_RX_BUF_SIZE - pos;
+		if(part > len) part = len;
+
+		memcpy(tcp_rx_buf[id] + pos, data, part);
+		memcpy(tcp_rx_buf[id], data + part, len - part);
+	}
+	else
+	{
+		st->cb->write(id, frame, len);
+	}
+
+	return tcp_rx_deliver(id, frame);
+}
+
+// acknowledge received data unless ACK was sent with data already,
+//	every second segment, filled gap and segment after which peer has
+//	no window for another one (small receive buffer) at once, others after delay
+static void tcp_rx_ack(uint8_t id, eth_frame_t *frame, uint16_t len, uint8_t now)
+{
+	tcp_state_t *st = tcp_pool + id;
+	ip_packet_t *ip = (void*)(frame->data);
+	tcp_packet_t *tcp = (void*)(ip->data);
+
+	if(tcp_ack_sent)
+		return;
+
+	if( (now) || (st->ack_delayed) || (tcp_seq_lt(st->adv_num, st->ack_num + len)) )
+	{
+		tcp->flags = TCP_FLAG_ACK;
+		tcp_xmit(st, frame, 0);
+	}
+	else
+	{
+		st->ack_delayed = 1;
+		st->ack_time = HAL_GetTick();
+	}
+}
+
+// MSS option of SYN segment
+static void tcp_parse_mss(tcp_state_t *st, tcp_packet_t *tcp)
+{
+	uint8_t *opt = tcp->data, *end = tcp_get_data(tcp);
+	uint16_t mss = TCP_MSS_DEFAULT;
+
+	while( (opt < end) && (*opt) )
+	{
+		// no-operation
+		if(*opt == 1)
+		{
+			opt++;
+			continue;
+		}
+
+		if( (opt + 2 > end) || (opt[1] < 2) )
+			break;
+
+		if( (opt[0] == 2) && (opt[1] == 4) && (opt + 4 <= end) )
+			mss = (opt[2] << 8) | opt[3];
+
+		opt += opt[1];
+	}
+
+	if(mss > TCP_MSS_MAX) mss = TCP_MSS_MAX;
+	if(!mss) mss = TCP_MSS_DEFAULT;
+
+	// four segments fit to send buffer, enough for fast rexmit
+	if(mss > TCP_TX_BUF_SIZE / 4) mss = TCP_TX_BUF_SIZE / 4;
+	st->mss = mss;
+
+	// initial congestion window (RFC 3390)
+	st->cwnd = (4380 > 2 * mss) ? 4380 : 2 * mss;
+	if(st->cwnd > 4 * mss) st->cwnd = 4 * mss;
+}
+
+// hash of connection
+//	(all bytes are folded, connections of one client differ in port only)
+static uint8_t tcp_hash(uint32_t addr, uint16_t port, uint16_t local_port)
+{
+	addr ^= port ^ ((uint32_t)local_port << 16);
+	addr ^= addr >> 16;
+	addr ^= addr >> 8;
+	return addr & (TCP_HASH_SIZE - 1);
+}
+
+// find open connection
+// return: TCP_ID_NONE - not found, other value - connection id
+static uint8_t tcp_find(uint32_t addr, uint16_t port, uint16_t local_port)
+{
+	tcp_state_t *st;
+	uint8_t id;
+
+	for(id = tcp_hash_head[tcp_hash(addr, port, local_port)]; id != TCP_ID_NONE; id = st->next)
+	{
+		st = tcp_pool + id;
+
+		if( (st->status != TCP_CLOSED) && (st->remote_addr == addr) &&
+			(st->remote_port == port) && (st->local_port == local_port) )
+		{
+			return id;
+		}
+	}
+	return TCP_ID_NONE;
+}
+
+// get free connection slot and move it to hash chain of new connection
+//	(closed connection with data for app keeps its slot)
+// return: TCP_ID_NONE - all slots used, other value - connection id (closed yet)
+static uint8_t tcp_alloc(uint32_t addr, uint16_t port, uint16_t local_port,
+	uint8_t listener, const tcp_callbacks_t *cb)
+{
+	tcp_state_t *st;
+	uint8_t id, i, *link, hash;
+
+	for(id = 0; id < TCP_MAX_CONNECTIONS; ++id)
+	{
+		if( (tcp_pool[id].status == TCP_CLOSED) && (!tcp_pool[id].rx_keep) )
+			break;
+	}
+
+	// all slots used, connection longest in TIME_WAIT gives its slot up
+	if(id == TCP_MAX_CONNECTIONS)
+	{
+		for(i = 0; i < TCP_MAX_CONNECTIONS; ++i)
+		{
+			if( (tcp_pool[i].status == TCP_TIME_WAIT) && ( (id == TCP_MAX_CONNECTIONS) ||
+				(HAL_GetTick() - tcp_pool[i].event_time > HAL_GetTick() - tcp_pool[id].event_time) ) )
+			{
+				id = i;
+			}
+		}
+
+		if(id == TCP_MAX_CONNECTIONS)
+			return TCP_ID_NONE;
+
+		tcp_pool[id].status = TCP_CLOSED;
+	}
+
+	// remove slot from chain of previous connection
+	st = tcp_pool + id;
+	link = &tcp_hash_head[tcp_hash(st->remote_addr, st->remote_port, st->local_port)];
+	while(*link != TCP_ID_NONE)
+	{
+		if(*link == id)
+		{
+			*link = st->next;
+			break;
+		}
+		link = &tcp_pool[*link].next;
+	}
+
+	hash = tcp_hash(addr, port, local_port);
+	st->remote_addr = addr;
+	st->remote_port = port;
+	st->local_port = local_port;
+	st->listener = listener;
+	st->cb = cb;
+	st->rx_keep = 0;
+	st->next = tcp_hash_head[hash];
+	tcp_hash_head[hash] = id;
+
+	return id;
+}
+
+// listening port entry
+// return: TCP_LISTENER_NONE - port is not listened, other value - entry index
+static uint8_t tcp_listener_find(uint16_t port)
+{
+	uint8_t i;
+
+	for(i = 0; i < TCP_MAX_LISTENERS; ++i)
+	{
+		if( (tcp_listeners[i].port) && (tcp_listeners[i].port == port) )
+			return i;
+	}
+	return TCP_LISTENER_NONE;
+}
+
+// too many connections of listening port in handshake?
+static uint8_t tcp_backlog_full(uint8_t listener)
+{
+	uint8_t id, count = 0;
+
+	if( (listener == TCP_LISTENER_NONE) || (!tcp_listeners[listener].backlog) )
+		return 0;
+
+	for(id = 0; id < TCP_MAX_CONNECTIONS; ++id)
+	{
+		if( (tcp_pool[id].status == TCP_SYN_RECEIVED) &&
+			(tcp_pool[id].listener == listener) )
+		{
+			count++;
+		}
+	}
+	return count >= tcp_listeners[listener].backlog;
+}
+
+// refuse segment of unknown connection with RST
+static void tcp_reset(eth_frame_t *frame, uint16_t len)
+{
+	ip_packet_t *ip = (void*)(frame->data);
+	tcp_packet_t *tcp = (void*)(ip->data);
+	tcp_state_t st;
+
+	// RST takes sequence number from ACK, or acknowledges segment
+	st.ack_num = ntohl(tcp->seq_num) + len;
+	if(tcp->flags & (TCP_FLAG_SYN|TCP_FLAG_FIN))
+		st.ack_num++;
+
+	if(tcp->flags & TCP_FLAG_ACK)
+	{
+		st.seq_num = ntohl(tcp->ack_num);
+		tcp->flags = TCP_FLAG_RST;
+	}
+	else
+	{
+		st.seq_num = 0;
+		tcp->flags = TCP_FLAG_RST|TCP_FLAG_ACK;
+	}
+	st.max_num = st.seq_num;
+	st.rd_num = st.ack_num;
+	st.adv_num = st.ack_num;
+
+	tcp_xmit(&st, frame, 0);
+}
+
+// accept connections to local port
+// return: 0 - ok, 1 - port listened already or no free entry
+uint8_t LAN_TCPListen(uint16_t port, uint8_t backlog, const tcp_callbacks_t *callbacks)
+{
+	tcp_listener_t *lst;
+	uint8_t i, id;
+
+	if( (!port) || (tcp_listener_find(port) != TCP_LISTENER_NONE) )
+		return 1;
+
+	// free entry, not used by connections of port listened before
+	for(i = 0; i < TCP_MAX_LISTENERS; ++i)
+	{
+		if(tcp_listeners[i].port)
+			continue;
+
+		for(id = 0; id < TCP_MAX_CONNECTIONS; ++id)
+		{
+			if( (tcp_pool[id].status != TCP_CLOSED) &&
+				(tcp_pool[id].status <= TCP_FIN_WAIT) && (tcp_pool[id].listener == i) )
+			{
+				break;
+			}
+		}
+
+		if(id == TCP_MAX_CONNECTIONS)
+			break;
+	}
+
+	if(i == TCP_MAX_LISTENERS)
+		return 1;
+
+	lst = tcp_listeners + i;
+	lst->cb = tcp_default_cb;
+	if(callbacks)
+	{
+		if(callbacks->listen) lst->cb.listen = callbacks->listen;
+		if(callbacks->read) lst->cb.read = callbacks->read;
+		if(callbacks->write) lst->cb.write = callbacks->write;
+		if(callbacks->closed) lst->cb.closed = callbacks->closed;
+	}
+	lst->backlog = backlog;
+	lst->port = port;
+	tcp_listening = 1;
+
+	return 0;
+}
+
+// stop accepting connections to local port
+void LAN_TCPUnlisten(uint16_t port)
+{
+	uint8_t i = tcp_listener_find(port);
+
+	if(i != TCP_LISTENER_NONE)
+		tcp_listeners[i].port = 0;
+}
+
+// sending SYN to peer
+// return: 0xff - error, other value - connection id (not established)
+uint8_t LAN_TCPOpen(uint32_t addr, uint16_t port, uint16_t local_port)
+{
+	return LAN_TCPConnect(addr, port, local_port, 0);
+}
+
+// sending SYN to peer, connection uses own callbacks
+// return: 0xff - error, other value - connection id (not established)
+uint8_t LAN_TCPConnect(uint32_t addr, uint16_t port, uint16_t local_port, const tcp_callbacks_t *callbacks)
+{
+	eth_frame_t *frame;
+	ip_packet_t *ip;
+	tcp_packet_t *tcp;
+	tcp_state_t *st;
+	uint8_t id;
+	uint32_t seq_num;
+
+	// free connection slot and buffer found
+	id = tcp_alloc(addr, port, local_port, TCP_LISTENER_NONE,
+		(callbacks) ? callbacks : &tcp_default_cb);
+	if( (id != TCP_ID_NONE) && (frame = LAN_BufAlloc()) )
+	{
+		st = tcp_pool + id;
+		ip = (void*)(frame->data);
+		tcp = (void*)(ip->data);
+
+		// add new connection
+		seq_num = HAL_GetTick() + (HAL_GetTick() << 16);
+
+		st->status = TCP_SYN_SENT;
+		st->event_time = HAL_GetTick();
+		st->ack_num = 0;
+		tcp_init(st, seq_num);
+
+		// send packet
+		tcp_send_mode = TCP_SENDING_SEND;
+		tcp->flags = TCP_FLAG_SYN;
+		if(tcp_xmit(st, frame, 0))
+		{
+			LAN_BufFree(frame);
+			return id;
+		}
+
+		LAN_BufFree(frame);
+		st->status = TCP_CLOSED;
+	}
+
+	return 0xff;
+}
+
+// put data to send buffer and send what peer window allows
+// return: number of bytes stored
+uint16_t LAN_TCPWrite(uint8_t id, const void *data, uint16_t len)
+{
+	tcp_state_t *st = tcp_pool + id;
+
+	// check if connection established
+	if(st->status != TCP_ESTABLISHED)
+		return 0;
+
+	len = tcp_write(id, data, len);
+	tcp_output(id);
+
+	return len;
+}
+
+// connection status
+tcp_status_code_t LAN_TCPGetStatus(uint8_t id)
+{
+	return tcp_pool[id].status;
+}
+
+// received data stay in buffer until LAN_TCPRecv
+void LAN_TCPRecvBuffered(uint8_t id)
+{
+	tcp_pool[id].rx_keep = 1;
+}
+
+// copy data from receive buffer, window opens for peer
+// return: number of bytes read
+uint16_t LAN_TCPRecv(uint8_t id, void *data, uint16_t len)
+{
+	tcp_state_t *st = tcp_pool + id;
+	uint16_t pos, part, avail = LAN_TCPRecvAvailable(id);
+
+	if(len > avail)
+		len = avail;
+
+	// copy with wrap at end of buffer
+	pos = st->rd_num & (TCP_RX_BUF_SIZE - 1);
+	part = TCP_RX_BUF_SIZE - pos;
+	if(part > len) part = len;
+
+	memcpy(data, tcp_rx_buf[id] + pos, part);
+	memcpy((uint8_t*)data + part, tcp_rx_buf[id], len - part);
+	st->rd_num += len;
+
+	// window update when peer can send more than before
+	if( ( (st->status == TCP_ESTABLISHED) || (st->status == TCP_FIN_WAIT) ) &&
+		(!st->rx_fin) && (!tcp_seq_lt(st->rd_num + TCP_RX_BUF_SIZE,
+		st->adv_num + TCP_RX_WND_STEP)) )
+	{
+		tcp_send_segment(id, 0, 0);
+	}
+
+	return len;
+}
+
+// number of bytes LAN_TCPRecv can read
+uint16_t LAN_TCPRecvAvailable(uint8_t id)
+{
+	tcp_state_t *st = tcp_pool + id;
+
+	if(!st->rx_keep)
+		return 0;
+
+	return st->ack_num - st->rd_num - st->rx_fin;
+}
+
+// free space in send buffer
+uint16_t LAN_TCPWriteSpace(uint8_t id)
+{
+	tcp_state_t *st = tcp_pool + id;
+
+	if( (st->status != TCP_ESTABLISHED) || (st->fin_state != TCP_FIN_NONE) )
+		return 0;
+
+	return TCP_TX_BUF_SIZE - st->tx_len;
+}
+
+// send FIN after data in send buffer
+void LAN_TCPClose(uint8_t id)
+{
+	tcp_state_t *st = tcp_pool + id;
+
+	// unread data are dropped, slot can be reused
+	st->rx_keep = 0;
+	st->rd_num = st->ack_num;
+
+	switch(st->status)
+	{
+	case TCP_ESTABLISHED:
+		st->status = TCP_FIN_WAIT;
+		st->fin_state = TCP_FIN_QUEUED;
+		tcp_output(id);
+		break;
+
+	// connection not established yet, forget it
+	case TCP_SYN_SENT:
+	case TCP_SYN_RECEIVED:
+		st->status = TCP_CLOSED;
+		break;
+
+	default:
+		break;
+	}
+}
+
+// send TCP data
+// data after TCP header are copied to send buffer
+void LAN_TCPSend(uint8_t id, eth_frame_t *frame, uint16_t len, uint8_t options)
+{
+	ip_packet_t *ip = (void*)(frame->data);
+	tcp_packet_t *tcp = (void*)(ip->data);
+	tcp_state_t *st = tcp_pool + id;
+
+	// check if connection established
+	if(st->status != TCP_ESTABLISHED)
+		return;
+
+	tcp_write(id, tcp->data, len);
+
+	// send small segment without waiting for ACK
+	if(options & TCP_OPTION_PUSH)
+		st->tx_push = 1;
+
+	// send FIN/ACK after data
+	if(options & TCP_OPTION_CLOSE)
+		LAN_TCPClose(id);
+	else
+		tcp_output(id);
+}
+
+// processing tcp packets
+void tcp_filter(eth_frame_t *frame, uint16_t len)
+{
+	ip_packet_t *ip = (void*)(frame->data);
+	tcp_packet_t *tcp = (void*)(ip->data);
+	tcp_state_t *st = 0;
+	uint8_t id, tcpflags, listener, filled = 0;
+	uint32_t seq_num, ack_num, acked;
+
+	if(ip->to_addr != ip_addr)
+		return;
+
+	// header with options must fit in packet
+	if( (len < sizeof(tcp_packet_t)) ||
+		(tcp_head_size(tcp) < sizeof(tcp_packet_t)) ||
+		(tcp_head_size(tcp) > len) )
+	{
+		return;
+	}
+
+	// tcp data length
+	len -= tcp_head_size(tcp);
+
+	// me needs only SYN/FIN/ACK/RST
+	tcpflags = tcp->flags & (TCP_FLAG_SYN|TCP_FLAG_ACK|
+		TCP_FLAG_RST|TCP_FLAG_FIN);
+
+	// sending packets back
+	tcp_send_mode = TCP_SENDING_REPLY;
+	tcp_ack_sent = 0;
+
+	// search connection pool for connection
+	//	to specific port from specific host/port
+	id = tcp_find(ip->from_addr, tcp->from_port, tcp->to_port);
+	if(id != TCP_ID_NONE)
+		st = tcp_pool + id;
+
+	// peer opens connection again, old one in TIME_WAIT is forgotten
+	//	(new sequence number is ahead of old stream)
+	if( (st) && (st->status == TCP_TIME_WAIT) && (tcpflags == TCP_FLAG_SYN) &&
+		(tcp_seq_lt(st->ack_num, ntohl(tcp->seq_num))) )
+	{
+		st->status = TCP_CLOSED;
+		st = 0;
+	}
+
+	// connection not found/new connection
+	if(!st)
+	{
+		// no reply to RST
+		if(tcpflags & TCP_FLAG_RST)
+			return;
+
+		// received SYN - initiating new connection
+		listener = tcp_listener_find(tcp->to_port);
+		if( (tcpflags != TCP_FLAG_SYN) ||
+			( (listener == TCP_LISTENER_NONE) && (tcp_listening) ) )
+		{
+			tcp_reset(frame, len);
+			return;
+		}
+
+		// too many connections in handshake or no free slot,
+		//	peer sends SYN again later
+		if( (tcp_backlog_full(listener)) || ( (id = tcp_alloc(ip->from_addr,
+			tcp->from_port, tcp->to_port, listener, (listener == TCP_LISTENER_NONE) ?
+			&tcp_default_cb : &tcp_listeners[listener].cb)) == TCP_ID_NONE ) )
+		{
+			return;
+		}
+
+		// app accepts connection?
+		st = tcp_pool + id;
+		if(!st->cb->listen(id, frame))
+		{
+			tcp_reset(frame, len);
+			return;
+		}
+
+		// add embrionic connection to pool
+		st->status = TCP_SYN_RECEIVED;
+		st->event_time = HAL_GetTick();
+		st->ack_num = ntohl(tcp->seq_num) + 1;
+		tcp_init(st, HAL_GetTick() + (HAL_GetTick() << 16));
+		tcp_parse_mss(st, tcp);
+		st->window = ntohs(tcp->window);
+
+		// send SYN/ACK
+		tcp->flags = TCP_FLAG_SYN|TCP_FLAG_ACK;
+		tcp_xmit(st, frame, 0);
+	}
+
+	else
+	{
+		// connection reset by peer?
+		//	(not in TIME_WAIT, old duplicate RST would end it early)
+		if(tcpflags & TCP_FLAG_RST)
+		{
+			if(st->status == TCP_TIME_WAIT)
+				return;
+
+			if( (st->status == TCP_ESTABLISHED) ||
+				(st->status == TCP_FIN_WAIT) )
+			{
+				st->cb->closed(id, 1);
+			}
+			st->status = TCP_CLOSED;
+			return;
+		}
+
+		// me needs only ack packet
+		if(!(tcpflags & TCP_FLAG_ACK))
+			return;
+
+		// peer is alive
+		st->rx_time = HAL_GetTick();
+		st->ka_probes = 0;
+
+		seq_num = ntohl(tcp->seq_num);
+		ack_num = ntohl(tcp->ack_num);
+
+		// SYN/ACK starts peer sequence
+		if( (st->status == TCP_SYN_SENT) && (tcpflags & TCP_FLAG_SYN) )
+		{
+			st->ack_num = seq_num;
+			st->rd_num = seq_num + 1;
+			st->adv_num = seq_num + 1;
+		}
+
+		// ACK of data not sent yet?
+		if(tcp_seq_lt(st->max_num, ack_num))
+			return;
+
+		// new data acknowledged
+		if(tcp_seq_lt(st->una_num, ack_num))
+		{
+			// remove data from send buffer
+			//	(SYN and FIN take sequence number, but not buffer)
+			acked = ack_num - st->una_num;
+			if(acked > st->tx_len)
+			{
+				acked = st->tx_len;
+				if(st->fin_state != TCP_FIN_NONE)
+					st->fin_state = TCP_FIN_SENT;
+			}
+			st->tx_len -= acked;
+			st->una_num = ack_num;
+
+			// data sent before rexmit timeout can be acknowledged
+			if(tcp_seq_lt(st->seq_num, ack_num))
+				st->seq_num = ack_num;
+
+			tcp_acked(st, ack_num, acked);
+
+			// reset rexmit counter and timer
+			st->rexmit_count = 0;
+			st->event_time = HAL_GetTick();
+		}
+
+		// duplicate ACK, peer received segment after lost one
+		else if( (ack_num == st->una_num) && (st->una_num != st->max_num) &&
+			(!len) && (!(tcpflags & (TCP_FLAG_SYN|TCP_FLAG_FIN))) &&
+			(ntohs(tcp->window) == st->window) )
+		{
+			if(st->dup_acks < 0xff)
+				st->dup_acks++;
+
+			if(st->dup_acks == 3)
+				tcp_fast_rexmit(id);
+			else if( (st->dup_acks > 3) && (st->cwnd <= 0xffff - st->mss) )
+				st->cwnd += st->mss;
+		}
+
+		// peer window
+		if(!tcp_seq_lt(ack_num, st->una_num))
+		{
+			st->window = ntohs(tcp->window);
+
+			// peer is alive, window probes are not limited
+			if(!st->window)
+				st->rexmit_count = 0;
+		}
+
+		// segment starts with data received before, cut them off
+		if( (len) && (tcp_seq_lt(seq_num, st->ack_num)) &&
+			(tcp_seq_lt(st->ack_num, seq_num + len)) )
+		{
+			acked = st->ack_num - seq_num;
+			len -= acked;
+			memmove(tcp_get_data(tcp), tcp_get_data(tcp) + acked, len);
+			seq_num = st->ack_num;
+		}
+
+		// segment out of order, data are kept in receive buffer,
+		//	peer gets ACK with expected sequence number at once
+		if(seq_num != st->ack_num)
+		{
+			if(len)
+				tcp_rx_queue(id, seq_num, tcp_get_data(tcp), len);
+
+			// FIN sent again, our ACK was lost
+			if( (st->status == TCP_TIME_WAIT) && (tcpflags & TCP_FLAG_FIN) )
+				st->event_time = HAL_GetTick();
+
+			if( (len) || (tcpflags & TCP_FLAG_FIN) )
+			{
+				tcp->flags = TCP_FLAG_ACK;
+				tcp_xmit(st, frame, 0);
+			}
+			return;
+		}
+
+		// no room for data not read by app yet, FIN comes again with the rest
+		if(len > tcp_rx_space(st))
+		{
+			len = tcp_rx_space(st);
+			tcpflags &= ~TCP_FLAG_FIN;
+
+			// window probe gets ACK at once
+			if(!len)
+			{
+				tcp->flags = TCP_FLAG_ACK;
+				tcp_xmit(st, frame, 0);
+			}
+		}
+
+		// update ack pointer
+		st->ack_num += len;
+		if( (tcpflags & TCP_FLAG_FIN) || (tcpflags & TCP_FLAG_SYN) )
+			st->ack_num++;
+		if(tcpflags & TCP_FLAG_FIN)
+			st->rx_fin = 1;
+		if(!st->rx_keep)
+			st->rd_num = st->ack_num;
+		if(len)
+			st->data_time = HAL_GetTick();
+
+		switch(st->status)
+		{
+
+		// SYN sent by me (active open, step 1)
+		// awaiting SYN/ACK (active open, step 2)
+		case TCP_SYN_SENT:
+
+			// received packet must be SYN/ACK for my SYN
+			if( (tcpflags != (TCP_FLAG_SYN|TCP_FLAG_ACK)) ||
+				(st->una_num != st->seq_num) )
+			{
+				st->status = TCP_CLOSED;
+				break;
+			}
+
+			tcp_parse_mss(st, tcp);
+
+			// send ACK (active open, step 3)
+			tcp->flags = TCP_FLAG_ACK;
+			tcp_xmit(st, frame, 0);
+
+			// connection is now established
+			st->status = TCP_ESTABLISHED;
+
+			// app can send some data
+			st->cb->read(id, frame, 0);
+
+			break;
+
+		// SYN received my me (passive open, step 1)
+		// SYN/ACK sent by me (passive open, step 2)
+		// awaiting ACK (passive open, step 3)
+		case TCP_SYN_RECEIVED:
+
+			// received packet must be ACK for my SYN/ACK
+			if( (tcpflags != TCP_FLAG_ACK) ||
+				(st->una_num != st->seq_num) )
+			{
 				st->status = TCP_CLOSED;
-				LAN_Callback_TCPClosed(id, 0);
+				break;
+			}
+
+			// connection is now established
+			st->status = TCP_ESTABLISHED;
+
+			// feed data to app
+			if(len)
+				filled = tcp_rx_data(id, frame, seq_num, len);
+
+			// app can send some data
+			st->cb->read(id, frame, 0);
+
+			// send ACK
+			if(len) tcp_rx_ack(id, frame, len, filled);
+
+			break;
+
+		// connection established
+		// awaiting ACK or FIN/ACK
+		case TCP_ESTABLISHED:
+
+			// received FIN/ACK?
+			// (passive close, step 1)
+			if(tcpflags == (TCP_FLAG_FIN|TCP_FLAG_ACK))
+			{
+				// feed data to app
+				if(len) tcp_rx_data(id, frame, seq_num, len);
+
+				// send rest of data and FIN/ACK (passive close, step 2),
+				//	ACK alone when data wait for window
+				st->status = TCP_CLOSE_WAIT;
+				st->fin_state = TCP_FIN_QUEUED;
+				tcp_output(id);
+				if(!tcp_ack_sent)
+				{
+					tcp->flags = TCP_FLAG_ACK;
+					tcp_xmit(st, frame, 0);
+				}
+
+				// connection is closed for app
+				st->cb->closed(id, 0);
 			}
 
-			// received ACK+data?
-			// (buffer flushing by peer)
-			else if( (tcpflags == TCP_FLAG_ACK) && (len) )
+			// received ACK
+			else if(tcpflags == TCP_FLAG_ACK)
 			{
 				// feed data to app
-				LAN_Callback_TCPWrite(id, frame, len);
+				if(len)
+					filled = tcp_rx_data(id, frame, seq_num, len);
+
+				// app can send some data
+				if( (st->status == TCP_ESTABLISHED) &&
+					(TCP_TX_BUF_SIZE - st->tx_len >= tcp_tx_room(st)) )
+				{
+					st->cb->read(id, frame, 0);
+				}
+
+				// send data waiting for window, joined with new data
+				tcp_output(id);
 
 				// send ACK
-				tcp->flags = TCP_FLAG_ACK;
-				tcp_xmit(st, frame, 0);
+				if(len) tcp_rx_ack(id, frame, len, filled);
+			}
 
-#ifdef WITH_TCP_REXMIT
-				// our data+FIN/ACK acked
-				st->is_closing = 1;
-#endif
+			break;
+
+		// FIN/ACK queued by me (active close, step 1)
+		// awaiting ACK or FIN/ACK
+		case TCP_FIN_WAIT:
+
+			// received FIN/ACK?
+			// (active close, step 2)
+			if(tcpflags == (TCP_FLAG_FIN|TCP_FLAG_ACK))
+			{
+				// feed data to app
+				if(len) tcp_rx_data(id, frame, seq_num, len);
+
+				// my FIN acknowledged already?
+				if( (st->fin_state == TCP_FIN_SENT) && (st->una_num == st->max_num) )
+				{
+					st->status = TCP_TIME_WAIT;
+					st->event_time = HAL_GetTick();
+				}
+				else
+				{
+					st->status = TCP_CLOSING;
+				}
+
+				// send ACK (active close, step 3),
+				//	with rest of data and FIN when they were not sent yet
+				tcp_output(id);
+				if(!tcp_ack_sent)
+				{
+					tcp->flags = TCP_FLAG_ACK;
+					tcp_xmit(st, frame, 0);
+				}
+
+				// connection is closed for app
+				st->cb->closed(id, 0);
+			}
+
+			// received ACK
+			else if(tcpflags == TCP_FLAG_ACK)
+			{
+				// feed data to app
+				if(len)
+					filled = tcp_rx_data(id, frame, seq_num, len);
+
+				// send rest of data and FIN
+				tcp_output(id);
+
+				// send ACK
+				if(len) tcp_rx_ack(id, frame, len, filled);
+			}
+
+			break;
+
+		// FIN received, sending rest of data and FIN (passive close, step 2)
+		// awaiting ACK of FIN (passive close, step 3)
+		case TCP_CLOSE_WAIT:
+		case TCP_LAST_ACK:
+
+			if( (st->fin_state == TCP_FIN_SENT) && (st->una_num == st->max_num) )
+				st->status = TCP_CLOSED;
+			else
+				tcp_output(id);
+
+			break;
+
+		// both FINs received, awaiting ACK of my FIN
+		case TCP_CLOSING:
+
+			if( (st->fin_state == TCP_FIN_SENT) && (st->una_num == st->max_num) )
+			{
+				st->status = TCP_TIME_WAIT;
+				st->event_time = HAL_GetTick();
+			}
+			else
+			{
+				tcp_output(id);
 			}
 
 			break;
@@ -907,15 +1987,51 @@ void tcp_filter(eth_frame_t *frame, uint16_t len)
 	}
 }
 
+// drop connection, peer gets RST
+static void tcp_abort(uint8_t id)
+{
+	tcp_state_t *st = tcp_pool + id;
+	tcp_sending_mode_t mode = tcp_send_mode;
+	eth_frame_t *frame;
+	ip_packet_t *ip;
+	tcp_packet_t *tcp;
+
+	if( (frame = LAN_BufAlloc()) )
+	{
+		ip = (void*)(frame->data);
+		tcp = (void*)(ip->data);
+
+		tcp->flags = TCP_FLAG_RST|TCP_FLAG_ACK;
+		tcp_send_mode = TCP_SENDING_SEND;
+		tcp_xmit(st, frame, 0);
+		tcp_send_mode = mode;
+
+		LAN_BufFree(frame);
+	}
+
+	st->status = TCP_CLOSED;
+	st->cb->closed(id, 1);
+}
+
+#ifdef WITH_TCP_KEEPALIVE
+// keep-alive probe, ACK with sequence number peer has acknowledged already,
+//	so peer answers with ACK
+static void tcp_keepalive(uint8_t id)
+{
+	tcp_state_t *st = tcp_pool + id;
+	uint32_t seq_num = st->seq_num;
+
+	st->seq_num = st->una_num - 1;
+	tcp_send_segment(id, 0, 0);
+	st->seq_num = seq_num;
+}
+#endif
+
 // periodic event
-void tcp_poll(void)
+void tcp_poll(eth_frame_t *frame)
 {
-#ifdef WITH_TCP_REXMIT
-	eth_frame_t *frame = (void*)net_buf;
 	ip_packet_t *ip = (void*)(frame->data);
 	tcp_packet_t *tcp = (void*)(ip->data);
-#endif
-
 	uint8_t id;
 	tcp_state_t *st;
 
@@ -923,89 +2039,135 @@ void tcp_poll(void)
 	{
 		st = tcp_pool + id;
 
-#ifdef WITH_TCP_REXMIT
-		// connection timed out?
-		if( (st->status != TCP_CLOSED) &&
-			(HAL_GetTick() - st->event_time > TCP_REXMIT_TIMEOUT) )
+		if(st->status == TCP_CLOSED)
+			continue;
+
+		// FIN sent again by peer would be answered by now
+		if(st->status == TCP_TIME_WAIT)
 		{
-			// rexmit limit reached?
-			if(st->rexmit_count > TCP_REXMIT_LIMIT)
-			{
-				// close connection
+			if(HAL_GetTick() - st->event_time > TCP_TIME_WAIT_TIMEOUT)
 				st->status = TCP_CLOSED;
-				LAN_Callback_TCPClosed(id, 1);
-			}
+			continue;
+		}
 
-			// should rexmit?
-			else
-			{
-				// reset timeout counter
-				st->event_time = HAL_GetTick();
+		// no data sent or received for long time
+		if( (TCP_IDLE_TIMEOUT) && (st->status == TCP_ESTABLISHED) &&
+			(HAL_GetTick() - st->data_time > TCP_IDLE_TIMEOUT) )
+		{
+			tcp_abort(id);
+			continue;
+		}
 
-				// increment rexmit counter
-				st->rexmit_count++;
+#ifdef WITH_TCP_KEEPALIVE
+		// peer silent with nothing in flight, it may have crashed
+		if( (st->status == TCP_ESTABLISHED) && (st->una_num == st->max_num) &&
+			(HAL_GetTick() - st->rx_time >= TCP_KEEPALIVE_IDLE +
+			(uint32_t)st->ka_probes * TCP_KEEPALIVE_INTERVAL) )
+		{
+			if(st->ka_probes >= TCP_KEEPALIVE_COUNT)
+			{
+				tcp_abort(id);
+				continue;
+			}
 
-				// load previous state
-				st->seq_num = st->seq_num_saved;
+			st->ka_probes++;
+			tcp_keepalive(id);
+		}
+#endif
 
-				// will send packets
-				tcp_send_mode = TCP_SENDING_SEND;
-				tcp_ack_sent = 0;
+		// send data waiting for buffer or ARP reply
+		tcp_output(id);
 
-				// rexmit
-				switch(st->status)
-				{
-				// rexmit SYN
-				case TCP_SYN_SENT:
-					tcp->flags = TCP_FLAG_SYN;
-					tcp_xmit(st, frame, 0);
-					break;
+		// delayed ACK
+		if( (st->ack_delayed) && (HAL_GetTick() - st->ack_time >= TCP_ACK_DELAY) )
+			tcp_send_segment(id, 0, 0);
 
-				// rexmit SYN/ACK
-				case TCP_SYN_RECEIVED:
-					tcp->flags = TCP_FLAG_SYN|TCP_FLAG_ACK;
-					tcp_xmit(st, frame, 0);
-					break;
+		// nothing in flight
+		if(st->una_num == st->max_num)
+		{
+			if(HAL_GetTick() - st->event_time <= st->rto)
+				continue;
 
-				// rexmit data+FIN/ACK or ACK (in FIN_WAIT state)
-				case TCP_FIN_WAIT:
-
-					// data+FIN/ACK acked?
-					if(st->is_closing)
-					{
-						tcp->flags = TCP_FLAG_ACK;
-						tcp_xmit(st, frame, 0);
-						break;
-					}
-
-					// rexmit data+FIN/ACK
-					st->status = TCP_ESTABLISHED;
-
-				// rexmit data
-				case TCP_ESTABLISHED:
-					LAN_Callback_TCPRead(id, frame, 1);
-					if(!tcp_ack_sent)
-					{
-						tcp->flags = TCP_FLAG_ACK;
-						tcp_xmit(st, frame, 0);
-					}
-					break;
+			// peer window closed, probe it with one byte
+			if( (st->tx_len) && (!st->window) )
+			{
+				st->window = 1;
+				tcp_output(id);
+				st->window = 0;
+			}
 
-				default:
-					break;
-				}
+			// our FIN acked, peer does not close
+			else if( (st->status == TCP_FIN_WAIT) && (st->fin_state == TCP_FIN_SENT) &&
+				(HAL_GetTick() - st->event_time > TCP_REXMIT_TIMEOUT * TCP_REXMIT_LIMIT) )
+			{
+				st->status = TCP_CLOSED;
+				st->cb->closed(id, 1);
 			}
+
+			continue;
 		}
-#else
-		// check if connection timed out
-		if( (st->status != TCP_CLOSED) &&
-			(gettc() - st->event_time > TCP_CONN_TIMEOUT) )
+
+		// rexmit timer expired?
+		if(HAL_GetTick() - st->event_time <= st->rto)
+			continue;
+
+		// rexmit limit reached?
+		if(st->rexmit_count >= TCP_REXMIT_LIMIT)
 		{
-			// kill connection
+			// close connection, app is told unless peer closed it before
+			if(st->status > TCP_FIN_WAIT)
+			{
+				st->status = TCP_CLOSED;
+				continue;
+			}
+
 			st->status = TCP_CLOSED;
-			LAN_Callback_TCPClosed(id, 1);
+			st->cb->closed(id, 1);
+			continue;
+		}
+
+		// reset timeout counter
+		st->event_time = HAL_GetTick();
+
+		// increment rexmit counter
+		st->rexmit_count++;
+
+		// back off, slow start from one segment
+		tcp_congestion(st);
+		st->cwnd = st->mss;
+		st->dup_acks = 0;
+		st->rto = (st->rto < TCP_REXMIT_TIMEOUT_MAX / 2) ?
+			st->rto * 2 : TCP_REXMIT_TIMEOUT_MAX;
+
+		// send again from oldest unacknowledged byte
+		st->seq_num = st->una_num;
+
+		// will send packets
+		tcp_send_mode = TCP_SENDING_SEND;
+		tcp_ack_sent = 0;
+
+		switch(st->status)
+		{
+		// rexmit SYN
+		case TCP_SYN_SENT:
+			tcp->flags = TCP_FLAG_SYN;
+			tcp_xmit(st, frame, 0);
+			break;
+
+		// rexmit SYN/ACK
+		case TCP_SYN_RECEIVED:
+			tcp->flags = TCP_FLAG_SYN|TCP_FLAG_ACK;
+			tcp_xmit(st, frame, 0);
+			break;
+
+		// rexmit data and FIN from send buffer
+		default:
+			if(st->fin_state == TCP_FIN_SENT)
+				st->fin_state = TCP_FIN_QUEUED;
+			st->tx_push = 1;
+			tcp_output(id);
+			break;
 		}
-#endif
 	}
 }
 
@@ -1040,9 +2202,6 @@ uint8_t LAN_UDPSend(eth_frame_t *frame, uint16_t len)
 	ip->from_addr = ip_addr;
 
 	udp->len = htons(len);
-	udp->cksum = 0;
-	udp->cksum = ip_cksum(len + IP_PROTOCOL_UDP,
-		(uint8_t*)udp-8, len+8);
 
 	return ip_send(frame, len);
 }
@@ -1065,10 +2224,6 @@ void LAN_UDPReply(eth_frame_t *frame, uint16_t len)
 
 	udp->len = htons(len);
 
-	udp->cksum = 0;
-	udp->cksum = ip_cksum(len + IP_PROTOCOL_UDP,
-		(uint8_t*)udp-8, len+8);
-
 	ip_reply(frame, len);
 }
 
@@ -1078,7 +2233,10 @@ static void udp_filter(eth_frame_t *frame, uint16_t len)
 	ip_packet_t *ip = (void*)(frame->data);
 	udp_packet_t *udp = (void*)(ip->data);
 
-	if(len >= sizeof(udp_packet_t))
+	// datagram must fit in IP packet
+	if( (len >= sizeof(udp_packet_t)) &&
+		(ntohs(udp->len) >= sizeof(udp_packet_t)) &&
+		(ntohs(udp->len) <= len) )
 	{
 		len = ntohs(udp->len) - sizeof(udp_packet_t);
 
@@ -1120,8 +2278,10 @@ static void icmp_filter(eth_frame_t *frame, uint16_t len)
 	{
 		if(icmp->type == ICMP_TYPE_ECHO_RQ)
 		{
+			// only type changes, code byte is same in both words
+			icmp->cksum = ip_cksum_update(icmp->cksum,
+				htons(ICMP_TYPE_ECHO_RQ << 8), htons(ICMP_TYPE_ECHO_RPLY << 8));
 			icmp->type = ICMP_TYPE_ECHO_RPLY;
-			icmp->cksum += 8; // update cksum
 			ip_reply(frame, len);
 		}
 	}
@@ -1134,18 +2294,61 @@ static void icmp_filter(eth_frame_t *frame, uint16_t len)
  * IP
  */
 
+// add 32-bit word to one's complement sum, carry goes back to bit 0
+#define IP_CKSUM_ADD(acc, word)		do { (acc) += (word); (acc) += ((acc) < (word)); } while(0)
+
 // calculate IP checksum
+//	(sum is added as big endian words, result is in network byte order)
 static uint16_t ip_cksum(uint32_t sum, uint8_t *buf, uint16_t len)
 {
-	while(len >= 2)
+	uint32_t acc = 0, w[4];
+	uint16_t half;
+	uint8_t last[2];
+
+	// one's complement sum does not depend on byte order (RFC 1071),
+	//	so words are added as loaded and swapped once at the end
+	while(len >= sizeof(w))
+	{
+		memcpy(w, buf, sizeof(w));
+		IP_CKSUM_ADD(acc, w[0]);
+		IP_CKSUM_ADD(acc, w[1]);
+		IP_CKSUM_ADD(acc, w[2]);
+		IP_CKSUM_ADD(acc, w[3]);
+		buf += sizeof(w);
+		len -= sizeof(w);
+	}
+
+	while(len >= sizeof(w[0]))
+	{
+		memcpy(w, buf, sizeof(w[0]));
+		IP_CKSUM_ADD(acc, w[0]);
+		buf += sizeof(w[0]);
+		len -= sizeof(w[0]);
+	}
+
+	acc = (acc & 0xffff) + (acc >> 16);
+
+	if(len >= 2)
 	{
-		sum += ((uint16_t)*buf << 8) | *(buf+1);
+		memcpy(&half, buf, 2);
+		acc += half;
 		buf += 2;
 		len -= 2;
 	}
 
 	if(len)
-		sum += (uint16_t)*buf << 8;
+	{
+		// odd byte is high byte of last big endian word
+		last[0] = *buf;
+		last[1] = 0;
+		memcpy(&half, last, 2);
+		acc += half;
+	}
+
+	while(acc >> 16)
+		acc = (acc & 0xffff) + (acc >> 16);
+
+	sum += ntohs((uint16_t)acc);
 
 	while(sum >> 16)
 		sum = (sum & 0xffff) + (sum >> 16);
@@ -1153,6 +2356,41 @@ static uint16_t ip_cksum(uint32_t sum, uint8_t *buf, uint16_t len)
 	return ~htons((uint16_t)sum);
 }
 
+// update checksum after 16-bit field changed from old to new (RFC 1624, eqn. 3)
+//	(values in network byte order, as stored in packet)
+static uint16_t ip_cksum_update(uint16_t cksum, uint16_t old, uint16_t new)
+{
+	uint32_t sum;
+
+	sum = (uint16_t)~cksum + (uint16_t)~old + new;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = ~sum & 0xffff;
+
+	// 0x0000 is wrong for all-zero data, 0xffff is valid for any data
+	//	with same sum (and is not "no checksum" of UDP)
+	return sum ? sum : 0xffff;
+}
+
+// offset of TCP/UDP checksum field in frame, checksum is inserted by eth_xmit
+//	(0 - none, ICMP checksum is set by stack)
+static uint16_t ip_cksum_field(eth_frame_t *frame)
+{
+	ip_packet_t *ip = (void*)(frame->data);
+
+	switch(ip->protocol)
+	{
+	case IP_PROTOCOL_TCP:
+		return offsetof(eth_frame_t, data) + offsetof(ip_packet_t, data) +
+			offsetof(tcp_packet_t, cksum);
+	case IP_PROTOCOL_UDP:
+		return offsetof(eth_frame_t, data) + offsetof(ip_packet_t, data) +
+			offsetof(udp_packet_t, cksum);
+	}
+
+	return 0;
+}
+
 // send IP packet
 // fields must be set:
 //	- ip.dst
@@ -1164,6 +2402,27 @@ static uint8_t ip_send(eth_frame_t *frame, uint16_t len)
 	uint32_t route_ip;
 	uint8_t *mac_addr_to;
 
+	// set frame.type
+	frame->type = ETH_TYPE_IP;
+
+	// fill IP header
+	len += sizeof(ip_packet_t);
+
+	ip->ver_head_len = 0x45;
+	ip->tos = 0;
+	ip->total_len = htons(len);
+	ip->fragment_id = 0;
+	ip->flags_framgent_offset = 0;
+	ip->ttl = IP_PACKET_TTL;
+	ip->cksum = 0;
+	ip->from_addr = ip_addr;
+	ip->cksum = ip_cksum(0, (void*)ip, sizeof(ip_packet_t));
+
+#ifdef WITH_ARP_QUEUE
+	if(frame == arp_queue_frame)
+		arp_queue_frame = 0;
+#endif
+
 	// set frame.dst
 	if(ip->to_addr == ip_broadcast)
 	{
@@ -1180,28 +2439,22 @@ static uint8_t ip_send(eth_frame_t *frame, uint16_t len)
 
 		// resolve mac address
 		if(!(mac_addr_to = arp_resolve(route_ip)))
+		{
+#ifdef WITH_ARP_QUEUE
+			// frame is sent when ARP reply arrives
+			memcpy(frame->from_addr, mac_addr, 6);
+			arp_queue_frame = frame;
+			arp_queue_route = route_ip;
+			return arp_queue_add(route_ip, frame, len + sizeof(eth_frame_t));
+#else
 			return 0;
+#endif
+		}
 		memcpy(frame->to_addr, mac_addr_to, 6);
 	}
 
-	// set frame.type
-	frame->type = ETH_TYPE_IP;
-
-	// fill IP header
-	len += sizeof(ip_packet_t);
-
-	ip->ver_head_len = 0x45;
-	ip->tos = 0;
-	ip->total_len = htons(len);
-	ip->fragment_id = 0;
-	ip->flags_framgent_offset = 0;
-	ip->ttl = IP_PACKET_TTL;
-	ip->cksum = 0;
-	ip->from_addr = ip_addr;
-	ip->cksum = ip_cksum(0, (void*)ip, sizeof(ip_packet_t));
-
 	// send frame
-	eth_send(frame, len);
+	eth_send(frame, len, ip_cksum_field(frame));
 	return 1;
 }
 
@@ -1222,7 +2475,12 @@ static void ip_reply(eth_frame_t *frame, uint16_t len)
 	packet->from_addr = ip_addr;
 	packet->cksum = ip_cksum(0, (void*)packet, sizeof(ip_packet_t));
 
-	eth_reply((void*)frame, len);
+#ifdef WITH_ARP_QUEUE
+	if(frame == arp_queue_frame)
+		arp_queue_frame = 0;
+#endif
+
+	eth_reply((void*)frame, len, ip_cksum_field(frame));
 }
 
 // can be called directly after
@@ -1231,27 +2489,36 @@ static void ip_resend(eth_frame_t *frame, uint16_t len)
 {
 	ip_packet_t *ip = (void*)(frame->data);
 
+	// header is complete, only length changes
 	len += sizeof(ip_packet_t);
+	ip->cksum = ip_cksum_update(ip->cksum, ip->total_len, htons(len));
 	ip->total_len = htons(len);
-	ip->cksum = 0;
-	ip->cksum = ip_cksum(0, (void*)ip, sizeof(ip_packet_t));
 
-	eth_resend(frame, len);
+#ifdef WITH_ARP_QUEUE
+	// previous frame waits for ARP reply, this one waits too
+	if(frame == arp_queue_frame)
+	{
+		arp_queue_add(arp_queue_route, frame, len + sizeof(eth_frame_t));
+		return;
+	}
+#endif
+
+	eth_resend(frame, len, ip_cksum_field(frame));
 }
 
 // process IP packet
 static void ip_filter(eth_frame_t *frame, uint16_t len)
 {
-	uint16_t hcs;
 	ip_packet_t *packet = (void*)(frame->data);
 
-	//if(len >= sizeof(ip_packet_t))
-	//{
-		hcs = packet->cksum;
-		packet->cksum = 0;
-
+	// packet must fit in received frame, padding after it is ignored
+	if( (len >= sizeof(ip_packet_t)) &&
+		(ntohs(packet->total_len) >= sizeof(ip_packet_t)) &&
+		(ntohs(packet->total_len) <= len) )
+	{
+		// sum of header with valid checksum is 0xffff
 		if( (packet->ver_head_len == 0x45) &&
-			(ip_cksum(0, (void*)packet, sizeof(ip_packet_t)) == hcs) &&
+			(ip_cksum(0, (void*)packet, sizeof(ip_packet_t)) == 0) &&
 			((packet->to_addr == ip_addr) || (packet->to_addr == ip_broadcast)) )
 		{
 			len = ntohs(packet->total_len) -
@@ -1279,7 +2546,68 @@ static void ip_filter(eth_frame_t *frame, uint16_t len)
 			}
 
 		}
-	//}
+	}
+}
+
+
+/*
+ * Buffer pool
+ */
+
+// get pool buffer of frame, 0 if frame is not from pool
+static lan_buf_t *lan_buf_get(eth_frame_t *frame)
+{
+	uint8_t *data = (void*)frame;
+
+	if( (data < lan_buf_pool[0].data) ||
+		(data > lan_buf_pool[LAN_BUF_COUNT - 1].data) )
+		return 0;
+
+	return (void*)(data - offsetof(lan_buf_t, data));
+}
+
+eth_frame_t *LAN_BufAlloc(void)
+{
+	uint8_t i;
+
+	for(i = 0; i < LAN_BUF_COUNT; ++i)
+	{
+		if(!lan_buf_pool[i].ref)
+		{
+			lan_buf_pool[i].ref = 1;
+			lan_buf_pool[i].next = LAN_BUF_NONE;
+			return (void*)lan_buf_pool[i].data;
+		}
+	}
+	return 0;
+}
+
+void LAN_BufHold(eth_frame_t *frame)
+{
+	lan_buf_t *buf = lan_buf_get(frame);
+
+	if(buf)
+		buf->ref++;
+}
+
+void LAN_BufFree(eth_frame_t *frame)
+{
+	lan_buf_t *buf = lan_buf_get(frame);
+
+	if( (buf) && (buf->ref) )
+		buf->ref--;
+}
+
+uint8_t LAN_BufAvailable(void)
+{
+	uint8_t i, count = 0;
+
+	for(i = 0; i < LAN_BUF_COUNT; ++i)
+	{
+		if(!lan_buf_pool[i].ref)
+			count++;
+	}
+	return count;
 }
 
 
@@ -1287,33 +2615,96 @@ static void ip_filter(eth_frame_t *frame, uint16_t len)
  * ARP
  */
 
-// search ARP cache
-uint8_t *arp_search_cache(uint32_t node_ip_addr)
+// hash of IP address
+//	(hosts in same subnet differ in highest byte of ip_addr)
+static uint8_t arp_hash(uint32_t node_ip_addr)
+{
+	node_ip_addr ^= node_ip_addr >> 16;
+	node_ip_addr ^= node_ip_addr >> 8;
+	return node_ip_addr & (ARP_CACHE_HASH_SIZE - 1);
+}
+
+// find ARP cache entry of node in any state
+static arp_cache_entry_t *arp_find(uint32_t node_ip_addr)
 {
 	uint8_t i;
-	for(i = 0; i < ARP_CACHE_SIZE; ++i)
+
+	for(i = arp_hash_head[arp_hash(node_ip_addr)]; i != ARP_CACHE_NONE; i = arp_cache[i].next)
 	{
 		if(arp_cache[i].ip_addr == node_ip_addr)
-			return arp_cache[i].mac_addr;
+			return &arp_cache[i];
 	}
 	return 0;
 }
 
-// resolve MAC address
-// returns 0 if still resolving
-// (invalidates net_buffer if not resolved)
-uint8_t *arp_resolve(uint32_t node_ip_addr)
+// remove entry from hash chain and free it
+static void arp_free(arp_cache_entry_t *entry)
 {
-	eth_frame_t *frame = (void*)net_buf;
-	arp_message_t *msg = (void*)(frame->data);
-	uint8_t *mac;
+	uint8_t *link = &arp_hash_head[arp_hash(entry->ip_addr)];
 
-	// search arp cache
-	if((mac = arp_search_cache(node_ip_addr)))
-		return mac;
+	while(*link != ARP_CACHE_NONE)
+	{
+		if(&arp_cache[*link] == entry)
+		{
+			*link = entry->next;
+			break;
+		}
+		link = &arp_cache[*link].next;
+	}
+
+#ifdef WITH_ARP_QUEUE
+	// address not resolved, waiting frames are dropped
+	if(entry->state == ARP_STATE_PENDING)
+		arp_queue_flush(entry->ip_addr, 0);
+#endif
+
+	entry->state = ARP_STATE_FREE;
+}
+
+// get entry for new node
+//	(free entry or least recently used one)
+static arp_cache_entry_t *arp_alloc(uint32_t node_ip_addr)
+{
+	arp_cache_entry_t *entry = 0;
+	uint8_t i, hash;
+
+	for(i = 0; i < ARP_CACHE_SIZE; ++i)
+	{
+		if(arp_cache[i].state == ARP_STATE_FREE)
+		{
+			entry = &arp_cache[i];
+			break;
+		}
+
+		if( (!entry) || ((int32_t)(arp_cache[i].used - entry->used) < 0) )
+			entry = &arp_cache[i];
+	}
+
+	if(entry->state != ARP_STATE_FREE)
+		arp_free(entry);
+
+	hash = arp_hash(node_ip_addr);
+	entry->ip_addr = node_ip_addr;
+	entry->tries = 0;
+	entry->used = HAL_GetTick();
+	entry->next = arp_hash_head[hash];
+	arp_hash_head[hash] = entry - arp_cache;
+
+	return entry;
+}
+
+// send ARP request
+//	(to_mac 0 - broadcast, otherwise unicast to verify entry)
+static void arp_request(uint32_t node_ip_addr, uint8_t *to_mac)
+{
+	eth_frame_t *frame = (void*)arp_buf;
+	arp_message_t *msg = (void*)(frame->data);
 
-	// send request
-	memset(frame->to_addr, 0xff, 6);
+	if(to_mac)
+		memcpy(frame->to_addr, to_mac, 6);
+	else
+		memset(frame->to_addr, 0xff, 6);
+	memcpy(frame->from_addr, mac_addr, 6);
 	frame->type = ETH_TYPE_ARP;
 
 	msg->hw_type = ARP_HW_TYPE_ETH;
@@ -1326,10 +2717,190 @@ uint8_t *arp_resolve(uint32_t node_ip_addr)
 	memset(msg->mac_addr_to, 0x00, 6);
 	msg->ip_addr_to = node_ip_addr;
 
-	eth_send(frame, sizeof(arp_message_t));
+	// sent directly, frame being built is kept
+	enc28j60_send_packet(arp_buf, sizeof(arp_buf));
+}
+
+#ifdef WITH_ARP_QUEUE
+// remove frame from ARP queue
+//	(link points to queue head or next of previous frame)
+static void arp_queue_remove(uint8_t *link)
+{
+	lan_buf_t *buf = &lan_buf_pool[*link];
+
+	*link = buf->next;
+	arp_queue_count--;
+	LAN_BufFree((void*)buf->data);
+}
+
+// store copy of frame until MAC address of next hop is known
+//	(oldest frames are dropped when queue or pool is full)
+static uint8_t arp_queue_add(uint32_t node_ip_addr, eth_frame_t *frame, uint16_t len)
+{
+	eth_frame_t *copy;
+	lan_buf_t *buf;
+	uint8_t *link;
+
+	if(arp_queue_count >= ARP_QUEUE_LEN)
+		arp_queue_remove(&arp_queue_head);
+
+	if( (!(copy = LAN_BufAlloc())) && (arp_queue_count) )
+	{
+		arp_queue_remove(&arp_queue_head);
+		copy = LAN_BufAlloc();
+	}
+
+	if(!copy)
+		return 0;
+
+	buf = lan_buf_get(copy);
+	buf->addr = node_ip_addr;
+	buf->len = len;
+	memcpy(copy, frame, len);
+
+	for(link = &arp_queue_head; *link != LAN_BUF_NONE; link = &lan_buf_pool[*link].next)
+		;
+	*link = buf - lan_buf_pool;
+	arp_queue_count++;
+
+	return 1;
+}
+
+// send frames waiting for node
+//	(node_mac 0 - address not resolved, frames are dropped)
+static void arp_queue_flush(uint32_t node_ip_addr, uint8_t *node_mac)
+{
+	uint8_t *link = &arp_queue_head;
+	lan_buf_t *buf;
+
+	while(*link != LAN_BUF_NONE)
+	{
+		buf = &lan_buf_pool[*link];
+
+		if(buf->addr != node_ip_addr)
+		{
+			link = &buf->next;
+			continue;
+		}
+
+		if(node_mac)
+		{
+			memcpy(((eth_frame_t*)buf->data)->to_addr, node_mac, 6);
+			eth_xmit((void*)buf->data, buf->len,
+				ip_cksum_field((void*)buf->data));
+		}
+
+		arp_queue_remove(link);
+	}
+}
+#endif
+
+// search ARP cache
+uint8_t *arp_search_cache(uint32_t node_ip_addr)
+{
+	arp_cache_entry_t *entry = arp_find(node_ip_addr);
+
+	if( (entry) && (entry->state >= ARP_STATE_RESOLVED) )
+	{
+		entry->used = HAL_GetTick();
+		return entry->mac_addr;
+	}
+	return 0;
+}
+
+// resolve MAC address
+// returns 0 if still resolving
+//	(request is sent only for new entry, arp_poll repeats it;
+//	frame being built is not changed)
+uint8_t *arp_resolve(uint32_t node_ip_addr)
+{
+	arp_cache_entry_t *entry;
+	uint8_t *mac;
+
+	// search arp cache
+	if((mac = arp_search_cache(node_ip_addr)))
+		return mac;
+
+	if(!arp_find(node_ip_addr))
+	{
+		entry = arp_alloc(node_ip_addr);
+		entry->state = ARP_STATE_PENDING;
+		entry->tries = 1;
+		entry->time = HAL_GetTick();
+		arp_request(node_ip_addr, 0);
+	}
 	return 0;
 }
 
+// store MAC address of node
+//	(new entry is created only when create is set)
+static void arp_update(uint32_t node_ip_addr, uint8_t *node_mac, uint8_t create)
+{
+	arp_cache_entry_t *entry = arp_find(node_ip_addr);
+
+	if(!entry)
+	{
+		if(!create)
+			return;
+		entry = arp_alloc(node_ip_addr);
+	}
+
+	memcpy(entry->mac_addr, node_mac, 6);
+	entry->state = ARP_STATE_RESOLVED;
+	entry->tries = 0;
+	entry->time = HAL_GetTick();
+
+#ifdef WITH_ARP_QUEUE
+	arp_queue_flush(node_ip_addr, entry->mac_addr);
+#endif
+}
+
+// age ARP cache entries
+//	(repeats requests of pending entries, verifies expired entries
+//	which are still used and frees the rest)
+static void arp_poll(void)
+{
+	arp_cache_entry_t *entry;
+	uint32_t now = HAL_GetTick();
+	uint8_t i;
+
+	for(i = 0; i < ARP_CACHE_SIZE; ++i)
+	{
+		entry = &arp_cache[i];
+
+		switch(entry->state)
+		{
+		case ARP_STATE_RESOLVED:
+			if(now - entry->time < ARP_CACHE_TIMEOUT)
+				break;
+			if(now - entry->used >= ARP_CACHE_TIMEOUT)
+			{
+				arp_free(entry);
+				break;
+			}
+			entry->state = ARP_STATE_REFRESH;
+			entry->tries = 1;
+			entry->time = now;
+			arp_request(entry->ip_addr, entry->mac_addr);
+			break;
+		case ARP_STATE_PENDING:
+		case ARP_STATE_REFRESH:
+			if(now - entry->time < ARP_REQUEST_INTERVAL)
+				break;
+			if(entry->tries >= ARP_REQUEST_LIMIT)
+			{
+				arp_free(entry);
+				break;
+			}
+			entry->tries++;
+			entry->time = now;
+			arp_request(entry->ip_addr,
+				(entry->state == ARP_STATE_REFRESH) ? entry->mac_addr : 0);
+			break;
+		}
+	}
+}
+
 // process arp packet
 void arp_filter(eth_frame_t *frame, uint16_t len)
 {
@@ -1344,22 +2915,18 @@ void arp_filter(eth_frame_t *frame, uint16_t len)
 			switch(msg->type)
 			{
 			case ARP_TYPE_REQUEST:
+				// sender is known already, refresh it
+				arp_update(msg->ip_addr_from, msg->mac_addr_from, 0);
+
 				msg->type = ARP_TYPE_RESPONSE;
 				memcpy(msg->mac_addr_to, msg->mac_addr_from, 6);
 				memcpy(msg->mac_addr_from, mac_addr, 6);
 				msg->ip_addr_to = msg->ip_addr_from;
 				msg->ip_addr_from = ip_addr;
-				eth_reply(frame, sizeof(arp_message_t));
+				eth_reply(frame, sizeof(arp_message_t), 0);
 				break;
 			case ARP_TYPE_RESPONSE:
-				if(!arp_search_cache(msg->ip_addr_from))
-				{
-					arp_cache[arp_cache_wr].ip_addr = msg->ip_addr_from;
-					memcpy(arp_cache[arp_cache_wr].mac_addr, msg->mac_addr_from, 6);
-					arp_cache_wr++;
-					if(arp_cache_wr == ARP_CACHE_SIZE)
-						arp_cache_wr = 0;
-				}
+				arp_update(msg->ip_addr_from, msg->mac_addr_from, 1);
 				break;
 			}
 		}
@@ -1370,12 +2937,32 @@ void arp_filter(eth_frame_t *frame, uint16_t len)
  * Ethernet
  */
 
+// pass frame to ENC28J60, TCP/UDP checksum is computed on the way
+//	(cksum_field - offset of checksum field in IP frame, 0 - none;
+//	pseudo header is taken from IP header)
+// len is whole frame length
+static void eth_xmit(eth_frame_t *frame, uint16_t len, uint16_t cksum_field)
+{
+	ip_packet_t *ip = (void*)(frame->data);
+
+	if( (cksum_field) && (frame->type == ETH_TYPE_IP) )
+	{
+		memset((uint8_t*)frame + cksum_field, 0, 2);
+		enc28j60_send_packet_cksum((void*)frame, len,
+			(uint8_t*)&ip->from_addr - (uint8_t*)frame, cksum_field,
+			ntohs(ip->total_len) - sizeof(ip_packet_t) + ip->protocol);
+	}
+	else
+	{
+		enc28j60_send_packet((void*)frame, len);
+	}
+}
+
 // send new Ethernet frame to same host
 //	(can be called directly after eth_send)
-static void eth_resend(eth_frame_t *frame, uint16_t len)
+static void eth_resend(eth_frame_t *frame, uint16_t len, uint16_t cksum_field)
 {
-	enc28j60_send_packet((void*)frame, len +
-		sizeof(eth_frame_t));
+	eth_xmit(frame, len + sizeof(eth_frame_t), cksum_field);
 }
 
 
@@ -1383,20 +2970,47 @@ static void eth_resend(eth_frame_t *frame, uint16_t len)
 // fields must be set:
 //	- frame.dst
 //	- frame.type
-static void eth_send(eth_frame_t *frame, uint16_t len)
+static void eth_send(eth_frame_t *frame, uint16_t len, uint16_t cksum_field)
 {
 	memcpy(frame->from_addr, mac_addr, 6);
-	enc28j60_send_packet((void*)frame, len +
-		sizeof(eth_frame_t));
+	eth_xmit(frame, len + sizeof(eth_frame_t), cksum_field);
 }
 
 // send Ethernet frame back
-static void eth_reply(eth_frame_t *frame, uint16_t len)
+static void eth_reply(eth_frame_t *frame, uint16_t len, uint16_t cksum_field)
 {
 	memcpy(frame->to_addr, frame->from_addr, 6);
 	memcpy(frame->from_addr, mac_addr, 6);
-	enc28j60_send_packet((void*)frame, len +
-		sizeof(eth_frame_t));
+	eth_xmit(frame, len + sizeof(eth_frame_t), cksum_field);
+}
+
+// check frame headers before rest of frame is read
+// len is number of bytes already read
+static uint8_t eth_accept(eth_frame_t *frame, uint16_t len)
+{
+	arp_message_t *msg = (void*)(frame->data);
+	ip_packet_t *ip = (void*)(frame->data);
+
+	if(len < sizeof(eth_frame_t))
+		return 0;
+
+	switch(frame->type)
+	{
+	case ETH_TYPE_ARP:
+		// only requests/responses for me
+		return (len >= sizeof(eth_frame_t) + sizeof(arp_message_t)) &&
+			(msg->ip_addr_to == ip_addr);
+	case ETH_TYPE_IP:
+		if( (len < sizeof(eth_frame_t) + sizeof(ip_packet_t)) ||
+			(ip->ver_head_len != 0x45) )
+			return 0;
+		if(ip->to_addr == ip_addr)
+			return 1;
+		// broadcasts are used only by UDP services
+		return (ip->to_addr == ip_broadcast) &&
+			(ip->protocol == IP_PROTOCOL_UDP);
+	}
+	return 0;
 }
 
 // process Ethernet frame
@@ -1421,15 +3035,41 @@ static void eth_filter(eth_frame_t *frame, uint16_t len)
  * LAN
  */
 
+// set receive filter of ENC28J60
+//	(broadcasts are needed while there is no address)
+static void lan_rx_filter(void)
+{
+#ifdef WITH_ARP_FILTER
+	if(!ip_addr)
+	{
+		enc28j60_set_filter(ENC28J60_FILTER_DEFAULT);
+		return;
+	}
+
+	enc28j60_filter_arp((uint8_t*)&ip_addr);
+	enc28j60_set_filter(ERXFCON_UCEN | ERXFCON_CRCEN | ERXFCON_PMEN);
+#endif
+}
+
 void LAN_init(void)
 {
 	enc28j60_init(mac_addr);
 
+	memset(arp_hash_head, ARP_CACHE_NONE, sizeof(arp_hash_head));
+#ifdef WITH_TCP
+	memset(tcp_hash_head, TCP_ID_NONE, sizeof(tcp_hash_head));
+#endif
+#ifdef WITH_ARP_QUEUE
+	arp_queue_head = LAN_BUF_NONE;
+#endif
+
 	//_D(("ETH MAC: %02x:%02x:%02x:%02x:%02x:%02x\n", mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5]));
 
 #ifdef WITH_DHCP
 	dhcp_retry_time = HAL_GetTick() + 2 * 1000;
 #else
+	lan_rx_filter();
+
 	//_D(("ETH (STATIC): IP %d.%d.%d.%d NETMASK %d.%d.%d.%d GATEWAY %d.%d.%d.%d\n",
 	//		((ip_addr)&0xff), ((ip_addr >> 8)&0xff), ((ip_addr >> 16)&0xff), ((ip_addr >> 24)&0xff),
 	//		((ip_mask)&0xff), ((ip_mask >> 8)&0xff), ((ip_mask >> 16)&0xff), ((ip_mask >> 24)&0xff),
@@ -1443,23 +3083,59 @@ void LAN_init(void)
 
 void LAN_poll(void)
 {
-	uint16_t len;
-	eth_frame_t *frame = (void*)net_buf;
+	uint16_t len, hlen;
+	eth_frame_t *frame = LAN_BufAlloc();
+
+	// frames stay in Rx ring while all buffers are used
+	while( (frame) && (len = enc28j60_rx_begin()) )
+	{
+		if(len > LAN_BUF_SIZE)
+			len = LAN_BUF_SIZE;
+
+		// read headers first, foreign frames are dropped
+		//	without reading payload
+		hlen = enc28j60_rx_read((void*)frame, LAN_RX_HEADER_SIZE);
+		if(!eth_accept(frame, hlen))
+		{
+			enc28j60_rx_end();
+			continue;
+		}
+
+		enc28j60_rx_read((uint8_t*)frame + hlen, len - hlen);
+		enc28j60_rx_end();
 
-	while((len = enc28j60_recv_packet(net_buf, sizeof(net_buf))))
 		eth_filter(frame, len);
 
+		// frame is kept by application, next one needs new buffer
+		if(lan_buf_get(frame)->ref > 1)
+		{
+			LAN_BufFree(frame);
+			frame = LAN_BufAlloc();
+		}
+	}
+
+	enc28j60_poll();
+
+	arp_poll();
+
+	// periodic tasks build frames in one buffer
+	//	(and wait while all buffers are used)
+	if( (!frame) && (!(frame = LAN_BufAlloc())) )
+		return;
+
 #ifdef WITH_DHCP
-	dhcp_poll();
+	dhcp_poll(frame);
 #endif
 
 #ifdef WITH_TCP
-	tcp_poll();
+	tcp_poll(frame);
 #endif
 
 #ifdef WITH_NTP
-	ntp_poll();
+	ntp_poll(frame);
 #endif
+
+	LAN_BufFree(frame);
 }
 
 uint8_t lan_up(void)
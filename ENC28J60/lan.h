@@ -68,10 +68,21 @@ typedef struct arp_message {
 } arp_message_t;
 #pragma pack(pop)
 
-#pragma pack(push, 1)
+#define ARP_STATE_FREE		0	// entry not used
+#define ARP_STATE_PENDING	1	// request sent, no reply yet
+#define ARP_STATE_RESOLVED	2	// MAC address known
+#define ARP_STATE_REFRESH	3	// MAC address known, entry expired and is verified again
+
+#define ARP_CACHE_NONE		0xff
+
 typedef struct arp_cache_entry {
 	uint32_t ip_addr;
 	uint8_t mac_addr[6];
+	uint8_t state;			// ARP_STATE_*
+	uint8_t tries;			// requests sent in PENDING/REFRESH state
+	uint8_t next;			// next entry in hash chain, ARP_CACHE_NONE at end
+	uint32_t time;			// time of last reply, or last request in PENDING/REFRESH state
+	uint32_t used;			// time of last lookup (for LRU replacement)
 } arp_cache_entry_t;
 
 /*
@@ -198,23 +209,76 @@ typedef enum tcp_status_code {
 	TCP_SYN_SENT,
 	TCP_SYN_RECEIVED,
 	TCP_ESTABLISHED,
-	TCP_FIN_WAIT
+	TCP_FIN_WAIT,		// FIN queued or sent by app, waiting for FIN from peer
+	// app got closed callback already in states below
+	TCP_CLOSE_WAIT,		// FIN received, sending rest of data before own FIN
+	TCP_LAST_ACK,		// FIN received and sent, waiting for ACK
+	TCP_CLOSING,		// both FINs received, own not acknowledged yet
+	TCP_TIME_WAIT		// closed, slot answers FIN sent again by peer until TCP_TIME_WAIT_TIMEOUT
 } tcp_status_code_t;
 
+#define TCP_ID_NONE			0xff
+#define TCP_LISTENER_NONE	0xff
+
+/**
+ * \brief  Application callbacks of connection, see \ref LAN_TCPListen and \ref LAN_TCPConnect
+ * \note   For \ref LAN_TCPListen field set to 0 selects global LAN_Callback_TCP* function
+ */
+typedef struct tcp_callbacks {
+	uint8_t (*listen)(uint8_t id, eth_frame_t *frame);
+	void (*read)(uint8_t id, eth_frame_t *frame, uint8_t re);
+	void (*write)(uint8_t id, eth_frame_t *frame, uint16_t len);
+	void (*closed)(uint8_t id, uint8_t hard);
+} tcp_callbacks_t;
+
 #pragma pack(push, 1)
 typedef struct tcp_state {
 	tcp_status_code_t status;
+	uint8_t next;			// next connection in hash chain, TCP_ID_NONE at end
+	uint8_t listener;		// listening port entry, TCP_LISTENER_NONE for LAN_TCPConnect
+	const tcp_callbacks_t *cb;	// app callbacks, all fields set
 	uint32_t event_time;
-	uint32_t seq_num;
-	uint32_t ack_num;
+	uint32_t seq_num;		// next sequence number to send
+	uint32_t ack_num;		// next sequence number expected from peer
+	uint32_t una_num;		// oldest unacknowledged sequence number
+	uint32_t max_num;		// highest sequence number sent
+	uint32_t small_num;		// end of last segment shorter than MSS
 	uint32_t remote_addr;
 	uint16_t remote_port;
 	uint16_t local_port;
-#ifdef WITH_TCP_REXMIT
-	uint8_t is_closing;
+	uint16_t window;		// window advertised by peer
+	uint16_t tx_len;		// bytes in send buffer, sent or not
+
+#define TCP_FIN_NONE		0
+#define TCP_FIN_QUEUED		1	// FIN is sent after data in send buffer
+#define TCP_FIN_SENT		2
+	uint8_t fin_state;
+	uint8_t tx_push;		// send small segment without waiting for ACK
 	uint8_t rexmit_count;
-	uint32_t seq_num_saved;
-#endif
+
+	uint16_t mss;			// segment size accepted by peer
+	uint16_t cwnd;			// congestion window
+	uint16_t ssthresh;		// slow start threshold
+	uint8_t dup_acks;		// duplicate ACKs in row
+
+	uint16_t rto;			// rexmit timeout, ms
+	uint32_t srtt;			// smoothed round trip time, ms * 8
+	uint32_t rttvar;		// round trip time variation, ms * 4
+	uint8_t rtt_timing;		// segment ending at rtt_num is timed
+	uint32_t rtt_num;
+	uint32_t rtt_time;
+
+	uint8_t ack_delayed;	// segments received, but not acknowledged yet
+	uint32_t ack_time;		// first of them received at
+
+	uint8_t rx_keep;		// in-order data stay in receive buffer for LAN_TCPRecv
+	uint8_t rx_fin;			// FIN received, it is counted in ack_num
+	uint32_t rd_num;		// first sequence number in receive buffer
+	uint32_t adv_num;		// right edge of window advertised to peer
+
+	uint32_t rx_time;		// last segment received from peer
+	uint32_t data_time;		// last data sent by app or received from peer
+	uint8_t ka_probes;		// keep-alive probes not answered
 } tcp_state_t;
 #pragma pack(pop)
 
@@ -229,31 +293,41 @@ typedef enum tcp_sending_mode {
 #define TCP_OPTION_PUSH			0x01
 #define TCP_OPTION_CLOSE		0x02
 
+typedef struct tcp_listener {
+	uint16_t port;			// local port, 0 - entry is free
+	uint8_t backlog;		// connections in handshake at most, 0 - no limit
+	tcp_callbacks_t cb;
+} tcp_listener_t;
+
 // TCP callbacks
 /**
  * \brief  LAN callback with new connection request
- * \note
+ * \note   SYN/ACK is sent when app accepts connection, RST otherwise
  * \param  id: connection identifier
  * \param  *frame: pointer to ETH frame
+ * \retval 1 to accept connection, 0 to refuse it
  * \note   With weak parameter to prevent link errors if not defined by user
  */
 uint8_t LAN_Callback_TCPListen(uint8_t id, eth_frame_t *frame);
 
 /**
  * \brief  LAN callback put some data from application to socket
- * \note   this mehod will be called if is possible to put some data to socket
+ * \note   this mehod will be called if is possible to put some data to socket,
+ *         at least one segment or half of send buffer is free
  * \param  id: connection identifier
- * \param  *frame: pointer to ETH frame
- * \param  *re: ???
+ * \param  *frame: pointer to ETH frame, data can be built after TCP header and sent with \ref LAN_TCPSend
+ * \param  re: always 0, data are retransmitted from send buffer by stack
  * \note   With weak parameter to prevent link errors if not defined by user
  */
 void LAN_Callback_TCPRead(uint8_t id, eth_frame_t *frame, uint8_t re);
 
 /**
  * \brief  LAN feed data to application
- * \note   callback with data from remote host to local
+ * \note   callback with data from remote host to local, always in stream order.
+ *         Data received out of order are kept in receive buffer and passed
+ *         in next calls when gap before them is filled
  * \param  id: connection identifier
- * \param  *frame: pointer to ETH frame
+ * \param  *frame: pointer to ETH frame, data are after TCP header (\ref tcp_get_data)
  * \param  len: data length
  * \note   With weak parameter to prevent link errors if not defined by user
  */
@@ -264,12 +338,32 @@ void LAN_Callback_TCPWrite(uint8_t id, eth_frame_t *frame, uint16_t len);
  * \note   callback when some connection are closed
  * \param  id: connection identifier
  * \param  hard: reason of close:
- *            0 -> remote host closed connection
- *            1 -> exception occurred
+ *            0 -> remote host closed connection, data in send buffer are still sent
+ *            1 -> exception occurred: reset by peer, no answer to retransmissions
+ *                 or keep-alive probes, connection idle for TCP_IDLE_TIMEOUT
  * \note   With weak parameter to prevent link errors if not defined by user
  */
 void LAN_Callback_TCPClosed(uint8_t id, uint8_t hard);
 
+/**
+ * \brief  accept connections to local port
+ * \note   SYN to port which is not listened is refused with RST. Until this function is called
+ *         first time, connections to any port are passed to \ref LAN_Callback_TCPListen.
+ *         SYN over backlog limit is dropped, peer tries again later
+ * \param  port: local port, network byte order
+ * \param  backlog: connections of port in handshake at most, 0 - no limit
+ * \param  *callbacks: callbacks for connections of port, 0 - global LAN_Callback_TCP* functions
+ * \retval 0 on success, 1 when port is listened already or all TCP_MAX_LISTENERS entries are used
+ */
+uint8_t LAN_TCPListen(uint16_t port, uint8_t backlog, const tcp_callbacks_t *callbacks);
+
+/**
+ * \brief  stop accepting connections to local port
+ * \note   Connections accepted before stay open and keep callbacks of port
+ * \param  port: local port, network byte order
+ */
+void LAN_TCPUnlisten(uint16_t port);
+
 /**
  * \brief  open the connection
  * \note
@@ -279,22 +373,138 @@ void LAN_Callback_TCPClosed(uint8_t id, uint8_t hard);
  */
 uint8_t LAN_TCPOpen(uint32_t addr, uint16_t port, uint16_t local_port);
 
+/**
+ * \brief  open the connection with own callbacks
+ * \param  addr: remote host address
+ * \param  port: remote host port, network byte order
+ * \param  local_port: local host port, network byte order
+ * \param  *callbacks: callbacks for connection with all fields set, 0 - global LAN_Callback_TCP* functions
+ * \retval Connection identifier, 0xff when no connection slot or frame buffer is free
+ */
+uint8_t LAN_TCPConnect(uint32_t addr, uint16_t port, uint16_t local_port, const tcp_callbacks_t *callbacks);
+
+/**
+ * \brief  get connection status
+ * \param  id: connection identifier
+ * \retval refer to tcp_status_code_t enum
+ */
+tcp_status_code_t LAN_TCPGetStatus(uint8_t id);
+
+/**
+ * \brief  keep received data in receive buffer instead of passing them to write callback
+ * \note   Call it from listen callback or right after \ref LAN_TCPConnect. Window advertised
+ *         to peer is free space of receive buffer, data are read with \ref LAN_TCPRecv.
+ *         Connection slot is not reused until \ref LAN_TCPClose is called, so data
+ *         received before peer closed connection can be read
+ * \param  id: connection identifier
+ */
+void LAN_TCPRecvBuffered(uint8_t id);
+
+/**
+ * \brief  read data from receive buffer
+ * \note   Only for connections set by \ref LAN_TCPRecvBuffered.
+ *         Peer gets window update when at least one segment or half of buffer is free again
+ * \param  id: connection identifier
+ * \param  *data: pointer to buffer for data
+ * \param  len: buffer size
+ * \retval Number of bytes read
+ */
+uint16_t LAN_TCPRecv(uint8_t id, void *data, uint16_t len);
+
+/**
+ * \brief  get number of bytes which can be read with \ref LAN_TCPRecv
+ * \param  id: connection identifier
+ * \retval Number of bytes in receive buffer
+ */
+uint16_t LAN_TCPRecvAvailable(uint8_t id);
+
+/**
+ * \brief  get free space in send buffer
+ * \param  id: connection identifier
+ * \retval Number of bytes \ref LAN_TCPWrite accepts, 0 when connection is not established
+ *         or is being closed
+ */
+uint16_t LAN_TCPWriteSpace(uint8_t id);
+
 /**
  * \brief  send TCP data to remote host
- * \note Don't use somewhere except tcp_write callback!
- * \param  id:
- * \param  *frame: pointer to ETH frame
- * \param  len: sizeof frame
- * \param  options:
+ * \note   Data are copied to send buffer, part which does not fit is dropped.
+ *         Can be used anywhere, not only in \ref LAN_Callback_TCPRead
+ * \param  id: connection identifier
+ * \param  *frame: pointer to ETH frame with data after TCP header (tcp->data)
+ * \param  len: data length
+ * \param  options: TCP_OPTION_PUSH sends last small segment without waiting for ACK,
+ *                  TCP_OPTION_CLOSE closes connection after data
  */
 void LAN_TCPSend(uint8_t id, eth_frame_t *frame, uint16_t len, uint8_t options);
 
+/**
+ * \brief  write data to connection stream
+ * \note   Data are copied to send buffer and kept there until peer acknowledges them,
+ *         lost segments are retransmitted from buffer
+ * \param  id: connection identifier
+ * \param  *data: pointer to data
+ * \param  len: data length
+ * \retval Number of bytes written, less than len when send buffer is full
+ */
+uint16_t LAN_TCPWrite(uint8_t id, const void *data, uint16_t len);
+
+/**
+ * \brief  close connection
+ * \note   FIN is sent after all data in send buffer. Data not read from receive buffer are dropped,
+ *         data received later go to write callback
+ * \param  id: connection identifier
+ */
+void LAN_TCPClose(uint8_t id);
+
 #endif // WITH_TCP
 
+/*
+ * Buffer pool
+ */
+#define LAN_BUF_SIZE		ENC28J60_MAXFRAME
+#define LAN_BUF_NONE		0xff
+
+typedef struct lan_buf {
+	uint8_t ref;			// references, 0 - free
+	uint8_t next;			// next buffer in queue, LAN_BUF_NONE at end
+	uint16_t len;			// length of queued frame
+	uint32_t addr;			// next hop of frame waiting for ARP reply
+	uint8_t data[LAN_BUF_SIZE];	// Ethernet frame
+} lan_buf_t;
+
+/**
+ * \brief  Allocates frame buffer from pool
+ * \note   Frames received by stack and frames built by application use same pool.
+ *         Buffer has one reference, release it with \ref LAN_BufFree
+ * \retval Pointer to frame, 0 when all buffers are used
+ */
+eth_frame_t *LAN_BufAlloc(void);
+
+/**
+ * \brief  Adds reference to frame buffer
+ * \note   Call it in callback to keep received frame after callback returns,
+ *         stack then receives next frames to other buffers
+ * \param  *frame: pointer to frame from pool
+ */
+void LAN_BufHold(eth_frame_t *frame);
+
+/**
+ * \brief  Releases reference to frame buffer, buffer is free when last reference is released
+ * \note   Frames not allocated from pool are ignored
+ * \param  *frame: pointer to frame from pool
+ */
+void LAN_BufFree(eth_frame_t *frame);
+
+/**
+ * \brief  Gets number of free buffers in pool
+ * \retval Number of free buffers
+ */
+uint8_t LAN_BufAvailable(void);
+
 /*
  * LAN
  */
-extern uint8_t net_buf[];
 
 // LAN calls
 void LAN_init(void);
@@ -0,0 +1,168 @@
+/*
+ * Host tests of IP checksum functions of LAN stack against reference implementation.
+ * Build and run with "make -C host test", "host/build/lan_cksum_test bench" measures speed on host.
+ *
+ * Checksum functions are static, so lan.c is compiled as part of this file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "lan.c"
+
+// Check condition, report line and stop test on failure
+#define CHECK(c) do { if(!(c)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #c); return 1; } } while(0)
+
+// Reference checksum, one big endian word per step like RFC 1071, result in network byte order
+static uint16_t test_cksum(uint32_t sum, const uint8_t *buf, uint16_t len){
+	while(len >= 2){
+		sum += (buf[0] << 8) | buf[1];
+		buf += 2;
+		len -= 2;
+	}
+	if(len)
+		sum += buf[0] << 8;
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return htons((uint16_t)~sum);
+}
+
+// Buffer of random bytes for fill -1, or of fill bytes
+static void test_fill(uint8_t *buf, uint16_t len, int fill){
+	uint16_t i;
+
+	for(i = 0; i < len; i++)
+		buf[i] = fill < 0 ? rand() : fill;
+}
+
+// ip_cksum on random, all-zero and all-ones buffers, all alignments and lengths up to full frame
+static int test_ip_cksum(void){
+	static const int fills[] = {-1, 0x00, 0xff};
+	static uint8_t buf[1520 + 8];
+	uint32_t sum, n;
+	uint16_t len, off;
+	uint8_t f;
+
+	srand(41);
+	for(f = 0; f < sizeof(fills) / sizeof(fills[0]); f++){
+		// All short lengths, carries of 32-bit accumulator with all-ones buffers
+		for(off = 0; off < 8; off++){
+			for(len = 0; len < 80; len++){
+				test_fill(buf + off, len, fills[f]);
+				sum = rand() % 0x20000;
+				CHECK(ip_cksum(sum, buf + off, len) == test_cksum(sum, buf + off, len));
+			}
+		}
+
+		// Random lengths
+		for(n = 0; n < 20000; n++){
+			off = rand() % 8;
+			len = rand() % 1520;
+			test_fill(buf + off, len, fills[f]);
+			sum = rand() % 0x20000;
+			CHECK(ip_cksum(sum, buf + off, len) == test_cksum(sum, buf + off, len));
+		}
+	}
+
+	return 0;
+}
+
+// ip_cksum_update after change of one 16-bit field gives checksum which verifies like full recompute
+static int test_ip_cksum_update(void){
+	uint8_t buf[64];
+	uint16_t cksum, full, old, new, field, len;
+	uint32_t n;
+
+	srand(1624);
+	for(n = 0; n < 100000; n++){
+		len = 2 * (2 + rand() % 31);
+		test_fill(buf, len, (n & 3) ? -1 : (n & 4) ? 0 : 0xff);
+		field = 2 * (1 + rand() % (len / 2 - 1));
+
+		// Checksum in first word, as in packet
+		memset(buf, 0, 2);
+		cksum = ip_cksum(0, buf, len);
+		memcpy(buf, &cksum, 2);
+
+		memcpy(&old, buf + field, 2);
+		new = (n & 8) ? rand() : (uint16_t)~old;
+		memcpy(buf + field, &new, 2);
+
+		cksum = ip_cksum_update(cksum, old, new);
+		memset(buf, 0, 2);
+		full = ip_cksum(0, buf, len);
+
+		// 0x0000 and 0xffff are same number in one's complement, update gives 0xffff
+		//	also where full recompute gives 0x0000
+		CHECK(cksum == full || (uint16_t)(cksum ^ full) == 0xffff);
+		memcpy(buf, &cksum, 2);
+		CHECK(ip_cksum(0, buf, len) == 0);
+	}
+
+	return 0;
+}
+
+// Time in nanoseconds and host cycles
+static double test_time(void){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t test_cycles(void){
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static uint16_t test_lan_cksum(uint32_t sum, const uint8_t *buf, uint16_t len){
+	return ip_cksum(sum, (uint8_t*)buf, len);
+}
+
+// Results of benchmark are kept, so loops are not optimized out
+volatile uint16_t test_sink;
+
+// Bytes per nanosecond and per cycle of reference and stack checksum on frame sized buffer
+static void test_bench(void){
+	static uint8_t buf[1500];
+	uint16_t (*const fn[2])(uint32_t, const uint8_t*, uint16_t) = {test_cksum, test_lan_cksum};
+	static const char *name[2] = {"reference", "ip_cksum"};
+	uint32_t n, count = 200000;
+	uint64_t cycles;
+	double ns;
+	uint8_t i;
+
+	test_fill(buf, sizeof(buf), -1);
+	for(i = 0; i < 2; i++){
+		ns = test_time();
+		cycles = test_cycles();
+		for(n = 0; n < count; n++)
+			test_sink = fn[i](n, buf, sizeof(buf));
+		cycles = test_cycles() - cycles;
+		ns = test_time() - ns;
+
+		printf("%-10s %5.2f bytes/ns", name[i], (double)count * sizeof(buf) / ns);
+		if(cycles)
+			printf(", %5.2f bytes/cycle (TSC)", (double)count * sizeof(buf) / cycles);
+		printf(" on host\n");
+	}
+}
+
+int main(int argc, char **argv){
+	if(argc > 1 && !strcmp(argv[1], "bench")){
+		test_bench();
+		return 0;
+	}
+
+	if(test_ip_cksum() || test_ip_cksum_update())
+		return 1;
+
+	printf("lan checksum tests ok\n");
+	return 0;
+}
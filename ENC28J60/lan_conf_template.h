@@ -47,13 +47,60 @@
  * @brief   Enables (1) or disables (0) TCP protocol
  */
 #define WITH_TCP
-#define WITH_TCP_REXMIT
 
 /**
- * @brief   Maximal cache size for ARP
- *
+ * @brief   Enables Berkeley style non-blocking sockets over TCP (lan_socket.c),
+ *          LAN_SOCKETS is maximal number of sockets including listening ones
+ */
+#define WITH_SOCKET
+#define LAN_SOCKETS				8
+
+/**
+ * @brief   Receive only unicast frames and ARP requests for our IP address when address is known,
+ *          filtering is done by ENC28J60 so broadcasts for other hosts never reach MCU.
+ *          All other broadcasts are dropped too, including UDP broadcasts for LAN_Callback_UDPPacket,
+ *          so it is disabled by default
+ */
+//#define WITH_ARP_FILTER
+
+/**
+ * @brief   Maximal cache size for ARP, up to 254 entries
+ *          Least recently used entry is replaced when cache is full
+ */
+#define ARP_CACHE_SIZE			8
+
+/**
+ * @brief   Number of hash chains for ARP cache lookup, power of 2
+ */
+#define ARP_CACHE_HASH_SIZE		8
+
+/**
+ * @brief   Time in ms after which resolved ARP entry is verified again,
+ *          entries not used for this time are removed
  */
-#define ARP_CACHE_SIZE			3
+#define ARP_CACHE_TIMEOUT		(300 * 1000UL)
+
+/**
+ * @brief   Time in ms between ARP requests for same address
+ *          and number of requests before entry is removed
+ */
+#define ARP_REQUEST_INTERVAL	1000
+#define ARP_REQUEST_LIMIT		3
+
+/**
+ * @brief   Keep frames to addresses being resolved and send them when ARP reply arrives,
+ *          ARP_QUEUE_LEN is maximal number of frames in queue. Oldest frames are dropped
+ *          when queue is full
+ */
+#define WITH_ARP_QUEUE
+#define ARP_QUEUE_LEN			2
+
+/**
+ * @brief   Number of frame buffers in pool, each takes about 1.5 kB
+ *          Received frames, frames built by stack and application and frames waiting
+ *          for ARP reply use buffers from pool
+ */
+#define LAN_BUF_COUNT			3
 
 /**
  * @brief   Set TTL value for ethernet frames
@@ -62,25 +109,91 @@
 #define IP_PACKET_TTL			64
 
 /**
- * @brief   Maximal TCP connections
- *
+ * @brief   Maximal TCP connections, up to 254
+ *          Each connection takes TCP_TX_BUF_SIZE + TCP_RX_BUF_SIZE bytes and about 150 bytes of state,
+ *          use smaller buffers for dozens of connections. RAM taken by stack is about
+ *            LAN_BUF_COUNT * 1.5 kB + TCP_MAX_CONNECTIONS * (TCP_TX_BUF_SIZE + TCP_RX_BUF_SIZE + 150)
+ *          which is 14 kB with defaults. Bulk transfers need bigger buffers, see TCP_TX_BUF_SIZE
+ *          and TCP_RX_BUF_SIZE, e.g. 4096 for both give 48 kB with 5 connections and 4 frame buffers
  */
-#define TCP_MAX_CONNECTIONS		5
+#define TCP_MAX_CONNECTIONS		4
 
 /**
- * @brief   Window size for TCP frames
- *
+ * @brief   Number of hash chains for connection lookup, power of 2
  */
-#define TCP_WINDOW_SIZE			65535
+#define TCP_HASH_SIZE			8
 
-#define TCP_SYN_MSS				512
+/**
+ * @brief   Maximal number of ports listened with LAN_TCPListen
+ */
+#define TCP_MAX_LISTENERS		4
+
+/**
+ * @brief   Receive buffer size for each TCP connection, power of 2 up to 32768
+ *          It is window advertised to peer, keep it below Rx part of ENC28J60 buffer.
+ *          In-order data go to app at once, buffer keeps segments received out of order
+ *          in up to TCP_RX_QUEUE_LEN separate blocks until the gap before them is filled.
+ *          Connections set by LAN_TCPRecvBuffered (sockets) keep in-order data too,
+ *          until app reads them. Peer sends at most TCP_RX_BUF_SIZE bytes per round trip:
+ *          1024 gives 50 kB/s with 20 ms round trip, 4096 is needed for bulk transfers
+ */
+#define TCP_RX_BUF_SIZE			1024
+#define TCP_RX_QUEUE_LEN		4
+
+/**
+ * @brief   Time in ms for which ACK of received data is delayed,
+ *          every second segment is acknowledged at once
+ */
+#define TCP_ACK_DELAY			200
+
+/**
+ * @brief   Maximal segment size announced to peer, up to ENC28J60_MAXFRAME - 58
+ *          (Ethernet, IP and TCP headers and CRC), larger segments are dropped by chip.
+ *          Segments sent to peer use size from its MSS option
+ */
+#define TCP_SYN_MSS				1442
+
+/**
+ * @brief   Send buffer size for each TCP connection, power of 2
+ *          Data are kept in buffer until peer acknowledges them,
+ *          it limits data in flight together with peer and congestion window.
+ *          Segments are TCP_TX_BUF_SIZE / 4 bytes at most, so four of them fit for fast retransmit:
+ *          1024 gives 256 byte segments, 4096 gives 1024 byte segments for bulk transfers
+ */
+#define TCP_TX_BUF_SIZE			1024
+
+/**
+ * @brief   Initial time in ms after which unacknowledged data are sent again,
+ *          later it follows measured round trip time within MIN/MAX limits.
+ *          TCP_REXMIT_LIMIT is number of retransmissions before connection is closed
+ */
+#define TCP_REXMIT_TIMEOUT		1000
+#define TCP_REXMIT_TIMEOUT_MIN	200
+#define TCP_REXMIT_TIMEOUT_MAX	60000
+#define TCP_REXMIT_LIMIT		5
+
+/**
+ * @brief   Time in ms for which actively closed connection stays in TIME_WAIT,
+ *          it acknowledges FIN sent again by peer whose ACK was lost.
+ *          Slot is taken earlier when new connection finds all slots used
+ */
+#define TCP_TIME_WAIT_TIMEOUT	(60 * 1000UL)
+
+/**
+ * @brief   Probe peer after TCP_KEEPALIVE_IDLE ms without any segment from it,
+ *          then every TCP_KEEPALIVE_INTERVAL ms. Connection is reset after
+ *          TCP_KEEPALIVE_COUNT probes without answer, so crashed peers do not hold slots
+ */
+#define WITH_TCP_KEEPALIVE
+#define TCP_KEEPALIVE_IDLE		(60 * 1000UL)
+#define TCP_KEEPALIVE_INTERVAL	(10 * 1000UL)
+#define TCP_KEEPALIVE_COUNT		5
 
-#ifdef WITH_TCP_REXMIT
-#	define TCP_REXMIT_TIMEOUT	1000
-#	define TCP_REXMIT_LIMIT		5
-#else
-#	define TCP_CONN_TIMEOUT		2500
-#endif
+/**
+ * @brief   Time in ms after which established connection without any data sent
+ *          or received is reset, 0 - no limit
+ */
+#define TCP_IDLE_TIMEOUT		0
 
 /**
  * @brief   Default MAC address
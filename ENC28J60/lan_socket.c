@@ -0,0 +1,481 @@
+/*
+ * Berkeley style non-blocking sockets over TCP connections
+ *
+ * History:
+ *	1.0 socket/bind/listen/accept/connect/send/recv/close and poll
+ */
+
+#include <string.h>
+#include "lan_socket.h"
+
+#ifdef WITH_SOCKET
+
+static lan_socket_t lan_sockets[LAN_SOCKETS];
+
+// socket of each TCP connection, LAN_SOCKET_NONE when socket was closed
+static int8_t lan_sock_of[TCP_MAX_CONNECTIONS];
+
+// next port for connections from unbound socket (host byte order)
+static uint16_t lan_sock_next_port = 49152;
+
+static uint8_t lan_sock_listen(uint8_t id, eth_frame_t *frame);
+static void lan_sock_read(uint8_t id, eth_frame_t *frame, uint8_t re);
+static void lan_sock_write(uint8_t id, eth_frame_t *frame, uint16_t len);
+static void lan_sock_closed(uint8_t id, uint8_t hard);
+
+static const tcp_callbacks_t lan_sock_cb = {
+	lan_sock_listen,
+	lan_sock_read,
+	lan_sock_write,
+	lan_sock_closed
+};
+
+// socket number is valid and socket is used
+#define lan_sock_valid(s)	( ((s) >= 0) && ((s) < LAN_SOCKETS) && \
+	(lan_sockets[s].state != LAN_SOCKET_FREE) )
+
+// get free socket
+// return: LAN_SOCKET_NONE - all sockets used
+static int8_t lan_sock_alloc(void)
+{
+	lan_socket_t *so;
+	int8_t s;
+
+	for(s = 0; s < LAN_SOCKETS; ++s)
+	{
+		so = lan_sockets + s;
+		if(so->state == LAN_SOCKET_FREE)
+		{
+			memset(so, 0, sizeof(*so));
+			so->state = LAN_SOCKET_NEW;
+			so->id = TCP_ID_NONE;
+			so->parent = LAN_SOCKET_NONE;
+			return s;
+		}
+	}
+	return LAN_SOCKET_NONE;
+}
+
+// release socket and its connection
+static void lan_sock_free(int8_t s)
+{
+	lan_socket_t *so = lan_sockets + s;
+
+	if(so->id != TCP_ID_NONE)
+	{
+		lan_sock_of[so->id] = LAN_SOCKET_NONE;
+		LAN_TCPClose(so->id);
+	}
+	so->state = LAN_SOCKET_FREE;
+}
+
+// port is used by socket
+//	(connections accepted by listening socket use its port too)
+static uint8_t lan_sock_port_used(uint16_t port)
+{
+	int8_t s;
+
+	for(s = 0; s < LAN_SOCKETS; ++s)
+	{
+		if( (lan_sockets[s].state != LAN_SOCKET_FREE) && (lan_sockets[s].port == port) )
+			return 1;
+	}
+	return 0;
+}
+
+// refused handshake ends without callback,
+//	socket learns it from connection status
+static void lan_sock_update(int8_t s)
+{
+	lan_socket_t *so = lan_sockets + s;
+
+	if( (so->state != LAN_SOCKET_CONNECTING) ||
+		(LAN_TCPGetStatus(so->id) != TCP_CLOSED) )
+	{
+		return;
+	}
+
+	// connection to listening socket, app did not see it
+	if(so->parent != LAN_SOCKET_NONE)
+	{
+		lan_sock_free(s);
+		return;
+	}
+
+	so->state = LAN_SOCKET_CLOSED;
+	so->error = LAN_ECONNREFUSED;
+}
+
+// number of connections of listening socket not accepted yet
+static uint8_t lan_sock_pending(int8_t s)
+{
+	uint8_t count = 0;
+	int8_t i;
+
+	for(i = 0; i < LAN_SOCKETS; ++i)
+	{
+		if( (lan_sockets[i].state != LAN_SOCKET_FREE) && (lan_sockets[i].parent == s) )
+			count++;
+	}
+	return count;
+}
+
+// SYN to listening socket, new socket waits for lan_accept
+static uint8_t lan_sock_listen(uint8_t id, eth_frame_t *frame)
+{
+	ip_packet_t *ip = (void*)(frame->data);
+	tcp_packet_t *tcp = (void*)(ip->data);
+	lan_socket_t *so;
+	int8_t s, parent;
+
+	for(parent = 0; parent < LAN_SOCKETS; ++parent)
+	{
+		if( (lan_sockets[parent].state == LAN_SOCKET_LISTEN) &&
+			(lan_sockets[parent].port == tcp->to_port) )
+		{
+			break;
+		}
+	}
+
+	if(parent == LAN_SOCKETS)
+		return 0;
+
+	// sockets failed in handshake are released first
+	for(s = 0; s < LAN_SOCKETS; ++s)
+	{
+		if(lan_sockets[s].parent == parent)
+			lan_sock_update(s);
+	}
+
+	if( (lan_sockets[parent].backlog) &&
+		(lan_sock_pending(parent) >= lan_sockets[parent].backlog) )
+	{
+		return 0;
+	}
+
+	if((s = lan_sock_alloc()) == LAN_SOCKET_NONE)
+		return 0;
+
+	so = lan_sockets + s;
+	so->state = LAN_SOCKET_CONNECTING;
+	so->id = id;
+	so->parent = parent;
+	so->port = tcp->to_port;
+	so->remote_addr = ip->from_addr;
+	so->remote_port = tcp->from_port;
+
+	lan_sock_of[id] = s;
+	LAN_TCPRecvBuffered(id);
+
+	return 1;
+}
+
+// connection established or send buffer has space,
+//	app finds out with lan_sockpoll
+static void lan_sock_read(uint8_t id, eth_frame_t *frame, uint8_t re)
+{
+	int8_t s = lan_sock_of[id];
+
+	if( (s != LAN_SOCKET_NONE) && (lan_sockets[s].state == LAN_SOCKET_CONNECTING) )
+		lan_sockets[s].state = LAN_SOCKET_CONNECTED;
+}
+
+// only data received after lan_close come here, they are dropped
+static void lan_sock_write(uint8_t id, eth_frame_t *frame, uint16_t len)
+{
+
+}
+
+static void lan_sock_closed(uint8_t id, uint8_t hard)
+{
+	int8_t s = lan_sock_of[id];
+	lan_socket_t *so;
+
+	if(s == LAN_SOCKET_NONE)
+		return;
+
+	// handshake timed out
+	so = lan_sockets + s;
+	if(so->state == LAN_SOCKET_CONNECTING)
+	{
+		if(so->parent != LAN_SOCKET_NONE)
+		{
+			lan_sock_free(s);
+			return;
+		}
+		so->error = LAN_ECONNREFUSED;
+	}
+	else if(hard)
+	{
+		so->error = LAN_ECONNRESET;
+	}
+
+	so->state = LAN_SOCKET_CLOSED;
+}
+
+// create socket
+// return: socket or error code
+int8_t lan_socket(void)
+{
+	int8_t s = lan_sock_alloc();
+
+	return (s == LAN_SOCKET_NONE) ? LAN_ENOMEM : s;
+}
+
+// set local port
+// return: 0 or error code
+int8_t lan_bind(int8_t s, uint16_t port)
+{
+	if( (!lan_sock_valid(s)) || (lan_sockets[s].state != LAN_SOCKET_NEW) || (!port) )
+		return LAN_EINVAL;
+
+	if(lan_sock_port_used(port))
+		return LAN_EADDRINUSE;
+
+	lan_sockets[s].port = port;
+	lan_sockets[s].state = LAN_SOCKET_BOUND;
+	return 0;
+}
+
+// accept connections to bound port
+// return: 0 or error code
+int8_t lan_listen(int8_t s, uint8_t backlog)
+{
+	if( (!lan_sock_valid(s)) || (lan_sockets[s].state != LAN_SOCKET_BOUND) )
+		return LAN_EINVAL;
+
+	if(LAN_TCPListen(lan_sockets[s].port, backlog, &lan_sock_cb))
+		return LAN_ENOMEM;
+
+	lan_sockets[s].backlog = backlog;
+	lan_sockets[s].state = LAN_SOCKET_LISTEN;
+	return 0;
+}
+
+// take established connection of listening socket
+// return: new socket or error code
+int8_t lan_accept(int8_t s, uint32_t *addr, uint16_t *port)
+{
+	lan_socket_t *so;
+	int8_t i;
+
+	if( (!lan_sock_valid(s)) || (lan_sockets[s].state != LAN_SOCKET_LISTEN) )
+		return LAN_EINVAL;
+
+	for(i = 0; i < LAN_SOCKETS; ++i)
+	{
+		so = lan_sockets + i;
+		if( (so->parent != s) || (so->state == LAN_SOCKET_FREE) )
+			continue;
+
+		lan_sock_update(i);
+		if( (so->state == LAN_SOCKET_CONNECTED) || (so->state == LAN_SOCKET_CLOSED) )
+		{
+			so->parent = LAN_SOCKET_NONE;
+			if(addr) *addr = so->remote_addr;
+			if(port) *port = so->remote_port;
+			return i;
+		}
+	}
+	return LAN_EAGAIN;
+}
+
+// send SYN to remote host
+// return: LAN_EINPROGRESS or error code
+int8_t lan_connect(int8_t s, uint32_t addr, uint16_t port)
+{
+	lan_socket_t *so = lan_sockets + s;
+	uint16_t local_port;
+	uint8_t id;
+
+	if( (!lan_sock_valid(s)) || ( (so->state != LAN_SOCKET_NEW) &&
+		(so->state != LAN_SOCKET_BOUND) ) )
+	{
+		return LAN_EINVAL;
+	}
+
+	// ephemeral port
+	local_port = so->port;
+	if(so->state == LAN_SOCKET_NEW)
+	{
+		do {
+			local_port = htons(lan_sock_next_port);
+			lan_sock_next_port = (lan_sock_next_port == 0xffff) ?
+				49152 : lan_sock_next_port + 1;
+		} while(lan_sock_port_used(local_port));
+	}
+
+	id = LAN_TCPConnect(addr, port, local_port, &lan_sock_cb);
+	if(id == TCP_ID_NONE)
+		return LAN_ENOMEM;
+
+	LAN_TCPRecvBuffered(id);
+	lan_sock_of[id] = s;
+
+	so->id = id;
+	so->port = local_port;
+	so->remote_addr = addr;
+	so->remote_port = port;
+	so->state = LAN_SOCKET_CONNECTING;
+	return LAN_EINPROGRESS;
+}
+
+// put data to send buffer
+// return: number of bytes stored or error code
+int16_t lan_send(int8_t s, const void *data, uint16_t len)
+{
+	lan_socket_t *so = lan_sockets + s;
+
+	if( (!lan_sock_valid(s)) || (so->parent != LAN_SOCKET_NONE) )
+		return LAN_EINVAL;
+
+	lan_sock_update(s);
+	if(so->state == LAN_SOCKET_CLOSED)
+		return (so->error) ? so->error : LAN_ENOTCONN;
+	if(so->state == LAN_SOCKET_CONNECTING)
+		return LAN_EAGAIN;
+	if(so->state != LAN_SOCKET_CONNECTED)
+		return LAN_ENOTCONN;
+
+	// length fits return value
+	if(len > 0x7fff)
+		len = 0x7fff;
+
+	len = LAN_TCPWrite(so->id, data, len);
+	return (len) ? (int16_t)len : LAN_EAGAIN;
+}
+
+// read received data
+// return: number of bytes read, 0 - end of stream, or error code
+int16_t lan_recv(int8_t s, void *data, uint16_t len)
+{
+	lan_socket_t *so = lan_sockets + s;
+
+	if( (!lan_sock_valid(s)) || (so->parent != LAN_SOCKET_NONE) )
+		return LAN_EINVAL;
+
+	lan_sock_update(s);
+	if( (so->state == LAN_SOCKET_CLOSED) && (so->error) )
+		return so->error;
+	if( (so->state != LAN_SOCKET_CONNECTED) && (so->state != LAN_SOCKET_CLOSED) )
+		return (so->state == LAN_SOCKET_CONNECTING) ? LAN_EAGAIN : LAN_ENOTCONN;
+
+	if(len > 0x7fff)
+		len = 0x7fff;
+
+	len = LAN_TCPRecv(so->id, data, len);
+	if( (len) || (so->state == LAN_SOCKET_CLOSED) )
+		return len;
+
+	return LAN_EAGAIN;
+}
+
+// close socket, connection sends FIN after data in send buffer
+// return: 0 or error code
+int8_t lan_close(int8_t s)
+{
+	int8_t i;
+
+	if(!lan_sock_valid(s))
+		return LAN_EINVAL;
+
+	if(lan_sockets[s].state == LAN_SOCKET_LISTEN)
+	{
+		LAN_TCPUnlisten(lan_sockets[s].port);
+
+		for(i = 0; i < LAN_SOCKETS; ++i)
+		{
+			if( (lan_sockets[i].state != LAN_SOCKET_FREE) && (lan_sockets[i].parent == s) )
+				lan_sock_free(i);
+		}
+	}
+
+	lan_sock_free(s);
+	return 0;
+}
+
+// error code of failed connection
+int8_t lan_sockerror(int8_t s)
+{
+	if(!lan_sock_valid(s))
+		return LAN_EINVAL;
+
+	lan_sock_update(s);
+	return lan_sockets[s].error;
+}
+
+// readiness of sockets
+// return: number of entries with events
+uint8_t lan_sockpoll(lan_pollfd_t *fds, uint8_t count)
+{
+	lan_socket_t *so;
+	uint8_t i, ready = 0, ev;
+	int8_t s, c;
+
+	for(i = 0; i < count; ++i)
+	{
+		s = fds[i].fd;
+		ev = 0;
+
+		if(s < 0)
+		{
+			fds[i].revents = 0;
+			continue;
+		}
+
+		if(!lan_sock_valid(s))
+		{
+			fds[i].revents = LAN_POLLERR;
+			ready++;
+			continue;
+		}
+
+		so = lan_sockets + s;
+		lan_sock_update(s);
+
+		switch(so->state)
+		{
+		// connection waits for lan_accept
+		case LAN_SOCKET_LISTEN:
+			for(c = 0; c < LAN_SOCKETS; ++c)
+			{
+				if(lan_sockets[c].parent != s)
+					continue;
+
+				lan_sock_update(c);
+				if( (lan_sockets[c].state == LAN_SOCKET_CONNECTED) ||
+					(lan_sockets[c].state == LAN_SOCKET_CLOSED) )
+				{
+					ev |= LAN_POLLIN;
+					break;
+				}
+			}
+			break;
+
+		case LAN_SOCKET_CONNECTED:
+			if(LAN_TCPRecvAvailable(so->id))
+				ev |= LAN_POLLIN;
+			if(LAN_TCPWriteSpace(so->id))
+				ev |= LAN_POLLOUT;
+			break;
+
+		// end of stream can be read after data
+		case LAN_SOCKET_CLOSED:
+			ev |= LAN_POLLIN | LAN_POLLHUP;
+			if(so->error)
+				ev |= LAN_POLLERR;
+			break;
+
+		default:
+			break;
+		}
+
+		fds[i].revents = ev & (fds[i].events | LAN_POLLERR | LAN_POLLHUP);
+		if(fds[i].revents)
+			ready++;
+	}
+
+	return ready;
+}
+
+#endif // WITH_SOCKET
@@ -0,0 +1,161 @@
+#ifndef LAN_SOCKET_H
+#define LAN_SOCKET_H 100
+
+/* C++ detection */
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include "lan.h"
+
+#ifdef WITH_SOCKET
+
+/*
+ * Berkeley style sockets over TCP connections of lan.c
+ *
+ * Calls never block, app checks readiness with lan_sockpoll and streams
+ * at its own pace. Received data stay in receive buffer of connection
+ * and sent data in its send buffer, so window advertised to peer follows
+ * what app reads. LAN_poll must be called as usual.
+ */
+
+#define LAN_SOCKET_NONE		(-1)
+
+// error codes, returned as negative values
+#define LAN_EAGAIN			(-2)	// operation would block, try later
+#define LAN_EINVAL			(-3)	// bad socket or socket in wrong state
+#define LAN_ENOMEM			(-4)	// no free socket, connection slot or frame buffer
+#define LAN_ENOTCONN		(-5)	// socket is not connected
+#define LAN_ECONNRESET		(-6)	// connection reset by peer or timed out
+#define LAN_EADDRINUSE		(-7)	// port is used by other socket
+#define LAN_EINPROGRESS		(-8)	// connection is being established
+#define LAN_ECONNREFUSED	(-9)	// peer refused connection or did not answer
+
+// events of lan_sockpoll
+#define LAN_POLLIN			0x01	// data to read, EOF or connection to accept
+#define LAN_POLLOUT			0x04	// space in send buffer
+#define LAN_POLLERR			0x08	// connection failed, see lan_sockerror
+#define LAN_POLLHUP			0x10	// peer closed connection
+
+typedef enum lan_socket_state {
+	LAN_SOCKET_FREE,
+	LAN_SOCKET_NEW,				// created, not bound yet
+	LAN_SOCKET_BOUND,			// local port set by lan_bind
+	LAN_SOCKET_LISTEN,			// accepting connections
+	LAN_SOCKET_CONNECTING,		// handshake in progress
+	LAN_SOCKET_CONNECTED,
+	LAN_SOCKET_CLOSED			// closed by peer or failed, waits for lan_close
+} lan_socket_state_t;
+
+typedef struct lan_socket {
+	lan_socket_state_t state;
+	uint8_t id;				// TCP connection, TCP_ID_NONE for none
+	int8_t parent;			// listening socket until accepted, LAN_SOCKET_NONE otherwise
+	uint8_t backlog;		// connections waiting for lan_accept at most (listening socket)
+	int8_t error;			// error code of failed connection, 0 - none
+	uint16_t port;			// local port, network byte order
+	uint32_t remote_addr;
+	uint16_t remote_port;	// network byte order
+} lan_socket_t;
+
+typedef struct lan_pollfd {
+	int8_t fd;				// socket, negative value - entry is skipped
+	uint8_t events;			// requested events, LAN_POLLIN and LAN_POLLOUT
+	uint8_t revents;		// returned events, LAN_POLLERR and LAN_POLLHUP are always reported
+} lan_pollfd_t;
+
+/**
+ * \brief  create TCP socket
+ * \retval Socket, LAN_ENOMEM when all LAN_SOCKETS are used
+ */
+int8_t lan_socket(void);
+
+/**
+ * \brief  set local port of socket
+ * \param  s: socket
+ * \param  port: local port, network byte order
+ * \retval 0 on success, LAN_EADDRINUSE when port is used by other socket or its connections
+ */
+int8_t lan_bind(int8_t s, uint16_t port);
+
+/**
+ * \brief  accept connections to port of socket
+ * \note   SYN is dropped when backlog connections are in handshake and refused with RST
+ *         when backlog connections wait for \ref lan_accept or no socket is free
+ * \param  s: bound socket
+ * \param  backlog: connections not accepted yet at most, 0 - no limit
+ * \retval 0 on success, LAN_ENOMEM when all TCP_MAX_LISTENERS entries are used
+ */
+int8_t lan_listen(int8_t s, uint8_t backlog);
+
+/**
+ * \brief  get established connection of listening socket
+ * \param  s: listening socket
+ * \param  *addr: remote host address is stored here, can be 0
+ * \param  *port: remote host port is stored here in network byte order, can be 0
+ * \retval New connected socket, LAN_EAGAIN when no connection waits
+ */
+int8_t lan_accept(int8_t s, uint32_t *addr, uint16_t *port);
+
+/**
+ * \brief  start connection to remote host
+ * \note   Unbound socket gets port from range 49152 - 65535. Socket is writable (\ref LAN_POLLOUT)
+ *         when connection is established, \ref LAN_POLLERR is reported when it fails
+ * \param  s: socket
+ * \param  addr: remote host address
+ * \param  port: remote host port, network byte order
+ * \retval LAN_EINPROGRESS when SYN was sent, LAN_ENOMEM when no connection slot or frame buffer is free
+ */
+int8_t lan_connect(int8_t s, uint32_t addr, uint16_t port);
+
+/**
+ * \brief  put data to send buffer of connection
+ * \param  s: connected socket
+ * \param  *data: pointer to data
+ * \param  len: data length
+ * \retval Number of bytes stored, LAN_EAGAIN when send buffer is full
+ */
+int16_t lan_send(int8_t s, const void *data, uint16_t len);
+
+/**
+ * \brief  read received data
+ * \param  s: connected socket
+ * \param  *data: pointer to buffer for data
+ * \param  len: buffer size
+ * \retval Number of bytes read, 0 when peer closed connection and all data were read,
+ *         LAN_EAGAIN when no data wait, LAN_ECONNRESET when connection was reset
+ */
+int16_t lan_recv(int8_t s, void *data, uint16_t len);
+
+/**
+ * \brief  close socket
+ * \note   Connection sends FIN after data in send buffer, unread data are dropped.
+ *         Connections of listening socket not accepted yet are closed too
+ * \param  s: socket
+ * \retval 0 on success, LAN_EINVAL for bad socket
+ */
+int8_t lan_close(int8_t s);
+
+/**
+ * \brief  get error code of failed connection
+ * \param  s: socket
+ * \retval Error code, 0 - none
+ */
+int8_t lan_sockerror(int8_t s);
+
+/**
+ * \brief  check readiness of sockets
+ * \note   Never waits, app calls it again after \ref LAN_poll
+ * \param  *fds: sockets and requested events, revents fields are set
+ * \param  count: number of entries
+ * \retval Number of entries with events
+ */
+uint8_t lan_sockpoll(lan_pollfd_t *fds, uint8_t count);
+
+#endif // WITH_SOCKET
+
+/* C++ detection */
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LAN_SOCKET_H
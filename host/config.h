@@ -0,0 +1 @@
+/* Host replacement of application configuration, nothing to configure */
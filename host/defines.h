@@ -0,0 +1 @@
+/* Host build configuration of TM libraries, defaults are used */
@@ -0,0 +1,7 @@
+/* Host build of ENC28J60 library, template maps SPI and CS to emulator when ENC28J60_EMU is defined */
+#include "enc28j60_ll_template.h"
+
+/* Buffer memory byte by byte, like platforms with ENC28J60_LL_SPIRxTx only */
+#ifdef HOST_LL_BYTE
+#undef ENC28J60_LL_BURST
+#endif
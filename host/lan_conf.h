@@ -0,0 +1,25 @@
+/* Host build configuration of LAN library, defaults from template are used */
+#include "lan_conf_template.h"
+
+/* Static address, no DHCP and NTP traffic on emulated wire */
+#undef WITH_DHCP
+#undef WITH_NTP
+
+/* Frames to unresolved hosts are dropped instead of queued */
+#ifdef HOST_NO_ARP_QUEUE
+#undef WITH_ARP_QUEUE
+#endif
+
+/* Bigger TCP buffers for benchmarks of bulk transfers */
+#ifdef HOST_TCP_BUF_SIZE
+#undef TCP_TX_BUF_SIZE
+#undef TCP_RX_BUF_SIZE
+#define TCP_TX_BUF_SIZE		HOST_TCP_BUF_SIZE
+#define TCP_RX_BUF_SIZE		HOST_TCP_BUF_SIZE
+#endif
+
+/* Many connections for tests of hashed lookup */
+#ifdef HOST_TCP_CONNECTIONS
+#undef TCP_MAX_CONNECTIONS
+#define TCP_MAX_CONNECTIONS	HOST_TCP_CONNECTIONS
+#endif
@@ -0,0 +1,7 @@
+/* Host replacement of OS compatibility header, debug output is disabled */
+#ifndef OS_COMPAT_H
+#define OS_COMPAT_H
+
+#define _D(x)                  do { } while (0)
+
+#endif
@@ -0,0 +1 @@
+/* Host replacement of application sensor list, nothing to configure */
@@ -58,7 +58,7 @@ static void AT24xx_dump( I2C_TypeDef *I2Cx, uint16_t addr, int size ){
 #endif // AT24xx_DUMP
 
 void PW_AT24xx_Init(I2C_TypeDef *I2Cx){
-	TM_I2C_Init( I2Cx, TM_I2C_PinsPack_1, 100000 );
+	TM_I2C_Init( I2Cx, TM_I2C_PinsPack_1, AT24xx_I2C_CLOCK );
 
 	if( PW_AT24xx_isDeviceConneted( I2Cx ) )
 		_D(("I: AT24xx INFO: pages %d, page size %d bytes\n", AT24xx_MAX_PAGES, AT24xx_PAGE_SIZE));
@@ -75,7 +75,7 @@ void PW_AT24xx_Init(I2C_TypeDef *I2Cx){
 }
 
 uint8_t PW_AT24xx_isDeviceConneted(I2C_TypeDef *I2Cx){
-	return TM_I2C_IsDeviceConnected( I2Cx, AT24xx_I2C_ADDR );
+	return TM_I2C_IsDevicePresent( I2Cx, AT24xx_I2C_ADDR );
 }
 
 void PW_AT24xx_Write(I2C_TypeDef *I2Cx, uint16_t address, const uint8_t *buf, int size){
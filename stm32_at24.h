@@ -7,6 +7,11 @@
 extern "C" {
 #endif
 
+/* AT24xx I2C clock, use TM_I2C_CLOCK_FAST_MODE for 400kHz capable parts */
+#ifndef AT24xx_I2C_CLOCK
+#define AT24xx_I2C_CLOCK            TM_I2C_CLOCK_STANDARD
+#endif
+
 /**
  * @brief  Initializes I2C inteface to communication with AT24xx
  * @note   This function also check if is present or not
@@ -17,6 +22,7 @@ void PW_AT24xx_Init(I2C_TypeDef *I2Cx);
 
 /**
  * @brief  Checks if device is connected to I2C bus
+ * @note   Bus is probed only first time, result is cached with @ref TM_I2C_IsDevicePresent()
  * @param  *I2Cx: I2C used
  * @retval Device status:
  *            - 0: Device is not connected
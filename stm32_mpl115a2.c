@@ -94,7 +94,7 @@ void PW_MPL115A2_Init( const PW_MPL115A2_t *mpl ){
 	TM_GPIO_Init( mpl->GPIOx_SHDN, mpl->GPIO_Pin_SHDN, TM_GPIO_Mode_OUT, TM_GPIO_OType_PP, TM_GPIO_PuPd_UP, TM_GPIO_Speed_Low );
 	TM_GPIO_SetPinHigh( mpl->GPIOx_SHDN, mpl->GPIO_Pin_SHDN );
 #endif // MPL115A2_USE_SHDN
-	TM_I2C_Init( mpl->I2Cx, TM_I2C_PinsPack_1, 100000 );
+	TM_I2C_Init( mpl->I2Cx, TM_I2C_PinsPack_1, MPL115A2_I2C_CLOCK );
 }
 
 //*****************************************************************************
@@ -117,7 +117,7 @@ uint8_t PW_MPL115A2_isDeviceConneted( const PW_MPL115A2_t *mpl ){
 	Delay(5000);
 #endif // MPL115A2_USE_SHDN
 
-	connected = TM_I2C_IsDeviceConnected( mpl->I2Cx, MPL115A2_I2C_ADDRESS );
+	connected = TM_I2C_IsDevicePresent( mpl->I2Cx, MPL115A2_I2C_ADDRESS );
 
 #ifdef MPL115A2_USE_RST
 	TM_GPIO_SetPinLow( mpl->GPIOx_RST, mpl->GPIO_Pin_RST );
@@ -140,7 +140,13 @@ uint8_t PW_MPL115A2_isDeviceConneted( const PW_MPL115A2_t *mpl ){
 //*****************************************************************************
 int PW_MPL115A2_GetPressure( const PW_MPL115A2_t *mpl, signed short *target ){
 	unsigned char ucVar[8];
-	unsigned char ucRow[8];
+	unsigned char ucRow[4];
+	unsigned char ucStart = 0x00;
+	uint8_t status;
+	TM_I2C_Transfer_t xfers[] = {
+		{ MPL115A2_I2C_ADDRESS, TM_I2C_TRANSFER_READ | TM_I2C_TRANSFER_REG, MPL115A2_CMD_COEFICNTS, ucVar, sizeof(ucVar) },
+		{ MPL115A2_I2C_ADDRESS, TM_I2C_TRANSFER_WRITE | TM_I2C_TRANSFER_REG, MPL115A2_CMD_CONVERSION, &ucStart, 1 },
+	};
 
 #ifdef MPL115A2_USE_RST
 	TM_GPIO_SetPinHigh( mpl->GPIOx_RST, mpl->GPIO_Pin_RST );
@@ -151,13 +157,18 @@ int PW_MPL115A2_GetPressure( const PW_MPL115A2_t *mpl, signed short *target ){
 	Delay(5000);
 #endif // MPL115A2_USE_SHDN
 
-	TM_I2C_ReadMulti( mpl->I2Cx, MPL115A2_I2C_ADDRESS, MPL115A2_CMD_COEFICNTS, ucVar, sizeof(ucVar) );
+	// read coefficients and start conversion in one transaction
+	status = TM_I2C_Transaction( mpl->I2Cx, xfers, sizeof(xfers) / sizeof(xfers[0]) );
 
-	TM_I2C_WriteNoRegister( mpl->I2Cx, MPL115A2_I2C_ADDRESS, MPL115A2_CMD_CONVERSION );
+	if( !status ) {
+		Delay(800000);// 7000);
 
-	Delay(800000);// 7000);
-
-	TM_I2C_ReadMulti( mpl->I2Cx, MPL115A2_I2C_ADDRESS, MPL115A2_CMD_COEFICNTS, ucRow, sizeof(ucRow) );
+		// pressure and temperature results
+		xfers[0].Reg = MPL115A2_CMD_RESULT;
+		xfers[0].Data = ucRow;
+		xfers[0].Count = sizeof(ucRow);
+		status = TM_I2C_Transaction( mpl->I2Cx, xfers, 1 );
+	}
 
 #ifdef MPL115A2_USE_RST
 	TM_GPIO_SetPinLow( mpl->GPIOx_RST, mpl->GPIO_Pin_RST );
@@ -168,6 +179,9 @@ int PW_MPL115A2_GetPressure( const PW_MPL115A2_t *mpl, signed short *target ){
 	Delay(5000);
 #endif // MPL115A2_USE_SHDN
 
+	if( status )
+		return 0;
+
 	*target = PW_MPL115A_calculatePressure(
 			((unsigned short)ucRow[0]<<8)|((unsigned short)ucRow[1]),
 			((unsigned short)ucRow[2]<<8)|((unsigned short)ucRow[3]),
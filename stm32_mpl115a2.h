@@ -54,6 +54,13 @@ extern "C" {
 #include "tm_stm32_i2c.h"
 #include "defines.h"
 
+//
+//! MPL115A2 I2C clock, chip supports up to 400kHz
+//
+#ifndef MPL115A2_I2C_CLOCK
+#define MPL115A2_I2C_CLOCK          TM_I2C_CLOCK_STANDARD
+#endif
+
 //*****************************************************************************
 //
 //! \addtogroup CoX_Shield_Lib
@@ -124,6 +131,7 @@ extern void PW_MPL115A2_Init( const PW_MPL115A2_t *mpl );
 //
 //! \brief check if chip is connected.
 //!
+//! bus is probed only first time, result is cached by TM_I2C_IsDevicePresent.
 //!
 //! \return 1 - is connected, 0 - not connected
 //
@@ -134,9 +142,9 @@ uint8_t PW_MPL115A2_isDeviceConneted( const PW_MPL115A2_t *mpl );
 //
 //! \brief get current pressure value.
 //!
-//! get current pressure value.
+//! get current pressure value, stored to target as int[16,4].
 //!
-//! \return int[16,4] the pressure value
+//! \return 1 - pressure is read, 0 - I2C error
 //
 //*****************************************************************************
 extern int PW_MPL115A2_GetPressure( const PW_MPL115A2_t *mpl, signed short *target );
@@ -1,4 +1,4 @@
-#include "stm32_PCF8574.h"
+#include "stm32_pcf8574.h"
 #include "os_compat.h"
 #include "config.h"
 
@@ -7,14 +7,14 @@
 #define PCF8574_I2C_ADDR       ((0x20)<<1)
 
 void PW_PCF8574_Init( I2C_TypeDef *I2Cx ){
-	TM_I2C_Init( I2Cx, TM_I2C_PinsPack_1, 100000 );
+	TM_I2C_Init( I2Cx, TM_I2C_PinsPack_1, PCF8574_I2C_CLOCK );
 
 	if( PW_PCF8574_isDeviceConneted( I2Cx ) )
 		_D(("I: PCF8574 i2c expander chip on board\n"));
 }
 
 uint8_t PW_PCF8574_isDeviceConneted( I2C_TypeDef *I2Cx ){
-	return TM_I2C_IsDeviceConnected( I2Cx, PCF8574_I2C_ADDR );
+	return TM_I2C_IsDevicePresent( I2Cx, PCF8574_I2C_ADDR );
 }
 
 void PW_PCF8574_WritePort( I2C_TypeDef *I2Cx, uint8_t pins ){
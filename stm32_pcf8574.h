@@ -8,6 +8,11 @@ extern "C"
 {
 #endif
 
+/* PCF8574 I2C clock, chip supports only standard mode */
+#ifndef PCF8574_I2C_CLOCK
+#define PCF8574_I2C_CLOCK           TM_I2C_CLOCK_STANDARD
+#endif
+
 /**
  * @brief  Initializes I2C inteface to communication with PCF8574
  * @note   This function also check if chip is present or not
@@ -18,6 +23,7 @@ void PW_PCF8574_Init( I2C_TypeDef *I2Cx );
 
 /**
  * @brief  Checks if device is connected to I2C bus
+ * @note   Bus is probed only first time, result is cached with @ref TM_I2C_IsDevicePresent()
  * @param  *I2Cx: I2C used
  * @retval Device status:
  *            - 0: Device is not connected
@@ -155,6 +155,14 @@ extern "C" {
 #define USE_HAL_DRIVER
 #endif
 
+/* Host build with simulated peripherals, no STM32 family is used */
+#if defined(TM_HOST)
+#include "tm_stm32_host.h"
+#if defined(TM_I2C_SIM)
+#include "tm_stm32_i2c_sim.h"
+#endif
+#else
+
 /* Include proper header file */
 /* STM32F0xx */
 #if defined(STM32F0xx) || defined(STM32F0XX)
@@ -209,9 +217,13 @@ extern "C" {
 #error "There is not selected STM32 family used. Check stm32fxxx_hal.h file for configuration!"
 #endif
 
+#endif /* TM_HOST */
+
 /* Init main libraries used everywhere */
 #include "defines.h"
+#if !defined(TM_HOST)
 #include "tm_stm32_rcc.h"
+#endif
 #include "tm_stm32_gpio.h"
 
 /**
@@ -175,7 +175,10 @@ uint32_t TM_DELAY_Init(void);
  * @retval None
  */
 __STATIC_INLINE void Delay(__IO uint32_t micros) {
-#if !defined(STM32F0xx)
+#if defined(TM_HOST)
+	/* Host build, only simulated time is advanced */
+	TM_HOST_Delay(micros);
+#elif !defined(STM32F0xx)
 	uint32_t start = DWT->CYCCNT;
 	
 	/* Go to number of cycles for system */
@@ -124,7 +124,7 @@ void TM_DS1307_SetYear(uint8_t year) {
 }
 
 void TM_DS1307_EnableOutputPin(TM_DS1307_OutputFrequency_t frequency) {
-	uint8_t temp;
+	uint8_t temp = 0;
 	if (frequency == TM_DS1307_OutputFrequency_1Hz) {
 		temp = 1 << DS1307_CONTROL_OUT | 1 << DS1307_CONTROL_SQWE;
 	} else if (frequency == TM_DS1307_OutputFrequency_4096Hz) {
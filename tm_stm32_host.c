@@ -0,0 +1,216 @@
+/**
+ * |----------------------------------------------------------------------
+ * | This program is free software: you can redistribute it and/or modify
+ * | it under the terms of the GNU General Public License as published by
+ * | the Free Software Foundation, either version 3 of the License, or
+ * | any later version.
+ * |
+ * | This program is distributed in the hope that it will be useful,
+ * | but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * | MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * | GNU General Public License for more details.
+ * |
+ * | You should have received a copy of the GNU General Public License
+ * | along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * |----------------------------------------------------------------------
+ */
+#include "stm32fxxx_hal.h"
+
+#if defined(TM_HOST)
+
+/* Number of GPIO ports */
+#define HOST_GPIO_PORTS        (sizeof(TM_HOST_GPIO) / sizeof(TM_HOST_GPIO[0]))
+
+/* GPIO mode of pin from MODER value */
+#define HOST_GPIO_MODE(moder, pin)    (((moder) >> (2 * (pin))) & 0x03)
+#define HOST_GPIO_MODE_OUT     0x01
+
+/* No event scheduled by simulators */
+#define HOST_NO_EVENT          0xFFFFFFFFFFFFFFFFULL
+
+/* Time conversions */
+#define HOST_NS_PER_US         1000ULL
+#define HOST_NS_PER_MS         1000000ULL
+
+/* Public variables */
+GPIO_TypeDef TM_HOST_GPIO[9];
+RCC_TypeDef TM_HOST_RCC;
+uint32_t SystemCoreClock = TM_HOST_CORE_CLOCK;
+
+/* Private variables */
+static uint64_t TM_HOST_Time;
+static uint64_t TM_HOST_Event = HOST_NO_EVENT;
+static DWT_Type TM_HOST_DWT_Regs = {DWT_CTRL_CYCCNTENA_Msk, 0};
+static uint16_t TM_HOST_GPIO_Low[HOST_GPIO_PORTS];
+static void (*TM_HOST_Models[TM_HOST_MAX_MODELS])(void);
+static uint8_t TM_HOST_Updating;
+
+/* Private functions */
+static void TM_HOST_INT_Run(uint64_t end);
+static void TM_HOST_INT_Update(void);
+static uint16_t TM_HOST_INT_GPIO_Levels(uint8_t port);
+
+uint64_t TM_HOST_GetTime(void) {
+	return TM_HOST_Time / HOST_NS_PER_US;
+}
+
+uint64_t TM_HOST_GetTimeNs(void) {
+	return TM_HOST_Time;
+}
+
+void TM_HOST_Delay(uint32_t micros) {
+	/* Simulators run during delay */
+	TM_HOST_INT_Run(TM_HOST_Time + micros * HOST_NS_PER_US);
+}
+
+void TM_HOST_Advance(uint64_t nanos) {
+	TM_HOST_Time += nanos;
+}
+
+uint8_t TM_HOST_AddModel(void (*Update)(void)) {
+	uint8_t i;
+
+	/* Add function only once */
+	for (i = 0; i < TM_HOST_MAX_MODELS; i++) {
+		if (TM_HOST_Models[i] == Update) {
+			return 0;
+		}
+		if (TM_HOST_Models[i] == NULL) {
+			TM_HOST_Models[i] = Update;
+			return 0;
+		}
+	}
+
+	/* No space */
+	return 1;
+}
+
+void TM_HOST_Schedule(uint64_t time) {
+	/* Keep the earliest event */
+	if (time < TM_HOST_Event) {
+		TM_HOST_Event = time;
+	}
+}
+
+uint8_t TM_HOST_Access(void) {
+	/* Register access takes time on MCU */
+	TM_HOST_Time += TM_HOST_ACCESS_TIME;
+
+	/* Update simulated peripherals */
+	TM_HOST_INT_Update();
+
+	/* Index to register array */
+	return 0;
+}
+
+void TM_HOST_GPIO_PullLow(GPIO_TypeDef* GPIOx, uint16_t GPIO_Pin, uint8_t low) {
+	uint8_t port = GPIOx - TM_HOST_GPIO;
+
+	/* Save external state, IDR is set on next access */
+	if (low) {
+		TM_HOST_GPIO_Low[port] |= GPIO_Pin;
+	} else {
+		TM_HOST_GPIO_Low[port] &= ~GPIO_Pin;
+	}
+}
+
+uint16_t TM_HOST_GPIO_GetLevels(GPIO_TypeDef* GPIOx) {
+	return TM_HOST_INT_GPIO_Levels(GPIOx - TM_HOST_GPIO);
+}
+
+DWT_Type* TM_HOST_DWT(void) {
+	/* Cycle counter wraps like on MCU */
+	TM_HOST_DWT_Regs.CYCCNT = (uint32_t)(TM_HOST_Time * (SystemCoreClock / 1000000) / HOST_NS_PER_US);
+	return &TM_HOST_DWT_Regs;
+}
+
+uint32_t HAL_GetTick(void) {
+	return (uint32_t)(TM_HOST_Time / HOST_NS_PER_MS);
+}
+
+void HAL_Delay(uint32_t Delay) {
+	/* Simulators run during delay */
+	TM_HOST_INT_Run(TM_HOST_Time + Delay * HOST_NS_PER_MS);
+}
+
+uint32_t HAL_RCC_GetHCLKFreq(void) {
+	return SystemCoreClock;
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq(void) {
+	return TM_HOST_PCLK1;
+}
+
+/* Private functions */
+static void TM_HOST_INT_Run(uint64_t end) {
+	/* Simulators see register writes made before delay */
+	TM_HOST_INT_Update();
+
+	/* Stop at every event, simulators schedule their next events again */
+	while (TM_HOST_Event < end) {
+		if (TM_HOST_Event > TM_HOST_Time) {
+			TM_HOST_Time = TM_HOST_Event;
+		}
+		TM_HOST_Event = HOST_NO_EVENT;
+		TM_HOST_INT_Update();
+	}
+
+	/* End of delay */
+	TM_HOST_Time = end;
+	TM_HOST_INT_Update();
+}
+
+static void TM_HOST_INT_Update(void) {
+	uint8_t i;
+	uint32_t bsrr;
+
+	/* Simulators access registers without macros, nested call is not expected */
+	if (TM_HOST_Updating) {
+		return;
+	}
+	TM_HOST_Updating = 1;
+
+	/* Apply set/reset requests, set has priority */
+	for (i = 0; i < HOST_GPIO_PORTS; i++) {
+		bsrr = TM_HOST_GPIO[i].BSRR_REG[0];
+		if (bsrr) {
+			TM_HOST_GPIO[i].ODR_REG[0] = ((TM_HOST_GPIO[i].ODR_REG[0] & ~(bsrr >> 16)) | bsrr) & 0xFFFF;
+			TM_HOST_GPIO[i].BSRR_REG[0] = 0;
+		}
+	}
+
+	/* Let simulators react to register writes */
+	for (i = 0; i < TM_HOST_MAX_MODELS && TM_HOST_Models[i] != NULL; i++) {
+		TM_HOST_Models[i]();
+	}
+
+	/* Set input registers from pin levels */
+	for (i = 0; i < HOST_GPIO_PORTS; i++) {
+		TM_HOST_GPIO[i].IDR_REG[0] = TM_HOST_INT_GPIO_Levels(i);
+	}
+
+	TM_HOST_Updating = 0;
+}
+
+static uint16_t TM_HOST_INT_GPIO_Levels(uint8_t port) {
+	GPIO_TypeDef* GPIOx = &TM_HOST_GPIO[port];
+	uint16_t levels = 0xFFFF;
+	uint8_t pin;
+
+	/* All pins are inputs, skip checks */
+	if (!GPIOx->MODER_REG[0]) {
+		return levels & ~TM_HOST_GPIO_Low[port];
+	}
+
+	/* Outputs drive their ODR value, other pins are pulled up */
+	for (pin = 0; pin < 16; pin++) {
+		if (HOST_GPIO_MODE(GPIOx->MODER_REG[0], pin) == HOST_GPIO_MODE_OUT && !(GPIOx->ODR_REG[0] & (1 << pin))) {
+			levels &= ~(1 << pin);
+		}
+	}
+
+	/* Lines pulled low by simulators */
+	return levels & ~TM_HOST_GPIO_Low[port];
+}
+
+#endif /* TM_HOST */
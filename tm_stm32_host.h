@@ -0,0 +1,355 @@
+/**
+ * @version v1.0
+ * @ide     GCC
+ * @license GNU GPL v3
+ * @brief   Host support for simulated builds of TM libraries
+ *
+@verbatim
+   ----------------------------------------------------------------------
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+   ----------------------------------------------------------------------
+@endverbatim
+ */
+#ifndef TM_HOST_H
+#define TM_HOST_H 100
+
+/* C++ detection */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup TM_STM32F4xx_Libraries
+ * @{
+ */
+
+/**
+ * @defgroup TM_HOST
+ * @brief    Host support for simulated builds of TM libraries
+ * @{
+ *
+ * Library replaces STM32 family headers on Linux host, so libraries can be compiled with GCC and run
+ * against simulated peripherals. It is shared by all simulators, like @ref TM_I2C_SIM and ENC28J60 emulator.
+ *
+ * \par Host build
+ *
+ * Define TM_HOST globally (compiler flag -DTM_HOST) and compile tm_stm32_host.c.
+ * stm32fxxx_hal.h then includes this file instead of STM32 family headers.
+ * Simulators are enabled with their own flags on top of TM_HOST.
+ *
+ * \par Simulated time
+ *
+ * Time starts at zero and runs only when simulation advances it, so tests give the same results on every run.
+ * Delay(), Delayms() and HAL_Delay() return immediately and only advance time. Simulators are updated before
+ * and after delay and at every event scheduled with @ref TM_HOST_Schedule(), so bus actions finish on time.
+ * Every access to simulated register takes @ref TM_HOST_ACCESS_TIME, so wait loops of drivers time out like on MCU.
+ * HAL_GetTick() and DWT cycle counter follow simulated time.
+ *
+ * \par Registers
+ *
+ * Register names of simulated peripherals are macros which call @ref TM_HOST_Access() before register is read
+ * or written. Function advances time, applies GPIO BSRR writes, calls update functions of simulators
+ * added with @ref TM_HOST_AddModel() and sets GPIO IDR from pin levels. Simulators react to register writes
+ * on next access, like hardware which needs some time to set its flags.
+ *
+ * GPIO pins read high unless pin is output driven low or simulator pulls it low with @ref TM_HOST_GPIO_PullLow(),
+ * like open-drain lines with pull-up resistors.
+ *
+ * \par Changelog
+ *
+@verbatim
+ Version 1.0
+  - First release
+@endverbatim
+ *
+ * \par Dependencies
+ *
+@verbatim
+ - Linux host, GCC
+ - defines.h
+ - attributes.h
+@endverbatim
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "attributes.h"
+
+/**
+ * @defgroup TM_HOST_Macros
+ * @brief    Library defines
+ * @{
+ */
+
+/* Core definitions missing on host */
+#ifndef __IO
+#define __IO                   volatile
+#endif
+#ifndef __STATIC_INLINE
+#define __STATIC_INLINE        static inline
+#endif
+
+/**
+ * @brief  Simulated core clock in Hz
+ */
+#ifndef TM_HOST_CORE_CLOCK
+#define TM_HOST_CORE_CLOCK     168000000
+#endif
+
+/**
+ * @brief  Simulated APB1 clock in Hz
+ */
+#ifndef TM_HOST_PCLK1
+#define TM_HOST_PCLK1          42000000
+#endif
+
+/**
+ * @brief  Time of one register access in nanoseconds
+ */
+#ifndef TM_HOST_ACCESS_TIME
+#define TM_HOST_ACCESS_TIME    20
+#endif
+
+/**
+ * @brief  Maximal number of simulators with update function
+ */
+#define TM_HOST_MAX_MODELS     4
+
+/**
+ * @brief  Simulated GPIO ports
+ */
+#define GPIOA                  (&TM_HOST_GPIO[0])
+#define GPIOB                  (&TM_HOST_GPIO[1])
+#define GPIOC                  (&TM_HOST_GPIO[2])
+#define GPIOD                  (&TM_HOST_GPIO[3])
+#define GPIOE                  (&TM_HOST_GPIO[4])
+#define GPIOF                  (&TM_HOST_GPIO[5])
+#define GPIOG                  (&TM_HOST_GPIO[6])
+#define GPIOH                  (&TM_HOST_GPIO[7])
+#define GPIOI                  (&TM_HOST_GPIO[8])
+#define GPIOA_BASE             ((uint32_t)(uintptr_t)GPIOA)
+#define GPIOB_BASE             ((uint32_t)(uintptr_t)GPIOB)
+
+/**
+ * @brief  GPIO registers, every access goes through @ref TM_HOST_Access()
+ */
+#define MODER                  MODER_REG[TM_HOST_Access()]
+#define OTYPER                 OTYPER_REG[TM_HOST_Access()]
+#define OSPEEDR                OSPEEDR_REG[TM_HOST_Access()]
+#define PUPDR                  PUPDR_REG[TM_HOST_Access()]
+#define IDR                    IDR_REG[TM_HOST_Access()]
+#define ODR                    ODR_REG[TM_HOST_Access()]
+#define BSRR                   BSRR_REG[TM_HOST_Access()]
+#define LCKR                   LCKR_REG[TM_HOST_Access()]
+#define AFR                    AFR_REG[TM_HOST_Access()]
+
+/**
+ * @brief  Simulated RCC and DWT
+ */
+#define RCC                    (&TM_HOST_RCC)
+#define DWT                    (TM_HOST_DWT())
+#define DWT_CTRL_CYCCNTENA_Msk (1UL << 0)
+#define RCC_APB1ENR_I2C1EN     (1UL << 21)
+#define RCC_APB1ENR_I2C2EN     (1UL << 22)
+#define RCC_APB1ENR_I2C3EN     (1UL << 23)
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup TM_HOST_Typedefs
+ * @brief    Library Typedefs
+ * @{
+ */
+
+/**
+ * @brief  Simulated GPIO port, STM32F4xx register layout
+ */
+typedef struct {
+	__IO uint32_t MODER_REG[1];   /*!< Mode register */
+	__IO uint32_t OTYPER_REG[1];  /*!< Output type register */
+	__IO uint32_t OSPEEDR_REG[1]; /*!< Output speed register */
+	__IO uint32_t PUPDR_REG[1];   /*!< Pull-up/pull-down register */
+	__IO uint32_t IDR_REG[1];     /*!< Input data register, set from pin levels */
+	__IO uint32_t ODR_REG[1];     /*!< Output data register */
+	__IO uint32_t BSRR_REG[1];    /*!< Bit set/reset register, applied to ODR on next access */
+	__IO uint32_t LCKR_REG[1];    /*!< Lock register, not simulated */
+	__IO uint32_t AFR_REG[1][2];  /*!< Alternate function registers */
+} GPIO_TypeDef;
+
+/**
+ * @brief  Simulated RCC, clock enable bits are only stored
+ */
+typedef struct {
+	__IO uint32_t AHBENR;
+	__IO uint32_t AHB1ENR;
+	__IO uint32_t APB1ENR;
+	__IO uint32_t APB2ENR;
+} RCC_TypeDef;
+
+/**
+ * @brief  Simulated DWT, cycle counter follows simulated time
+ */
+typedef struct {
+	__IO uint32_t CTRL;   /*!< Control register, counter is always enabled */
+	__IO uint32_t CYCCNT; /*!< Cycle counter at @ref TM_HOST_CORE_CLOCK */
+} DWT_Type;
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup TM_HOST_Variables
+ * @brief    Library variables
+ * @{
+ */
+
+extern GPIO_TypeDef TM_HOST_GPIO[9];
+extern RCC_TypeDef TM_HOST_RCC;
+extern uint32_t SystemCoreClock;
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup TM_HOST_Functions
+ * @brief    Library Functions
+ * @{
+ */
+
+/**
+ * @brief  Gets simulated time
+ * @param  None
+ * @retval Time from start of simulation in microseconds
+ */
+uint64_t TM_HOST_GetTime(void);
+
+/**
+ * @brief  Gets simulated time with full resolution
+ * @param  None
+ * @retval Time from start of simulation in nanoseconds
+ */
+uint64_t TM_HOST_GetTimeNs(void);
+
+/**
+ * @brief  Advances simulated time
+ * @param  micros: Number of microseconds
+ * @retval None
+ */
+void TM_HOST_Delay(uint32_t micros);
+
+/**
+ * @brief  Advances simulated time with full resolution
+ * @param  nanos: Number of nanoseconds
+ * @retval None
+ */
+void TM_HOST_Advance(uint64_t nanos);
+
+/**
+ * @brief  Adds simulator update function, called on every register access
+ * @param  *Update: Pointer to update function, it is added only once
+ * @retval Status:
+ *            - 0: Function added
+ *            - > 0: All @ref TM_HOST_MAX_MODELS entries are used
+ */
+uint8_t TM_HOST_AddModel(void (*Update)(void));
+
+/**
+ * @brief  Schedules simulator event, so delays do not skip it
+ * @note   Delay functions advance time to event and call update functions. Simulator with pending event
+ *         must schedule it again on every update, events are forgotten after they are reached
+ * @param  time: Time of event in nanoseconds
+ * @retval None
+ */
+void TM_HOST_Schedule(uint64_t time);
+
+/**
+ * @brief  Simulates register access, used by register macros
+ * @note   Advances time by @ref TM_HOST_ACCESS_TIME and updates simulated peripherals
+ * @param  None
+ * @retval Always 0, index to register array
+ */
+uint8_t TM_HOST_Access(void);
+
+/**
+ * @brief  Pulls pins low externally, like slave holding open-drain line
+ * @param  *GPIOx: GPIO port
+ * @param  GPIO_Pin: Pins to change
+ * @param  low: 1 to pull pins low, 0 to release them
+ * @retval None
+ */
+void TM_HOST_GPIO_PullLow(GPIO_TypeDef* GPIOx, uint16_t GPIO_Pin, uint8_t low);
+
+/**
+ * @brief  Gets level of pins, without time advance
+ * @param  *GPIOx: GPIO port
+ * @retval Pin levels, 1 bit per pin
+ */
+uint16_t TM_HOST_GPIO_GetLevels(GPIO_TypeDef* GPIOx);
+
+/**
+ * @brief  Gets simulated DWT with cycle counter updated to current time
+ * @param  None
+ * @retval Pointer to DWT registers
+ */
+DWT_Type* TM_HOST_DWT(void);
+
+/**
+ * @brief  Gets simulated time in milliseconds, replaces HAL function on host
+ * @param  None
+ * @retval Time in milliseconds
+ */
+uint32_t HAL_GetTick(void);
+
+/**
+ * @brief  Advances simulated time in milliseconds, replaces HAL function on host
+ * @param  Delay: Number of milliseconds
+ * @retval None
+ */
+void HAL_Delay(uint32_t Delay);
+
+/**
+ * @brief  Gets simulated core clock, replaces HAL function on host
+ * @param  None
+ * @retval @ref TM_HOST_CORE_CLOCK
+ */
+uint32_t HAL_RCC_GetHCLKFreq(void);
+
+/**
+ * @brief  Gets simulated APB1 clock, replaces HAL function on host
+ * @param  None
+ * @retval @ref TM_HOST_PCLK1
+ */
+uint32_t HAL_RCC_GetPCLK1Freq(void);
+
+/**
+ * @}
+ */
+
+/**
+ * @}
+ */
+
+/**
+ * @}
+ */
+
+/* C++ detection */
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -17,10 +17,35 @@
  * |----------------------------------------------------------------------
  */
 #include "tm_stm32_i2c.h"
+#include "tm_stm32_delay.h"
+#include <string.h>
+
+/* Library drives I2C with CCR/SR1/SR2 registers, newer I2C with TIMINGR/ISR registers is not supported */
+#if defined(I2C_TIMINGR_PRESC)
+#error "TM I2C library supports only I2C peripheral with CCR register, like on STM32F1xx and STM32F4xx"
+#endif
+
+/* Private structure */
+typedef struct {
+	uint32_t Timeout;             /* Timeout in milliseconds */
+	uint32_t Clock;               /* Achieved SCL frequency */
+	TM_I2C_PinsPack_t PinsPack;   /* Pinspack used on init */
+	GPIO_TypeDef* SCL_GPIOx;      /* SCL port, used for bus recovery */
+	uint16_t SCL_Pin;             /* SCL pin, used for bus recovery */
+	GPIO_TypeDef* SDA_GPIOx;      /* SDA port, used for bus recovery */
+	uint16_t SDA_Pin;             /* SDA pin, used for bus recovery */
+	TM_I2C_Stats_t Stats;         /* Error counters */
+	uint32_t Present[4];          /* Bitmap of addresses which acknowledged */
+	uint32_t Known[4];            /* Bitmap of addresses with known presence */
+	TM_I2C_Device_t Devices[TM_I2C_MAX_DEVICES]; /* Device registry */
+	TM_I2C_Device_t* Device;      /* Device in current transaction */
+	uint32_t TransferStart;       /* Timestamp of current transaction start */
+	uint8_t Scanning;             /* Set when bus scan is in progress */
+} TM_I2C_INT_t;
 
 /* Private variables */
-static uint32_t TM_I2C_Timeout;
 static uint32_t TM_I2C_INT_Clocks[3] = {0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF};
+static TM_I2C_INT_t TM_I2C_INT[3];
 
 /* Private defines */
 #define I2C_TRANSMITTER_MODE   0
@@ -28,13 +53,53 @@ static uint32_t TM_I2C_INT_Clocks[3] = {0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF};
 #define I2C_ACK_ENABLE         1
 #define I2C_ACK_DISABLE        0
 
+/* Presence bitmap helpers, index is 7-bit address */
+#define I2C_ADDR_INDEX(address)       (((address) >> 1) & 0x7F)
+#define I2C_BITMAP_GET(map, index)    ((map)[(index) >> 5] & (1UL << ((index) & 0x1F)))
+#define I2C_BITMAP_SET(map, index)    ((map)[(index) >> 5] |= (1UL << ((index) & 0x1F)))
+#define I2C_BITMAP_CLEAR(map, index)  ((map)[(index) >> 5] &= ~(1UL << ((index) & 0x1F)))
+
+/* Addresses probed on bus scan, reserved addresses are skipped */
+#define I2C_SCAN_FIRST         (0x08 << 1)
+#define I2C_SCAN_LAST          (0x77 << 1)
+
+/* Timestamp for latency measurement */
+#define I2C_TIMESTAMP()        (DWT->CYCCNT)
+#define I2C_ELAPSED_US(start)  ((DWT->CYCCNT - (start)) / (SystemCoreClock / 1000000))
+
+/* Number of SCL pulses to release SDA line */
+#define I2C_RECOVERY_PULSES    9
+
+/* Half period of SCL during recovery in microseconds, 100kHz */
+#define I2C_RECOVERY_DELAY     5
+
+/* Maximal rise time of SCL and SDA in ns from I2C specification */
+#define I2C_STANDARD_TRISE     1000
+#define I2C_FAST_TRISE         300
+
 /* Private functions */
 void TM_I2C1_INT_InitPins(TM_I2C_PinsPack_t pinspack);
 void TM_I2C2_INT_InitPins(TM_I2C_PinsPack_t pinspack);
 void TM_I2C3_INT_InitPins(TM_I2C_PinsPack_t pinspack);
+static uint8_t TM_I2C_INT_GetIndex(I2C_TypeDef* I2Cx);
+static uint8_t TM_I2C_INT_CheckError(I2C_TypeDef* I2Cx, uint32_t tickstart);
+static uint8_t TM_I2C_INT_WaitBusFree(I2C_TypeDef* I2Cx);
+static void TM_I2C_INT_RecoveryDelay(void);
+static uint32_t TM_I2C_INT_SetClock(I2C_TypeDef* I2Cx, uint32_t clockSpeed, uint16_t dutyCycle);
+static TM_I2C_Device_t* TM_I2C_INT_GetDevice(TM_I2C_INT_t* I2C_INT, uint8_t address, uint8_t create);
+static void TM_I2C_INT_EndTransfer(TM_I2C_INT_t* I2C_INT);
+static uint8_t TM_I2C_INT_WaitTransmitted(I2C_TypeDef* I2Cx);
+static uint8_t TM_I2C_INT_ReadByte(I2C_TypeDef* I2Cx, uint8_t* data);
 
 void TM_I2C_Init(I2C_TypeDef* I2Cx, TM_I2C_PinsPack_t pinspack, uint32_t clockSpeed) {
 	I2C_InitTypeDef I2C_InitStruct;
+	TM_I2C_INT_t* I2C_INT = &TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)];
+	
+	/* Save settings for bus recovery */
+	I2C_INT->PinsPack = pinspack;
+	if (!I2C_INT->Timeout) {
+		I2C_INT->Timeout = TM_I2C_TIMEOUT_MS;
+	}
 	
 	if (I2Cx == I2C1) {
 		/* Enable clock */
@@ -95,56 +160,64 @@ void TM_I2C_Init(I2C_TypeDef* I2Cx, TM_I2C_PinsPack_t pinspack, uint32_t clockSp
 		I2C_InitStruct.I2C_Ack = TM_I2C3_ACK;
 		I2C_InitStruct.I2C_DutyCycle = TM_I2C3_DUTY_CYCLE;
 #endif // I2C3
+	} else {
+		/* Unknown peripheral, nothing to initialize */
+		return;
+	}
+	
+	/* This I2C peripheral supports up to fast mode */
+	if (I2C_InitStruct.I2C_ClockSpeed > TM_I2C_CLOCK_FAST_MODE) {
+		I2C_InitStruct.I2C_ClockSpeed = TM_I2C_CLOCK_FAST_MODE;
 	}
 	
 	/* Disable I2C first */
 	I2Cx->CR1 &= ~I2C_CR1_PE;
 	
-	/* Initialize I2C */
+	/* Initialize I2C, it enables peripheral again */
 	I2C_Init(I2Cx, &I2C_InitStruct);
 	
+	/* CCR and TRISE can be written only while peripheral is disabled */
+	I2Cx->CR1 &= ~I2C_CR1_PE;
+	
+	/* Set SCL timing and rise time for selected mode */
+	I2C_INT->Clock = TM_I2C_INT_SetClock(I2Cx, I2C_InitStruct.I2C_ClockSpeed, I2C_InitStruct.I2C_DutyCycle);
+	
 	/* Enable I2C */
 	I2Cx->CR1 |= I2C_CR1_PE;
 }
 
 uint8_t TM_I2C_Read(I2C_TypeDef* I2Cx, uint8_t address, uint8_t reg) {
-	uint8_t received_data;
-	TM_I2C_Start(I2Cx, address, I2C_TRANSMITTER_MODE, I2C_ACK_DISABLE);
-	TM_I2C_WriteData(I2Cx, reg);
-	TM_I2C_Stop(I2Cx);
-	TM_I2C_Start(I2Cx, address, I2C_RECEIVER_MODE, I2C_ACK_DISABLE);
-	received_data = TM_I2C_ReadNack(I2Cx);
+	uint8_t received_data = 0;
+	TM_I2C_Transfer_t transfer = {address, TM_I2C_TRANSFER_READ | TM_I2C_TRANSFER_REG, reg, &received_data, 1};
+	
+	/* Register write and read with repeated start */
+	TM_I2C_Transaction(I2Cx, &transfer, 1);
 	return received_data;
 }
 
 
 void TM_I2C_ReadMulti(I2C_TypeDef* I2Cx, uint8_t address, uint8_t reg, uint8_t* data, uint16_t count) {
-	uint8_t i;
-	TM_I2C_Start(I2Cx, address, I2C_TRANSMITTER_MODE, I2C_ACK_ENABLE);
-	TM_I2C_WriteData(I2Cx, reg);
-	//TM_I2C_Stop(I2Cx);
-	TM_I2C_Start(I2Cx, address, I2C_RECEIVER_MODE, I2C_ACK_ENABLE);
-	for (i = 0; i < count; i++) {
-		if (i == (count - 1)) {
-			/* Last byte */
-			data[i] = TM_I2C_ReadNack(I2Cx);
-		} else {
-			data[i] = TM_I2C_ReadAck(I2Cx);
-		}
-	}
+	TM_I2C_Transfer_t transfer = {address, TM_I2C_TRANSFER_READ | TM_I2C_TRANSFER_REG, reg, data, count};
+	
+	/* Register write and read with repeated start */
+	TM_I2C_Transaction(I2Cx, &transfer, 1);
 }
 
 uint8_t TM_I2C_ReadNoRegister(I2C_TypeDef* I2Cx, uint8_t address) {
 	uint8_t data;
-	TM_I2C_Start(I2Cx, address, I2C_RECEIVER_MODE, I2C_ACK_ENABLE);
+	if (TM_I2C_Start(I2Cx, address, I2C_RECEIVER_MODE, I2C_ACK_ENABLE)) {
+		return 0;
+	}
 	/* Also stop condition happens */
 	data = TM_I2C_ReadNack(I2Cx);
 	return data;
 }
 
 void TM_I2C_ReadMultiNoRegister(I2C_TypeDef* I2Cx, uint8_t address, uint8_t* data, uint16_t count) {
-	uint8_t i;
-	TM_I2C_Start(I2Cx, address, I2C_RECEIVER_MODE, I2C_ACK_ENABLE);
+	uint16_t i;
+	if (TM_I2C_Start(I2Cx, address, I2C_RECEIVER_MODE, I2C_ACK_ENABLE)) {
+		return;
+	}
 	for (i = 0; i < count; i++) {
 		if (i == (count - 1)) {
 			/* Last byte */
@@ -156,46 +229,333 @@ void TM_I2C_ReadMultiNoRegister(I2C_TypeDef* I2Cx, uint8_t address, uint8_t* dat
 }
 
 void TM_I2C_Write(I2C_TypeDef* I2Cx, uint8_t address, uint8_t reg, uint8_t data) {
-	TM_I2C_Start(I2Cx, address, I2C_TRANSMITTER_MODE, I2C_ACK_DISABLE);
-	TM_I2C_WriteData(I2Cx, reg);
-	TM_I2C_WriteData(I2Cx, data);
+	if (TM_I2C_Start(I2Cx, address, I2C_TRANSMITTER_MODE, I2C_ACK_DISABLE)) {
+		return;
+	}
+	if (!TM_I2C_WriteData(I2Cx, reg)) {
+		TM_I2C_WriteData(I2Cx, data);
+	}
 	TM_I2C_Stop(I2Cx);
 }
 
 void TM_I2C_WriteMulti(I2C_TypeDef* I2Cx, uint8_t address, uint8_t reg, uint8_t* data, uint16_t count) {
-	uint8_t i;
-	TM_I2C_Start(I2Cx, address, I2C_TRANSMITTER_MODE, I2C_ACK_DISABLE);
-	TM_I2C_WriteData(I2Cx, reg);
-	for (i = 0; i < count; i++) {
-		TM_I2C_WriteData(I2Cx, data[i]);
+	uint16_t i;
+	if (TM_I2C_Start(I2Cx, address, I2C_TRANSMITTER_MODE, I2C_ACK_DISABLE)) {
+		return;
+	}
+	if (!TM_I2C_WriteData(I2Cx, reg)) {
+		for (i = 0; i < count; i++) {
+			if (TM_I2C_WriteData(I2Cx, data[i])) {
+				/* Slave did not accept data */
+				break;
+			}
+		}
 	}
 	TM_I2C_Stop(I2Cx);
 }
 
 void TM_I2C_WriteNoRegister(I2C_TypeDef* I2Cx, uint8_t address, uint8_t data) {
-	TM_I2C_Start(I2Cx, address, I2C_TRANSMITTER_MODE, I2C_ACK_DISABLE);
+	if (TM_I2C_Start(I2Cx, address, I2C_TRANSMITTER_MODE, I2C_ACK_DISABLE)) {
+		return;
+	}
 	TM_I2C_WriteData(I2Cx, data);
 	TM_I2C_Stop(I2Cx);
 }
 
 void TM_I2C_WriteMultiNoRegister(I2C_TypeDef* I2Cx, uint8_t address, uint8_t* data, uint16_t count) {
-	uint8_t i;
-	TM_I2C_Start(I2Cx, address, I2C_TRANSMITTER_MODE, I2C_ACK_DISABLE);
+	uint16_t i;
+	if (TM_I2C_Start(I2Cx, address, I2C_TRANSMITTER_MODE, I2C_ACK_DISABLE)) {
+		return;
+	}
 	for (i = 0; i < count; i++) {
-		TM_I2C_WriteData(I2Cx, data[i]);
+		if (TM_I2C_WriteData(I2Cx, data[i])) {
+			/* Slave did not accept data */
+			break;
+		}
 	}
 	TM_I2C_Stop(I2Cx);
 }
 
+uint8_t TM_I2C_Transaction(I2C_TypeDef* I2Cx, TM_I2C_Transfer_t* transfers, uint8_t count) {
+	TM_I2C_Transfer_t* transfer;
+	uint16_t i;
+	uint8_t t, last;
+	
+	/* At least one byte must be read, check before bus is touched */
+	for (t = 0; t < count; t++) {
+		if ((transfers[t].Flags & TM_I2C_TRANSFER_READ) && transfers[t].Count == 0) {
+			return 1;
+		}
+	}
+	
+	for (t = 0; t < count; t++) {
+		transfer = &transfers[t];
+		last = (t == (count - 1));
+		
+		/* Register is always written in transmitter mode */
+		if (transfer->Flags & TM_I2C_TRANSFER_REG) {
+			if (TM_I2C_Start(I2Cx, transfer->Address, I2C_TRANSMITTER_MODE, I2C_ACK_DISABLE)) {
+				return 1;
+			}
+			if (TM_I2C_WriteData(I2Cx, transfer->Reg)) {
+				return 1;
+			}
+		}
+		
+		if (transfer->Flags & TM_I2C_TRANSFER_READ) {
+			/* Register must be sent before repeated start */
+			if ((transfer->Flags & TM_I2C_TRANSFER_REG) && TM_I2C_INT_WaitTransmitted(I2Cx)) {
+				return 1;
+			}
+			
+			/* Single byte is not acknowledged */
+			I2Cx->CR1 &= ~I2C_CR1_ACK;
+			
+			/* Start in receiver mode, repeated start when previous part is not finished */
+			if (TM_I2C_Start(I2Cx, transfer->Address, I2C_RECEIVER_MODE, transfer->Count > 1 ? I2C_ACK_ENABLE : I2C_ACK_DISABLE)) {
+				return 1;
+			}
+			
+			/* Read all bytes except last one */
+			for (i = 0; i < (transfer->Count - 1); i++) {
+				if (TM_I2C_INT_ReadByte(I2Cx, &transfer->Data[i])) {
+					return 1;
+				}
+			}
+			
+			/* Last byte is not acknowledged, followed by stop or repeated start */
+			I2Cx->CR1 &= ~I2C_CR1_ACK;
+			if (last) {
+				I2Cx->CR1 |= I2C_CR1_STOP;
+			} else {
+				I2Cx->CR1 |= I2C_CR1_START;
+			}
+			if (TM_I2C_INT_ReadByte(I2Cx, &transfer->Data[i])) {
+				return 1;
+			}
+		} else {
+			/* Start in transmitter mode if register was not sent */
+			if (!(transfer->Flags & TM_I2C_TRANSFER_REG)) {
+				if (TM_I2C_Start(I2Cx, transfer->Address, I2C_TRANSMITTER_MODE, I2C_ACK_DISABLE)) {
+					return 1;
+				}
+			}
+			
+			/* Send data */
+			for (i = 0; i < transfer->Count; i++) {
+				if (TM_I2C_WriteData(I2Cx, transfer->Data[i])) {
+					return 1;
+				}
+			}
+			
+			/* Finish with stop or wait for repeated start on next part */
+			if (last) {
+				if (TM_I2C_Stop(I2Cx)) {
+					return 1;
+				}
+			} else if (TM_I2C_INT_WaitTransmitted(I2Cx)) {
+				return 1;
+			}
+		}
+	}
+	
+	/* Transaction with stop condition is finished */
+	if (count && (transfers[count - 1].Flags & TM_I2C_TRANSFER_READ)) {
+		TM_I2C_INT_EndTransfer(&TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)]);
+	}
+	
+	/* Return 0, everything ok */
+	return 0;
+}
+
+uint32_t TM_I2C_GetClock(I2C_TypeDef* I2Cx) {
+	/* Return SCL frequency set on init */
+	return TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)].Clock;
+}
+
+void TM_I2C_SetTimeout(I2C_TypeDef* I2Cx, uint32_t timeout) {
+	/* Set new timeout for I2C */
+	TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)].Timeout = timeout;
+}
+
+void TM_I2C_GetStats(I2C_TypeDef* I2Cx, TM_I2C_Stats_t* stats) {
+	/* Copy counters */
+	*stats = TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)].Stats;
+}
+
+void TM_I2C_ResetStats(I2C_TypeDef* I2Cx) {
+	TM_I2C_INT_t* I2C_INT = &TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)];
+	uint8_t i, address;
+	
+	/* Clear counters */
+	memset(&I2C_INT->Stats, 0, sizeof(TM_I2C_Stats_t));
+	
+	/* Clear device counters, keep registered addresses */
+	for (i = 0; i < TM_I2C_MAX_DEVICES; i++) {
+		address = I2C_INT->Devices[i].Address;
+		memset(&I2C_INT->Devices[i], 0, sizeof(TM_I2C_Device_t));
+		I2C_INT->Devices[i].Address = address;
+	}
+}
+
+uint8_t TM_I2C_Scan(I2C_TypeDef* I2Cx, uint8_t* addresses, uint8_t count) {
+	TM_I2C_INT_t* I2C_INT = &TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)];
+	uint16_t address;
+	uint8_t found = 0;
+	
+	/* Absent addresses are not counted as errors */
+	I2C_INT->Scanning = 1;
+	
+	/* Probe all non-reserved addresses */
+	for (address = I2C_SCAN_FIRST; address <= I2C_SCAN_LAST; address += 2) {
+		if (TM_I2C_IsDeviceConnected(I2Cx, address)) {
+			/* Register device for statistics */
+			TM_I2C_INT_GetDevice(I2C_INT, address, 1);
+			
+			/* Save address if there is space */
+			if (addresses != NULL && found < count) {
+				addresses[found] = address;
+			}
+			found++;
+		}
+	}
+	
+	/* Scan finished */
+	I2C_INT->Scanning = 0;
+	
+	/* Return number of devices found */
+	return found;
+}
+
+uint8_t TM_I2C_IsDevicePresent(I2C_TypeDef* I2Cx, uint8_t address) {
+	TM_I2C_INT_t* I2C_INT = &TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)];
+	uint8_t index = I2C_ADDR_INDEX(address);
+	
+	/* Probe bus only first time */
+	if (!I2C_BITMAP_GET(I2C_INT->Known, index)) {
+		return TM_I2C_IsDeviceConnected(I2Cx, address);
+	}
+	
+	/* Return cached value */
+	return I2C_BITMAP_GET(I2C_INT->Present, index) ? 1 : 0;
+}
+
+void TM_I2C_ForgetDevice(I2C_TypeDef* I2Cx, uint8_t address) {
+	/* Device will be probed again on next check */
+	I2C_BITMAP_CLEAR(TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)].Known, I2C_ADDR_INDEX(address));
+}
+
+uint8_t TM_I2C_GetDeviceStats(I2C_TypeDef* I2Cx, uint8_t address, TM_I2C_Device_t* device) {
+	TM_I2C_Device_t* dev = TM_I2C_INT_GetDevice(&TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)], address, 0);
+	
+	/* Device is not in registry */
+	if (dev == NULL) {
+		return 1;
+	}
+	
+	/* Copy counters */
+	*device = *dev;
+	
+	/* Return 0, everything ok */
+	return 0;
+}
+
+void TM_I2C_SetBusPins(I2C_TypeDef* I2Cx, GPIO_TypeDef* SCL_GPIOx, uint16_t SCL_Pin, GPIO_TypeDef* SDA_GPIOx, uint16_t SDA_Pin) {
+	TM_I2C_INT_t* I2C_INT = &TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)];
+	
+	/* Save pins */
+	I2C_INT->SCL_GPIOx = SCL_GPIOx;
+	I2C_INT->SCL_Pin = SCL_Pin;
+	I2C_INT->SDA_GPIOx = SDA_GPIOx;
+	I2C_INT->SDA_Pin = SDA_Pin;
+}
+
+uint8_t TM_I2C_BusRecovery(I2C_TypeDef* I2Cx) {
+	uint8_t i, index = TM_I2C_INT_GetIndex(I2Cx);
+	TM_I2C_INT_t* I2C_INT = &TM_I2C_INT[index];
+	uint8_t released;
+	
+	/* We need to know pins */
+	if (I2C_INT->SCL_GPIOx == NULL || I2C_INT->SDA_GPIOx == NULL) {
+		return 1;
+	}
+	
+	/* Disable I2C, pins will be driven as GPIO */
+	I2Cx->CR1 &= ~I2C_CR1_PE;
+	
+	/* Set both lines high first, open-drain */
+	TM_GPIO_SetPinHigh(I2C_INT->SCL_GPIOx, I2C_INT->SCL_Pin);
+	TM_GPIO_SetPinHigh(I2C_INT->SDA_GPIOx, I2C_INT->SDA_Pin);
+	TM_GPIO_Init(I2C_INT->SCL_GPIOx, I2C_INT->SCL_Pin, TM_GPIO_Mode_OUT, TM_GPIO_OType_OD, TM_GPIO_PuPd_UP, TM_GPIO_Speed_Medium);
+	TM_GPIO_Init(I2C_INT->SDA_GPIOx, I2C_INT->SDA_Pin, TM_GPIO_Mode_OUT, TM_GPIO_OType_OD, TM_GPIO_PuPd_UP, TM_GPIO_Speed_Medium);
+	TM_I2C_INT_RecoveryDelay();
+	
+	/* Clock out bits until slave releases SDA */
+	for (i = 0; i < I2C_RECOVERY_PULSES; i++) {
+		if (TM_GPIO_GetInputPinValue(I2C_INT->SDA_GPIOx, I2C_INT->SDA_Pin)) {
+			break;
+		}
+		TM_GPIO_SetPinLow(I2C_INT->SCL_GPIOx, I2C_INT->SCL_Pin);
+		TM_I2C_INT_RecoveryDelay();
+		TM_GPIO_SetPinHigh(I2C_INT->SCL_GPIOx, I2C_INT->SCL_Pin);
+		TM_I2C_INT_RecoveryDelay();
+	}
+	
+	/* Generate STOP condition, SDA goes high while SCL is high */
+	TM_GPIO_SetPinLow(I2C_INT->SCL_GPIOx, I2C_INT->SCL_Pin);
+	TM_I2C_INT_RecoveryDelay();
+	TM_GPIO_SetPinLow(I2C_INT->SDA_GPIOx, I2C_INT->SDA_Pin);
+	TM_I2C_INT_RecoveryDelay();
+	TM_GPIO_SetPinHigh(I2C_INT->SCL_GPIOx, I2C_INT->SCL_Pin);
+	TM_I2C_INT_RecoveryDelay();
+	TM_GPIO_SetPinHigh(I2C_INT->SDA_GPIOx, I2C_INT->SDA_Pin);
+	TM_I2C_INT_RecoveryDelay();
+	
+	/* Check lines */
+	released = TM_GPIO_GetInputPinValue(I2C_INT->SCL_GPIOx, I2C_INT->SCL_Pin) &&
+		TM_GPIO_GetInputPinValue(I2C_INT->SDA_GPIOx, I2C_INT->SDA_Pin);
+	
+	/* Reset I2C peripheral, BUSY flag stays set otherwise */
+	I2Cx->CR1 |= I2C_CR1_SWRST;
+	I2Cx->CR1 &= ~I2C_CR1_SWRST;
+	
+	/* Initialize pins and I2C again */
+	TM_I2C_Init(I2Cx, I2C_INT->PinsPack, TM_I2C_INT_Clocks[index]);
+	
+	/* Count recovery */
+	I2C_INT->Stats.Recoveries++;
+	
+	/* Return status */
+	return !released;
+}
+
 /* Private functions */
 int16_t TM_I2C_Start(I2C_TypeDef* I2Cx, uint8_t address, uint8_t direction, uint8_t ack) {
-	/* Generate I2C start pulse */
-	I2Cx->CR1 |= I2C_CR1_START;
+	TM_I2C_INT_t* I2C_INT = &TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)];
+	uint32_t tickstart;
+	
+	/* Bus must be free if we are not master already (repeated start), master with pending stop is leaving the bus */
+	if (!(I2Cx->SR2 & I2C_SR2_MSL) || (I2Cx->CR1 & I2C_CR1_STOP)) {
+		if (TM_I2C_INT_WaitBusFree(I2Cx)) {
+			return 1;
+		}
+		
+		/* New transaction starts */
+		I2C_INT->TransferStart = I2C_TIMESTAMP();
+	}
+	
+	/* Select device for statistics, absent devices are not registered on scan */
+	I2C_INT->Device = TM_I2C_INT_GetDevice(I2C_INT, address, !I2C_INT->Scanning);
+	
+	/* Generate I2C start pulse, repeated start may be already generated after last read byte */
+	if (!(I2Cx->SR1 & I2C_SR1_SB)) {
+		I2Cx->CR1 |= I2C_CR1_START;
+	}
 	
 	/* Wait till I2C is busy */
-	TM_I2C_Timeout = TM_I2C_TIMEOUT;
+	tickstart = HAL_GetTick();
 	while (!(I2Cx->SR1 & I2C_SR1_SB)) {
-		if (--TM_I2C_Timeout == 0x00) {
+		if (TM_I2C_INT_CheckError(I2Cx, tickstart)) {
 			return 1;
 		}
 	}
@@ -211,9 +571,9 @@ int16_t TM_I2C_Start(I2C_TypeDef* I2Cx, uint8_t address, uint8_t direction, uint
 		I2Cx->DR = address & ~I2C_OAR1_ADD0;
 		
 		/* Wait till finished */
-		TM_I2C_Timeout = TM_I2C_TIMEOUT;
+		tickstart = HAL_GetTick();
 		while (!(I2Cx->SR1 & I2C_SR1_ADDR)) {
-			if (--TM_I2C_Timeout == 0x00) {
+			if (TM_I2C_INT_CheckError(I2Cx, tickstart)) {
 				return 1;
 			}
 		}
@@ -223,9 +583,9 @@ int16_t TM_I2C_Start(I2C_TypeDef* I2Cx, uint8_t address, uint8_t direction, uint
 		I2Cx->DR = address | I2C_OAR1_ADD0;
 		
 		/* Wait till finished */
-		TM_I2C_Timeout = TM_I2C_TIMEOUT;
+		tickstart = HAL_GetTick();
 		while (!I2C_CheckEvent(I2Cx, I2C_EVENT_MASTER_RECEIVER_MODE_SELECTED)) {
-			if (--TM_I2C_Timeout == 0x00) {
+			if (TM_I2C_INT_CheckError(I2Cx, tickstart)) {
 				return 1;
 			}
 		}
@@ -234,31 +594,43 @@ int16_t TM_I2C_Start(I2C_TypeDef* I2Cx, uint8_t address, uint8_t direction, uint
 	/* Read status register to clear ADDR flag */
 	I2Cx->SR2;
 	
+	/* Device acknowledged, it is present */
+	I2C_BITMAP_SET(I2C_INT->Present, I2C_ADDR_INDEX(address));
+	I2C_BITMAP_SET(I2C_INT->Known, I2C_ADDR_INDEX(address));
+	
 	/* Return 0, everything ok */
 	return 0;
 }
 
-void TM_I2C_WriteData(I2C_TypeDef* I2Cx, uint8_t data) {
+uint8_t TM_I2C_WriteData(I2C_TypeDef* I2Cx, uint8_t data) {
+	uint32_t tickstart;
+	
 	/* Wait till I2C is not busy anymore */
-	TM_I2C_Timeout = TM_I2C_TIMEOUT;
-	while (!(I2Cx->SR1 & I2C_SR1_TXE) && TM_I2C_Timeout) {
-		TM_I2C_Timeout--;
+	tickstart = HAL_GetTick();
+	while (!(I2Cx->SR1 & I2C_SR1_TXE)) {
+		if (TM_I2C_INT_CheckError(I2Cx, tickstart)) {
+			return 1;
+		}
 	}
 	
 	/* Send I2C data */
 	I2Cx->DR = data;
+	
+	/* Return 0, everything ok */
+	return 0;
 }
 
 uint8_t TM_I2C_ReadAck(I2C_TypeDef* I2Cx) {
 	uint8_t data;
+	uint32_t tickstart;
 	
 	/* Enable ACK */
 	I2Cx->CR1 |= I2C_CR1_ACK;
 	
 	/* Wait till not received */
-	TM_I2C_Timeout = TM_I2C_TIMEOUT;
+	tickstart = HAL_GetTick();
 	while (!I2C_CheckEvent(I2Cx, I2C_EVENT_MASTER_BYTE_RECEIVED)) {
-		if (--TM_I2C_Timeout == 0x00) {
+		if (TM_I2C_INT_CheckError(I2Cx, tickstart)) {
 			return 1;
 		}
 	}
@@ -272,6 +644,7 @@ uint8_t TM_I2C_ReadAck(I2C_TypeDef* I2Cx) {
 
 uint8_t TM_I2C_ReadNack(I2C_TypeDef* I2Cx) {
 	uint8_t data;
+	uint32_t tickstart;
 	
 	/* Disable ACK */
 	I2Cx->CR1 &= ~I2C_CR1_ACK;
@@ -280,9 +653,9 @@ uint8_t TM_I2C_ReadNack(I2C_TypeDef* I2Cx) {
 	I2Cx->CR1 |= I2C_CR1_STOP;
 	
 	/* Wait till received */
-	TM_I2C_Timeout = TM_I2C_TIMEOUT;
+	tickstart = HAL_GetTick();
 	while (!I2C_CheckEvent(I2Cx, I2C_EVENT_MASTER_BYTE_RECEIVED)) {
-		if (--TM_I2C_Timeout == 0x00) {
+		if (TM_I2C_INT_CheckError(I2Cx, tickstart)) {
 			return 1;
 		}
 	}
@@ -290,15 +663,20 @@ uint8_t TM_I2C_ReadNack(I2C_TypeDef* I2Cx) {
 	/* Read data */
 	data = I2Cx->DR;
 	
+	/* Transaction finished with stop */
+	TM_I2C_INT_EndTransfer(&TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)]);
+	
 	/* Return data */
 	return data;
 }
 
 uint8_t TM_I2C_Stop(I2C_TypeDef* I2Cx) {
+	uint32_t tickstart;
+	
 	/* Wait till transmitter not empty */
-	TM_I2C_Timeout = TM_I2C_TIMEOUT;
+	tickstart = HAL_GetTick();
 	while (((!(I2Cx->SR1 & I2C_SR1_TXE)) || (!(I2Cx->SR1 & I2C_SR1_BTF)))) {
-		if (--TM_I2C_Timeout == 0x00) {
+		if (TM_I2C_INT_CheckError(I2Cx, tickstart)) {
 			return 1;
 		}
 	}
@@ -306,22 +684,31 @@ uint8_t TM_I2C_Stop(I2C_TypeDef* I2Cx) {
 	/* Generate stop */
 	I2Cx->CR1 |= I2C_CR1_STOP;
 	
+	/* Transaction finished */
+	TM_I2C_INT_EndTransfer(&TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)]);
+	
 	/* Return 0, everything ok */
 	return 0;
 }
 
 uint8_t TM_I2C_IsDeviceConnected(I2C_TypeDef* I2Cx, uint8_t address) {
-	uint8_t connected = 0;
+	TM_I2C_INT_t* I2C_INT = &TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)];
+	
 	/* Try to start, function will return 0 in case device will send ACK */
-	if (!TM_I2C_Start(I2Cx, address, I2C_TRANSMITTER_MODE, I2C_ACK_ENABLE)) {
-		connected = 1;
+	if (TM_I2C_Start(I2Cx, address, I2C_TRANSMITTER_MODE, I2C_ACK_ENABLE)) {
+		/* Device is not present */
+		I2C_BITMAP_CLEAR(I2C_INT->Present, I2C_ADDR_INDEX(address));
+		I2C_BITMAP_SET(I2C_INT->Known, I2C_ADDR_INDEX(address));
+		
+		/* Stop condition was already generated */
+		return 0;
 	}
 	
 	/* STOP I2C */
 	TM_I2C_Stop(I2Cx);
 	
-	/* Return status */
-	return connected;
+	/* Device is connected */
+	return 1;
 }
 
 __weak void TM_I2C_InitCustomPinsCallback(I2C_TypeDef* I2Cx, uint16_t AlternateFunction) {
@@ -339,12 +726,14 @@ void TM_I2C1_INT_InitPins(TM_I2C_PinsPack_t pinspack) {
 #else
 		TM_GPIO_InitAlternate(GPIOB, GPIO_PIN_6 | GPIO_PIN_7, TM_GPIO_OType_OD, TM_GPIO_PuPd_UP, TM_GPIO_Speed_Medium, GPIO_AF_I2C1);
 #endif //
+		TM_I2C_SetBusPins(I2C1, GPIOB, GPIO_PIN_6, GPIOB, GPIO_PIN_7);
 	}
 #endif
 #if defined(GPIOB)
 	if (pinspack == TM_I2C_PinsPack_2) {
 #ifdef GPIO_AF_I2C1
 		TM_GPIO_InitAlternate(GPIOB, GPIO_PIN_8 | GPIO_PIN_9, TM_GPIO_OType_OD, TM_GPIO_PuPd_UP, TM_GPIO_Speed_Medium, GPIO_AF_I2C1);
+		TM_I2C_SetBusPins(I2C1, GPIOB, GPIO_PIN_8, GPIOB, GPIO_PIN_9);
 #endif //
 		}
 #endif
@@ -352,6 +741,7 @@ void TM_I2C1_INT_InitPins(TM_I2C_PinsPack_t pinspack) {
 	if (pinspack == TM_I2C_PinsPack_3) {
 #ifdef GPIO_AF_I2C1
 		TM_GPIO_InitAlternate(GPIOB, GPIO_PIN_6 | GPIO_PIN_9, TM_GPIO_OType_OD, TM_GPIO_PuPd_UP, TM_GPIO_Speed_Medium, GPIO_AF_I2C1);
+		TM_I2C_SetBusPins(I2C1, GPIOB, GPIO_PIN_6, GPIOB, GPIO_PIN_9);
 #endif //
 		}
 #endif
@@ -372,12 +762,14 @@ void TM_I2C2_INT_InitPins(TM_I2C_PinsPack_t pinspack) {
 #else
 		TM_GPIO_InitAlternate(GPIOB, GPIO_PIN_10 | GPIO_PIN_11, TM_GPIO_OType_OD, TM_GPIO_PuPd_UP, TM_GPIO_Speed_Medium, GPIO_AF_I2C2);
 #endif
+		TM_I2C_SetBusPins(I2C2, GPIOB, GPIO_PIN_10, GPIOB, GPIO_PIN_11);
 	}
 #endif
 #if defined(GPIOF)
 	if (pinspack == TM_I2C_PinsPack_2) {
 #ifdef GPIO_AF_I2C1
 		TM_GPIO_InitAlternate(GPIOF, GPIO_PIN_0 | GPIO_PIN_1, TM_GPIO_OType_OD, TM_GPIO_PuPd_UP, TM_GPIO_Speed_Medium, GPIO_AF_I2C2);
+		TM_I2C_SetBusPins(I2C2, GPIOF, GPIO_PIN_1, GPIOF, GPIO_PIN_0);
 #endif
 	}
 #endif
@@ -385,6 +777,7 @@ void TM_I2C2_INT_InitPins(TM_I2C_PinsPack_t pinspack) {
 	if (pinspack == TM_I2C_PinsPack_3) {
 #ifdef GPIO_AF_I2C1
 		TM_GPIO_InitAlternate(GPIOH, GPIO_PIN_4 | GPIO_PIN_5, TM_GPIO_OType_OD, TM_GPIO_PuPd_UP, TM_GPIO_Speed_Medium, GPIO_AF_I2C2);
+		TM_I2C_SetBusPins(I2C2, GPIOH, GPIO_PIN_4, GPIOH, GPIO_PIN_5);
 #endif
 	}
 #endif
@@ -403,11 +796,13 @@ void TM_I2C3_INT_InitPins(TM_I2C_PinsPack_t pinspack) {
 	if (pinspack == TM_I2C_PinsPack_1) {
 		TM_GPIO_InitAlternate(GPIOA, GPIO_PIN_8, TM_GPIO_OType_OD, TM_GPIO_PuPd_UP, TM_GPIO_Speed_Medium, GPIO_AF_I2C3);
 		TM_GPIO_InitAlternate(GPIOC, GPIO_PIN_9, TM_GPIO_OType_OD, TM_GPIO_PuPd_UP, TM_GPIO_Speed_Medium, GPIO_AF_I2C3);
+		TM_I2C_SetBusPins(I2C3, GPIOA, GPIO_PIN_8, GPIOC, GPIO_PIN_9);
 	}
 #endif
 #if defined(GPIOH)
 	if (pinspack == TM_I2C_PinsPack_2) {
 		TM_GPIO_InitAlternate(GPIOH, GPIO_PIN_7 | GPIO_PIN_8, TM_GPIO_OType_OD, TM_GPIO_PuPd_UP, TM_GPIO_Speed_Medium, GPIO_AF_I2C3);
+		TM_I2C_SetBusPins(I2C3, GPIOH, GPIO_PIN_7, GPIOH, GPIO_PIN_8);
 	}
 #endif
 	if (pinspack == TM_I2C_PinsPack_Custom) {
@@ -416,3 +811,230 @@ void TM_I2C3_INT_InitPins(TM_I2C_PinsPack_t pinspack) {
 	}
 }
 #endif // I2C3
+
+static uint8_t TM_I2C_INT_GetIndex(I2C_TypeDef* I2Cx) {
+	/* Get index for I2C peripheral */
+	if (I2Cx == I2C2) {
+		return 1;
+	}
+#ifdef I2C3
+	if (I2Cx == I2C3) {
+		return 2;
+	}
+#endif
+	return 0;
+}
+
+static uint8_t TM_I2C_INT_CheckError(I2C_TypeDef* I2Cx, uint32_t tickstart) {
+	TM_I2C_INT_t* I2C_INT = &TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)];
+	uint32_t sr1 = I2Cx->SR1;
+	
+	/* Slave did not acknowledge, no need to wait for timeout */
+	if (sr1 & I2C_SR1_AF) {
+		I2Cx->SR1 = ~I2C_SR1_AF;
+		I2Cx->CR1 |= I2C_CR1_STOP;
+		
+		/* Absent devices are expected on bus scan */
+		if (!I2C_INT->Scanning) {
+			I2C_INT->Stats.Nacks++;
+			if (I2C_INT->Device) {
+				I2C_INT->Device->Nacks++;
+			}
+		}
+		TM_I2C_INT_EndTransfer(I2C_INT);
+		return 1;
+	}
+	
+	/* Arbitration lost, peripheral is in slave mode now */
+	if (sr1 & I2C_SR1_ARLO) {
+		I2Cx->SR1 = ~I2C_SR1_ARLO;
+		I2C_INT->Stats.ArbitrationLost++;
+		TM_I2C_INT_EndTransfer(I2C_INT);
+		return 1;
+	}
+	
+	/* Misplaced start or stop condition */
+	if (sr1 & I2C_SR1_BERR) {
+		I2Cx->SR1 = ~I2C_SR1_BERR;
+		I2Cx->CR1 |= I2C_CR1_STOP;
+		I2C_INT->Stats.BusErrors++;
+		TM_I2C_INT_EndTransfer(I2C_INT);
+		return 1;
+	}
+	
+	/* Check timeout */
+	if ((HAL_GetTick() - tickstart) > I2C_INT->Timeout) {
+		I2Cx->CR1 |= I2C_CR1_STOP;
+		I2C_INT->Stats.Timeouts++;
+		if (I2C_INT->Device) {
+			I2C_INT->Device->Timeouts++;
+		}
+		TM_I2C_INT_EndTransfer(I2C_INT);
+		return 1;
+	}
+	
+	/* No error */
+	return 0;
+}
+
+static uint8_t TM_I2C_INT_WaitBusFree(I2C_TypeDef* I2Cx) {
+	TM_I2C_INT_t* I2C_INT = &TM_I2C_INT[TM_I2C_INT_GetIndex(I2Cx)];
+	uint32_t tickstart = HAL_GetTick();
+	
+	/* Wait till other master or slave releases the bus */
+	while (I2Cx->SR2 & I2C_SR2_BUSY) {
+		if ((HAL_GetTick() - tickstart) > I2C_INT->Timeout) {
+			/* Bus is stuck, try to release it */
+			I2C_INT->Stats.Timeouts++;
+			return TM_I2C_BusRecovery(I2Cx);
+		}
+	}
+	
+	/* Bus is free */
+	return 0;
+}
+
+static void TM_I2C_INT_RecoveryDelay(void) {
+	uint32_t tickstart;
+	
+	/* Delay needs DWT counter, wait for second tick change otherwise, at least 1ms */
+	if (!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk)) {
+		tickstart = HAL_GetTick();
+		while ((HAL_GetTick() - tickstart) < 2);
+		return;
+	}
+	
+	/* Half period of SCL */
+	Delay(I2C_RECOVERY_DELAY);
+}
+
+static uint32_t TM_I2C_INT_SetClock(I2C_TypeDef* I2Cx, uint32_t clockSpeed, uint16_t dutyCycle) {
+	uint32_t pclk = HAL_RCC_GetPCLK1Freq();
+	uint32_t freqrange = pclk / 1000000;
+	uint32_t ccr, divider;
+	
+	/* Set peripheral clock in MHz */
+	I2Cx->CR2 = (I2Cx->CR2 & ~I2C_CR2_FREQ) | freqrange;
+	
+	/* Fast mode needs at least 4MHz peripheral clock */
+	if (clockSpeed > TM_I2C_CLOCK_STANDARD && freqrange >= 4) {
+		/* Fast mode plus is not supported */
+		if (clockSpeed > TM_I2C_CLOCK_FAST_MODE) {
+			clockSpeed = TM_I2C_CLOCK_FAST_MODE;
+		}
+		
+		/* Tlow/Thigh = 2 or 16/9 */
+		divider = (dutyCycle == I2C_DutyCycle_16_9) ? 25 : 3;
+		
+		/* Round up, SCL must not be faster than requested */
+		ccr = (pclk + divider * clockSpeed - 1) / (divider * clockSpeed);
+		if (ccr < 1) {
+			ccr = 1;
+		} else if (ccr > I2C_CCR_CCR) {
+			ccr = I2C_CCR_CCR;
+		}
+		
+		/* Set fast mode */
+		I2Cx->CCR = I2C_CCR_FS | (divider == 25 ? I2C_CCR_DUTY : 0) | ccr;
+		I2Cx->TRISE = (freqrange * I2C_FAST_TRISE) / 1000 + 1;
+	} else {
+		/* Standard mode up to 100kHz */
+		if (clockSpeed > TM_I2C_CLOCK_STANDARD) {
+			clockSpeed = TM_I2C_CLOCK_STANDARD;
+		}
+		divider = 2;
+		
+		/* Round up, minimal value in standard mode is 4 */
+		ccr = (pclk + divider * clockSpeed - 1) / (divider * clockSpeed);
+		if (ccr < 4) {
+			ccr = 4;
+		} else if (ccr > I2C_CCR_CCR) {
+			ccr = I2C_CCR_CCR;
+		}
+		
+		/* Set standard mode */
+		I2Cx->CCR = ccr;
+		I2Cx->TRISE = freqrange * I2C_STANDARD_TRISE / 1000 + 1;
+	}
+	
+	/* Return nominal SCL frequency, without rise and fall times */
+	return pclk / (divider * ccr);
+}
+
+static TM_I2C_Device_t* TM_I2C_INT_GetDevice(TM_I2C_INT_t* I2C_INT, uint8_t address, uint8_t create) {
+	TM_I2C_Device_t* free = NULL;
+	uint8_t i;
+	
+	/* Address without read/write bit */
+	address &= ~I2C_OAR1_ADD0;
+	
+	/* Find device in registry */
+	for (i = 0; i < TM_I2C_MAX_DEVICES; i++) {
+		if (I2C_INT->Devices[i].Address == address) {
+			return &I2C_INT->Devices[i];
+		}
+		if (free == NULL && I2C_INT->Devices[i].Address == 0) {
+			free = &I2C_INT->Devices[i];
+		}
+	}
+	
+	/* Register new device if there is space */
+	if (create && free != NULL && address != 0) {
+		memset(free, 0, sizeof(TM_I2C_Device_t));
+		free->Address = address;
+		return free;
+	}
+	
+	/* Not registered */
+	return NULL;
+}
+
+static void TM_I2C_INT_EndTransfer(TM_I2C_INT_t* I2C_INT) {
+	TM_I2C_Device_t* dev = I2C_INT->Device;
+	
+	/* No device in transaction */
+	if (dev == NULL) {
+		return;
+	}
+	
+	/* Count transaction and its duration */
+	dev->Transactions++;
+	dev->LatencyLast = I2C_ELAPSED_US(I2C_INT->TransferStart);
+	if (dev->LatencyLast > dev->LatencyMax) {
+		dev->LatencyMax = dev->LatencyLast;
+	}
+	
+	/* Transaction finished */
+	I2C_INT->Device = NULL;
+}
+
+static uint8_t TM_I2C_INT_WaitTransmitted(I2C_TypeDef* I2Cx) {
+	uint32_t tickstart = HAL_GetTick();
+	
+	/* Wait till last byte is shifted out */
+	while (!(I2Cx->SR1 & I2C_SR1_BTF)) {
+		if (TM_I2C_INT_CheckError(I2Cx, tickstart)) {
+			return 1;
+		}
+	}
+	
+	/* Return 0, everything ok */
+	return 0;
+}
+
+static uint8_t TM_I2C_INT_ReadByte(I2C_TypeDef* I2Cx, uint8_t* data) {
+	uint32_t tickstart = HAL_GetTick();
+	
+	/* Wait till received */
+	while (!(I2Cx->SR1 & I2C_SR1_RXNE)) {
+		if (TM_I2C_INT_CheckError(I2Cx, tickstart)) {
+			return 1;
+		}
+	}
+	
+	/* Read data */
+	*data = I2Cx->DR;
+	
+	/* Return 0, everything ok */
+	return 0;
+}
@@ -3,7 +3,7 @@
  * @email   tilen@majerle.eu
  * @website http://stm32f4-discovery.com
  * @link    http://stm32f4-discovery.com/2014/05/library-09-i2c-for-stm32f4xx/
- * @version v1.6.1
+ * @version v1.7
  * @ide     Keil uVision
  * @license GNU GPL v3
  * @brief   I2C library for STM32F4xx
@@ -28,7 +28,7 @@
 @endverbatim
  */
 #ifndef TM_I2C_H
-#define TM_I2C_H 161
+#define TM_I2C_H 170
 /**
  * @addtogroup TM_STM32F4xx_Libraries
  * @{
@@ -71,10 +71,95 @@ I2C3   |PA8   PC9    |PH7   PH8    |-     -
 //Duty cycle 2, 50%
 #define TM_I2Cx_DUTY_CYCLE             I2C_DutyCycle_2
 @endverbatim
+ *
+ * \par Bus speed
+ *
+ * Clock speed passed to @ref TM_I2C_Init() selects mode of I2C bus:
+ *  - Up to @ref TM_I2C_CLOCK_STANDARD: standard mode, 1000ns rise time
+ *  - Up to @ref TM_I2C_CLOCK_FAST_MODE: fast mode, 300ns rise time and duty cycle from TM_I2Cx_DUTY_CYCLE setting
+ *
+ * Faster speeds are limited to fast mode. I2C peripheral with timing register (STM32F0xx, STM32F7xx) is not supported.
+ *
+ * SCL is rounded down to nearest possible frequency and never goes above requested one.
+ * Achieved frequency can be read with @ref TM_I2C_GetClock().
+ *
+ * Duty cycle 16/9 (I2C_DutyCycle_16_9) gives exact 400kHz only when APB1 clock is multiple of 10MHz.
+ *
+ * \par Timeouts and bus recovery
+ *
+ * Each I2C peripheral has its own timeout in milliseconds, measured with HAL_GetTick().
+ * Default value is set with @ref TM_I2C_TIMEOUT_MS and can be changed at runtime with @ref TM_I2C_SetTimeout().
+ *
+ * If slave holds SDA line low (for example reset in the middle of read operation), library detects busy bus
+ * on next start condition and calls @ref TM_I2C_BusRecovery() automatically.
+ * Recovery takes over SCL and SDA pins as GPIO, clocks out up to 9 SCL pulses until slave releases SDA,
+ * generates STOP condition and reinitializes I2C peripheral.
+ *
+ * When @ref TM_I2C_PinsPack_Custom is used, call @ref TM_I2C_SetBusPins() from your custom pins callback,
+ * otherwise library does not know which pins to use for recovery.
+ *
+ * SCL pulses during recovery are timed with Delay() from TM DELAY library, at most 100kHz.
+ * When DWT counter is not started with TM_DELAY_Init(), HAL_GetTick() is used and recovery takes up to 50ms.
+ *
+ * Errors are counted for each I2C peripheral separately, check @ref TM_I2C_GetStats().
+ *
+@verbatim
+//Timeout for I2C operations in milliseconds
+#define TM_I2C_TIMEOUT_MS              10
+@endverbatim
+ *
+ * \par Device registry
+ *
+ * Library remembers which addresses acknowledged on each I2C bus.
+ * @ref TM_I2C_Scan() probes all addresses once, @ref TM_I2C_IsDevicePresent() then answers from memory
+ * without touching the bus, so absent devices do not cost a timeout on every check.
+ * Presence is also updated by @ref TM_I2C_IsDeviceConnected() and by every acknowledged start condition.
+ * Use @ref TM_I2C_ForgetDevice() when device can be plugged or removed at runtime.
+ *
+ * Up to TM_I2C_MAX_DEVICES devices per bus get their own transaction, NACK, timeout and latency counters,
+ * check @ref TM_I2C_GetDeviceStats(). Latency is measured with DWT cycle counter, call TM_DELAY_Init() first.
+ *
+@verbatim
+//Number of devices with statistics for each I2C peripheral
+#define TM_I2C_MAX_DEVICES             8
+@endverbatim
+ *
+ * \par Transactions
+ *
+ * @ref TM_I2C_Transaction() executes list of reads and writes as one bus transaction.
+ * Parts are separated with repeated start condition and only last part generates stop condition,
+ * so other master can not take the bus in the middle and start/stop overhead is paid only once.
+ *
+@verbatim
+//Read 8 coefficient bytes from register 0x04 and start conversion with write 0x00 to register 0x12
+uint8_t coef[8], start = 0x00;
+TM_I2C_Transfer_t transfers[] = {
+	{0xC0, TM_I2C_TRANSFER_READ | TM_I2C_TRANSFER_REG, 0x04, coef, sizeof(coef)},
+	{0xC0, TM_I2C_TRANSFER_WRITE | TM_I2C_TRANSFER_REG, 0x12, &start, 1},
+};
+TM_I2C_Transaction(I2C1, transfers, 2);
+@endverbatim
+ *
+ * \par Host build
+ *
+ * When TM_I2C_SIM is defined, this library runs on Linux host on top of simulated I2C registers
+ * from tm_stm32_i2c_sim.c, so library and drivers using it can be tested with "make -C host test".
+ * Check @ref TM_I2C_SIM for details.
  *
  * \par Changelog
  *
 @verbatim
+ Version 1.7
+  - Fast mode rise time and duty cycle are set properly
+  - Added function to get achieved SCL frequency
+  - Added bus scan, cached device presence and per-device statistics
+  - Added transactions with repeated start, TM_I2C_Read and TM_I2C_ReadMulti use repeated start now
+  - Added simulated I2C bus for host builds
+  - Timeouts are now in milliseconds and separate for each I2C peripheral, TM_I2C_TIMEOUT is replaced with TM_I2C_TIMEOUT_MS
+  - Added automatic bus recovery when slave holds SDA line low
+  - Added error counters for each I2C peripheral
+  - Functions return immediately when slave does not acknowledge its address
+
  Version 1.6.1
   - March 31, 2015
   - Fixed I2C issue when sometime it didn't send data
@@ -116,10 +201,13 @@ I2C3   |PA8   PC9    |PH7   PH8    |-     -
  - defines.h
  - attributes.h
  - TM GPIO
+ - TM DELAY
 @endverbatim
  */
 #include "stm32fxxx_hal.h"
+#if !defined(TM_I2C_SIM)
 #include "stm32f1xx_hal_i2c.h"
+#endif
 #include "attributes.h"
 #include "defines.h"
 #include "tm_stm32_gpio.h"
@@ -131,10 +219,29 @@ I2C3   |PA8   PC9    |PH7   PH8    |-     -
  */
 
 /**
- * @brief  Timeout for I2C
+ * @brief  Default timeout for I2C operations in milliseconds
  */
-#ifndef TM_I2C_TIMEOUT
-#define TM_I2C_TIMEOUT					20000
+#ifndef TM_I2C_TIMEOUT_MS
+#define TM_I2C_TIMEOUT_MS				10
+#endif
+
+/* Old timeout was number of loop iterations, it can not be converted to milliseconds */
+#if defined(TM_I2C_TIMEOUT)
+#error "TM_I2C_TIMEOUT is not supported anymore, set timeout in milliseconds with TM_I2C_TIMEOUT_MS"
+#endif
+
+/**
+ * @brief  Transfer flags for @ref TM_I2C_Transfer_t
+ */
+#define TM_I2C_TRANSFER_WRITE			0x00 /*!< Data are written to slave */
+#define TM_I2C_TRANSFER_READ			0x01 /*!< Data are read from slave */
+#define TM_I2C_TRANSFER_REG				0x02 /*!< Register is written first, followed by repeated start for read */
+
+/**
+ * @brief  Number of devices with statistics for each I2C peripheral
+ */
+#ifndef TM_I2C_MAX_DEVICES
+#define TM_I2C_MAX_DEVICES				8
 #endif
 
 /* I2C1 settings, change them in defines.h project file */
@@ -213,6 +320,40 @@ typedef enum {
 	TM_I2C_PinsPack_Custom  /*!< Use custom pins for I2Cx */
 } TM_I2C_PinsPack_t;
 
+/**
+ * @brief  I2C error counters, separate for each I2C peripheral
+ */
+typedef struct {
+	uint32_t Timeouts;        /*!< Number of operations which did not finish in timeout */
+	uint32_t Nacks;           /*!< Number of not acknowledged addresses or data bytes */
+	uint32_t BusErrors;       /*!< Number of misplaced start or stop conditions detected */
+	uint32_t ArbitrationLost; /*!< Number of lost arbitrations */
+	uint32_t Recoveries;      /*!< Number of bus recoveries made */
+} TM_I2C_Stats_t;
+
+/**
+ * @brief  Part of I2C transaction, used with @ref TM_I2C_Transaction()
+ */
+typedef struct {
+	uint8_t Address;  /*!< 7 bit slave address, left aligned, bits 7:1 are used, LSB bit is not used */
+	uint8_t Flags;    /*!< Transfer flags, @ref TM_I2C_TRANSFER_WRITE or @ref TM_I2C_TRANSFER_READ, optionally ORed with @ref TM_I2C_TRANSFER_REG */
+	uint8_t Reg;      /*!< Register written before data, used with @ref TM_I2C_TRANSFER_REG flag */
+	uint8_t* Data;    /*!< Pointer to data to be written or buffer for read data */
+	uint16_t Count;   /*!< Number of data bytes. Must be at least 1 for read */
+} TM_I2C_Transfer_t;
+
+/**
+ * @brief  I2C device statistics, registered on first transaction or bus scan
+ */
+typedef struct {
+	uint8_t Address;          /*!< Device address, 0 for free entry */
+	uint32_t Transactions;    /*!< Number of finished transactions, including failed ones */
+	uint32_t Nacks;           /*!< Number of not acknowledged addresses or data bytes */
+	uint32_t Timeouts;        /*!< Number of operations which did not finish in timeout */
+	uint32_t LatencyLast;     /*!< Duration of last transaction in microseconds */
+	uint32_t LatencyMax;      /*!< Longest transaction in microseconds */
+} TM_I2C_Device_t;
+
 /**
  * @}
  */
@@ -327,6 +468,120 @@ void TM_I2C_WriteMultiNoRegister(I2C_TypeDef* I2Cx, uint8_t address, uint8_t* da
  */
 uint8_t TM_I2C_IsDeviceConnected(I2C_TypeDef* I2Cx, uint8_t address);
 
+/**
+ * @brief  Executes list of transfers as one I2C transaction
+ * @note   Transfers are separated with repeated start, stop condition is generated after last transfer or on error
+ * @param  *I2Cx: I2C used
+ * @param  *transfers: Pointer to array of @ref TM_I2C_Transfer_t structures
+ * @param  count: Number of transfers in array
+ * @retval Transaction status:
+ *            - 0: All transfers finished
+ *            - > 0: Transaction aborted, slave did not respond or timeout. Also returned without bus access
+ *                   when read transfer has zero Count
+ */
+uint8_t TM_I2C_Transaction(I2C_TypeDef* I2Cx, TM_I2C_Transfer_t* transfers, uint8_t count);
+
+/**
+ * @brief  Gets SCL frequency set on I2C peripheral
+ * @note   Value is calculated from timing registers and does not include rise and fall times on bus
+ * @param  *I2Cx: I2C used
+ * @retval SCL frequency in Hertz
+ */
+uint32_t TM_I2C_GetClock(I2C_TypeDef* I2Cx);
+
+/**
+ * @brief  Sets timeout for I2C operations
+ * @param  *I2Cx: I2C used
+ * @param  timeout: Timeout in milliseconds for each wait on I2C peripheral
+ * @retval None
+ */
+void TM_I2C_SetTimeout(I2C_TypeDef* I2Cx, uint32_t timeout);
+
+/**
+ * @brief  Gets error counters for I2C peripheral
+ * @param  *I2Cx: I2C used
+ * @param  *stats: Pointer to @ref TM_I2C_Stats_t structure to be filled
+ * @retval None
+ */
+void TM_I2C_GetStats(I2C_TypeDef* I2Cx, TM_I2C_Stats_t* stats);
+
+/**
+ * @brief  Resets error counters for I2C peripheral
+ * @note   Counters of registered devices are cleared too
+ * @param  *I2Cx: I2C used
+ * @retval None
+ */
+void TM_I2C_ResetStats(I2C_TypeDef* I2Cx);
+
+/**
+ * @brief  Scans I2C bus for devices
+ * @note   Addresses 0x08 to 0x77 (7-bit) are probed, found devices are registered for statistics
+ * @param  *I2Cx: I2C used
+ * @param  *addresses: Pointer to array where found 8-bit addresses will be saved. Can be NULL
+ * @param  count: Size of addresses array
+ * @retval Number of devices found, can be greater than count
+ */
+uint8_t TM_I2C_Scan(I2C_TypeDef* I2Cx, uint8_t* addresses, uint8_t count);
+
+/**
+ * @brief  Checks if device is present on I2C bus
+ * @note   Bus is probed only when presence is not known yet, otherwise result of last probe is returned
+ * @param  *I2Cx: I2C used
+ * @param  address: 7 bit slave address, left aligned, bits 7:1 are used, LSB bit is not used
+ * @retval Device status:
+ *            - 0: Device is not present
+ *            - > 0: Device is present
+ */
+uint8_t TM_I2C_IsDevicePresent(I2C_TypeDef* I2Cx, uint8_t address);
+
+/**
+ * @brief  Forgets presence of device, next @ref TM_I2C_IsDevicePresent() call will probe bus again
+ * @param  *I2Cx: I2C used
+ * @param  address: 7 bit slave address, left aligned, bits 7:1 are used, LSB bit is not used
+ * @retval None
+ */
+void TM_I2C_ForgetDevice(I2C_TypeDef* I2Cx, uint8_t address);
+
+/**
+ * @brief  Gets statistics for device
+ * @param  *I2Cx: I2C used
+ * @param  address: 7 bit slave address, left aligned, bits 7:1 are used, LSB bit is not used
+ * @param  *device: Pointer to @ref TM_I2C_Device_t structure to be filled
+ * @retval Status:
+ *            - 0: Statistics are copied
+ *            - > 0: Device is not registered
+ */
+uint8_t TM_I2C_GetDeviceStats(I2C_TypeDef* I2Cx, uint8_t address, TM_I2C_Device_t* device);
+
+/**
+ * @brief  Releases I2C bus when slave holds SDA line low
+ *
+ *         Recovery is made in these steps:
+ *            - SCL and SDA pins are set as open-drain outputs
+ *            - Up to 9 SCL pulses are generated until slave releases SDA
+ *            - STOP condition is generated
+ *            - I2C peripheral is reset and initialized again
+ *
+ * @note   Function is called automatically on start condition when bus stays busy longer than timeout
+ * @param  *I2Cx: I2C used
+ * @retval Recovery status:
+ *            - 0: Bus is released
+ *            - > 0: SDA or SCL line is still low or pins are not known
+ */
+uint8_t TM_I2C_BusRecovery(I2C_TypeDef* I2Cx);
+
+/**
+ * @brief  Sets SCL and SDA pins used for bus recovery
+ * @note   Must be called for @ref TM_I2C_PinsPack_Custom only, best from @ref TM_I2C_InitCustomPinsCallback() function
+ * @param  *I2Cx: I2C used
+ * @param  *SCL_GPIOx: GPIO port of SCL pin
+ * @param  SCL_Pin: SCL pin
+ * @param  *SDA_GPIOx: GPIO port of SDA pin
+ * @param  SDA_Pin: SDA pin
+ * @retval None
+ */
+void TM_I2C_SetBusPins(I2C_TypeDef* I2Cx, GPIO_TypeDef* SCL_GPIOx, uint16_t SCL_Pin, GPIO_TypeDef* SDA_GPIOx, uint16_t SDA_Pin);
+
 /**
  * @brief  I2C Start condition
  * @param  *I2Cx: I2C used
@@ -366,10 +621,12 @@ uint8_t TM_I2C_ReadAck(I2C_TypeDef* I2Cx);
  * @brief  Writes to slave
  * @param  *I2Cx: I2C used
  * @param  data: data to be sent
- * @retval None
+ * @retval Write status:
+ *            - 0: Byte sent
+ *            - > 0: Timeout or slave did not acknowledge previous byte
  * @note   For private use
  */
-void TM_I2C_WriteData(I2C_TypeDef* I2Cx, uint8_t data);
+uint8_t TM_I2C_WriteData(I2C_TypeDef* I2Cx, uint8_t data);
 
 /**
  * @brief  Callback for custom pins initialization.
@@ -0,0 +1,942 @@
+/**
+ * |----------------------------------------------------------------------
+ * | This program is free software: you can redistribute it and/or modify
+ * | it under the terms of the GNU General Public License as published by
+ * | the Free Software Foundation, either version 3 of the License, or
+ * | any later version.
+ * |
+ * | This program is distributed in the hope that it will be useful,
+ * | but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * | MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * | GNU General Public License for more details.
+ * |
+ * | You should have received a copy of the GNU General Public License
+ * | along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * |----------------------------------------------------------------------
+ */
+#include "tm_stm32_i2c.h"
+#include <string.h>
+
+#if defined(TM_I2C_SIM)
+
+/* Bus states */
+typedef enum {
+	I2C_SIM_STATE_IDLE, /* Peripheral is not master */
+	I2C_SIM_STATE_SB,   /* Start generated, address is expected in DR */
+	I2C_SIM_STATE_ADDR, /* Address acknowledged, ADDR flag is not cleared yet */
+	I2C_SIM_STATE_TX,   /* Master transmitter */
+	I2C_SIM_STATE_RX,   /* Master receiver */
+	I2C_SIM_STATE_HOLD  /* NACK received or sent, stop or repeated start is expected */
+} I2C_SIM_State_t;
+
+/* Bus actions which take time */
+typedef enum {
+	I2C_SIM_ACTION_NONE,
+	I2C_SIM_ACTION_START,
+	I2C_SIM_ACTION_ADDRESS,
+	I2C_SIM_ACTION_TX,
+	I2C_SIM_ACTION_RX,
+	I2C_SIM_ACTION_STOP
+} I2C_SIM_Action_t;
+
+/* Private structure */
+typedef struct {
+	TM_I2C_SIM_Device_t* Models;  /* Devices attached to bus */
+	TM_I2C_SIM_Device_t* Active;  /* Addressed device */
+	I2C_SIM_State_t State;        /* Bus state */
+	I2C_SIM_Action_t Action;      /* Bus action in progress */
+	uint64_t Done;                /* Simulated time when action is finished */
+	uint32_t Flags;               /* SR1 flags set by simulator */
+	uint8_t Master;               /* MSL flag */
+	uint8_t Transmitter;          /* TRA flag */
+	uint8_t Shift;                /* Shift register */
+	uint8_t ShiftFull;            /* Received byte waits in shift register, BTF is set */
+	uint8_t TxPending;            /* Byte written to DR waits for shift register */
+	uint8_t TxData;               /* Byte written to DR */
+	uint8_t Ack;                  /* Last received byte was acknowledged */
+	uint8_t AddrRead;             /* SR1 was read with ADDR flag set */
+	uint8_t AddrClear;            /* SR2 was read after SR1, ADDR flag is cleared */
+	uint8_t DrRead;               /* DR was read with RXNE flag set */
+	uint8_t Stuck;                /* SCL falling edges till slave releases SDA */
+	uint8_t SclLevel;             /* Last SCL level seen by stuck slave */
+	uint32_t Ccr;                 /* CCR written while PE was cleared */
+	uint32_t Trise;               /* TRISE written while PE was cleared */
+	GPIO_TypeDef* SCL_GPIOx;      /* SCL port */
+	uint16_t SCL_Pin;             /* SCL pin */
+	GPIO_TypeDef* SDA_GPIOx;      /* SDA port */
+	uint16_t SDA_Pin;             /* SDA pin */
+	TM_I2C_SIM_Stats_t Stats;     /* Bus counters */
+} TM_I2C_SIM_INT_t;
+
+/* Public variables */
+I2C_TypeDef TM_I2C_SIM_Ports[3];
+
+/* Private variables, pins of pinspack 1 by default */
+static TM_I2C_SIM_INT_t TM_I2C_SIM_INT[3] = {
+	{.SCL_GPIOx = GPIOB, .SCL_Pin = GPIO_PIN_6, .SDA_GPIOx = GPIOB, .SDA_Pin = GPIO_PIN_7},
+	{.SCL_GPIOx = GPIOB, .SCL_Pin = GPIO_PIN_10, .SDA_GPIOx = GPIOB, .SDA_Pin = GPIO_PIN_11},
+	{.SCL_GPIOx = GPIOA, .SCL_Pin = GPIO_PIN_8, .SDA_GPIOx = GPIOC, .SDA_Pin = GPIO_PIN_9},
+};
+static uint8_t TM_I2C_SIM_Registered;
+
+/* Get simulated bus for peripheral */
+#define I2C_SIM_BUS(I2Cx)      (&TM_I2C_SIM_INT[(I2Cx) - TM_I2C_SIM_Ports])
+
+/* DR value when nothing was written or received */
+#define I2C_SIM_DR_EMPTY       0xFFFFFFFF
+
+/* SR1 flags cleared by writing 0, other flags are read only */
+#define I2C_SIM_SR1_RC_W0      (I2C_SR1_BERR | I2C_SR1_ARLO | I2C_SR1_AF | I2C_SR1_OVR | I2C_SR1_PECERR | I2C_SR1_TIMEOUT | I2C_SR1_SMBALERT)
+
+/* Number of SCL clocks for bus actions */
+#define I2C_SIM_CONDITION_BITS 1
+#define I2C_SIM_BYTE_BITS      9
+
+/* Time conversions */
+#define I2C_SIM_NS_PER_US      1000ULL
+#define I2C_SIM_NS_PER_S       1000000000ULL
+
+/* MPL115A2 registers */
+#define MPL115A2_REG_COEFFICIENTS     0x04
+#define MPL115A2_REG_CONVERT          0x12
+
+/* DS1307 registers */
+#define DS1307_REG_SECONDS     0x00
+#define DS1307_REG_MINUTES     0x01
+#define DS1307_REG_HOURS       0x02
+#define DS1307_REG_DAY         0x03
+#define DS1307_REG_DATE        0x04
+#define DS1307_REG_MONTH       0x05
+#define DS1307_REG_YEAR        0x06
+#define DS1307_SECONDS_CH      0x80
+
+/* Private functions */
+static void TM_I2C_SIM_INT_Register(void);
+static void TM_I2C_SIM_INT_Update(void);
+static void TM_I2C_SIM_INT_UpdateBus(I2C_TypeDef* I2Cx, TM_I2C_SIM_INT_t* bus);
+static void TM_I2C_SIM_INT_UpdateStuck(TM_I2C_SIM_INT_t* bus);
+static void TM_I2C_SIM_INT_Reset(I2C_TypeDef* I2Cx, TM_I2C_SIM_INT_t* bus);
+static void TM_I2C_SIM_INT_Begin(I2C_TypeDef* I2Cx, TM_I2C_SIM_INT_t* bus, I2C_SIM_Action_t action);
+static void TM_I2C_SIM_INT_Finish(I2C_TypeDef* I2Cx, TM_I2C_SIM_INT_t* bus);
+static void TM_I2C_SIM_INT_Write(I2C_TypeDef* I2Cx, TM_I2C_SIM_INT_t* bus, uint8_t data);
+static void TM_I2C_SIM_INT_Condition(I2C_TypeDef* I2Cx, TM_I2C_SIM_INT_t* bus);
+static uint64_t TM_I2C_SIM_INT_BitTime(I2C_TypeDef* I2Cx);
+static TM_I2C_SIM_Device_t* TM_I2C_SIM_INT_Find(TM_I2C_SIM_INT_t* bus, uint8_t address);
+
+void I2C_Init(I2C_TypeDef* I2Cx, I2C_InitTypeDef* I2C_InitStruct) {
+	uint32_t pclk = HAL_RCC_GetPCLK1Freq();
+	uint32_t freqrange = pclk / 1000000;
+	uint32_t speed = I2C_InitStruct->I2C_ClockSpeed;
+	uint32_t ccr;
+
+	/* Set peripheral clock in MHz */
+	I2Cx->CR2 = (I2Cx->CR2 & ~I2C_CR2_FREQ) | freqrange;
+
+	/* Timing is set with peripheral disabled, rounded down like in standard peripheral library */
+	I2Cx->CR1 &= ~I2C_CR1_PE;
+	if (speed <= TM_I2C_CLOCK_STANDARD) {
+		ccr = pclk / (speed * 2);
+		if (ccr < 4) {
+			ccr = 4;
+		}
+		I2Cx->TRISE = freqrange + 1;
+	} else {
+		if (I2C_InitStruct->I2C_DutyCycle == I2C_DutyCycle_16_9) {
+			ccr = (pclk / (speed * 25)) | I2C_CCR_DUTY;
+		} else {
+			ccr = pclk / (speed * 3);
+		}
+		if (!(ccr & I2C_CCR_CCR)) {
+			ccr |= 1;
+		}
+		ccr |= I2C_CCR_FS;
+		I2Cx->TRISE = freqrange * 300 / 1000 + 1;
+	}
+	I2Cx->CCR = ccr;
+	I2Cx->CR1 |= I2C_CR1_PE;
+
+	/* Set mode and acknowledge */
+	I2Cx->CR1 = (I2Cx->CR1 & ~I2C_CR1_ACK) | I2C_InitStruct->I2C_Mode | I2C_InitStruct->I2C_Ack;
+
+	/* Set own address */
+	I2Cx->OAR1 = I2C_InitStruct->I2C_AcknowledgedAddress | I2C_InitStruct->I2C_OwnAddress1;
+}
+
+uint8_t I2C_CheckEvent(I2C_TypeDef* I2Cx, uint32_t I2C_EVENT) {
+	uint32_t flag1, flag2;
+
+	/* Read both status registers, ADDR flag is cleared */
+	flag1 = I2Cx->SR1;
+	flag2 = I2Cx->SR2;
+
+	/* All flags of event must be set */
+	return ((((flag2 << 16) | flag1) & I2C_EVENT) == I2C_EVENT) ? 1 : 0;
+}
+
+uint8_t TM_I2C_SIM_Access(TM_I2C_SIM_Reg_t reg) {
+	TM_I2C_SIM_INT_t* bus;
+	uint8_t i;
+
+	/* Advance time and update peripherals before register is accessed */
+	TM_I2C_SIM_INT_Register();
+	TM_HOST_Access();
+
+	/* Read side effects, accessed peripheral is not known */
+	for (i = 0; i < 3; i++) {
+		bus = &TM_I2C_SIM_INT[i];
+		if (reg == TM_I2C_SIM_Reg_SR1 && (bus->Flags & I2C_SR1_ADDR)) {
+			bus->AddrRead = 1;
+		} else if (reg == TM_I2C_SIM_Reg_SR2 && bus->AddrRead) {
+			bus->AddrRead = 0;
+			bus->AddrClear = 1;
+		} else if (reg == TM_I2C_SIM_Reg_DR && (bus->Flags & I2C_SR1_RXNE)) {
+			bus->DrRead = 1;
+		}
+	}
+
+	/* Index to register array */
+	return 0;
+}
+
+void TM_I2C_SIM_Attach(I2C_TypeDef* I2Cx, TM_I2C_SIM_Device_t* dev) {
+	TM_I2C_SIM_INT_t* bus = I2C_SIM_BUS(I2Cx);
+
+	/* Add to the beginning of list */
+	dev->Next = bus->Models;
+	bus->Models = dev;
+}
+
+void TM_I2C_SIM_Detach(I2C_TypeDef* I2Cx, TM_I2C_SIM_Device_t* dev) {
+	TM_I2C_SIM_INT_t* bus = I2C_SIM_BUS(I2Cx);
+	TM_I2C_SIM_Device_t** ptr;
+
+	/* Remove from list */
+	for (ptr = &bus->Models; *ptr != NULL; ptr = &(*ptr)->Next) {
+		if (*ptr == dev) {
+			*ptr = dev->Next;
+			break;
+		}
+	}
+
+	/* Device can not finish transaction anymore */
+	if (bus->Active == dev) {
+		bus->Active = NULL;
+	}
+}
+
+void TM_I2C_SIM_SetPins(I2C_TypeDef* I2Cx, GPIO_TypeDef* SCL_GPIOx, uint16_t SCL_Pin, GPIO_TypeDef* SDA_GPIOx, uint16_t SDA_Pin) {
+	TM_I2C_SIM_INT_t* bus = I2C_SIM_BUS(I2Cx);
+	uint8_t stuck = bus->Stuck;
+
+	/* Release old pins */
+	TM_I2C_SIM_SetStuck(I2Cx, 0);
+
+	/* Save pins */
+	bus->SCL_GPIOx = SCL_GPIOx;
+	bus->SCL_Pin = SCL_Pin;
+	bus->SDA_GPIOx = SDA_GPIOx;
+	bus->SDA_Pin = SDA_Pin;
+
+	/* Hold new SDA pin */
+	TM_I2C_SIM_SetStuck(I2Cx, stuck);
+}
+
+void TM_I2C_SIM_SetStuck(I2C_TypeDef* I2Cx, uint8_t clocks) {
+	TM_I2C_SIM_INT_t* bus = I2C_SIM_BUS(I2Cx);
+
+	/* Slave counts SCL pulses in update function */
+	TM_I2C_SIM_INT_Register();
+
+	/* SDA is held low until number of clocks */
+	bus->Stuck = clocks;
+	bus->SclLevel = (TM_HOST_GPIO_GetLevels(bus->SCL_GPIOx) & bus->SCL_Pin) ? 1 : 0;
+	TM_HOST_GPIO_PullLow(bus->SDA_GPIOx, bus->SDA_Pin, clocks > 0);
+}
+
+void TM_I2C_SIM_GetStats(I2C_TypeDef* I2Cx, TM_I2C_SIM_Stats_t* stats) {
+	/* Copy counters */
+	*stats = I2C_SIM_BUS(I2Cx)->Stats;
+}
+
+void TM_I2C_SIM_ResetStats(I2C_TypeDef* I2Cx) {
+	/* Clear counters */
+	memset(&I2C_SIM_BUS(I2Cx)->Stats, 0, sizeof(TM_I2C_SIM_Stats_t));
+}
+
+/******************************************************************/
+/*                          AT24xx model                          */
+/******************************************************************/
+static uint8_t TM_I2C_SIM_INT_AT24_Start(TM_I2C_SIM_Device_t* dev, uint8_t address) {
+	TM_I2C_SIM_AT24_t* at24 = (TM_I2C_SIM_AT24_t *)dev;
+
+	/* Device does not respond during write cycle */
+	if (TM_HOST_GetTimeNs() < at24->BusyUntil) {
+		return 1;
+	}
+
+	/* Block bits from slave address are upper bits of memory address */
+	at24->Pointer = ((((address & dev->AddressMask) >> 1) << 8) | (at24->Pointer & 0xFF)) % at24->Size;
+
+	/* Word address follows in write mode, repeated start aborts page write */
+	at24->AddressPhase = !(address & 0x01);
+	at24->PageValid = 0;
+
+	return 0;
+}
+
+static uint8_t TM_I2C_SIM_INT_AT24_Write(TM_I2C_SIM_Device_t* dev, uint8_t data) {
+	TM_I2C_SIM_AT24_t* at24 = (TM_I2C_SIM_AT24_t *)dev;
+	uint8_t offset;
+
+	/* First byte is word address */
+	if (at24->AddressPhase) {
+		at24->Pointer = (at24->Pointer & 0xFF00) | data;
+		at24->PageBase = at24->Pointer & ~(at24->PageSize - 1);
+		at24->AddressPhase = 0;
+		return 0;
+	}
+
+	/* Data go to page buffer, address rolls over inside page */
+	offset = at24->Pointer & (at24->PageSize - 1);
+	at24->Page[offset] = data;
+	at24->PageValid |= 1ULL << offset;
+	at24->Pointer = at24->PageBase | ((offset + 1) & (at24->PageSize - 1));
+
+	return 0;
+}
+
+static uint8_t TM_I2C_SIM_INT_AT24_Read(TM_I2C_SIM_Device_t* dev) {
+	TM_I2C_SIM_AT24_t* at24 = (TM_I2C_SIM_AT24_t *)dev;
+	uint8_t data;
+
+	/* Sequential read rolls over whole memory */
+	data = at24->Memory[at24->Pointer];
+	at24->Pointer = (at24->Pointer + 1) % at24->Size;
+
+	return data;
+}
+
+static void TM_I2C_SIM_INT_AT24_Stop(TM_I2C_SIM_Device_t* dev) {
+	TM_I2C_SIM_AT24_t* at24 = (TM_I2C_SIM_AT24_t *)dev;
+	uint8_t i;
+
+	/* Nothing to write */
+	if (!at24->PageValid) {
+		return;
+	}
+
+	/* Write page buffer and start write cycle */
+	for (i = 0; i < at24->PageSize; i++) {
+		if (at24->PageValid & (1ULL << i)) {
+			at24->Memory[at24->PageBase + i] = at24->Page[i];
+		}
+	}
+	at24->PageValid = 0;
+	at24->PageWrites++;
+	at24->BusyUntil = TM_HOST_GetTimeNs() + at24->WriteCycle * I2C_SIM_NS_PER_US;
+}
+
+void TM_I2C_SIM_AT24_Init(TM_I2C_SIM_AT24_t* at24, uint8_t address, uint8_t* memory, uint16_t size, uint8_t pageSize) {
+	memset(at24, 0, sizeof(TM_I2C_SIM_AT24_t));
+
+	/* Fill structure */
+	at24->Memory = memory;
+	at24->Size = size;
+	at24->PageSize = pageSize > TM_I2C_SIM_AT24_MAX_PAGE ? TM_I2C_SIM_AT24_MAX_PAGE : pageSize;
+	at24->WriteCycle = TM_I2C_SIM_AT24_WRITE_CYCLE;
+
+	/* Set device, every 256 bytes use one block bit in address */
+	at24->Device.Address = address;
+	at24->Device.AddressMask = size > 256 ? (((size - 1) >> 8) << 1) & 0x0E : 0;
+	at24->Device.Start = TM_I2C_SIM_INT_AT24_Start;
+	at24->Device.Write = TM_I2C_SIM_INT_AT24_Write;
+	at24->Device.Read = TM_I2C_SIM_INT_AT24_Read;
+	at24->Device.Stop = TM_I2C_SIM_INT_AT24_Stop;
+}
+
+/******************************************************************/
+/*                         PCF8574 model                          */
+/******************************************************************/
+static uint8_t TM_I2C_SIM_INT_PCF8574_Start(TM_I2C_SIM_Device_t* dev, uint8_t address) {
+	return 0;
+}
+
+static uint8_t TM_I2C_SIM_INT_PCF8574_Write(TM_I2C_SIM_Device_t* dev, uint8_t data) {
+	/* Every byte is written to port */
+	((TM_I2C_SIM_PCF8574_t *)dev)->Latch = data;
+	return 0;
+}
+
+static uint8_t TM_I2C_SIM_INT_PCF8574_Read(TM_I2C_SIM_Device_t* dev) {
+	TM_I2C_SIM_PCF8574_t* pcf = (TM_I2C_SIM_PCF8574_t *)dev;
+
+	/* Pin is high only when latch is high and nothing pulls it low */
+	return pcf->Latch & pcf->Inputs;
+}
+
+void TM_I2C_SIM_PCF8574_Init(TM_I2C_SIM_PCF8574_t* pcf, uint8_t address) {
+	memset(pcf, 0, sizeof(TM_I2C_SIM_PCF8574_t));
+
+	/* Port is high after power on */
+	pcf->Latch = 0xFF;
+	pcf->Inputs = 0xFF;
+
+	/* Set device */
+	pcf->Device.Address = address;
+	pcf->Device.Start = TM_I2C_SIM_INT_PCF8574_Start;
+	pcf->Device.Write = TM_I2C_SIM_INT_PCF8574_Write;
+	pcf->Device.Read = TM_I2C_SIM_INT_PCF8574_Read;
+}
+
+/******************************************************************/
+/*                         MPL115A2 model                         */
+/******************************************************************/
+static void TM_I2C_SIM_INT_MPL115A2_Update(TM_I2C_SIM_MPL115A2_t* mpl) {
+	/* Copy ADC values to result registers when conversion is done */
+	if (mpl->Pending && TM_HOST_GetTimeNs() >= mpl->ReadyAt) {
+		mpl->Result[0] = mpl->Padc >> 8;
+		mpl->Result[1] = mpl->Padc & 0xC0;
+		mpl->Result[2] = mpl->Tadc >> 8;
+		mpl->Result[3] = mpl->Tadc & 0xC0;
+		mpl->Pending = 0;
+	}
+}
+
+static uint8_t TM_I2C_SIM_INT_MPL115A2_Start(TM_I2C_SIM_Device_t* dev, uint8_t address) {
+	TM_I2C_SIM_MPL115A2_t* mpl = (TM_I2C_SIM_MPL115A2_t *)dev;
+
+	/* Register address follows in write mode */
+	TM_I2C_SIM_INT_MPL115A2_Update(mpl);
+	mpl->AddressPhase = !(address & 0x01);
+
+	return 0;
+}
+
+static uint8_t TM_I2C_SIM_INT_MPL115A2_Write(TM_I2C_SIM_Device_t* dev, uint8_t data) {
+	TM_I2C_SIM_MPL115A2_t* mpl = (TM_I2C_SIM_MPL115A2_t *)dev;
+
+	/* Only register address is used */
+	if (mpl->AddressPhase) {
+		mpl->Pointer = data;
+		mpl->AddressPhase = 0;
+
+		/* Start conversion */
+		if (data == MPL115A2_REG_CONVERT) {
+			mpl->Pending = 1;
+			mpl->ReadyAt = TM_HOST_GetTimeNs() + TM_I2C_SIM_MPL115A2_CONVERSION * I2C_SIM_NS_PER_US;
+			mpl->Conversions++;
+		}
+	}
+
+	return 0;
+}
+
+static uint8_t TM_I2C_SIM_INT_MPL115A2_Read(TM_I2C_SIM_Device_t* dev) {
+	TM_I2C_SIM_MPL115A2_t* mpl = (TM_I2C_SIM_MPL115A2_t *)dev;
+	uint8_t data = 0;
+
+	/* Results first, followed by coefficients */
+	if (mpl->Pointer < MPL115A2_REG_COEFFICIENTS) {
+		data = mpl->Result[mpl->Pointer];
+	} else if (mpl->Pointer < MPL115A2_REG_COEFFICIENTS + sizeof(mpl->Coefficients)) {
+		data = mpl->Coefficients[mpl->Pointer - MPL115A2_REG_COEFFICIENTS];
+	}
+	mpl->Pointer++;
+
+	return data;
+}
+
+void TM_I2C_SIM_MPL115A2_Init(TM_I2C_SIM_MPL115A2_t* mpl, uint8_t address) {
+	static const uint8_t coefficients[8] = {0x3E, 0xCE, 0xB3, 0xF9, 0xC5, 0x17, 0x33, 0xC8};
+
+	memset(mpl, 0, sizeof(TM_I2C_SIM_MPL115A2_t));
+
+	/* Values from Freescale AN3785 example */
+	memcpy(mpl->Coefficients, coefficients, sizeof(coefficients));
+	mpl->Padc = 0x6680;
+	mpl->Tadc = 0x7EC0;
+
+	/* Set device */
+	mpl->Device.Address = address;
+	mpl->Device.Start = TM_I2C_SIM_INT_MPL115A2_Start;
+	mpl->Device.Write = TM_I2C_SIM_INT_MPL115A2_Write;
+	mpl->Device.Read = TM_I2C_SIM_INT_MPL115A2_Read;
+}
+
+/******************************************************************/
+/*                          DS1307 model                          */
+/******************************************************************/
+static uint8_t TM_I2C_SIM_INT_Bcd2Bin(uint8_t bcd) {
+	return 10 * (bcd >> 4) + (bcd & 0x0F);
+}
+
+static uint8_t TM_I2C_SIM_INT_Bin2Bcd(uint8_t bin) {
+	return ((bin / 10) << 4) | (bin % 10);
+}
+
+static uint8_t TM_I2C_SIM_INT_DS1307_Increment(uint8_t* reg, uint8_t mask, uint8_t min, uint8_t max) {
+	uint8_t value = TM_I2C_SIM_INT_Bcd2Bin(*reg & mask) + 1;
+	uint8_t overflow = value > max;
+
+	/* Keep bits outside value, like clock halt and 12/24 mode */
+	if (overflow) {
+		value = min;
+	}
+	*reg = (*reg & ~mask) | TM_I2C_SIM_INT_Bin2Bcd(value);
+
+	return overflow;
+}
+
+static void TM_I2C_SIM_INT_DS1307_Tick(TM_I2C_SIM_DS1307_t* rtc) {
+	static const uint8_t days[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+	uint8_t* r = rtc->Registers;
+	uint8_t month, year, last;
+
+	if (!TM_I2C_SIM_INT_DS1307_Increment(&r[DS1307_REG_SECONDS], 0x7F, 0, 59)) {
+		return;
+	}
+	if (!TM_I2C_SIM_INT_DS1307_Increment(&r[DS1307_REG_MINUTES], 0x7F, 0, 59)) {
+		return;
+	}
+	if (!TM_I2C_SIM_INT_DS1307_Increment(&r[DS1307_REG_HOURS], 0x3F, 0, 23)) {
+		return;
+	}
+
+	/* New day */
+	TM_I2C_SIM_INT_DS1307_Increment(&r[DS1307_REG_DAY], 0x07, 1, 7);
+	month = TM_I2C_SIM_INT_Bcd2Bin(r[DS1307_REG_MONTH] & 0x1F);
+	year = TM_I2C_SIM_INT_Bcd2Bin(r[DS1307_REG_YEAR]);
+	last = (month >= 1 && month <= 12) ? days[month - 1] : 31;
+	if (month == 2 && (year % 4) == 0) {
+		last = 29;
+	}
+	if (!TM_I2C_SIM_INT_DS1307_Increment(&r[DS1307_REG_DATE], 0x3F, 1, last)) {
+		return;
+	}
+	if (!TM_I2C_SIM_INT_DS1307_Increment(&r[DS1307_REG_MONTH], 0x1F, 1, 12)) {
+		return;
+	}
+	TM_I2C_SIM_INT_DS1307_Increment(&r[DS1307_REG_YEAR], 0xFF, 0, 99);
+}
+
+static void TM_I2C_SIM_INT_DS1307_Update(TM_I2C_SIM_DS1307_t* rtc) {
+	/* Oscillator is stopped */
+	if (rtc->Registers[DS1307_REG_SECONDS] & DS1307_SECONDS_CH) {
+		rtc->LastSecond = TM_HOST_GetTimeNs();
+		return;
+	}
+
+	/* Count elapsed seconds */
+	while ((TM_HOST_GetTimeNs() - rtc->LastSecond) >= I2C_SIM_NS_PER_S) {
+		rtc->LastSecond += I2C_SIM_NS_PER_S;
+		TM_I2C_SIM_INT_DS1307_Tick(rtc);
+	}
+}
+
+static uint8_t TM_I2C_SIM_INT_DS1307_Start(TM_I2C_SIM_Device_t* dev, uint8_t address) {
+	TM_I2C_SIM_DS1307_t* rtc = (TM_I2C_SIM_DS1307_t *)dev;
+
+	/* Time registers are copied to buffer on start condition */
+	TM_I2C_SIM_INT_DS1307_Update(rtc);
+	rtc->AddressPhase = !(address & 0x01);
+
+	return 0;
+}
+
+static uint8_t TM_I2C_SIM_INT_DS1307_Write(TM_I2C_SIM_Device_t* dev, uint8_t data) {
+	TM_I2C_SIM_DS1307_t* rtc = (TM_I2C_SIM_DS1307_t *)dev;
+
+	/* First byte is register address */
+	if (rtc->AddressPhase) {
+		rtc->Pointer = data & 0x3F;
+		rtc->AddressPhase = 0;
+		return 0;
+	}
+
+	/* Writing seconds resets countdown chain */
+	if (rtc->Pointer == DS1307_REG_SECONDS) {
+		rtc->LastSecond = TM_HOST_GetTimeNs();
+	}
+	rtc->Registers[rtc->Pointer] = data;
+	rtc->Pointer = (rtc->Pointer + 1) & 0x3F;
+
+	return 0;
+}
+
+static uint8_t TM_I2C_SIM_INT_DS1307_Read(TM_I2C_SIM_Device_t* dev) {
+	TM_I2C_SIM_DS1307_t* rtc = (TM_I2C_SIM_DS1307_t *)dev;
+	uint8_t data;
+
+	/* Register pointer wraps at the end of RAM */
+	data = rtc->Registers[rtc->Pointer];
+	rtc->Pointer = (rtc->Pointer + 1) & 0x3F;
+
+	return data;
+}
+
+void TM_I2C_SIM_DS1307_Init(TM_I2C_SIM_DS1307_t* rtc, uint8_t address) {
+	memset(rtc, 0, sizeof(TM_I2C_SIM_DS1307_t));
+
+	/* Power-on state, oscillator is disabled, 01/01/00 */
+	rtc->Registers[DS1307_REG_SECONDS] = DS1307_SECONDS_CH;
+	rtc->Registers[DS1307_REG_DAY] = 0x01;
+	rtc->Registers[DS1307_REG_DATE] = 0x01;
+	rtc->Registers[DS1307_REG_MONTH] = 0x01;
+
+	/* Set device */
+	rtc->Device.Address = address;
+	rtc->Device.Start = TM_I2C_SIM_INT_DS1307_Start;
+	rtc->Device.Write = TM_I2C_SIM_INT_DS1307_Write;
+	rtc->Device.Read = TM_I2C_SIM_INT_DS1307_Read;
+}
+
+/* Private functions */
+static void TM_I2C_SIM_INT_Register(void) {
+	/* Add update function only once */
+	if (!TM_I2C_SIM_Registered) {
+		TM_HOST_AddModel(TM_I2C_SIM_INT_Update);
+		TM_I2C_SIM_Registered = 1;
+	}
+}
+
+static void TM_I2C_SIM_INT_Update(void) {
+	uint8_t i;
+
+	/* Update all peripherals */
+	for (i = 0; i < 3; i++) {
+		TM_I2C_SIM_INT_UpdateBus(&TM_I2C_SIM_Ports[i], &TM_I2C_SIM_INT[i]);
+	}
+}
+
+static void TM_I2C_SIM_INT_UpdateBus(I2C_TypeDef* I2Cx, TM_I2C_SIM_INT_t* bus) {
+	uint32_t cr1 = I2Cx->CR1_REG[0];
+
+	/* Stuck slave sees SCL pulses also when pins are driven as GPIO */
+	TM_I2C_SIM_INT_UpdateStuck(bus);
+
+	/* Timing registers are accepted only while peripheral is disabled */
+	if (!(cr1 & I2C_CR1_PE)) {
+		bus->Ccr = I2Cx->CCR_REG[0];
+		bus->Trise = I2Cx->TRISE_REG[0];
+	} else if (I2Cx->CCR_REG[0] != bus->Ccr || I2Cx->TRISE_REG[0] != bus->Trise) {
+		bus->Stats.TimingWrites++;
+		I2Cx->CCR_REG[0] = bus->Ccr;
+		I2Cx->TRISE_REG[0] = bus->Trise;
+	}
+
+	/* Disabled peripheral or software reset clears state */
+	if (!(cr1 & I2C_CR1_PE) || (cr1 & I2C_CR1_SWRST)) {
+		TM_I2C_SIM_INT_Reset(I2Cx, bus);
+		return;
+	}
+
+	/* Error flags cleared by software */
+	if (I2Cx->SR1_REG[0] != bus->Flags) {
+		bus->Flags &= I2Cx->SR1_REG[0] | ~I2C_SIM_SR1_RC_W0;
+	}
+
+	/* ADDR flag cleared with SR1 and SR2 read, transfer of data starts */
+	if (bus->AddrClear) {
+		bus->AddrClear = 0;
+		if (bus->State == I2C_SIM_STATE_ADDR) {
+			bus->Flags &= ~I2C_SR1_ADDR;
+			if (bus->Transmitter) {
+				/* Data and shift registers are empty */
+				bus->State = I2C_SIM_STATE_TX;
+				bus->Flags |= I2C_SR1_TXE | I2C_SR1_BTF;
+			} else {
+				/* Slave sends first byte */
+				bus->State = I2C_SIM_STATE_RX;
+				TM_I2C_SIM_INT_Begin(I2Cx, bus, I2C_SIM_ACTION_RX);
+			}
+		}
+	}
+
+	/* Received byte was read */
+	if (bus->DrRead) {
+		bus->DrRead = 0;
+		if (bus->ShiftFull) {
+			/* Next byte waits in shift register, SCL was stretched */
+			I2Cx->DR_REG[0] = bus->Shift;
+			bus->ShiftFull = 0;
+			bus->Flags &= ~I2C_SR1_BTF;
+			if (bus->State == I2C_SIM_STATE_RX && bus->Ack && bus->Action == I2C_SIM_ACTION_NONE) {
+				TM_I2C_SIM_INT_Begin(I2Cx, bus, I2C_SIM_ACTION_RX);
+			}
+		} else {
+			I2Cx->DR_REG[0] = I2C_SIM_DR_EMPTY;
+			bus->Flags &= ~I2C_SR1_RXNE;
+		}
+	}
+
+	/* Byte written to DR */
+	if (!(bus->Flags & I2C_SR1_RXNE) && I2Cx->DR_REG[0] != I2C_SIM_DR_EMPTY) {
+		TM_I2C_SIM_INT_Write(I2Cx, bus, I2Cx->DR_REG[0]);
+		I2Cx->DR_REG[0] = I2C_SIM_DR_EMPTY;
+	}
+
+	/* Finish bus action when its time comes */
+	while (bus->Action != I2C_SIM_ACTION_NONE && TM_HOST_GetTimeNs() >= bus->Done) {
+		TM_I2C_SIM_INT_Finish(I2Cx, bus);
+	}
+
+	/* Start and stop conditions wait for end of bus action */
+	if (bus->Action == I2C_SIM_ACTION_NONE) {
+		TM_I2C_SIM_INT_Condition(I2Cx, bus);
+	}
+
+	/* Delays must not skip end of bus action */
+	if (bus->Action != I2C_SIM_ACTION_NONE) {
+		TM_HOST_Schedule(bus->Done);
+	}
+
+	/* Publish flags */
+	I2Cx->SR1_REG[0] = bus->Flags;
+	I2Cx->SR2_REG[0] = (bus->Master ? I2C_SR2_MSL : 0) | (bus->Transmitter ? I2C_SR2_TRA : 0) |
+		((bus->Master || bus->Action != I2C_SIM_ACTION_NONE || bus->Stuck) ? I2C_SR2_BUSY : 0);
+}
+
+static void TM_I2C_SIM_INT_UpdateStuck(TM_I2C_SIM_INT_t* bus) {
+	uint8_t level;
+
+	/* Bus is not stuck */
+	if (!bus->Stuck) {
+		return;
+	}
+
+	/* Count falling edges on SCL */
+	level = (TM_HOST_GPIO_GetLevels(bus->SCL_GPIOx) & bus->SCL_Pin) ? 1 : 0;
+	if (bus->SclLevel && !level) {
+		bus->Stuck--;
+		if (!bus->Stuck) {
+			/* Slave finished its byte and releases SDA */
+			TM_HOST_GPIO_PullLow(bus->SDA_GPIOx, bus->SDA_Pin, 0);
+		}
+	}
+	bus->SclLevel = level;
+}
+
+static void TM_I2C_SIM_INT_Reset(I2C_TypeDef* I2Cx, TM_I2C_SIM_INT_t* bus) {
+	/* Slave does not see stop condition */
+	bus->Active = NULL;
+	bus->State = I2C_SIM_STATE_IDLE;
+	bus->Action = I2C_SIM_ACTION_NONE;
+	bus->Flags = 0;
+	bus->Master = 0;
+	bus->Transmitter = 0;
+	bus->ShiftFull = 0;
+	bus->TxPending = 0;
+	bus->AddrRead = 0;
+	bus->AddrClear = 0;
+	bus->DrRead = 0;
+
+	/* Clear registers, BUSY flag follows bus lines */
+	I2Cx->CR1_REG[0] &= ~(I2C_CR1_START | I2C_CR1_STOP);
+	I2Cx->DR_REG[0] = I2C_SIM_DR_EMPTY;
+	I2Cx->SR1_REG[0] = 0;
+	I2Cx->SR2_REG[0] = bus->Stuck ? I2C_SR2_BUSY : 0;
+}
+
+static void TM_I2C_SIM_INT_Begin(I2C_TypeDef* I2Cx, TM_I2C_SIM_INT_t* bus, I2C_SIM_Action_t action) {
+	uint64_t ns;
+
+	/* Conditions take one SCL period, bytes 8 data bits and acknowledge */
+	if (action == I2C_SIM_ACTION_START || action == I2C_SIM_ACTION_STOP) {
+		ns = I2C_SIM_CONDITION_BITS * TM_I2C_SIM_INT_BitTime(I2Cx);
+	} else {
+		ns = I2C_SIM_BYTE_BITS * TM_I2C_SIM_INT_BitTime(I2Cx);
+		bus->Stats.Bytes++;
+	}
+
+	/* Start new transaction */
+	if (action == I2C_SIM_ACTION_START) {
+		if (!bus->Master) {
+			bus->Stats.Transactions++;
+		}
+		bus->Stats.Starts++;
+	}
+
+	/* Set end time */
+	bus->Action = action;
+	bus->Done = TM_HOST_GetTimeNs() + ns;
+	bus->Stats.BusTime += ns;
+}
+
+static void TM_I2C_SIM_INT_Finish(I2C_TypeDef* I2Cx, TM_I2C_SIM_INT_t* bus) {
+	I2C_SIM_Action_t action = bus->Action;
+	TM_I2C_SIM_Device_t* dev;
+	uint8_t data;
+
+	/* Action is done */
+	bus->Action = I2C_SIM_ACTION_NONE;
+
+	switch (action) {
+		case I2C_SIM_ACTION_START:
+			/* Master mode, received byte stays in DR */
+			I2Cx->CR1_REG[0] &= ~I2C_CR1_START;
+			bus->Flags = (bus->Flags & I2C_SR1_RXNE) | I2C_SR1_SB;
+			bus->Master = 1;
+			bus->Transmitter = 0;
+			bus->Active = NULL;
+			bus->State = I2C_SIM_STATE_SB;
+			break;
+
+		case I2C_SIM_ACTION_ADDRESS:
+			/* Find device which acknowledges address */
+			dev = TM_I2C_SIM_INT_Find(bus, bus->Shift);
+			if (dev != NULL && dev->Start(dev, bus->Shift) == 0) {
+				bus->Active = dev;
+				bus->Transmitter = !(bus->Shift & 0x01);
+				bus->Flags |= I2C_SR1_ADDR;
+				bus->State = I2C_SIM_STATE_ADDR;
+			} else {
+				bus->Flags |= I2C_SR1_AF;
+				bus->State = I2C_SIM_STATE_HOLD;
+			}
+			break;
+
+		case I2C_SIM_ACTION_TX:
+			/* Slave acknowledges byte */
+			if (bus->Active != NULL && bus->Active->Write(bus->Active, bus->Shift) == 0) {
+				if (bus->TxPending) {
+					/* Next byte goes from DR to shift register */
+					bus->Shift = bus->TxData;
+					bus->TxPending = 0;
+					bus->Flags |= I2C_SR1_TXE;
+					TM_I2C_SIM_INT_Begin(I2Cx, bus, I2C_SIM_ACTION_TX);
+				} else {
+					/* Nothing to send, SCL is stretched */
+					bus->Flags |= I2C_SR1_BTF;
+				}
+			} else {
+				bus->TxPending = 0;
+				bus->Flags |= I2C_SR1_AF;
+				bus->State = I2C_SIM_STATE_HOLD;
+			}
+			break;
+
+		case I2C_SIM_ACTION_RX:
+			/* Bus stays high when nobody drives it */
+			data = bus->Active != NULL ? bus->Active->Read(bus->Active) : 0xFF;
+
+			/* Acknowledge is sent according to ACK bit at the end of byte */
+			bus->Ack = (I2Cx->CR1_REG[0] & I2C_CR1_ACK) ? 1 : 0;
+
+			/* Byte goes to DR, or stays in shift register when DR is full */
+			if (!(bus->Flags & I2C_SR1_RXNE)) {
+				I2Cx->DR_REG[0] = data;
+				bus->Flags |= I2C_SR1_RXNE;
+			} else {
+				bus->Shift = data;
+				bus->ShiftFull = 1;
+				bus->Flags |= I2C_SR1_BTF;
+			}
+
+			/* Slave stops sending after NACK */
+			if (!bus->Ack) {
+				bus->State = I2C_SIM_STATE_HOLD;
+			} else if (!bus->ShiftFull) {
+				TM_I2C_SIM_INT_Begin(I2Cx, bus, I2C_SIM_ACTION_RX);
+			}
+			break;
+
+		case I2C_SIM_ACTION_STOP:
+			/* Notify device */
+			if (bus->Active != NULL && bus->Active->Stop != NULL) {
+				bus->Active->Stop(bus->Active);
+			}
+			bus->Active = NULL;
+
+			/* Slave mode, received byte stays in DR */
+			I2Cx->CR1_REG[0] &= ~I2C_CR1_STOP;
+			bus->Flags &= I2C_SR1_RXNE;
+			bus->Master = 0;
+			bus->Transmitter = 0;
+			bus->TxPending = 0;
+			bus->State = I2C_SIM_STATE_IDLE;
+			break;
+
+		default:
+			break;
+	}
+}
+
+static void TM_I2C_SIM_INT_Write(I2C_TypeDef* I2Cx, TM_I2C_SIM_INT_t* bus, uint8_t data) {
+	if (bus->State == I2C_SIM_STATE_SB) {
+		/* Address byte, SB flag is cleared */
+		bus->Flags &= ~I2C_SR1_SB;
+		bus->Shift = data;
+		TM_I2C_SIM_INT_Begin(I2Cx, bus, I2C_SIM_ACTION_ADDRESS);
+	} else if (bus->State == I2C_SIM_STATE_TX) {
+		if (bus->Action == I2C_SIM_ACTION_NONE) {
+			/* Shift register is empty, DR is empty again */
+			bus->Shift = data;
+			bus->Flags &= ~I2C_SR1_BTF;
+			TM_I2C_SIM_INT_Begin(I2Cx, bus, I2C_SIM_ACTION_TX);
+		} else {
+			/* Wait for shift register */
+			bus->TxData = data;
+			bus->TxPending = 1;
+			bus->Flags &= ~I2C_SR1_TXE;
+		}
+	}
+
+	/* Writes in other states are ignored */
+}
+
+static void TM_I2C_SIM_INT_Condition(I2C_TypeDef* I2Cx, TM_I2C_SIM_INT_t* bus) {
+	uint32_t cr1 = I2Cx->CR1_REG[0];
+
+	if (cr1 & I2C_CR1_STOP) {
+		/* Only master generates stop */
+		if (bus->State == I2C_SIM_STATE_IDLE) {
+			I2Cx->CR1_REG[0] &= ~I2C_CR1_STOP;
+		} else {
+			TM_I2C_SIM_INT_Begin(I2Cx, bus, I2C_SIM_ACTION_STOP);
+		}
+	} else if (cr1 & I2C_CR1_START) {
+		if (bus->State == I2C_SIM_STATE_SB) {
+			/* Start was already generated */
+			I2Cx->CR1_REG[0] &= ~I2C_CR1_START;
+		} else if (bus->State != I2C_SIM_STATE_IDLE || !bus->Stuck) {
+			/* Repeated start, or start when bus is free */
+			TM_I2C_SIM_INT_Begin(I2Cx, bus, I2C_SIM_ACTION_START);
+		}
+	}
+}
+
+static uint64_t TM_I2C_SIM_INT_BitTime(I2C_TypeDef* I2Cx) {
+	uint32_t freq = I2Cx->CR2_REG[0] & I2C_CR2_FREQ;
+	uint32_t ccr = I2Cx->CCR_REG[0];
+	uint32_t period;
+
+	/* Standard mode when timing is not set */
+	if (!freq || !(ccr & I2C_CCR_CCR)) {
+		return I2C_SIM_NS_PER_S / TM_I2C_CLOCK_STANDARD;
+	}
+
+	/* SCL period in peripheral clocks, Tlow/Thigh = 1, 2 or 16/9 */
+	if (ccr & I2C_CCR_FS) {
+		period = (ccr & I2C_CCR_CCR) * ((ccr & I2C_CCR_DUTY) ? 25 : 3);
+	} else {
+		period = (ccr & I2C_CCR_CCR) * 2;
+	}
+
+	/* Peripheral clock is in MHz */
+	return (uint64_t)period * I2C_SIM_NS_PER_US / freq;
+}
+
+static TM_I2C_SIM_Device_t* TM_I2C_SIM_INT_Find(TM_I2C_SIM_INT_t* bus, uint8_t address) {
+	TM_I2C_SIM_Device_t* dev;
+
+	/* Compare address without ignored bits and read/write bit */
+	for (dev = bus->Models; dev != NULL; dev = dev->Next) {
+		if (((address ^ dev->Address) & ~dev->AddressMask & 0xFE) == 0) {
+			return dev;
+		}
+	}
+
+	return NULL;
+}
+
+#endif /* TM_I2C_SIM */
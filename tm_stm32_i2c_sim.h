@@ -0,0 +1,501 @@
+/**
+ * @version v1.1
+ * @ide     GCC
+ * @license GNU GPL v3
+ * @brief   Simulated I2C bus for host builds of TM I2C library
+ *
+@verbatim
+   ----------------------------------------------------------------------
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+   ----------------------------------------------------------------------
+@endverbatim
+ */
+#ifndef TM_I2C_SIM_H
+#define TM_I2C_SIM_H 110
+
+/* C++ detection */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @addtogroup TM_STM32F4xx_Libraries
+ * @{
+ */
+
+/**
+ * @defgroup TM_I2C_SIM
+ * @brief    Simulated I2C bus for host builds of TM I2C library
+ * @{
+ *
+ * Library simulates I2C peripheral registers of STM32F4xx on Linux host, so real @ref TM_I2C library
+ * and I2C device drivers (AT24xx, PCF8574, MPL115A2, DS1307) built on it can be tested without hardware.
+ *
+ * \par Host build
+ *
+ * Define TM_HOST and TM_I2C_SIM globally (compiler flags -DTM_HOST -DTM_I2C_SIM) and compile tm_stm32_host.c,
+ * tm_stm32_gpio.c, tm_stm32_i2c.c and tm_stm32_i2c_sim.c. stm32fxxx_hal.h then includes this file after @ref TM_HOST,
+ * which provides GPIO registers and simulated time. Check host/Makefile for complete build with tests.
+ *
+ * \par Registers
+ *
+ * CR1, CR2, OAR1, OAR2, DR, SR1, SR2, CCR and TRISE are macros which call @ref TM_I2C_SIM_Access() before
+ * register is accessed. Simulator reacts to register writes on next access, sets status flags when bus events
+ * finish in simulated time and applies side effects of register reads, like clearing ADDR flag with SR1 and SR2 read
+ * and RXNE flag with DR read. Library does not know which peripheral is accessed, so read side effects are applied
+ * to all I2C peripherals. This is fine for blocking driver which uses one peripheral at a time.
+ *
+ * Simulated peripheral works in master mode only, START, address, data bytes with ACK/NACK and STOP are simulated.
+ * Received byte is acknowledged according to ACK bit in CR1 at the end of byte, like on real hardware,
+ * so driver must clear ACK bit before last byte is received.
+ *
+ * \par Device models
+ *
+ * Devices are attached to bus with @ref TM_I2C_SIM_Attach(). Each device is structure with callbacks for
+ * start condition, written and read bytes and stop condition. Library includes these models:
+ *  - AT24xx EEPROM with page write buffer and write cycle time, device does not acknowledge while busy
+ *  - PCF8574 I/O expander with quasi-bidirectional port
+ *  - MPL115A2 barometer with coefficients and conversion time
+ *  - DS1307 RTC with clock running on simulated time and 56 bytes of RAM
+ *
+ * \par Stuck bus
+ *
+ * @ref TM_I2C_SIM_SetStuck() simulates slave which holds SDA line low. Simulator pulls SDA pin low and
+ * counts falling edges on SCL pin, so bus recovery of driver is tested with its GPIO code. Pins of pinspack 1
+ * are used by default, use @ref TM_I2C_SIM_SetPins() for other pins.
+ *
+ * \par Bus time
+ *
+ * Every start, stop, address and data byte takes time according to SCL frequency set in CCR register by driver.
+ * CCR and TRISE are accepted only while PE bit is cleared, like reference manual requires. Writes with PE set
+ * are ignored and counted. Number of transactions, bytes and bus time are counted for each bus, check @ref TM_I2C_SIM_GetStats().
+ * This allows measuring effect of transactions with repeated start or cached device presence.
+ *
+@verbatim
+//Attach 2kB EEPROM and read from it
+static uint8_t memory[2048];
+static TM_I2C_SIM_AT24_t eeprom;
+
+TM_I2C_SIM_AT24_Init(&eeprom, 0xA0, memory, sizeof(memory), 16);
+TM_I2C_SIM_Attach(I2C1, &eeprom.Device);
+
+TM_I2C_Init(I2C1, TM_I2C_PinsPack_1, 400000);
+TM_I2C_ReadMulti(I2C1, 0xA0, 0x00, data, 16);
+@endverbatim
+ *
+ * \par Changelog
+ *
+@verbatim
+ Version 1.1
+  - Registers of I2C peripheral are simulated, real TM I2C library runs on top of simulator
+
+ Version 1.0
+  - First release
+@endverbatim
+ *
+ * \par Dependencies
+ *
+@verbatim
+ - Linux host, GCC
+ - TM HOST
+ - TM GPIO
+ - TM I2C
+ - defines.h
+ - attributes.h
+@endverbatim
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include "attributes.h"
+
+#if !defined(TM_HOST)
+#error "Simulated I2C bus needs host build with TM_HOST defined"
+#endif
+
+/**
+ * @defgroup TM_I2C_SIM_Macros
+ * @brief    Library defines
+ * @{
+ */
+
+/**
+ * @brief  Simulated I2C peripherals
+ */
+#define I2C1                   (&TM_I2C_SIM_Ports[0])
+#define I2C2                   (&TM_I2C_SIM_Ports[1])
+#define I2C3                   (&TM_I2C_SIM_Ports[2])
+
+/**
+ * @brief  I2C registers, every access goes through @ref TM_I2C_SIM_Access()
+ */
+#define CR1                    CR1_REG[TM_I2C_SIM_Access(TM_I2C_SIM_Reg_CR1)]
+#define CR2                    CR2_REG[TM_I2C_SIM_Access(TM_I2C_SIM_Reg_CR2)]
+#define OAR1                   OAR1_REG[TM_I2C_SIM_Access(TM_I2C_SIM_Reg_OAR1)]
+#define OAR2                   OAR2_REG[TM_I2C_SIM_Access(TM_I2C_SIM_Reg_OAR2)]
+#define DR                     DR_REG[TM_I2C_SIM_Access(TM_I2C_SIM_Reg_DR)]
+#define SR1                    SR1_REG[TM_I2C_SIM_Access(TM_I2C_SIM_Reg_SR1)]
+#define SR2                    SR2_REG[TM_I2C_SIM_Access(TM_I2C_SIM_Reg_SR2)]
+#define CCR                    CCR_REG[TM_I2C_SIM_Access(TM_I2C_SIM_Reg_CCR)]
+#define TRISE                  TRISE_REG[TM_I2C_SIM_Access(TM_I2C_SIM_Reg_TRISE)]
+
+/**
+ * @brief  I2C register bits, STM32F4xx values
+ */
+#define I2C_CR1_PE             ((uint16_t)0x0001)
+#define I2C_CR1_START          ((uint16_t)0x0100)
+#define I2C_CR1_STOP           ((uint16_t)0x0200)
+#define I2C_CR1_ACK            ((uint16_t)0x0400)
+#define I2C_CR1_SWRST          ((uint16_t)0x8000)
+#define I2C_CR2_FREQ           ((uint16_t)0x003F)
+#define I2C_OAR1_ADD0          ((uint16_t)0x0001)
+#define I2C_SR1_SB             ((uint16_t)0x0001)
+#define I2C_SR1_ADDR           ((uint16_t)0x0002)
+#define I2C_SR1_BTF            ((uint16_t)0x0004)
+#define I2C_SR1_RXNE           ((uint16_t)0x0040)
+#define I2C_SR1_TXE            ((uint16_t)0x0080)
+#define I2C_SR1_BERR           ((uint16_t)0x0100)
+#define I2C_SR1_ARLO           ((uint16_t)0x0200)
+#define I2C_SR1_AF             ((uint16_t)0x0400)
+#define I2C_SR1_OVR            ((uint16_t)0x0800)
+#define I2C_SR1_PECERR         ((uint16_t)0x1000)
+#define I2C_SR1_TIMEOUT        ((uint16_t)0x4000)
+#define I2C_SR1_SMBALERT       ((uint16_t)0x8000)
+#define I2C_SR2_MSL            ((uint16_t)0x0001)
+#define I2C_SR2_BUSY           ((uint16_t)0x0002)
+#define I2C_SR2_TRA            ((uint16_t)0x0004)
+#define I2C_CCR_CCR            ((uint16_t)0x0FFF)
+#define I2C_CCR_DUTY           ((uint16_t)0x4000)
+#define I2C_CCR_FS             ((uint16_t)0x8000)
+
+/**
+ * @brief  I2C init values and events, STM32F4xx standard peripheral library values
+ */
+#define I2C_Mode_I2C                             ((uint16_t)0x0000)
+#define I2C_DutyCycle_16_9                       ((uint16_t)0x4000)
+#define I2C_DutyCycle_2                          ((uint16_t)0xBFFF)
+#define I2C_Ack_Enable                           ((uint16_t)0x0400)
+#define I2C_Ack_Disable                          ((uint16_t)0x0000)
+#define I2C_AcknowledgedAddress_7bit             ((uint16_t)0x4000)
+#define I2C_EVENT_MASTER_RECEIVER_MODE_SELECTED  ((uint32_t)0x00030002)
+#define I2C_EVENT_MASTER_BYTE_RECEIVED           ((uint32_t)0x00030040)
+#define GPIO_AF_I2C1                             ((uint8_t)0x04)
+#define GPIO_AF_I2C2                             ((uint8_t)0x04)
+#define GPIO_AF_I2C3                             ((uint8_t)0x04)
+
+/**
+ * @brief  Default write cycle time of AT24xx model in microseconds
+ */
+#ifndef TM_I2C_SIM_AT24_WRITE_CYCLE
+#define TM_I2C_SIM_AT24_WRITE_CYCLE    5000
+#endif
+
+/**
+ * @brief  Maximal page size of AT24xx model
+ */
+#define TM_I2C_SIM_AT24_MAX_PAGE       64
+
+/**
+ * @brief  Conversion time of MPL115A2 model in microseconds
+ */
+#ifndef TM_I2C_SIM_MPL115A2_CONVERSION
+#define TM_I2C_SIM_MPL115A2_CONVERSION 3000
+#endif
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup TM_I2C_SIM_Typedefs
+ * @brief    Library Typedefs
+ * @{
+ */
+
+/**
+ * @brief  Simulated I2C peripheral, STM32F4xx register layout
+ */
+typedef struct {
+	__IO uint32_t CR1_REG[1];   /*!< Control register 1 */
+	__IO uint32_t CR2_REG[1];   /*!< Control register 2 */
+	__IO uint32_t OAR1_REG[1];  /*!< Own address register 1 */
+	__IO uint32_t OAR2_REG[1];  /*!< Own address register 2 */
+	__IO uint32_t DR_REG[1];    /*!< Data register */
+	__IO uint32_t SR1_REG[1];   /*!< Status register 1 */
+	__IO uint32_t SR2_REG[1];   /*!< Status register 2 */
+	__IO uint32_t CCR_REG[1];   /*!< Clock control register */
+	__IO uint32_t TRISE_REG[1]; /*!< Rise time register */
+} I2C_TypeDef;
+
+/**
+ * @brief  I2C init structure, STM32F4xx standard peripheral library layout
+ */
+typedef struct {
+	uint32_t I2C_ClockSpeed;          /*!< SCL frequency, set again by TM I2C library */
+	uint16_t I2C_Mode;                /*!< I2C mode */
+	uint16_t I2C_DutyCycle;           /*!< Fast mode duty cycle */
+	uint16_t I2C_OwnAddress1;         /*!< Own address */
+	uint16_t I2C_Ack;                 /*!< Acknowledge enable */
+	uint16_t I2C_AcknowledgedAddress; /*!< 7 or 10 bit address acknowledged */
+} I2C_InitTypeDef;
+
+/**
+ * @brief  Register identifiers for @ref TM_I2C_SIM_Access()
+ */
+typedef enum {
+	TM_I2C_SIM_Reg_CR1,
+	TM_I2C_SIM_Reg_CR2,
+	TM_I2C_SIM_Reg_OAR1,
+	TM_I2C_SIM_Reg_OAR2,
+	TM_I2C_SIM_Reg_DR,
+	TM_I2C_SIM_Reg_SR1,
+	TM_I2C_SIM_Reg_SR2,
+	TM_I2C_SIM_Reg_CCR,
+	TM_I2C_SIM_Reg_TRISE
+} TM_I2C_SIM_Reg_t;
+
+/**
+ * @brief  Simulated I2C device
+ * @note   Model structures have this structure as first member
+ */
+typedef struct _TM_I2C_SIM_Device_t {
+	uint8_t Address;                                              /*!< 7 bit slave address, left aligned */
+	uint8_t AddressMask;                                          /*!< Address bits which are not compared, for example AT24xx block bits */
+	uint8_t (*Start)(struct _TM_I2C_SIM_Device_t* dev, uint8_t address); /*!< Start or repeated start with address, return 0 for ACK */
+	uint8_t (*Write)(struct _TM_I2C_SIM_Device_t* dev, uint8_t data);    /*!< Byte written by master, return 0 for ACK */
+	uint8_t (*Read)(struct _TM_I2C_SIM_Device_t* dev);                   /*!< Byte read by master */
+	void (*Stop)(struct _TM_I2C_SIM_Device_t* dev);                      /*!< Stop condition, can be NULL */
+	struct _TM_I2C_SIM_Device_t* Next;                            /*!< Next device on bus, used by library */
+} TM_I2C_SIM_Device_t;
+
+/**
+ * @brief  Simulated bus counters
+ */
+typedef struct {
+	uint32_t Transactions; /*!< Number of transactions, from start to stop condition */
+	uint32_t Starts;       /*!< Number of start and repeated start conditions */
+	uint32_t Bytes;        /*!< Number of address and data bytes */
+	uint64_t BusTime;      /*!< Time when bus was used, in nanoseconds */
+	uint32_t TimingWrites; /*!< Writes to CCR or TRISE while PE was set, they are ignored */
+} TM_I2C_SIM_Stats_t;
+
+/**
+ * @brief  AT24xx EEPROM model
+ */
+typedef struct {
+	TM_I2C_SIM_Device_t Device;              /*!< Device on bus */
+	uint8_t* Memory;                         /*!< Pointer to memory content */
+	uint16_t Size;                           /*!< Memory size in bytes */
+	uint8_t PageSize;                        /*!< Page size in bytes, power of 2 */
+	uint32_t WriteCycle;                     /*!< Write cycle time in microseconds */
+	uint32_t PageWrites;                     /*!< Number of page writes made */
+	uint16_t Pointer;                        /*!< Internal address pointer */
+	uint8_t AddressPhase;                    /*!< Next written byte is word address */
+	uint8_t Page[TM_I2C_SIM_AT24_MAX_PAGE];  /*!< Page write buffer */
+	uint64_t PageValid;                      /*!< Valid bytes in page buffer */
+	uint16_t PageBase;                       /*!< Memory address of page buffer */
+	uint64_t BusyUntil;                      /*!< End of write cycle, in nanoseconds */
+} TM_I2C_SIM_AT24_t;
+
+/**
+ * @brief  PCF8574 I/O expander model
+ */
+typedef struct {
+	TM_I2C_SIM_Device_t Device; /*!< Device on bus */
+	uint8_t Latch;              /*!< Output latch, written by master */
+	uint8_t Inputs;             /*!< Levels driven externally on pins, set by test */
+} TM_I2C_SIM_PCF8574_t;
+
+/**
+ * @brief  MPL115A2 barometer model
+ */
+typedef struct {
+	TM_I2C_SIM_Device_t Device; /*!< Device on bus */
+	uint8_t Coefficients[8];    /*!< a0, b1, b2 and c12 coefficients, MSB first */
+	uint16_t Padc;              /*!< Pressure ADC value for next conversion, left aligned 10 bit */
+	uint16_t Tadc;              /*!< Temperature ADC value for next conversion, left aligned 10 bit */
+	uint32_t Conversions;       /*!< Number of conversions started */
+	uint8_t Result[4];          /*!< Result registers */
+	uint8_t Pointer;            /*!< Register pointer */
+	uint8_t AddressPhase;       /*!< Next written byte is register address */
+	uint8_t Pending;            /*!< Conversion is in progress */
+	uint64_t ReadyAt;           /*!< End of conversion, in nanoseconds */
+} TM_I2C_SIM_MPL115A2_t;
+
+/**
+ * @brief  DS1307 RTC model
+ */
+typedef struct {
+	TM_I2C_SIM_Device_t Device; /*!< Device on bus */
+	uint8_t Registers[64];      /*!< Time, control and RAM registers */
+	uint8_t Pointer;            /*!< Register pointer */
+	uint8_t AddressPhase;       /*!< Next written byte is register address */
+	uint64_t LastSecond;        /*!< Simulated time of last seconds increment, in nanoseconds */
+} TM_I2C_SIM_DS1307_t;
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup TM_I2C_SIM_Variables
+ * @brief    Library variables
+ * @{
+ */
+
+extern I2C_TypeDef TM_I2C_SIM_Ports[3];
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup TM_I2C_SIM_Functions
+ * @brief    Library Functions
+ * @{
+ */
+
+/**
+ * @brief  Initializes I2C peripheral, replaces standard peripheral library function on host
+ * @note   Like standard peripheral library, clears PE, sets peripheral clock, SCL timing for I2C_ClockSpeed,
+ *         mode, acknowledge and own address and sets PE again
+ * @param  *I2Cx: I2C used
+ * @param  *I2C_InitStruct: Pointer to @ref I2C_InitTypeDef structure
+ * @retval None
+ */
+void I2C_Init(I2C_TypeDef* I2Cx, I2C_InitTypeDef* I2C_InitStruct);
+
+/**
+ * @brief  Checks last I2C event, replaces standard peripheral library function on host
+ * @note   Reads SR1 and SR2 registers, so ADDR flag is cleared
+ * @param  *I2Cx: I2C used
+ * @param  I2C_EVENT: Event to check, SR2 flags in upper 16 bits
+ * @retval 1 when all event flags are set, 0 otherwise
+ */
+uint8_t I2C_CheckEvent(I2C_TypeDef* I2Cx, uint32_t I2C_EVENT);
+
+/**
+ * @brief  Simulates I2C register access, used by register macros
+ * @note   Calls @ref TM_HOST_Access() and applies read side effects of selected register
+ * @param  reg: Accessed register, member of @ref TM_I2C_SIM_Reg_t
+ * @retval Always 0, index to register array
+ */
+uint8_t TM_I2C_SIM_Access(TM_I2C_SIM_Reg_t reg);
+
+/**
+ * @brief  Attaches device to simulated bus
+ * @param  *I2Cx: I2C used
+ * @note   Device can be attached to one bus only, use separate structures for each bus
+ * @param  *dev: Pointer to @ref TM_I2C_SIM_Device_t structure, usually first member of model structure
+ * @retval None
+ */
+void TM_I2C_SIM_Attach(I2C_TypeDef* I2Cx, TM_I2C_SIM_Device_t* dev);
+
+/**
+ * @brief  Detaches device from simulated bus
+ * @param  *I2Cx: I2C used
+ * @param  *dev: Pointer to @ref TM_I2C_SIM_Device_t structure
+ * @retval None
+ */
+void TM_I2C_SIM_Detach(I2C_TypeDef* I2Cx, TM_I2C_SIM_Device_t* dev);
+
+/**
+ * @brief  Sets SCL and SDA pins of simulated bus, used for stuck bus simulation
+ * @note   Pins of pinspack 1 are used by default
+ * @param  *I2Cx: I2C used
+ * @param  *SCL_GPIOx: GPIO port of SCL pin
+ * @param  SCL_Pin: SCL pin
+ * @param  *SDA_GPIOx: GPIO port of SDA pin
+ * @param  SDA_Pin: SDA pin
+ * @retval None
+ */
+void TM_I2C_SIM_SetPins(I2C_TypeDef* I2Cx, GPIO_TypeDef* SCL_GPIOx, uint16_t SCL_Pin, GPIO_TypeDef* SDA_GPIOx, uint16_t SDA_Pin);
+
+/**
+ * @brief  Holds SDA line low, like slave reset in the middle of read operation
+ * @note   Peripheral reports busy bus, slave releases SDA after falling edges on SCL pin
+ * @param  *I2Cx: I2C used
+ * @param  clocks: Number of SCL pulses needed before slave releases SDA. Use 0 to release bus
+ * @retval None
+ */
+void TM_I2C_SIM_SetStuck(I2C_TypeDef* I2Cx, uint8_t clocks);
+
+/**
+ * @brief  Gets simulated bus counters
+ * @param  *I2Cx: I2C used
+ * @param  *stats: Pointer to @ref TM_I2C_SIM_Stats_t structure to be filled
+ * @retval None
+ */
+void TM_I2C_SIM_GetStats(I2C_TypeDef* I2Cx, TM_I2C_SIM_Stats_t* stats);
+
+/**
+ * @brief  Resets simulated bus counters
+ * @param  *I2Cx: I2C used
+ * @retval None
+ */
+void TM_I2C_SIM_ResetStats(I2C_TypeDef* I2Cx);
+
+/**
+ * @brief  Initializes AT24xx model
+ * @note   Devices bigger than 256 bytes use block select bits in slave address, like AT24C04 to AT24C16
+ * @param  *at24: Pointer to @ref TM_I2C_SIM_AT24_t structure
+ * @param  address: 7 bit slave address, left aligned, block bits must be zero
+ * @param  *memory: Pointer to memory content
+ * @param  size: Memory size in bytes, 256 to 2048
+ * @param  pageSize: Page size in bytes, power of 2 up to @ref TM_I2C_SIM_AT24_MAX_PAGE
+ * @retval None
+ */
+void TM_I2C_SIM_AT24_Init(TM_I2C_SIM_AT24_t* at24, uint8_t address, uint8_t* memory, uint16_t size, uint8_t pageSize);
+
+/**
+ * @brief  Initializes PCF8574 model, all pins are high
+ * @param  *pcf: Pointer to @ref TM_I2C_SIM_PCF8574_t structure
+ * @param  address: 7 bit slave address, left aligned
+ * @retval None
+ */
+void TM_I2C_SIM_PCF8574_Init(TM_I2C_SIM_PCF8574_t* pcf, uint8_t address);
+
+/**
+ * @brief  Initializes MPL115A2 model with coefficients and ADC values from Freescale AN3785 example
+ * @param  *mpl: Pointer to @ref TM_I2C_SIM_MPL115A2_t structure
+ * @param  address: 7 bit slave address, left aligned
+ * @retval None
+ */
+void TM_I2C_SIM_MPL115A2_Init(TM_I2C_SIM_MPL115A2_t* mpl, uint8_t address);
+
+/**
+ * @brief  Initializes DS1307 model, clock is stopped until seconds register is written
+ * @param  *rtc: Pointer to @ref TM_I2C_SIM_DS1307_t structure
+ * @param  address: 7 bit slave address, left aligned
+ * @retval None
+ */
+void TM_I2C_SIM_DS1307_Init(TM_I2C_SIM_DS1307_t* rtc, uint8_t address);
+
+/**
+ * @}
+ */
+
+/**
+ * @}
+ */
+
+/**
+ * @}
+ */
+
+/* C++ detection */
+#ifdef __cplusplus
+}
+#endif
+
+#endif
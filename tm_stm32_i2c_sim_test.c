@@ -0,0 +1,297 @@
+/**
+ * |----------------------------------------------------------------------
+ * | This program is free software: you can redistribute it and/or modify
+ * | it under the terms of the GNU General Public License as published by
+ * | the Free Software Foundation, either version 3 of the License, or
+ * | any later version.
+ * |
+ * | This program is distributed in the hope that it will be useful,
+ * | but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * | MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * | GNU General Public License for more details.
+ * |
+ * | You should have received a copy of the GNU General Public License
+ * | along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * |----------------------------------------------------------------------
+ */
+/*
+ * Host test of TM I2C library and I2C device drivers on simulated bus.
+ * Build and run with "make -C host test".
+ */
+#include "tm_stm32_i2c.h"
+#include "tm_stm32_delay.h"
+#include "stm32_at24.h"
+#include "stm32_pcf8574.h"
+#include "stm32_mpl115a2.h"
+#include "tm_stm32_ds1307.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Check condition, report line and stop test on failure */
+#define CHECK(c) do { if (!(c)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #c); return 1; } } while (0)
+
+/* Bus time of bits in nanoseconds */
+#define BITS_100K(bits)        ((uint64_t)(bits) * 10000)
+#define BITS_400K(bits)        ((uint64_t)(bits) * 2500)
+
+static uint8_t memory[2048];
+static TM_I2C_SIM_AT24_t eeprom;
+static TM_I2C_SIM_PCF8574_t expander;
+static TM_I2C_SIM_MPL115A2_t barometer;
+static TM_I2C_SIM_DS1307_t rtc;
+
+/* Let last stop condition finish */
+static void bus_idle(void) {
+	HAL_Delay(1);
+}
+
+/* Reset all counters on idle bus */
+static void reset_stats(I2C_TypeDef* I2Cx) {
+	bus_idle();
+	TM_I2C_ResetStats(I2Cx);
+	TM_I2C_SIM_ResetStats(I2Cx);
+}
+
+static int test_init(void) {
+	TM_I2C_SIM_Stats_t sim;
+	uint32_t ccr = (HAL_RCC_GetPCLK1Freq() + 3 * 300000 - 1) / (3 * 300000);
+
+	/* Driver sets CCR and TRISE with PE cleared, SCL is not faster than requested */
+	TM_I2C_SIM_ResetStats(I2C3);
+	TM_I2C_Init(I2C3, TM_I2C_PinsPack_1, 300000);
+	TM_I2C_SIM_GetStats(I2C3, &sim);
+	CHECK(sim.TimingWrites == 0);
+	CHECK((I2C3->CCR & I2C_CCR_CCR) == ccr && (I2C3->CCR & I2C_CCR_FS));
+	CHECK(I2C3->TRISE == (HAL_RCC_GetPCLK1Freq() / 1000000) * 300 / 1000 + 1);
+	CHECK(I2C3->CR1 & I2C_CR1_PE);
+	CHECK(TM_I2C_GetClock(I2C3) <= 300000);
+
+	return 0;
+}
+
+static int test_scan(void) {
+	uint8_t addresses[16];
+	uint8_t found;
+
+	/* AT24C16 answers on 8 addresses, one for each 256 byte block */
+	found = TM_I2C_Scan(I2C1, addresses, sizeof(addresses));
+	CHECK(found == 11);
+	CHECK(addresses[0] == 0x40);
+	CHECK(addresses[1] == 0xA0 && addresses[8] == 0xAE);
+	CHECK(addresses[9] == 0xC0 && addresses[10] == 0xD0);
+
+	/* Absent addresses are not errors on scan */
+	TM_I2C_Stats_t stats;
+	TM_I2C_GetStats(I2C1, &stats);
+	CHECK(stats.Nacks == 0 && stats.Timeouts == 0);
+
+	return 0;
+}
+
+static int test_timing(void) {
+	TM_I2C_SIM_PCF8574_t output;
+	TM_I2C_SIM_Stats_t sim;
+	uint8_t data[16];
+
+	/* Register read: start, address, register, repeated start, address, 16 bytes, stop */
+	CHECK(TM_I2C_GetClock(I2C1) == TM_I2C_CLOCK_STANDARD);
+	reset_stats(I2C1);
+	TM_I2C_ReadMulti(I2C1, 0xA0, 0x00, data, sizeof(data));
+	bus_idle();
+	TM_I2C_SIM_GetStats(I2C1, &sim);
+	CHECK(sim.Transactions == 1 && sim.Starts == 2 && sim.Bytes == 19);
+	CHECK(sim.BusTime == BITS_100K(1 + 9 + 9 + 1 + 9 + 16 * 9 + 1));
+
+	/* Slave sent exactly 16 bytes, last one was not acknowledged in time */
+	CHECK(eeprom.Pointer == 16);
+
+	/* Fast mode on second bus, write register and one byte */
+	TM_I2C_SIM_PCF8574_Init(&output, 0x40);
+	TM_I2C_SIM_Attach(I2C2, &output.Device);
+	TM_I2C_Init(I2C2, TM_I2C_PinsPack_1, TM_I2C_CLOCK_FAST_MODE);
+	CHECK(TM_I2C_GetClock(I2C2) == TM_I2C_CLOCK_FAST_MODE);
+	TM_I2C_Write(I2C2, 0x40, 0x00, 0x5A);
+	bus_idle();
+	TM_I2C_SIM_GetStats(I2C2, &sim);
+	CHECK(sim.Transactions == 1 && sim.Bytes == 3);
+	CHECK(sim.BusTime == BITS_400K(1 + 3 * 9 + 1));
+	CHECK(output.Latch == 0x5A);
+	TM_I2C_SIM_Detach(I2C2, &output.Device);
+
+	return 0;
+}
+
+static int test_reads(void) {
+	uint8_t data[3];
+
+	/* Memory content for reads */
+	memory[0x20] = 0x11;
+	memory[0x21] = 0x22;
+	memory[0x22] = 0x33;
+
+	/* Single byte with register */
+	CHECK(TM_I2C_Read(I2C1, 0xA0, 0x21) == 0x22);
+	bus_idle();
+
+	/* Without register, pointer continues */
+	CHECK(TM_I2C_ReadNoRegister(I2C1, 0xA0) == 0x33);
+	bus_idle();
+
+	/* Multiple bytes without register */
+	TM_I2C_Read(I2C1, 0xA0, 0x1F);
+	bus_idle();
+	TM_I2C_ReadMultiNoRegister(I2C1, 0xA0, data, 3);
+	bus_idle();
+	CHECK(data[0] == 0x11 && data[1] == 0x22 && data[2] == 0x33);
+	CHECK(eeprom.Pointer == 0x23);
+
+	return 0;
+}
+
+static int test_transaction(void) {
+	TM_I2C_SIM_Stats_t sim;
+	uint8_t coefficients[8], start = 0x00;
+	TM_I2C_Transfer_t transfers[] = {
+		{0xC0, TM_I2C_TRANSFER_READ | TM_I2C_TRANSFER_REG, 0x04, coefficients, sizeof(coefficients)},
+		{0xC0, TM_I2C_TRANSFER_WRITE | TM_I2C_TRANSFER_REG, 0x12, &start, 1},
+	};
+
+	/* Coefficient read and conversion start in one transaction */
+	reset_stats(I2C1);
+	CHECK(TM_I2C_Transaction(I2C1, transfers, 2) == 0);
+	bus_idle();
+	CHECK(memcmp(coefficients, barometer.Coefficients, sizeof(coefficients)) == 0);
+	CHECK(barometer.Conversions == 1);
+	TM_I2C_SIM_GetStats(I2C1, &sim);
+	CHECK(sim.Transactions == 1 && sim.Starts == 3);
+
+	/* Zero length read is rejected before bus is touched */
+	transfers[0].Count = 0;
+	reset_stats(I2C1);
+	CHECK(TM_I2C_Transaction(I2C1, transfers, 2) == 1);
+	TM_I2C_SIM_GetStats(I2C1, &sim);
+	CHECK(sim.Starts == 0);
+
+	return 0;
+}
+
+static int test_absent(void) {
+	TM_I2C_SIM_Stats_t sim;
+	TM_I2C_Stats_t stats;
+
+	/* Absent device is probed once, address is not acknowledged */
+	TM_I2C_ForgetDevice(I2C1, 0x90);
+	reset_stats(I2C1);
+	CHECK(TM_I2C_IsDevicePresent(I2C1, 0x90) == 0);
+	bus_idle();
+	CHECK(TM_I2C_IsDevicePresent(I2C1, 0x90) == 0);
+	TM_I2C_GetStats(I2C1, &stats);
+	TM_I2C_SIM_GetStats(I2C1, &sim);
+	CHECK(stats.Nacks == 1 && stats.Timeouts == 0);
+	CHECK(sim.Starts == 1);
+
+	/* Write to absent device returns without data bytes */
+	TM_I2C_Write(I2C1, 0x90, 0x00, 0x00);
+	bus_idle();
+	TM_I2C_SIM_GetStats(I2C1, &sim);
+	CHECK(sim.Starts == 2 && sim.Bytes == 2);
+
+	return 0;
+}
+
+static int test_drivers(void) {
+	uint8_t data[20], read[20], port;
+	PW_MPL115A2_t mpl = {I2C1};
+	signed short pressure = 0;
+	TM_DS1307_Time_t time = {.seconds = 58, .minutes = 59, .hours = 23, .day = 3, .date = 28, .month = 2, .year = 24};
+	uint8_t i;
+
+	/* EEPROM, driver writes up to 8 bytes at once, start on page boundary */
+	PW_AT24xx_Init(I2C1);
+	for (i = 0; i < sizeof(data); i++) {
+		data[i] = i + 1;
+	}
+	eeprom.PageWrites = 0;
+	PW_AT24xx_Write(I2C1, 16, data, sizeof(data));
+	PW_AT24xx_Read(I2C1, 16, read, sizeof(read));
+	CHECK(memcmp(data, read, sizeof(data)) == 0);
+	CHECK(eeprom.PageWrites == 3);
+
+	/* I/O expander, pin 0 is pulled low externally */
+	PW_PCF8574_Init(I2C1);
+	PW_PCF8574_WritePort(I2C1, 0x0F);
+	bus_idle();
+	expander.Inputs = 0xFE;
+	PW_PCF8574_ReadPort(I2C1, &port);
+	CHECK(expander.Latch == 0x0F && port == 0x0E);
+
+	/* Barometer, 96.5 kPa from Freescale AN3785 example */
+	PW_MPL115A2_Init(&mpl);
+	CHECK(PW_MPL115A2_GetPressure(&mpl, &pressure) == 1);
+	CHECK((pressure >> 4) == 96);
+
+	/* RTC, leap day after 2 seconds */
+	CHECK(TM_DS1307_Init() == TM_DS1307_Result_Ok);
+	TM_DS1307_SetDateTime(&time);
+	Delayms(2500);
+	TM_DS1307_GetDateTime(&time);
+	CHECK(time.hours == 0 && time.minutes == 0 && time.seconds == 0);
+	CHECK(time.date == 29 && time.month == 2 && time.day == 4);
+
+	return 0;
+}
+
+static int test_stuck(void) {
+	TM_I2C_Stats_t stats;
+	uint8_t data[4] = {1, 2, 3, 4}, read[4];
+
+	/* Slave holds SDA for 5 clocks, bus is recovered on first transfer */
+	reset_stats(I2C1);
+	TM_I2C_SIM_SetStuck(I2C1, 5);
+	TM_I2C_WriteMulti(I2C1, 0xA0, 0x40, data, sizeof(data));
+	Delay(6000);
+	TM_I2C_ReadMulti(I2C1, 0xA0, 0x40, read, sizeof(read));
+	CHECK(memcmp(data, read, sizeof(data)) == 0);
+	TM_I2C_GetStats(I2C1, &stats);
+	CHECK(stats.Timeouts == 1 && stats.Recoveries == 1);
+
+	/* Bus stuck right after transfer, while stop condition is still on bus */
+	TM_I2C_Read(I2C1, 0xA0, 0x40);
+	TM_I2C_ResetStats(I2C1);
+	TM_I2C_SIM_SetStuck(I2C1, 3);
+	CHECK(TM_I2C_Read(I2C1, 0xA0, 0x40) == 1);
+	TM_I2C_GetStats(I2C1, &stats);
+	CHECK(stats.Timeouts == 1 && stats.Recoveries == 1);
+
+	/* One recovery gives 9 pulses and stop, slave needs more, second transfer recovers bus again */
+	reset_stats(I2C1);
+	TM_I2C_SIM_SetStuck(I2C1, 12);
+	TM_I2C_Read(I2C1, 0xA0, 0x41);
+	CHECK(TM_I2C_Read(I2C1, 0xA0, 0x41) == 2);
+	TM_I2C_GetStats(I2C1, &stats);
+	CHECK(stats.Timeouts == 2 && stats.Recoveries == 2);
+
+	return 0;
+}
+
+int main(void) {
+	/* Devices on first bus */
+	TM_I2C_SIM_AT24_Init(&eeprom, 0xA0, memory, sizeof(memory), 16);
+	TM_I2C_SIM_Attach(I2C1, &eeprom.Device);
+	TM_I2C_SIM_PCF8574_Init(&expander, 0x40);
+	TM_I2C_SIM_Attach(I2C1, &expander.Device);
+	TM_I2C_SIM_MPL115A2_Init(&barometer, 0xC0);
+	TM_I2C_SIM_Attach(I2C1, &barometer.Device);
+	TM_I2C_SIM_DS1307_Init(&rtc, 0xD0);
+	TM_I2C_SIM_Attach(I2C1, &rtc.Device);
+
+	/* Standard mode */
+	TM_I2C_Init(I2C1, TM_I2C_PinsPack_1, TM_I2C_CLOCK_STANDARD);
+
+	if (test_init() || test_scan() || test_timing() || test_reads() || test_transaction() || test_absent() || test_stuck() || test_drivers()) {
+		return 1;
+	}
+
+	printf("i2c sim tests ok, simulated time %u ms\n", (unsigned)(TM_HOST_GetTime() / 1000));
+	return 0;
+}